@@ -0,0 +1,212 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Data item aggregation source file
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ell/util.h>
+#include <ell/timeout.h>
+
+#include "aggregate.h"
+
+/* Sliding windows are kept as a ring of panes, one per step */
+#define MAX_PANES 64
+
+/* Welford accumulator: panes are merged with Chan's formula */
+struct aggregate_pane {
+	unsigned int count;
+	double mean;
+	double m2;
+	double min;
+	double max;
+	double last;
+};
+
+struct aggregate {
+	int id;
+	struct aggregate_pane *panes;
+	int n_panes;
+	int current;
+	int step;		/* ms */
+	struct l_timeout *step_to;
+	aggregate_close_cb_t close_cb;
+};
+
+static const char * const function_names[] = {
+	[AGGREGATE_MEAN] = "mean",
+	[AGGREGATE_MIN] = "min",
+	[AGGREGATE_MAX] = "max",
+	[AGGREGATE_LAST] = "last",
+	[AGGREGATE_COUNT] = "count",
+	[AGGREGATE_STDDEV] = "stddev",
+};
+
+static void pane_add(struct aggregate_pane *pane, double value)
+{
+	double delta = value - pane->mean;
+
+	if (!pane->count || value < pane->min)
+		pane->min = value;
+	if (!pane->count || value > pane->max)
+		pane->max = value;
+
+	pane->count++;
+	pane->mean += delta / pane->count;
+	pane->m2 += delta * (value - pane->mean);
+	pane->last = value;
+}
+
+/* Panes are merged from the oldest so that 'last' ends up the newest */
+static void pane_merge(struct aggregate_pane *to,
+		       const struct aggregate_pane *from)
+{
+	double delta;
+	unsigned int count;
+
+	if (!from->count)
+		return;
+
+	if (!to->count) {
+		*to = *from;
+		return;
+	}
+
+	count = to->count + from->count;
+	delta = from->mean - to->mean;
+
+	to->m2 += from->m2 +
+		delta * delta * to->count * from->count / count;
+	to->mean += delta * from->count / count;
+	to->count = count;
+	to->min = from->min < to->min ? from->min : to->min;
+	to->max = from->max > to->max ? from->max : to->max;
+	to->last = from->last;
+}
+
+static void on_step_timeout(struct l_timeout *to, void *user_data)
+{
+	struct aggregate *agg = user_data;
+	struct aggregate_pane total;
+	struct aggregate_summary summary;
+	int i;
+
+	memset(&total, 0, sizeof(total));
+
+	for (i = 1; i <= agg->n_panes; i++)
+		pane_merge(&total,
+			   &agg->panes[(agg->current + i) % agg->n_panes]);
+
+	/* The oldest pane leaves the window and takes the new samples */
+	agg->current = (agg->current + 1) % agg->n_panes;
+	memset(&agg->panes[agg->current], 0, sizeof(struct aggregate_pane));
+
+	l_timeout_modify_ms(to, agg->step);
+
+	if (!total.count)
+		return;
+
+	summary.count = total.count;
+	summary.min = total.min;
+	summary.max = total.max;
+	summary.mean = total.mean;
+	summary.last = total.last;
+	summary.stddev = total.count > 1 ?
+		sqrt(total.m2 / (total.count - 1)) : 0;
+
+	agg->close_cb(agg->id, &summary);
+}
+
+int aggregate_parse_function(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(function_names); i++)
+		if (!strcmp(name, function_names[i]))
+			return i;
+
+	return -EINVAL;
+}
+
+double aggregate_summary_value(const struct aggregate_summary *summary,
+			       enum aggregate_function function)
+{
+	switch (function) {
+	case AGGREGATE_MIN:
+		return summary->min;
+	case AGGREGATE_MAX:
+		return summary->max;
+	case AGGREGATE_LAST:
+		return summary->last;
+	case AGGREGATE_COUNT:
+		return summary->count;
+	case AGGREGATE_STDDEV:
+		return summary->stddev;
+	case AGGREGATE_MEAN:
+	default:
+		return summary->mean;
+	}
+}
+
+struct aggregate *aggregate_new(int id, int window, int step,
+				aggregate_close_cb_t close_cb)
+{
+	struct aggregate *agg;
+
+	/* A window without a step tumbles */
+	if (step <= 0)
+		step = window;
+
+	if (window <= 0 || step > window || window % step ||
+	    window / step > MAX_PANES || !close_cb)
+		return NULL;
+
+	agg = l_new(struct aggregate, 1);
+	agg->id = id;
+	agg->step = step;
+	agg->n_panes = window / step;
+	agg->panes = l_new(struct aggregate_pane, agg->n_panes);
+	agg->close_cb = close_cb;
+	agg->step_to = l_timeout_create_ms(step, on_step_timeout, agg, NULL);
+	if (!agg->step_to) {
+		aggregate_free(agg);
+		return NULL;
+	}
+
+	return agg;
+}
+
+void aggregate_free(struct aggregate *agg)
+{
+	if (!agg)
+		return;
+
+	if (agg->step_to)
+		l_timeout_remove(agg->step_to);
+
+	l_free(agg->panes);
+	l_free(agg);
+}
+
+void aggregate_add(struct aggregate *agg, double value)
+{
+	pane_add(&agg->panes[agg->current], value);
+}
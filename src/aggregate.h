@@ -0,0 +1,52 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Data item aggregation header file
+ */
+
+enum aggregate_function {
+	AGGREGATE_MEAN,
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+	AGGREGATE_LAST,
+	AGGREGATE_COUNT,
+	AGGREGATE_STDDEV
+};
+
+struct aggregate_summary {
+	unsigned int count;
+	double min;
+	double max;
+	double mean;
+	double last;
+	double stddev;
+};
+
+struct aggregate;
+
+typedef void (*aggregate_close_cb_t) (int id,
+				      const struct aggregate_summary *summary);
+
+int aggregate_parse_function(const char *name);
+double aggregate_summary_value(const struct aggregate_summary *summary,
+			       enum aggregate_function function);
+
+struct aggregate *aggregate_new(int id, int window, int step,
+				aggregate_close_cb_t close_cb);
+void aggregate_free(struct aggregate *agg);
+void aggregate_add(struct aggregate *agg, double value);
@@ -0,0 +1,551 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Compiled device configuration source file
+ *
+ *  Once device.conf is validated, its DataItem groups are written to an
+ *  image of fixed-size records, ordered by link, slave and register as
+ *  they are acquired, followed by the URLs they use and the text of the
+ *  KNoTThing group. Later starts map the image instead of parsing the
+ *  file, for as long as the file keeps its mtime or its contents.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "conf-image.h"
+
+#define IMAGE_MAGIC		0x4b4e4349	/* "KNCI" */
+#define IMAGE_VERSION		1
+#define TMP_SUFFIX		".tmp"
+
+#define FNV_OFFSET_BASIS	0xcbf29ce484222325ULL
+#define FNV_PRIME		0x100000001b3ULL
+
+struct image_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t item_size;
+	uint32_t run_size;
+	int64_t source_mtime;	/* nsec */
+	uint64_t source_size;
+	uint64_t source_hash;
+	uint32_t n_runs;
+	uint32_t n_items;
+	uint32_t strings_len;
+	uint32_t thing_len;
+	uint64_t checksum;	/* of everything after the header */
+};
+
+/* Items read from the same slave, in register order */
+struct image_run {
+	uint32_t url;		/* in the string table, 0 for the thing's */
+	int32_t slave_id;
+	uint32_t first;
+	uint32_t count;
+};
+
+struct source_stamp {
+	int64_t mtime;
+	uint64_t size;
+	uint64_t hash;
+};
+
+struct builder_item {
+	struct conf_image_item item;
+	char *url;
+};
+
+struct conf_image_builder {
+	struct source_stamp stamp;
+	struct l_queue *items;
+	char *thing;
+	size_t thing_len;
+};
+
+struct conf_image {
+	void *map;
+	size_t map_len;
+	const struct image_header *header;
+	const struct image_run *runs;
+	const struct conf_image_item *items;
+	const char *strings;
+	const char *thing;
+};
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static int64_t stat_mtime(const struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static int stamp_source(const char *source, struct source_stamp *stamp)
+{
+	struct stat st;
+	void *map;
+	int err = 0;
+	int fd;
+
+	fd = open(source, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	stamp->mtime = stat_mtime(&st);
+	stamp->size = st.st_size;
+	stamp->hash = FNV_OFFSET_BASIS;
+
+	if (!st.st_size)
+		goto done;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		err = -errno;
+		goto done;
+	}
+
+	stamp->hash = fnv1a(stamp->hash, map, st.st_size);
+	munmap(map, st.st_size);
+
+done:
+	close(fd);
+
+	return err;
+}
+
+static void builder_item_free(void *data)
+{
+	struct builder_item *entry = data;
+
+	l_free(entry->url);
+	l_free(entry);
+}
+
+struct conf_image_builder *conf_image_builder_new(const char *source)
+{
+	struct conf_image_builder *builder;
+	struct source_stamp stamp;
+
+	/* Taken before the file is parsed: a later edit is seen as one */
+	if (stamp_source(source, &stamp) < 0)
+		return NULL;
+
+	builder = l_new(struct conf_image_builder, 1);
+	builder->stamp = stamp;
+	builder->items = l_queue_new();
+
+	return builder;
+}
+
+void conf_image_builder_free(struct conf_image_builder *builder)
+{
+	if (!builder)
+		return;
+
+	l_queue_destroy(builder->items, builder_item_free);
+	l_free(builder->thing);
+	l_free(builder);
+}
+
+void conf_image_builder_set_thing(struct conf_image_builder *builder,
+				  const char *data, size_t len)
+{
+	l_free(builder->thing);
+	builder->thing = l_memdup(data, len);
+	builder->thing_len = len;
+}
+
+void conf_image_builder_add_item(struct conf_image_builder *builder,
+				 const struct conf_image_item *item,
+				 const char *url)
+{
+	struct builder_item *entry;
+
+	entry = l_new(struct builder_item, 1);
+	entry->item = *item;
+	entry->url = l_strdup(url);
+
+	l_queue_push_tail(builder->items, entry);
+}
+
+static int compare_plan(const void *a, const void *b)
+{
+	const struct builder_item *x = *(const struct builder_item **) a;
+	const struct builder_item *y = *(const struct builder_item **) b;
+	int rc;
+
+	if (!x->url != !y->url)
+		return x->url ? 1 : -1;
+
+	if (x->url) {
+		rc = strcmp(x->url, y->url);
+		if (rc)
+			return rc;
+	}
+
+	if (x->item.slave_id != y->item.slave_id)
+		return x->item.slave_id < y->item.slave_id ? -1 : 1;
+
+	if (x->item.reg_addr != y->item.reg_addr)
+		return x->item.reg_addr < y->item.reg_addr ? -1 : 1;
+
+	return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *pos = data;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, pos, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+
+		pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int write_image(const char *path, const struct image_header *header,
+		       const struct image_run *runs,
+		       const struct conf_image_item *items,
+		       const char *strings, const char *thing)
+{
+	char *tmp_path;
+	int err;
+	int fd;
+
+	tmp_path = l_strdup_printf("%s%s", path, TMP_SUFFIX);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	err = write_all(fd, header, sizeof(*header));
+	if (!err)
+		err = write_all(fd, runs, header->n_runs * sizeof(*runs));
+	if (!err)
+		err = write_all(fd, items, header->n_items * sizeof(*items));
+	if (!err)
+		err = write_all(fd, strings, header->strings_len);
+	if (!err)
+		err = write_all(fd, thing, header->thing_len);
+	if (!err && fsync(fd) < 0)
+		err = -errno;
+
+	close(fd);
+
+	if (!err && rename(tmp_path, path) < 0)
+		err = -errno;
+
+	if (err)
+		unlink(tmp_path);
+
+done:
+	l_free(tmp_path);
+
+	return err;
+}
+
+int conf_image_builder_save(struct conf_image_builder *builder,
+			    const char *path)
+{
+	const struct l_queue_entry *entry;
+	struct image_header header;
+	struct builder_item **plan;
+	struct image_run *runs;
+	struct image_run *run = NULL;
+	struct conf_image_item *items;
+	struct l_hashmap *offsets;
+	struct l_string *strings;
+	char *strings_data;
+	uint32_t url;
+	unsigned int n;
+	unsigned int i;
+	int err;
+
+	n = l_queue_length(builder->items);
+	plan = l_new(struct builder_item *, n + 1);
+	runs = l_new(struct image_run, n + 1);
+	items = l_new(struct conf_image_item, n + 1);
+
+	for (entry = l_queue_get_entries(builder->items), i = 0; entry;
+	     entry = entry->next)
+		plan[i++] = entry->data;
+
+	qsort(plan, n, sizeof(*plan), compare_plan);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = IMAGE_MAGIC;
+	header.version = IMAGE_VERSION;
+	header.item_size = sizeof(struct conf_image_item);
+	header.run_size = sizeof(struct image_run);
+	header.source_mtime = builder->stamp.mtime;
+	header.source_size = builder->stamp.size;
+	header.source_hash = builder->stamp.hash;
+	header.n_items = n;
+	header.thing_len = builder->thing_len;
+
+	/* Offset 0 is the empty string, for items on the thing's link */
+	offsets = l_hashmap_string_new();
+	strings = l_string_new(256);
+	l_string_append_c(strings, '\0');
+	header.strings_len = 1;
+
+	for (i = 0; i < n; i++) {
+		url = 0;
+
+		if (plan[i]->url) {
+			url = L_PTR_TO_UINT(l_hashmap_lookup(offsets,
+							     plan[i]->url));
+			if (!url) {
+				url = header.strings_len;
+				l_hashmap_insert(offsets, plan[i]->url,
+						 L_UINT_TO_PTR(url));
+				l_string_append(strings, plan[i]->url);
+				l_string_append_c(strings, '\0');
+				header.strings_len += strlen(plan[i]->url) + 1;
+			}
+		}
+
+		if (!run || run->url != url ||
+		    run->slave_id != plan[i]->item.slave_id) {
+			run = &runs[header.n_runs++];
+			run->url = url;
+			run->slave_id = plan[i]->item.slave_id;
+			run->first = i;
+		}
+
+		run->count++;
+		items[i] = plan[i]->item;
+	}
+
+	strings_data = l_string_unwrap(strings);
+
+	header.checksum = fnv1a(FNV_OFFSET_BASIS, runs,
+				header.n_runs * sizeof(*runs));
+	header.checksum = fnv1a(header.checksum, items, n * sizeof(*items));
+	header.checksum = fnv1a(header.checksum, strings_data,
+				header.strings_len);
+	header.checksum = fnv1a(header.checksum, builder->thing,
+				builder->thing_len);
+
+	err = write_image(path, &header, runs, items, strings_data,
+			  builder->thing);
+
+	l_hashmap_destroy(offsets, NULL);
+	l_free(strings_data);
+	l_free(items);
+	l_free(runs);
+	l_free(plan);
+
+	return err;
+}
+
+static bool image_is_valid(const struct conf_image *image)
+{
+	const struct image_header *header = image->header;
+	uint64_t checksum;
+	uint64_t len;
+	uint32_t i;
+
+	if (header->magic != IMAGE_MAGIC ||
+	    header->version != IMAGE_VERSION ||
+	    header->item_size != sizeof(struct conf_image_item) ||
+	    header->run_size != sizeof(struct image_run))
+		return false;
+
+	len = sizeof(*header) +
+		(uint64_t) header->n_runs * sizeof(struct image_run) +
+		(uint64_t) header->n_items * sizeof(struct conf_image_item) +
+		header->strings_len + header->thing_len;
+	if (len != image->map_len || !header->strings_len)
+		return false;
+
+	checksum = fnv1a(FNV_OFFSET_BASIS, image->runs,
+			 image->map_len - sizeof(*header));
+	if (checksum != header->checksum)
+		return false;
+
+	if (image->strings[0] != '\0' ||
+	    image->strings[header->strings_len - 1] != '\0')
+		return false;
+
+	for (i = 0; i < header->n_runs; i++) {
+		if (image->runs[i].url >= header->strings_len ||
+		    (uint64_t) image->runs[i].first + image->runs[i].count >
+		    header->n_items)
+			return false;
+	}
+
+	return true;
+}
+
+/* Same file, or touched without a change: the image still holds */
+static bool image_is_current(const struct conf_image *image,
+			     const char *path, const char *source)
+{
+	const struct image_header *header = image->header;
+	struct source_stamp stamp;
+	struct stat st;
+	int fd;
+
+	if (stat(source, &st) < 0)
+		return false;
+
+	if (stat_mtime(&st) == header->source_mtime &&
+	    (uint64_t) st.st_size == header->source_size)
+		return true;
+
+	if (stamp_source(source, &stamp) < 0 ||
+	    stamp.size != header->source_size ||
+	    stamp.hash != header->source_hash)
+		return false;
+
+	/* Keep the next start on the fast path */
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		if (pwrite(fd, &stamp.mtime, sizeof(stamp.mtime),
+			   offsetof(struct image_header, source_mtime)) < 0)
+			l_warn("Failed to update %s (%s)", path,
+			       strerror(errno));
+		close(fd);
+	}
+
+	return true;
+}
+
+struct conf_image *conf_image_open(const char *path, const char *source)
+{
+	struct conf_image *image;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 ||
+	    (size_t) st.st_size < sizeof(struct image_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	image = l_new(struct conf_image, 1);
+	image->map = map;
+	image->map_len = st.st_size;
+	image->header = map;
+	image->runs = (const void *) (image->header + 1);
+	image->items = (const void *) (image->runs + image->header->n_runs);
+	image->strings = (const char *) (image->items +
+					 image->header->n_items);
+	image->thing = image->strings + image->header->strings_len;
+
+	if (!image_is_valid(image)) {
+		l_warn("Ignoring invalid configuration image %s", path);
+		conf_image_close(image);
+		return NULL;
+	}
+
+	if (!image_is_current(image, path, source)) {
+		l_info("Configuration image %s is out of date", path);
+		conf_image_close(image);
+		return NULL;
+	}
+
+	return image;
+}
+
+void conf_image_close(struct conf_image *image)
+{
+	if (!image)
+		return;
+
+	munmap(image->map, image->map_len);
+	l_free(image);
+}
+
+const char *conf_image_get_thing(const struct conf_image *image,
+				 size_t *len)
+{
+	*len = image->header->thing_len;
+
+	return image->thing;
+}
+
+int conf_image_foreach_item(const struct conf_image *image,
+			    conf_image_item_cb_t func, void *user_data)
+{
+	const struct image_run *run;
+	const char *url;
+	uint32_t i;
+	uint32_t j;
+	int err;
+
+	for (i = 0; i < image->header->n_runs; i++) {
+		run = &image->runs[i];
+		url = run->url ? image->strings + run->url : NULL;
+
+		for (j = run->first; j < run->first + run->count; j++) {
+			err = func(&image->items[j], url, user_data);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Compiled device configuration header file
+ */
+
+/* Optional keys present on the item */
+#define CONF_IMAGE_MAX_AGE		0x01
+#define CONF_IMAGE_SCAN_CLASS		0x02
+#define CONF_IMAGE_AGGREGATE		0x04
+#define CONF_IMAGE_HISTORY		0x08
+
+/* A DataItem group as validated from device.conf, checked by size */
+struct conf_image_item {
+	int32_t sensor_id;
+	uint32_t flags;
+	knot_schema schema;
+	knot_event event;
+	int32_t slave_id;
+	int32_t reg_addr;
+	int32_t bit_offset;
+	int32_t max_age;
+	int32_t scan_class;
+	int32_t aggregate_window;
+	int32_t aggregate_step;
+	int32_t aggregate_function;
+	int32_t history_size;
+};
+
+struct conf_image;
+struct conf_image_builder;
+
+typedef int (*conf_image_item_cb_t)(const struct conf_image_item *item,
+				    const char *url, void *user_data);
+
+struct conf_image_builder *conf_image_builder_new(const char *source);
+void conf_image_builder_free(struct conf_image_builder *builder);
+void conf_image_builder_set_thing(struct conf_image_builder *builder,
+				  const char *data, size_t len);
+void conf_image_builder_add_item(struct conf_image_builder *builder,
+				 const struct conf_image_item *item,
+				 const char *url);
+int conf_image_builder_save(struct conf_image_builder *builder,
+			    const char *path);
+
+struct conf_image *conf_image_open(const char *path, const char *source);
+void conf_image_close(struct conf_image *image);
+const char *conf_image_get_thing(const struct conf_image *image,
+				 size_t *len);
+int conf_image_foreach_item(const struct conf_image *image,
+			    conf_image_item_cb_t func, void *user_data);
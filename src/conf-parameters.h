@@ -21,6 +21,7 @@
 #define CREDENTIALS_GROUP		"Credentials"
 #define CREDENTIALS_THING_ID		"ThingId"
 #define CREDENTIALS_THING_TOKEN		"ThingToken"
+#define CREDENTIALS_SCHEMA_HASH		"SchemaHash"
 
 #define CLOUD_GROUP			"Cloud"
 #define RABBIT_URL			"Url"
@@ -32,6 +33,29 @@
 #define THING_USER_TOKEN		"UserToken"
 #define THING_MODBUS_SLAVE_ID		"ModbusSlaveId"
 #define THING_MODBUS_URL		"ModbusURL"
+#define THING_MODBUS_TURNAROUND_DELAY	"ModbusTurnaroundDelay"
+#define THING_MODBUS_RESPONSE_TIMEOUT	"ModbusResponseTimeout"
+#define THING_MODBUS_MAX_IN_FLIGHT	"ModbusMaxInFlight"
+#define THING_MODBUS_LINK_MAX_IN_FLIGHT	"ModbusLinkMaxInFlight"
+#define THING_MODBUS_SLAVE_MAX_IN_FLIGHT "ModbusSlaveMaxInFlight"
+#define THING_MODBUS_RECONNECT_MIN	"ModbusReconnectMinDelay"
+#define THING_MODBUS_RECONNECT_MAX	"ModbusReconnectMaxDelay"
+#define THING_MODBUS_KEEPALIVE		"ModbusKeepAlive"
+#define THING_MODBUS_LIVENESS_INTERVAL	"ModbusLivenessInterval"
+#define THING_MODBUS_SLAVE_RATE		"ModbusSlaveRate"
+#define THING_MODBUS_SLAVE_BURST	"ModbusSlaveBurst"
+#define THING_POLL_MIN_INTERVAL		"PollMinInterval"
+#define THING_POLL_MAX_INTERVAL		"PollMaxInterval"
+#define THING_POLL_BUDGET		"PollBudget"
+#define THING_HISTORY_PATH		"HistoryPath"
+#define THING_STATE_PATH		"StatePath"
+#define THING_PUBLISH_RATE		"PublishRate"
+#define THING_PUBLISH_BURST		"PublishBurst"
+#define THING_MODBUS_SERVER_ADDRESS	"ModbusServerAddress"
+#define THING_MODBUS_SERVER_PORT	"ModbusServerPort"
+#define THING_MODBUS_SERVER_MAX_AGE	"ModbusServerMaxAge"
+#define THING_MODBUS_SERVER_WRITES	"ModbusServerWrites"
+#define MODBUS_SERVER_MAX_PORT		65535
 #define MODBUS_MIN_SLAVE_ID		0
 #define MODBUS_MAX_SLAVE_ID		255
 
@@ -40,6 +64,8 @@
 #define SCHEMA_VALUE_TYPE		"SchemaValueType"
 #define SCHEMA_UNIT			"SchemaUnit"
 #define SCHEMA_TYPE_ID			"SchemaTypeId"
+#define SCHEMA_MIN_SENSOR_ID		0
+#define SCHEMA_MAX_SENSOR_ID		0xFFFF
 
 #define EVENT_LOWER_THRESHOLD		"EventLowerThreshold"
 #define EVENT_UPPER_THRESHOLD		"EventUpperThreshold"
@@ -47,5 +73,15 @@
 #define EVENT_CHANGE			"EventChange"
 #define EVENT_CHANGE_TRUE		1
 
+#define VALUE_MAX_AGE			"ValueMaxAge"
+#define SCAN_CLASS			"ScanClass"
+#define SCAN_CLASS_MAX			0xFFFF
+#define AGGREGATE_WINDOW		"AggregateWindow"
+#define AGGREGATE_STEP			"AggregateStep"
+#define AGGREGATE_FUNCTION		"AggregateFunction"
+#define HISTORY_SIZE			"HistorySize"
+
+#define MODBUS_SLAVE_ID			"ModbusSlaveId"
+#define MODBUS_URL			"ModbusURL"
 #define MODBUS_REG_ADDRESS		"ModbusRegisterAddress"
 #define MODBUS_BIT_OFFSET		"ModbusBitOffset"
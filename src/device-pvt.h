@@ -14,4 +14,6 @@
  *  Lesser General Public License for more details.
  */
 
-char *device_get_id();
+struct knot_thing *device_thing_new(void);
+void device_thing_destroy(struct knot_thing *thing);
+char *device_get_id(struct knot_thing *thing);
@@ -25,6 +25,9 @@
 #include <knot/knot_cloud.h>
 #include <ell/ell.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
 #include <errno.h>
 
 #include "storage.h"
@@ -33,40 +36,142 @@
 #include "device.h"
 #include "device-pvt.h"
 #include "iface-modbus.h"
+#include "modbus-server.h"
 #include "sm.h"
 #include "event.h"
 #include "poll.h"
+#include "aggregate.h"
+#include "history.h"
+#include "state.h"
+#include "watch.h"
+#include "conf-image.h"
 #include "properties.h"
 
 #define CONNECTED_MASK		0xFF
 #define set_conn_bitmask(a, b1, b2) (a) ? (b1) | (b2) : (b1) & ~(b2)
 #define DEFAULT_POLLING_INTERVAL 1
+#define USEC_PER_SEC 1000000
+#define USEC_PER_MSEC 1000
+#define MSEC_PER_SEC 1000
+#define DEFAULT_PUBLISH_RATE 100
+#define DEFAULT_PUBLISH_BURST 10
+#define RESYNC_REPORT_PERIOD 5
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define SCHEMA_HASH_LEN 16
+#define REGISTER_ID_LEN 48
+/* Things share the scan and event engines: their ids carry the thing */
+#define KEY_SHIFT 16
+#define KEY_ID_MASK 0xFFFF
+#define MAX_THINGS 0x7FFF
 
 enum CONN_TYPE {
 	MODBUS = 0x0F,
 	CLOUD = 0xF0
 };
 
+/* Shared by all the things reading from its URL */
+struct modbus_link {
+	char *url;
+	int bus_id;
+	bool connected;
+	/* Of the first thing that used it */
+	struct iface_modbus_opts *opts;
+};
+
 struct modbus_slave {
 	int id;
 	char *url;
+	struct iface_modbus_opts opts;
+	int max_in_flight;
+	/* Every distinct Modbus URL used by the thing or its items */
+	struct l_queue *links;
+	struct modbus_link *link;
+	unsigned int connected;
 };
 
 struct modbus_source {
+	struct modbus_link *link;
+	int slave_id;
 	int reg_addr;
 	int bit_offset;
 };
 
+/* A read of one register, shared by every data item mapping it */
+struct register_read {
+	char id[REGISTER_ID_LEN];
+	int bus_id;
+	int slave_id;
+	enum iface_modbus_priority priority;
+	struct l_queue *readers;
+};
+
+struct register_reader {
+	int key;
+	iface_modbus_read_cb_t read_cb;
+};
+
+struct poll_settings {
+	int min_interval;	/* ms */
+	int max_interval;	/* ms, 0 for fixed intervals */
+	int budget;		/* reads per second */
+};
+
+struct server_settings {
+	char *address;		/* NULL for loopback */
+	int port;		/* 0 when not serving */
+	int max_age;		/* ms, 0 for the default */
+	bool writes;		/* forwarded to the slaves */
+};
+
+struct publish_settings {
+	int rate;		/* publishes per second when resyncing */
+	int burst;
+};
+
+/* Data items still to be published after going online */
+struct resync {
+	struct l_queue *pending;
+	struct l_timeout *to;
+	unsigned int total;
+	unsigned int done;
+	double tokens;
+	uint64_t last_refill;	/* usec */
+	uint64_t last_report;	/* usec */
+};
+
 struct knot_data_item {
+	struct knot_thing *thing;
 	int sensor_id;
 	knot_schema schema;
 	knot_event event;
 	knot_value_type current_val;
 	knot_value_type sent_val;
 	struct modbus_source modbus_source;
+	/* Only published on timeouts and requests: read when needed */
+	bool on_demand;
+	int max_age;		/* ms, -1 for the default */
+	uint64_t updated;	/* usec, when current_val was read */
+	bool reading;
+	bool publish_pending;
+	bool acquired;
+	int scan_class;		/* 0 when sampled on its own */
+	bool sampled;		/* read in the current burst */
+	/* Window statistics published in place of the raw samples */
+	struct aggregate *aggregate;
+	enum aggregate_function aggregate_function;
+	int aggregate_window;	/* ms */
+	int aggregate_step;	/* ms */
+	knot_value_type summary_val;
+	bool has_summary;
+	bool alarm;		/* raw value beyond a threshold to publish */
+	struct history *history;
+	int history_size;
+	int64_t published;	/* usec since the epoch, 0 if never */
 };
 
 struct knot_thing {
+	int index;		/* in things, part of its keys */
 	char token[KNOT_PROTOCOL_TOKEN_LEN + 1];
 	char id[KNOT_PROTOCOL_UUID_LEN + 1];
 	char name[KNOT_PROTOCOL_DEVICE_NAME_LEN];
@@ -79,23 +184,192 @@ struct knot_thing {
 	struct l_hashmap *data_items;
 
 	struct l_timeout *msg_to;
+	struct sm *sm;
+	uint8_t conn_mask;
+	bool online;		/* its events are being checked */
+	struct resync resync;
+
+	struct poll_settings poll;
+	struct publish_settings publish;
+	struct server_settings server;
+	struct modbus_server *modbus_server;
+
+	char *history_path;	/* directory of the history files */
+	struct history_server *history_server;
+	char *state_path;	/* last published values */
+	struct state *state;
+	char *schema_hash;	/* last schema acknowledged by the cloud */
+	struct watch *watch;	/* on its device file */
 };
 
-struct knot_thing thing;
+static struct knot_thing **things;
+static unsigned int n_things;
+static struct l_queue *links;
+static unsigned int links_connected;
+static struct l_hashmap *register_reads;
+
+static int thing_key(const struct knot_thing *thing, int id)
+{
+	return thing->index << KEY_SHIFT | id;
+}
+
+static int data_item_key(const struct knot_data_item *data_item)
+{
+	return thing_key(data_item->thing, data_item->sensor_id);
+}
+
+/* Scan classes are only shared by the items of a thing */
+static int scan_class_key(const struct knot_thing *thing, int scan_class)
+{
+	return scan_class ? thing_key(thing, scan_class) : 0;
+}
+
+static struct knot_thing *key_thing(int key)
+{
+	unsigned int index = key >> KEY_SHIFT;
+
+	return index < n_things ? things[index] : NULL;
+}
+
+static int key_id(int key)
+{
+	return key & KEY_ID_MASK;
+}
+
+static struct knot_data_item *data_item_lookup(int key)
+{
+	struct knot_thing *thing = key_thing(key);
+
+	if (!thing)
+		return NULL;
+
+	return l_hashmap_lookup(thing->data_items, L_INT_TO_PTR(key_id(key)));
+}
+
+static void modbus_link_free(void *data)
+{
+	struct modbus_link *link = data;
+
+	l_free(link->url);
+	l_free(link);
+}
+
+static bool modbus_link_match_url(const void *a, const void *b)
+{
+	const struct modbus_link *link = a;
+	const char *url = b;
+
+	return !strcmp(link->url, url);
+}
+
+static bool match_ptr(const void *a, const void *b)
+{
+	return a == b;
+}
+
+static bool thing_uses_link(struct knot_thing *thing,
+			    struct modbus_link *link)
+{
+	return l_queue_find(thing->modbus_slave.links, match_ptr, link);
+}
+
+static void conn_handler(struct knot_thing *thing, enum CONN_TYPE conn,
+			 bool is_up);
+
+/* Polling goes on while any of the thing's slaves is still reachable */
+static void thing_link_changed(struct knot_thing *thing, bool is_up)
+{
+	if (is_up) {
+		if (thing->modbus_slave.connected++)
+			return;
+	} else if (--thing->modbus_slave.connected) {
+		return;
+	}
+
+	conn_handler(thing, MODBUS, is_up);
+}
+
+/* Takes ownership of url */
+static struct modbus_link *modbus_link_get(struct knot_thing *thing,
+					   char *url)
+{
+	struct modbus_link *link;
+
+	if (!links)
+		links = l_queue_new();
+
+	link = l_queue_find(links, modbus_link_match_url, url);
+	if (link) {
+		l_free(url);
+	} else {
+		link = l_new(struct modbus_link, 1);
+		link->url = url;
+		link->bus_id = -1;
+		link->opts = &thing->modbus_slave.opts;
+		l_queue_push_tail(links, link);
+	}
+
+	if (!thing->modbus_slave.links)
+		thing->modbus_slave.links = l_queue_new();
+
+	if (thing_uses_link(thing, link))
+		return link;
+
+	l_queue_push_tail(thing->modbus_slave.links, link);
+
+	if (link->connected)
+		thing_link_changed(thing, true);
 
-static void knot_thing_destroy(struct knot_thing *thing)
+	return link;
+}
+
+static void data_item_free(void *data)
+{
+	struct knot_data_item *data_item = data;
+
+	aggregate_free(data_item->aggregate);
+	history_close(data_item->history);
+	l_free(data_item);
+}
+
+struct knot_thing *device_thing_new(void)
+{
+	struct knot_thing *thing;
+
+	thing = l_new(struct knot_thing, 1);
+	thing->data_items = l_hashmap_new();
+
+	return thing;
+}
+
+void device_thing_destroy(struct knot_thing *thing)
 {
 	if (thing->msg_to)
 		l_timeout_remove(thing->msg_to);
 
+	watch_remove(thing->watch);
+	history_server_stop(thing->history_server);
+	modbus_server_stop(thing->modbus_server);
+	state_close(thing->state);
+	if (thing->sm)
+		sm_stop(thing->sm);
+
 	l_free(thing->user_token);
 	l_free(thing->rabbitmq_url);
 	l_free(thing->modbus_slave.url);
+	/* The links themselves outlive the things */
+	l_queue_destroy(thing->modbus_slave.links, NULL);
 	l_free(thing->conf_files.credentials_path);
 	l_free(thing->conf_files.device_path);
 	l_free(thing->conf_files.cloud_path);
-
-	l_hashmap_destroy(thing->data_items, l_free);
+	l_free(thing->conf_files.image_path);
+	l_free(thing->history_path);
+	l_free(thing->server.address);
+	l_free(thing->state_path);
+	l_free(thing->schema_hash);
+
+	l_hashmap_destroy(thing->data_items, data_item_free);
+	l_free(thing);
 }
 
 static void foreach_event_add_data_item(const void *key, void *value,
@@ -103,15 +377,34 @@ static void foreach_event_add_data_item(const void *key, void *value,
 {
 	struct knot_data_item *data_item = value;
 
-	event_add_data_item(data_item->sensor_id, data_item->event);
+	event_add_data_item(data_item_key(data_item), data_item->event);
+}
+
+static void foreach_event_remove_data_item(const void *key, void *value,
+					   void *user_data)
+{
+	struct knot_data_item *data_item = value;
+
+	event_remove_data_item(data_item_key(data_item));
+}
+
+/* Timers only run while the thing is online */
+static void data_item_update_event(struct knot_data_item *data_item)
+{
+	if (data_item->thing->online)
+		event_update_data_item(data_item_key(data_item),
+				       data_item->event);
 }
 
-static void foreach_update_config(void *data, void *user_data)
+static int data_item_check_event(struct knot_data_item *data_item,
+				 knot_event event)
 {
-	knot_msg_config *config = data;
+	if (!data_item->thing->online)
+		return -ENOMSG;
 
-	properties_update_data_item(&thing, thing.conf_files.device_path,
-				    config);
+	return event_check_value(event, data_item->current_val,
+				 data_item->sent_val,
+				 data_item->schema.value_type);
 }
 
 static void foreach_send_config(const void *key, void *value, void *user_data)
@@ -127,468 +420,2065 @@ static void foreach_send_config(const void *key, void *value, void *user_data)
 						 sizeof(knot_msg_config)));
 }
 
+static bool is_on_demand(knot_event event)
+{
+	return !(event.event_flags & (KNOT_EVT_FLAG_CHANGE |
+				      KNOT_EVT_FLAG_LOWER_THRESHOLD |
+				      KNOT_EVT_FLAG_UPPER_THRESHOLD));
+}
+
+static uint64_t time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static double value_to_double(const knot_value_type *value, int value_type)
+{
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		return value->val_i;
+	case KNOT_VALUE_TYPE_FLOAT:
+		return value->val_f;
+	case KNOT_VALUE_TYPE_BOOL:
+		return value->val_b;
+	case KNOT_VALUE_TYPE_INT64:
+		return value->val_i64;
+	case KNOT_VALUE_TYPE_UINT:
+		return value->val_u;
+	case KNOT_VALUE_TYPE_UINT64:
+		return value->val_u64;
+	default:
+		return 0;
+	}
+}
+
+static void double_to_value(double d, int value_type, knot_value_type *value)
+{
+	memset(value, 0, sizeof(*value));
+
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		value->val_i = lround(d);
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		value->val_f = d;
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		value->val_b = d >= 0.5;
+		break;
+	case KNOT_VALUE_TYPE_INT64:
+		value->val_i64 = llround(d);
+		break;
+	case KNOT_VALUE_TYPE_UINT:
+		value->val_u = lround(d);
+		break;
+	case KNOT_VALUE_TYPE_UINT64:
+		value->val_u64 = llround(d);
+		break;
+	}
+}
+
+static int64_t time_realtime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (int64_t) ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* Only the member of the value type counts, the rest of the union is noise */
+static bool value_equal(const knot_value_type *a, const knot_value_type *b,
+			int value_type)
+{
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		return !memcmp(&a->val_i, &b->val_i, sizeof(a->val_i));
+	case KNOT_VALUE_TYPE_FLOAT:
+		return !memcmp(&a->val_f, &b->val_f, sizeof(a->val_f));
+	case KNOT_VALUE_TYPE_BOOL:
+		return !memcmp(&a->val_b, &b->val_b, sizeof(a->val_b));
+	case KNOT_VALUE_TYPE_INT64:
+		return !memcmp(&a->val_i64, &b->val_i64, sizeof(a->val_i64));
+	case KNOT_VALUE_TYPE_UINT:
+		return !memcmp(&a->val_u, &b->val_u, sizeof(a->val_u));
+	case KNOT_VALUE_TYPE_UINT64:
+		return !memcmp(&a->val_u64, &b->val_u64, sizeof(a->val_u64));
+	default:
+		return !memcmp(a, b, sizeof(*a));
+	}
+}
+
+/* Aggregated items publish their last window, alarms excepted */
+static knot_value_type *publish_value(struct knot_data_item *data_item)
+{
+	if (data_item->has_summary && !data_item->alarm)
+		return &data_item->summary_val;
+
+	return &data_item->current_val;
+}
+
+static void input_publish_event(struct knot_thing *thing, int id)
+{
+	struct l_queue *list;
+
+	list = l_queue_new();
+	l_queue_push_head(list, &id);
+
+	sm_input_event(thing->sm, EVT_PUB_DATA, list);
+
+	l_queue_destroy(list, NULL);
+}
+
+static bool is_stale(struct knot_data_item *data_item)
+{
+	int max_age = data_item->max_age;
+
+	/* Written values are read back before being published */
+	if (!data_item->updated)
+		return true;
+
+	/* Scanned items are fresh enough unless told otherwise */
+	if (max_age < 0)
+		max_age = data_item->on_demand ? 0 : -1;
+
+	if (max_age < 0)
+		return false;
+
+	return time_now() - data_item->updated >
+		(uint64_t) max_age * USEC_PER_MSEC;
+}
+
+static void record_sample(struct knot_data_item *data_item, int rc)
+{
+	if (!data_item->history)
+		return;
+
+	/* Failed reads are kept too, with the last known value */
+	history_append(data_item->history,
+		       value_to_double(&data_item->current_val,
+				       data_item->schema.value_type),
+		       rc < 0 ? HISTORY_QUALITY_BAD : HISTORY_QUALITY_GOOD);
+}
+
+static void data_item_read_done(struct knot_data_item *data_item, int rc)
+{
+	data_item->reading = false;
+
+	record_sample(data_item, rc);
+
+	if (rc >= 0)
+		data_item->updated = time_now();
+
+	if (!data_item->publish_pending)
+		return;
+
+	/* Publish once for every request that waited on this read */
+	data_item->publish_pending = false;
+	data_item->acquired = true;
+
+	input_publish_event(data_item->thing, data_item->sensor_id);
+}
+
+static void register_read_free(void *data)
+{
+	struct register_read *read = data;
+
+	l_queue_destroy(read->readers, l_free);
+	l_free(read);
+}
+
+static void on_register_read(int rc, knot_value_type *value, void *user_data)
+{
+	struct register_read *read = user_data;
+	struct register_reader *reader;
+	knot_value_type sample;
+
+	/* A reader may ask for the register again: that is a new read */
+	l_hashmap_remove(register_reads, read->id);
+
+	if (rc >= 0)
+		sample = *value;
+
+	while ((reader = l_queue_pop_head(read->readers))) {
+		reader->read_cb(rc, rc >= 0 ? &sample : NULL,
+				L_INT_TO_PTR(reader->key));
+		l_free(reader);
+	}
+
+	register_read_free(read);
+}
+
+/*
+ * Things mapping the same register of a slave share a single read, and
+ * the items of the same interval are due in the same scan cycle. The
+ * read waits in the lane of its most urgent reader.
+ */
+static int read_register(struct knot_data_item *data_item,
+			 enum iface_modbus_priority priority,
+			 iface_modbus_read_cb_t read_cb)
+{
+	struct modbus_source *source = &data_item->modbus_source;
+	struct register_reader *reader;
+	struct register_read *read;
+	char id[REGISTER_ID_LEN];
+	int rc;
+
+	snprintf(id, sizeof(id), "%d:%d:%d:%d", source->link->bus_id,
+		 source->slave_id, source->reg_addr, source->bit_offset);
+
+	if (!register_reads)
+		register_reads = l_hashmap_string_new();
+
+	read = l_hashmap_lookup(register_reads, id);
+	if (!read) {
+		read = l_new(struct register_read, 1);
+		strcpy(read->id, id);
+		read->bus_id = source->link->bus_id;
+		read->slave_id = source->slave_id;
+		read->priority = priority;
+		read->readers = l_queue_new();
+
+		rc = iface_modbus_read_data(source->link->bus_id,
+					    source->slave_id,
+					    source->reg_addr,
+					    source->bit_offset, priority,
+					    on_register_read, read);
+		if (rc < 0) {
+			register_read_free(read);
+			return rc;
+		}
+
+		l_hashmap_insert(register_reads, read->id, read);
+	} else if (priority < read->priority) {
+		/* Not left behind a scan read still queued */
+		iface_modbus_reprioritize(read->bus_id, read->slave_id, read,
+					  priority);
+		read->priority = priority;
+	}
+
+	reader = l_new(struct register_reader, 1);
+	reader->key = data_item_key(data_item);
+	reader->read_cb = read_cb;
+	l_queue_push_tail(read->readers, reader);
+
+	return 0;
+}
+
+static void on_demand_read(int rc, knot_value_type *value, void *user_data)
+{
+	struct knot_data_item *data_item;
+
+	data_item = data_item_lookup(L_PTR_TO_INT(user_data));
+	if (!data_item)
+		return;
+
+	/* On failure the last known value is published on schedule */
+	if (rc >= 0)
+		data_item->current_val = *value;
+
+	data_item_read_done(data_item, rc);
+}
+
+static bool acquire_data_item(struct knot_data_item *data_item)
+{
+	int rc;
+
+	/* Single flight: join the read already on its way */
+	if (data_item->reading)
+		return true;
+
+	rc = read_register(data_item, IFACE_MODBUS_PRIORITY_REQUEST,
+			   on_demand_read);
+	if (rc < 0)
+		return false;
+
+	data_item->reading = true;
+
+	return true;
+}
+
 static void on_publish_data(void *data, void *user_data)
 {
+	struct knot_thing *thing = user_data;
 	struct knot_data_item *data_item;
+	knot_value_type *value;
 	int *sensor_id = data;
 	int rc;
 
-	data_item = l_hashmap_lookup(thing.data_items,
+	data_item = l_hashmap_lookup(thing->data_items,
 				     L_INT_TO_PTR(*sensor_id));
 	if (!data_item)
 		return;
 
-	rc = knot_cloud_publish_data(thing.id, data_item->sensor_id,
-				     data_item->schema.value_type,
-				     &data_item->current_val,
+	/* A value older than its max age is read first, then published */
+	if (!data_item->acquired && !data_item->has_summary &&
+	    is_stale(data_item)) {
+		data_item->publish_pending = true;
+		if (acquire_data_item(data_item))
+			return;
+
+		data_item->publish_pending = false;
+	}
+
+	data_item->acquired = false;
+
+	value = publish_value(data_item);
+	data_item->alarm = false;
+
+	rc = knot_cloud_publish_data(thing->id, data_item->sensor_id,
+				     data_item->schema.value_type, value,
 				     sizeof(data_item->schema.value_type));
-	if (rc < 0)
+	if (rc < 0) {
 		l_error("Couldn't send data_update for data_item #%d",
 			*sensor_id);
+		return;
+	}
+
+	data_item->sent_val = *value;
+	data_item->published = time_realtime();
+	state_save(thing->state, data_item->sensor_id, value,
+		   data_item->published);
+}
+
+static bool is_publish_due(struct knot_data_item *data_item, int64_t now)
+{
+	int64_t period = (int64_t) data_item->event.time_sec * USEC_PER_SEC;
+
+	if (!data_item->published)
+		return true;
+
+	if ((data_item->event.event_flags & KNOT_EVT_FLAG_TIME) &&
+	    now - data_item->published >= period)
+		return true;
+
+	/* Not read since the start: the scan raises its own events */
+	if (!data_item->updated)
+		return false;
+
+	return !value_equal(publish_value(data_item), &data_item->sent_val,
+			    data_item->schema.value_type);
+}
+
+static void foreach_resync_data(const void *key, void *value,
+				void *user_data)
+{
+	struct knot_data_item *data_item = value;
+	struct resync *resync = &data_item->thing->resync;
+	int64_t *now = user_data;
+
+	if (is_publish_due(data_item, *now))
+		l_queue_push_tail(resync->pending,
+				  L_INT_TO_PTR(data_item->sensor_id));
+}
+
+static void resync_stop(struct resync *resync)
+{
+	if (resync->to) {
+		l_timeout_remove(resync->to);
+		resync->to = NULL;
+	}
+
+	l_queue_destroy(resync->pending, NULL);
+	resync->pending = NULL;
+}
+
+static void resync_report(struct knot_thing *thing, uint64_t now)
+{
+	thing->resync.last_report = now;
+
+	l_info("%s: %u of %u data items resynced", thing->name,
+	       thing->resync.done, thing->resync.total);
+}
+
+static void on_resync_timeout(struct l_timeout *to, void *user_data)
+{
+	struct knot_thing *thing = user_data;
+	struct resync *resync = &thing->resync;
+	struct knot_data_item *data_item;
+	struct l_queue *list;
+	uint64_t now = time_now();
+	int64_t realtime = time_realtime();
+	unsigned int wait;
+	int *ids;
+	int n = 0;
+
+	resync->tokens += (double) (now - resync->last_refill) /
+		USEC_PER_SEC * thing->publish.rate;
+	if (resync->tokens > thing->publish.burst)
+		resync->tokens = thing->publish.burst;
+	resync->last_refill = now;
+
+	ids = l_new(int, thing->publish.burst);
+	list = l_queue_new();
+
+	while (resync->tokens >= 1 && !l_queue_isempty(resync->pending)) {
+		ids[n] = L_PTR_TO_INT(l_queue_pop_head(resync->pending));
+		resync->done++;
+
+		/* Events may have published it meanwhile */
+		data_item = l_hashmap_lookup(thing->data_items,
+					     L_INT_TO_PTR(ids[n]));
+		if (!data_item || !is_publish_due(data_item, realtime))
+			continue;
+
+		l_queue_push_tail(list, &ids[n++]);
+		resync->tokens--;
+	}
+
+	/* Goes through the state machine: dropped if no longer online */
+	if (n)
+		sm_input_event(thing->sm, EVT_PUB_DATA, list);
+
+	l_queue_destroy(list, NULL);
+	l_free(ids);
+
+	if (l_queue_isempty(resync->pending)) {
+		resync_report(thing, now);
+		resync_stop(resync);
+		return;
+	}
+
+	if (now - resync->last_report >= RESYNC_REPORT_PERIOD * USEC_PER_SEC)
+		resync_report(thing, now);
+
+	/* Back when the next publish is allowed */
+	wait = (1 - resync->tokens) * MSEC_PER_SEC / thing->publish.rate + 1;
+	l_timeout_modify_ms(to, wait);
+}
+
+static void on_msg_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct knot_thing *thing = user_data;
+
+	sm_input_event(thing->sm, EVT_TIMEOUT, NULL);
+}
+
+static void on_event_timeout(int key)
+{
+	struct knot_thing *thing = key_thing(key);
+
+	if (thing)
+		input_publish_event(thing, key_id(key));
+}
+
+static struct knot_thing *thing_lookup_id(const char *id)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_things; i++)
+		if (!strcmp(things[i]->id, id))
+			return things[i];
+
+	return NULL;
+}
+
+static bool on_cloud_receive(const struct knot_cloud_msg *msg, void *user_data)
+{
+	struct knot_thing *thing = user_data;
+	struct sm *sm;
+
+	/* All things read through the same connection */
+	if (msg->device_id)
+		thing = thing_lookup_id(msg->device_id);
+
+	if (!thing)
+		return true;
+
+	sm = thing->sm;
+
+	switch (msg->type) {
+	case UPDATE_MSG:
+		if (!msg->error)
+			sm_input_event(sm, EVT_DATA_UPDT, msg->list);
+		break;
+	case REQUEST_MSG:
+		if (!msg->error)
+			sm_input_event(sm, EVT_PUB_DATA, msg->list);
+		break;
+	case REGISTER_MSG:
+		if (msg->error)
+			sm_input_event(sm, EVT_REG_NOT_OK, NULL);
+		else
+			sm_input_event(sm, EVT_REG_OK, (char *) msg->token);
+		break;
+	case UNREGISTER_MSG:
+		if (!msg->error)
+			sm_input_event(sm, EVT_UNREG_REQ, NULL);
+		break;
+	case AUTH_MSG:
+		if (msg->error)
+			sm_input_event(sm, EVT_AUTH_NOT_OK, NULL);
+		else
+			sm_input_event(sm, EVT_AUTH_OK, NULL);
+		break;
+	case CONFIG_MSG:
+		if (msg->error)
+			sm_input_event(sm, EVT_CFG_UPT_NOT_OK, NULL);
+		else
+			sm_input_event(sm, EVT_CFG_UPT_OK, msg->list);
+		break;
+	case LIST_MSG:
+	case MSG_TYPES_LENGTH:
+	default:
+		return true;
+	}
+
+	return true;
+}
+
+static void conn_handler(struct knot_thing *thing, enum CONN_TYPE conn,
+			 bool is_up)
+{
+	thing->conn_mask = set_conn_bitmask(is_up, thing->conn_mask, conn);
+
+	if (thing->conn_mask != CONNECTED_MASK) {
+		sm_input_event(thing->sm, EVT_NOT_READY, NULL);
+		return;
+	}
+
+	sm_input_event(thing->sm, EVT_READY, NULL);
+}
+
+static void on_cloud_disconnected(void *user_data)
+{
+	unsigned int i;
+
+	l_info("Disconnected from Cloud");
+
+	for (i = 0; i < n_things; i++)
+		conn_handler(things[i], CLOUD, false);
+}
+
+static void on_cloud_connected(void *user_data)
+{
+	unsigned int i;
+
+	l_info("Connected to Cloud %s", things[0]->rabbitmq_url);
+
+	for (i = 0; i < n_things; i++)
+		conn_handler(things[i], CLOUD, true);
+}
+
+static void on_modbus_disconnected(void *user_data)
+{
+	struct modbus_link *link = user_data;
+	unsigned int i;
+
+	if (!link->connected)
+		return;
+
+	l_info("Disconnected from Modbus %s", link->url);
+
+	link->connected = false;
+
+	for (i = 0; i < n_things; i++)
+		if (thing_uses_link(things[i], link))
+			thing_link_changed(things[i], false);
+
+	/* The scan goes on while any link is still up */
+	if (!--links_connected)
+		poll_stop();
+}
+
+static void on_modbus_connected(void *user_data)
+{
+	struct modbus_link *link = user_data;
+	unsigned int i;
+
+	if (link->connected)
+		return;
+
+	l_info("Connected to Modbus %s", link->url);
+
+	link->connected = true;
+
+	if (!links_connected++)
+		poll_start();
+
+	for (i = 0; i < n_things; i++)
+		if (thing_uses_link(things[i], link))
+			thing_link_changed(things[i], true);
+}
+
+/* Feeds a sample to the window, true when it must bypass it as an alarm */
+static bool aggregate_sample(struct knot_data_item *data_item)
+{
+	knot_event alarm = data_item->event;
+
+	aggregate_add(data_item->aggregate,
+		      value_to_double(&data_item->current_val,
+				      data_item->schema.value_type));
+
+	alarm.event_flags &= KNOT_EVT_FLAG_LOWER_THRESHOLD |
+		KNOT_EVT_FLAG_UPPER_THRESHOLD;
+	if (data_item_check_event(data_item, alarm) <= 0)
+		return false;
+
+	data_item->alarm = true;
+
+	return true;
+}
+
+static void on_aggregate_close(int key,
+			       const struct aggregate_summary *summary)
+{
+	struct knot_data_item *data_item;
+
+	data_item = data_item_lookup(key);
+	if (!data_item)
+		return;
+
+	l_debug("data_item #%d: %u samples, min %g max %g mean %g stddev %g",
+		data_item->sensor_id, summary->count, summary->min,
+		summary->max, summary->mean, summary->stddev);
+
+	double_to_value(aggregate_summary_value(summary,
+						data_item->aggregate_function),
+			data_item->schema.value_type, &data_item->summary_val);
+	data_item->has_summary = true;
+
+	input_publish_event(data_item->thing, data_item->sensor_id);
+}
+
+static void on_modbus_read(int rc, knot_value_type *value, void *user_data)
+{
+	struct knot_data_item *data_item;
+	int key = L_PTR_TO_INT(user_data);
+	unsigned int flags = 0;
+
+	data_item = data_item_lookup(key);
+	if (!data_item) {
+		poll_read_complete(key, rc, flags);
+		return;
+	}
+
+	if (rc < 0) {
+		data_item_read_done(data_item, rc);
+		poll_read_complete(key, rc, flags);
+		return;
+	}
+
+	if (!value_equal(&data_item->current_val, value,
+			 data_item->schema.value_type))
+		flags |= POLL_READ_CHANGED;
+
+	data_item->current_val = *value;
+
+	if (data_item->aggregate && aggregate_sample(data_item)) {
+		flags |= POLL_READ_EVENT;
+		data_item->acquired = true;
+		input_publish_event(data_item->thing, data_item->sensor_id);
+	}
+
+	/* Events of a scan class are checked once the whole set is in */
+	if (data_item->scan_class) {
+		data_item->sampled = true;
+		data_item->reading = false;
+		record_sample(data_item, rc);
+		poll_read_complete(key, rc, flags);
+		return;
+	}
+
+	if (!data_item->aggregate &&
+	    data_item_check_event(data_item, data_item->event) > 0) {
+		flags |= POLL_READ_EVENT;
+		/* The event publishes the fresh value for the waiters too */
+		data_item->publish_pending = false;
+		input_publish_event(data_item->thing, data_item->sensor_id);
+	}
+
+	data_item_read_done(data_item, rc);
+	poll_read_complete(key, rc, flags);
+}
+
+struct scan_sample {
+	int scan_class;
+	uint64_t stamp;
+	bool event;
+	struct l_queue *list;
+};
+
+static void foreach_scan_sample(const void *key, void *value,
+				void *user_data)
+{
+	struct knot_data_item *data_item = value;
+	struct scan_sample *sample = user_data;
+
+	if (data_item->scan_class != sample->scan_class ||
+	    !data_item->sampled)
+		return;
+
+	data_item->sampled = false;
+	data_item->updated = sample->stamp;
+
+	/* Aggregated members only go out at their window close */
+	if (!data_item->aggregate &&
+	    data_item_check_event(data_item, data_item->event) > 0)
+		sample->event = true;
+
+	l_queue_push_tail(sample->list, &data_item->sensor_id);
+}
+
+static void foreach_scan_sent(void *data, void *user_data)
+{
+	struct knot_thing *thing = user_data;
+	struct knot_data_item *data_item;
+	int *sensor_id = data;
+
+	data_item = l_hashmap_lookup(thing->data_items,
+				     L_INT_TO_PTR(*sensor_id));
+	/* The group publishes the fresh value for the waiters too */
+	data_item->publish_pending = false;
+	data_item->acquired = true;
+}
+
+static void foreach_scan_pending(void *data, void *user_data)
+{
+	struct knot_thing *thing = user_data;
+	struct knot_data_item *data_item;
+	int *sensor_id = data;
+
+	data_item = l_hashmap_lookup(thing->data_items,
+				     L_INT_TO_PTR(*sensor_id));
+	if (!data_item->publish_pending)
+		return;
+
+	data_item->publish_pending = false;
+	data_item->acquired = true;
+
+	input_publish_event(thing, data_item->sensor_id);
+}
+
+static void on_scan_class_done(int key, uint64_t stamp)
+{
+	struct knot_thing *thing = key_thing(key);
+	struct scan_sample sample = {
+		.scan_class = key_id(key),
+		.stamp = stamp,
+	};
+
+	if (!thing)
+		return;
+
+	sample.list = l_queue_new();
+
+	/* Items of a class share one timestamp and are published together */
+	l_hashmap_foreach(thing->data_items, foreach_scan_sample, &sample);
+
+	if (sample.event) {
+		l_queue_foreach(sample.list, foreach_scan_sent, thing);
+		sm_input_event(thing->sm, EVT_PUB_DATA, sample.list);
+	} else {
+		l_queue_foreach(sample.list, foreach_scan_pending, thing);
+	}
+
+	l_queue_destroy(sample.list, NULL);
+}
+
+static bool has_threshold(knot_event event)
+{
+	return event.event_flags & (KNOT_EVT_FLAG_LOWER_THRESHOLD |
+				    KNOT_EVT_FLAG_UPPER_THRESHOLD);
+}
+
+static int on_modbus_poll_receive(int key)
+{
+	struct knot_data_item *data_item;
+	enum iface_modbus_priority priority;
+	int rc;
+
+	data_item = data_item_lookup(key);
+	if (!data_item)
+		return -EINVAL;
+
+	if (data_item->reading)
+		return -EALREADY;
+
+	/* Alarm limits must not wait behind the rest of the scan */
+	priority = has_threshold(data_item->event) ?
+		IFACE_MODBUS_PRIORITY_ALARM : IFACE_MODBUS_PRIORITY_SCAN;
+
+	rc = read_register(data_item, priority, on_modbus_read);
+	if (rc < 0)
+		return rc;
+
+	data_item->reading = true;
+
+	return 0;
+}
+
+static void on_modbus_write(int rc, void *user_data)
+{
+	struct knot_data_item *data_item;
+	int key = L_PTR_TO_INT(user_data);
+
+	if (rc < 0) {
+		l_error("Couldn't write data_item #%d (%s)", key_id(key),
+			strerror(-rc));
+		return;
+	}
+
+	data_item = data_item_lookup(key);
+	if (!data_item)
+		return;
+
+	/* Publish what the slave holds now, not what was asked for */
+	data_item->updated = 0;
+	input_publish_event(data_item->thing, data_item->sensor_id);
+}
+
+static void on_update_data(void *data, void *user_data)
+{
+	struct knot_thing *thing = user_data;
+	knot_msg_data *msg = data;
+	struct knot_data_item *data_item;
+	int rc;
+
+	data_item = l_hashmap_lookup(thing->data_items,
+				     L_INT_TO_PTR(msg->sensor_id));
+	if (!data_item)
+		return;
+
+	rc = iface_modbus_write_data(data_item->modbus_source.link->bus_id,
+				     data_item->modbus_source.slave_id,
+				     data_item->modbus_source.reg_addr,
+				     data_item->modbus_source.bit_offset,
+				     &msg->payload, on_modbus_write,
+				     L_INT_TO_PTR(data_item_key(data_item)));
+	if (rc < 0)
+		l_error("Couldn't write data_item #%d (%s)", msg->sensor_id,
+			strerror(-rc));
+}
+
+static int start_data_item_polling(struct knot_data_item *data_item)
+{
+	int key = data_item_key(data_item);
+
+	if (poll_create(DEFAULT_POLLING_INTERVAL, key, data_item->thing->index,
+			on_modbus_poll_receive)) {
+		l_error("Fail on create poll to read data item with id: %d",
+			data_item->sensor_id);
+		return -1;
+	}
+
+	poll_set_on_demand(key, data_item->on_demand);
+
+	if (poll_set_scan_class(key, scan_class_key(data_item->thing,
+						    data_item->scan_class),
+				on_scan_class_done) < 0) {
+		l_error("Fail on set scan class of data item with id: %d",
+			data_item->sensor_id);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void foreach_data_item_polling(const void *key, void *value,
+				      void *user_data)
+{
+	struct knot_data_item *data_item = value;
+	int *rc = user_data;
+
+	if (start_data_item_polling(data_item) < 0)
+		*rc = -1;
+}
+
+/* A single scan reads the items of all the things */
+static int create_data_item_polling(void)
+{
+	struct knot_thing *thing;
+	unsigned int i;
+	int rc = 0;
+
+	for (i = 0; i < n_things && !rc; i++) {
+		thing = things[i];
+
+		/* Each thing paces its own items, within its own budget */
+		if (thing->poll.max_interval > 0) {
+			rc = poll_set_adaptive(thing->index,
+					       thing->poll.min_interval,
+					       thing->poll.max_interval,
+					       thing->poll.budget);
+			if (rc < 0)
+				break;
+		}
+
+		l_hashmap_foreach(thing->data_items,
+				  foreach_data_item_polling, &rc);
+	}
+
+	if (rc)
+		poll_destroy();
+
+	return rc;
+}
+
+static void foreach_modbus_link_stop(void *data, void *user_data)
+{
+	struct modbus_link *link = data;
+
+	if (link->bus_id < 0)
+		return;
+
+	iface_modbus_stop(link->bus_id, link);
+	link->bus_id = -1;
+	link->connected = false;
+}
+
+static void stop_modbus_links(void)
+{
+	unsigned int i;
+
+	l_queue_foreach(links, foreach_modbus_link_stop, NULL);
+	links_connected = 0;
+
+	for (i = 0; i < n_things; i++)
+		things[i]->modbus_slave.connected = 0;
+}
+
+static int modbus_link_start(struct modbus_link *link)
+{
+	int rc;
+
+	rc = iface_modbus_start(link->url, link->opts, on_modbus_connected,
+				on_modbus_disconnected, link);
+	if (rc < 0) {
+		l_error("Failed to start Modbus %s", link->url);
+		return rc;
+	}
+
+	link->bus_id = rc;
+
+	return 0;
+}
+
+static int start_modbus_links(void)
+{
+	const struct l_queue_entry *entry;
+	int max_in_flight = 0;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < n_things; i++)
+		if (things[i]->modbus_slave.max_in_flight > max_in_flight)
+			max_in_flight = things[i]->modbus_slave.max_in_flight;
+
+	iface_modbus_set_max_in_flight(max_in_flight);
+
+	/* One link per slave URL: reads to all of them are issued at once */
+	for (entry = l_queue_get_entries(links); entry; entry = entry->next) {
+		rc = modbus_link_start(entry->data);
+		if (rc < 0) {
+			stop_modbus_links();
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+void device_set_log_priority(int priority)
+{
+	knot_cloud_set_log_priority(priority);
+}
+
+char *device_get_id(struct knot_thing *thing)
+{
+	return thing->id;
+}
+
+void device_set_thing_name(struct knot_thing *thing, const char *name)
+{
+	strcpy(thing->name, name);
+}
+
+void device_set_thing_user_token(struct knot_thing *thing, char *token)
+{
+	thing->user_token = token;
+}
+
+void device_set_thing_modbus_slave(struct knot_thing *thing, int slave_id,
+				   char *url)
+{
+	thing->modbus_slave.id = slave_id;
+	thing->modbus_slave.url = url;
+	thing->modbus_slave.link = modbus_link_get(thing, l_strdup(url));
+}
+
+void device_set_thing_modbus_timing(struct knot_thing *thing,
+				    int turnaround_delay, int response_timeout)
+{
+	thing->modbus_slave.opts.turnaround_delay = turnaround_delay;
+	thing->modbus_slave.opts.response_timeout = response_timeout;
+}
+
+void device_set_thing_modbus_in_flight(struct knot_thing *thing,
+				       int max_in_flight,
+				       int link_max_in_flight,
+				       int slave_max_in_flight)
+{
+	thing->modbus_slave.max_in_flight = max_in_flight;
+	thing->modbus_slave.opts.link_max_in_flight = link_max_in_flight;
+	thing->modbus_slave.opts.slave_max_in_flight = slave_max_in_flight;
+}
+
+void device_set_thing_modbus_link(struct knot_thing *thing,
+				  int reconnect_min_delay,
+				  int reconnect_max_delay, int keepalive,
+				  int liveness_interval)
+{
+	thing->modbus_slave.opts.reconnect_min_delay = reconnect_min_delay;
+	thing->modbus_slave.opts.reconnect_max_delay = reconnect_max_delay;
+	thing->modbus_slave.opts.keepalive = keepalive;
+	thing->modbus_slave.opts.liveness_interval = liveness_interval;
+}
+
+void device_set_thing_poll_adaptive(struct knot_thing *thing,
+				    int min_interval, int max_interval,
+				    int budget)
+{
+	thing->poll.min_interval = min_interval;
+	thing->poll.max_interval = max_interval;
+	thing->poll.budget = budget;
+}
+
+void device_set_thing_modbus_rate(struct knot_thing *thing, int slave_rate,
+				  int slave_burst)
+{
+	thing->modbus_slave.opts.slave_rate = slave_rate;
+	thing->modbus_slave.opts.slave_burst = slave_burst;
+}
+
+void device_set_data_item_max_age(struct knot_thing *thing, int sensor_id,
+				  int max_age)
+{
+	struct knot_data_item *data_item;
+
+	data_item = l_hashmap_lookup(thing->data_items,
+				     L_INT_TO_PTR(sensor_id));
+	if (data_item)
+		data_item->max_age = max_age;
+}
+
+void device_set_data_item_scan_class(struct knot_thing *thing, int sensor_id,
+				     int scan_class)
+{
+	struct knot_data_item *data_item;
+
+	data_item = l_hashmap_lookup(thing->data_items,
+				     L_INT_TO_PTR(sensor_id));
+	if (!data_item)
+		return;
+
+	data_item->scan_class = scan_class;
+	data_item->on_demand = !scan_class && is_on_demand(data_item->event);
+}
+
+void device_set_thing_history_path(struct knot_thing *thing, char *path)
+{
+	l_free(thing->history_path);
+	thing->history_path = path;
+}
+
+void device_set_thing_publish_rate(struct knot_thing *thing, int rate,
+				   int burst)
+{
+	thing->publish.rate = rate;
+	thing->publish.burst = burst;
+}
+
+void device_set_thing_modbus_server(struct knot_thing *thing, char *address,
+				    int port, int max_age, bool writes)
+{
+	l_free(thing->server.address);
+	thing->server.address = address;
+	thing->server.port = port;
+	thing->server.max_age = max_age;
+	thing->server.writes = writes;
+}
+
+void device_set_thing_state_path(struct knot_thing *thing, char *path)
+{
+	l_free(thing->state_path);
+	thing->state_path = path;
+}
+
+int device_set_data_item_history(struct knot_thing *thing, int sensor_id,
+				 int size)
+{
+	struct knot_data_item *data_item;
+	char *path;
+
+	data_item = l_hashmap_lookup(thing->data_items,
+				     L_INT_TO_PTR(sensor_id));
+	if (!data_item)
+		return -ENOENT;
+
+	if (!thing->history_path || size <= 0)
+		return -EINVAL;
+
+	path = l_strdup_printf("%s/%d.ring", thing->history_path, sensor_id);
+	history_close(data_item->history);
+	data_item->history = history_open(path, size);
+	data_item->history_size = data_item->history ? size : 0;
+	l_free(path);
+
+	return data_item->history ? 0 : -EIO;
+}
+
+int device_set_data_item_aggregate(struct knot_thing *thing, int sensor_id,
+				   int window, int step, int function)
+{
+	struct knot_data_item *data_item;
+
+	data_item = l_hashmap_lookup(thing->data_items,
+				     L_INT_TO_PTR(sensor_id));
+	if (!data_item)
+		return -ENOENT;
+
+	if (data_item->schema.value_type == KNOT_VALUE_TYPE_RAW)
+		return -EINVAL;
+
+	aggregate_free(data_item->aggregate);
+	data_item->aggregate = aggregate_new(thing_key(thing, sensor_id),
+					     window, step, on_aggregate_close);
+	if (!data_item->aggregate)
+		return -EINVAL;
+
+	data_item->aggregate_function = function;
+	data_item->aggregate_window = window;
+	data_item->aggregate_step = step;
+
+	return 0;
+}
+
+void device_set_new_data_item(struct knot_thing *thing, int sensor_id,
+			      knot_schema schema, knot_event event, char *url,
+			      int slave_id, int reg_addr, int bit_offset)
+{
+	struct knot_data_item *data_item_aux;
+
+	data_item_aux = l_new(struct knot_data_item, 1);
+	data_item_aux->thing = thing;
+	data_item_aux->sensor_id = sensor_id;
+	data_item_aux->schema = schema;
+	data_item_aux->event = event;
+	data_item_aux->on_demand = is_on_demand(event);
+	data_item_aux->max_age = -1;
+	/* Items without their own URL share the thing's link */
+	data_item_aux->modbus_source.link = url ?
+		modbus_link_get(thing, url) : thing->modbus_slave.link;
+	/* Items without their own unit ID are read from the thing's slave */
+	data_item_aux->modbus_source.slave_id = slave_id < 0 ?
+					thing->modbus_slave.id : slave_id;
+	data_item_aux->modbus_source.reg_addr = reg_addr;
+	data_item_aux->modbus_source.bit_offset = bit_offset;
+
+	l_hashmap_insert(thing->data_items,
+			 L_INT_TO_PTR(data_item_aux->sensor_id),
+			 data_item_aux);
+}
+
+void device_update_config_data_item(struct knot_thing *thing,
+				    knot_msg_config *config)
+{
+	struct knot_data_item *data_item;
+
+	data_item = l_hashmap_lookup(thing->data_items,
+				     L_INT_TO_PTR(config->sensor_id));
+	if (!data_item)
+		return;
+
+	data_item->schema.type_id = config->schema.type_id;
+	data_item->schema.unit = config->schema.unit;
+	data_item->schema.value_type = config->schema.value_type;
+	strncpy(data_item->schema.name, config->schema.name,
+		KNOT_PROTOCOL_DATA_NAME_LEN);
+
+	if (!(config->event.event_flags & KNOT_EVT_FLAG_UNREGISTERED)) {
+		data_item->event.event_flags = config->event.event_flags;
+		data_item->event.time_sec = config->event.time_sec;
+		knot_value_assign_limit(config->schema.value_type,
+					config->event.lower_limit,
+					&data_item->event.lower_limit);
+		knot_value_assign_limit(config->schema.value_type,
+					config->event.upper_limit,
+					&data_item->event.upper_limit);
+
+		/* Members of a scan class are always sampled with it */
+		data_item->on_demand = !data_item->scan_class &&
+			is_on_demand(data_item->event);
+		poll_set_on_demand(data_item_key(data_item),
+				   data_item->on_demand);
+		data_item_update_event(data_item);
+	}
+}
+
+void *device_data_item_lookup(struct knot_thing *thing, int sensor_id)
+{
+	return l_hashmap_lookup(thing->data_items, L_INT_TO_PTR(sensor_id));
+}
+
+void device_set_thing_rabbitmq_url(struct knot_thing *thing, char *url)
+{
+	thing->rabbitmq_url = url;
+}
+
+void device_set_thing_credentials(struct knot_thing *thing, const char *id,
+				  const char *token)
+{
+	strncpy(thing->id, id, KNOT_PROTOCOL_UUID_LEN);
+	strncpy(thing->token, token, KNOT_PROTOCOL_TOKEN_LEN);
+}
+
+void device_generate_thing_id(struct knot_thing *thing)
+{
+	uint64_t id; /* knot id uses 16 characters which fits inside a uint64 */
+
+	l_getrandom(&id, sizeof(id));
+	/* PRIx64 formats the string as hex */
+	sprintf(thing->id, "%"PRIx64, id);
+}
+
+void device_set_thing_schema_hash(struct knot_thing *thing, char *hash)
+{
+	l_free(thing->schema_hash);
+	thing->schema_hash = hash;
+}
+
+void device_clear_thing_id(struct knot_thing *thing)
+{
+	thing->id[0] = '\0';
+}
+
+void device_clear_thing_token(struct knot_thing *thing)
+{
+	thing->token[0] = '\0';
+}
+
+int device_has_thing_token(struct knot_thing *thing)
+{
+	return thing->token[0] != '\0';
+}
+
+int device_store_credentials_on_file(struct knot_thing *thing, char *token)
+{
+	int rc;
+
+	rc = properties_store_credentials(thing,
+					  thing->conf_files.credentials_path,
+					  thing->id, token);
+	if (rc < 0)
+		return -1;
+
+	strncpy(thing->token, token, KNOT_PROTOCOL_TOKEN_LEN);
+
+	return 0;
+}
+
+int device_clear_credentials_on_file(struct knot_thing *thing)
+{
+	return properties_clear_credentials(thing,
+					    thing->conf_files.credentials_path);
+}
+
+int device_start_event(struct knot_thing *thing)
+{
+	if (thing->online)
+		return 0;
+
+	thing->online = true;
+	l_hashmap_foreach(thing->data_items, foreach_event_add_data_item, NULL);
+
+	return 0;
+}
+
+void device_stop_event(struct knot_thing *thing)
+{
+	if (!thing->online)
+		return;
+
+	thing->online = false;
+	l_hashmap_foreach(thing->data_items, foreach_event_remove_data_item,
+			  NULL);
+}
+
+int device_update_config(struct knot_thing *thing,
+			 struct l_queue *config_list)
+{
+	/* Only the items in the list are touched, timers included */
+	if (properties_update_data_items(thing, thing->conf_files.device_path,
+					 config_list) < 0)
+		l_error("Couldn't save the config update");
+
+	/* The cloud sent this config: it already has it */
+	if (device_store_schema_hash(thing) < 0)
+		l_error("Couldn't store the schema hash");
+
+	return 0;
 }
 
-static void foreach_publish_all_data(const void *key, void *value,
-				     void *user_data)
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
 {
-	struct knot_data_item *data_item = value;
+	const uint8_t *bytes = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
 
-	on_publish_data(&data_item->sensor_id, NULL);
+	return hash;
 }
 
-static void on_msg_timeout(struct l_timeout *timeout, void *user_data)
+/* Only the member of the value type in use, never its padding */
+static uint64_t fnv1a_value(uint64_t hash, const knot_value_type *value,
+			    int value_type)
 {
-	sm_input_event(EVT_TIMEOUT, user_data);
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		return fnv1a(hash, &value->val_i, sizeof(value->val_i));
+	case KNOT_VALUE_TYPE_FLOAT:
+		return fnv1a(hash, &value->val_f, sizeof(value->val_f));
+	case KNOT_VALUE_TYPE_BOOL:
+		return fnv1a(hash, &value->val_b, sizeof(value->val_b));
+	case KNOT_VALUE_TYPE_INT64:
+		return fnv1a(hash, &value->val_i64, sizeof(value->val_i64));
+	case KNOT_VALUE_TYPE_UINT:
+		return fnv1a(hash, &value->val_u, sizeof(value->val_u));
+	case KNOT_VALUE_TYPE_UINT64:
+		return fnv1a(hash, &value->val_u64, sizeof(value->val_u64));
+	default:
+		return hash;
+	}
 }
 
-static void on_event_timeout(int id)
+static int data_item_compare(const void *a, const void *b, void *user_data)
 {
-	struct l_queue *list;
-
-	list = l_queue_new();
-	l_queue_push_head(list, &id);
+	const struct knot_data_item *item_a = a;
+	const struct knot_data_item *item_b = b;
 
-	sm_input_event(EVT_PUB_DATA, list);
+	return item_a->sensor_id - item_b->sensor_id;
+}
 
-	l_queue_destroy(list, NULL);
+static void foreach_data_item_sort(const void *key, void *value,
+				   void *user_data)
+{
+	l_queue_insert(user_data, value, data_item_compare, NULL);
 }
 
-static bool on_cloud_receive(const struct knot_cloud_msg *msg, void *user_data)
+/* Hash of what device_send_config() sends, in sensor id order */
+static char *schema_hash(struct knot_thing *thing)
 {
-	switch (msg->type) {
-	case UPDATE_MSG:
-		if (!msg->error)
-			sm_input_event(EVT_DATA_UPDT, msg->list);
-		break;
-	case REQUEST_MSG:
-		if (!msg->error)
-			sm_input_event(EVT_PUB_DATA, msg->list);
-		break;
-	case REGISTER_MSG:
-		if (msg->error)
-			sm_input_event(EVT_REG_NOT_OK, NULL);
-		else
-			sm_input_event(EVT_REG_OK, (char *) msg->token);
-		break;
-	case UNREGISTER_MSG:
-		if (!msg->error)
-			sm_input_event(EVT_UNREG_REQ, NULL);
-		break;
-	case AUTH_MSG:
-		if (msg->error)
-			sm_input_event(EVT_AUTH_NOT_OK, NULL);
-		else
-			sm_input_event(EVT_AUTH_OK, NULL);
-		break;
-	case CONFIG_MSG:
-		if (msg->error)
-			sm_input_event(EVT_CFG_UPT_NOT_OK, NULL);
-		else
-			sm_input_event(EVT_CFG_UPT_OK, msg->list);
-		break;
-	case LIST_MSG:
-	case MSG_TYPES_LENGTH:
-	default:
-		return true;
+	const struct l_queue_entry *entry;
+	struct knot_data_item *data_item;
+	struct l_queue *sorted;
+	uint64_t hash = FNV_OFFSET_BASIS;
+	int32_t sensor_id;
+	uint32_t name_len;
+	uint8_t value_type;
+
+	sorted = l_queue_new();
+	l_hashmap_foreach(thing->data_items, foreach_data_item_sort, sorted);
+
+	/* Field by field: unused bytes are not part of the schema */
+	for (entry = l_queue_get_entries(sorted); entry; entry = entry->next) {
+		data_item = entry->data;
+		sensor_id = data_item->sensor_id;
+		value_type = data_item->schema.value_type;
+		name_len = strnlen(data_item->schema.name,
+				   KNOT_PROTOCOL_DATA_NAME_LEN);
+
+		hash = fnv1a(hash, &sensor_id, sizeof(sensor_id));
+		hash = fnv1a(hash, &value_type, sizeof(value_type));
+		hash = fnv1a(hash, &data_item->schema.unit,
+			     sizeof(data_item->schema.unit));
+		hash = fnv1a(hash, &data_item->schema.type_id,
+			     sizeof(data_item->schema.type_id));
+		hash = fnv1a(hash, &name_len, sizeof(name_len));
+		hash = fnv1a(hash, data_item->schema.name, name_len);
+		hash = fnv1a(hash, &data_item->event.event_flags,
+			     sizeof(data_item->event.event_flags));
+		hash = fnv1a(hash, &data_item->event.time_sec,
+			     sizeof(data_item->event.time_sec));
+		hash = fnv1a_value(hash, &data_item->event.lower_limit,
+				   value_type);
+		hash = fnv1a_value(hash, &data_item->event.upper_limit,
+				   value_type);
 	}
 
-	return true;
+	l_queue_destroy(sorted, NULL);
+
+	return l_strdup_printf("%0*llx", SCHEMA_HASH_LEN,
+			       (unsigned long long) hash);
 }
 
-static void conn_handler(enum CONN_TYPE conn, bool is_up)
+int device_check_schema_change(struct knot_thing *thing)
 {
-	static uint8_t conn_mask;
+	char *hash;
+	int changed;
 
-	conn_mask = set_conn_bitmask(is_up, conn_mask, conn);
+	if (!thing->schema_hash)
+		return 1;
 
-	if (conn_mask != CONNECTED_MASK) {
-		sm_input_event(EVT_NOT_READY, NULL);
-		return;
-	}
+	hash = schema_hash(thing);
+	changed = strcmp(hash, thing->schema_hash) != 0;
+	l_free(hash);
 
-	sm_input_event(EVT_READY, NULL);
+	return changed;
 }
 
-static void on_cloud_disconnected(void *user_data)
+int device_store_schema_hash(struct knot_thing *thing)
 {
-	l_info("Disconnected from Cloud");
+	char *hash;
+	int rc;
 
-	conn_handler(CLOUD, false);
-}
+	hash = schema_hash(thing);
+	if (thing->schema_hash && !strcmp(hash, thing->schema_hash)) {
+		l_free(hash);
+		return 0;
+	}
 
-static void on_cloud_connected(void *user_data)
-{
-	l_info("Connected to Cloud %s", thing.rabbitmq_url);
+	rc = properties_store_schema_hash(thing,
+					  thing->conf_files.credentials_path,
+					  hash);
+	l_free(hash);
 
-	conn_handler(CLOUD, true);
+	return rc;
 }
 
-static void on_modbus_disconnected(void *user_data)
+int device_send_register_request(struct knot_thing *thing)
 {
-	l_info("Disconnected from Modbus");
-
-	poll_stop();
-	conn_handler(MODBUS, false);
+	return knot_cloud_register_device(thing->id, thing->name);
 }
 
-static void on_modbus_connected(void *user_data)
+int device_send_auth_request(struct knot_thing *thing)
 {
-	l_info("Connected to Modbus %s", thing.modbus_slave.url);
-
-	poll_start();
-	conn_handler(MODBUS, true);
+	return knot_cloud_auth_device(thing->id, thing->token);
 }
 
-static int on_modbus_poll_receive(int id)
+int device_send_config(struct knot_thing *thing)
 {
-	struct knot_data_item *data_item;
-	struct l_queue *list;
+	struct l_queue *config_queue;
 	int rc;
 
-	data_item = l_hashmap_lookup(thing.data_items, L_INT_TO_PTR(id));
-	if (!data_item)
-		return -EINVAL;
+	config_queue = l_queue_new();
 
-	rc = iface_modbus_read_data(data_item->modbus_source.reg_addr,
-				    data_item->modbus_source.bit_offset,
-				    &data_item->current_val);
-	if (event_check_value(data_item->event,
-			      data_item->current_val,
-			      data_item->sent_val,
-			      data_item->schema.value_type) > 0) {
-		data_item->sent_val = data_item->current_val;
-		list = l_queue_new();
-		l_queue_push_head(list, &id);
+	l_hashmap_foreach(thing->data_items, foreach_send_config, config_queue);
 
-		sm_input_event(EVT_PUB_DATA, list);
+	rc = knot_cloud_update_config(thing->id, config_queue);
 
-		l_queue_destroy(list, NULL);
-	}
+	l_queue_destroy(config_queue, l_free);
 
 	return rc;
 }
 
-static void foreach_data_item_polling(const void *key, void *value,
-				      void *user_data)
+void device_publish_data_list(struct knot_thing *thing,
+			      struct l_queue *sensor_id_list)
 {
-	struct knot_data_item *data_item = value;
-	int *rc = user_data;
+	l_queue_foreach(sensor_id_list, on_publish_data, thing);
+}
 
-	if (poll_create(DEFAULT_POLLING_INTERVAL, data_item->sensor_id,
-			on_modbus_poll_receive)) {
-		l_error("Fail on create poll to read data item with id: %d",
-			data_item->sensor_id);
-		*rc = -1;
+void device_publish_data_changed(struct knot_thing *thing)
+{
+	struct resync *resync = &thing->resync;
+	int64_t now = time_realtime();
+
+	resync_stop(resync);
+
+	if (thing->publish.rate <= 0)
+		thing->publish.rate = DEFAULT_PUBLISH_RATE;
+	if (thing->publish.burst <= 0)
+		thing->publish.burst = DEFAULT_PUBLISH_BURST;
+
+	/* Only what the cloud missed while we were away, paced */
+	resync->pending = l_queue_new();
+	l_hashmap_foreach(thing->data_items, foreach_resync_data, &now);
+
+	resync->total = l_queue_length(resync->pending);
+	resync->done = 0;
+	if (!resync->total) {
+		resync_stop(resync);
+		return;
 	}
+
+	resync->tokens = thing->publish.burst;
+	resync->last_refill = time_now();
+	resync->last_report = resync->last_refill;
+
+	/* Event traffic goes on between the batches */
+	resync->to = l_timeout_create_ms(1, on_resync_timeout, thing, NULL);
 }
 
-static int create_data_item_polling(void)
+void device_update_data_list(struct knot_thing *thing,
+			     struct l_queue *data_list)
 {
-	int rc = 0;
+	l_queue_foreach(data_list, on_update_data, thing);
+}
 
-	l_hashmap_foreach(thing.data_items, foreach_data_item_polling,
-			  &rc);
-	if (rc)
-		poll_destroy();
+void device_msg_timeout_create(struct knot_thing *thing, int seconds)
+{
+	if (thing->msg_to)
+		return;
 
-	return rc;
+	thing->msg_to = l_timeout_create(seconds, on_msg_timeout, thing,
+					 NULL);
 }
 
-void device_set_log_priority(int priority)
+void device_msg_timeout_modify(struct knot_thing *thing, int seconds)
 {
-	knot_cloud_set_log_priority(priority);
+	l_timeout_modify(thing->msg_to, seconds);
 }
 
-char *device_get_id(void)
+void device_msg_timeout_remove(struct knot_thing *thing)
 {
-	return thing.id;
+	l_timeout_remove(thing->msg_to);
+	thing->msg_to = NULL;
 }
 
-void device_set_thing_name(struct knot_thing *thing, const char *name)
+int device_start_read_cloud(struct knot_thing *thing)
 {
-	strcpy(thing->name, name);
+	return knot_cloud_read_start(thing->id, on_cloud_receive, thing);
 }
 
-void device_set_thing_user_token(struct knot_thing *thing, char *token)
+static void foreach_data_item_restore(const void *key, void *value,
+				      void *user_data)
 {
-	thing->user_token = token;
+	struct knot_data_item *data_item = value;
+
+	if (state_load(data_item->thing->state, data_item->sensor_id,
+		       &data_item->sent_val, &data_item->published) < 0)
+		return;
+
+	/* Change events compare against what the cloud has */
+	data_item->current_val = data_item->sent_val;
 }
 
-void device_set_thing_modbus_slave(struct knot_thing *thing, int slave_id,
-				   char *url)
+static void restore_state(struct knot_thing *thing)
 {
-	thing->modbus_slave.id = slave_id;
-	thing->modbus_slave.url = url;
+	if (!thing->state_path)
+		return;
+
+	thing->state = state_open(thing->state_path);
+	if (!thing->state) {
+		l_error("Failed to open state %s (%s)", thing->state_path,
+			strerror(errno));
+		return;
+	}
+
+	l_hashmap_foreach(thing->data_items, foreach_data_item_restore, NULL);
 }
 
-void device_set_new_data_item(struct knot_thing *thing, int sensor_id,
-			      knot_schema schema, knot_event event,
-			      int reg_addr, int bit_offset)
+static struct history *history_lookup(int id, void *user_data)
 {
-	struct knot_data_item *data_item_aux;
+	struct knot_thing *thing = user_data;
+	struct knot_data_item *data_item;
 
-	data_item_aux = l_new(struct knot_data_item, 1);
-	data_item_aux->sensor_id = sensor_id;
-	data_item_aux->schema = schema;
-	data_item_aux->event = event;
-	data_item_aux->modbus_source.reg_addr = reg_addr;
-	data_item_aux->modbus_source.bit_offset = bit_offset;
+	data_item = l_hashmap_lookup(thing->data_items, L_INT_TO_PTR(id));
 
-	l_hashmap_insert(thing->data_items,
-			 L_INT_TO_PTR(data_item_aux->sensor_id),
-			 data_item_aux);
+	return data_item ? data_item->history : NULL;
 }
 
-void device_update_config_data_item(struct knot_thing *thing,
-				    knot_msg_config *config)
+static void start_history_server(struct knot_thing *thing)
 {
-	struct knot_data_item *data_item;
+	char *path;
 
-	data_item = l_hashmap_lookup(thing->data_items,
-				     L_INT_TO_PTR(config->sensor_id));
-	if (!data_item)
+	if (!thing->history_path)
 		return;
 
-	data_item->schema.type_id = config->schema.type_id;
-	data_item->schema.unit = config->schema.unit;
-	data_item->schema.value_type = config->schema.value_type;
-	strncpy(data_item->schema.name, config->schema.name,
-		KNOT_PROTOCOL_DATA_NAME_LEN);
+	/* History keeps being recorded even if no one can query it */
+	path = l_strdup_printf("%s/history.sock", thing->history_path);
+	thing->history_server = history_server_start(path, history_lookup,
+						     thing);
+	if (!thing->history_server)
+		l_error("Failed to serve history on %s (%s)", path,
+			strerror(errno));
+	l_free(path);
+}
 
-	if (!(config->event.event_flags & KNOT_EVT_FLAG_UNREGISTERED)) {
-		data_item->event.event_flags = config->event.event_flags;
-		data_item->event.time_sec = config->event.time_sec;
-		knot_value_assign_limit(config->schema.value_type,
-					config->event.lower_limit,
-					&data_item->event.lower_limit);
-		knot_value_assign_limit(config->schema.value_type,
-					config->event.upper_limit,
-					&data_item->event.upper_limit);
-	}
+static bool modbus_link_match_bus_id(const void *a, const void *b)
+{
+	const struct modbus_link *link = a;
+
+	return link->bus_id == L_PTR_TO_INT(b);
 }
 
-void *device_data_item_lookup(struct knot_thing *thing, int sensor_id)
+/* Each server mirrors the blocks read from the links of its thing */
+static void on_modbus_image(int bus_id, int slave_id,
+			    enum iface_modbus_table table, int addr, int nb,
+			    const uint16_t *values, void *user_data)
 {
-	return l_hashmap_lookup(thing->data_items, L_INT_TO_PTR(sensor_id));
+	struct knot_thing *thing;
+	unsigned int i;
+
+	for (i = 0; i < n_things; i++) {
+		thing = things[i];
+
+		if (!thing->modbus_server ||
+		    !l_queue_find(thing->modbus_slave.links,
+				  modbus_link_match_bus_id,
+				  L_INT_TO_PTR(bus_id)))
+			continue;
+
+		modbus_server_update(thing->modbus_server, bus_id, slave_id,
+				     table, addr, nb, values);
+	}
 }
 
-void device_set_thing_rabbitmq_url(struct knot_thing *thing, char *url)
+static void start_modbus_server(struct knot_thing *thing)
 {
-	thing->rabbitmq_url = url;
+	const char *address = thing->server.address;
+
+	if (!thing->server.port)
+		return;
+
+	thing->modbus_server = modbus_server_start(address,
+						   thing->server.port,
+						   thing->server.max_age,
+						   thing->server.writes);
+	if (!thing->modbus_server) {
+		l_error("Failed to serve Modbus on %s port %d (%s)",
+			address ? address : "loopback", thing->server.port,
+			strerror(errno));
+		return;
+	}
+
+	iface_modbus_set_image_cb(on_modbus_image, NULL);
 }
 
-void device_set_thing_credentials(struct knot_thing *thing, const char *id,
-				  const char *token)
+/* A DataItem group read back from device.conf */
+struct reload_item {
+	struct conf_image_item item;
+	char *url;
+};
+
+struct reload {
+	struct knot_thing *thing;
+	struct l_hashmap *items;
+	struct l_queue *removed;
+	unsigned int added;
+	unsigned int changed;
+};
+
+static void reload_item_free(void *data)
 {
-	strncpy(thing->id, id, KNOT_PROTOCOL_UUID_LEN);
-	strncpy(thing->token, token, KNOT_PROTOCOL_TOKEN_LEN);
+	struct reload_item *entry = data;
+
+	l_free(entry->url);
+	l_free(entry);
 }
 
-void device_generate_thing_id(void)
+static int collect_data_item(const struct conf_image_item *item,
+			     const char *url, void *user_data)
 {
-	uint64_t id; /* knot id uses 16 characters which fits inside a uint64 */
+	struct l_hashmap *items = user_data;
+	struct reload_item *entry;
 
-	l_getrandom(&id, sizeof(id));
-	sprintf(thing.id, "%"PRIx64, id); /* PRIx64 formats the string as hex */
+	entry = l_new(struct reload_item, 1);
+	entry->item = *item;
+	entry->url = l_strdup(url);
+
+	l_hashmap_insert(items, L_INT_TO_PTR(item->sensor_id), entry);
+
+	return 0;
 }
 
-void device_clear_thing_id(struct knot_thing *thing)
+static bool schema_equal(const knot_schema *a, const knot_schema *b)
 {
-	thing->id[0] = '\0';
+	return a->value_type == b->value_type && a->unit == b->unit &&
+		a->type_id == b->type_id && !strncmp(a->name, b->name,
+					KNOT_PROTOCOL_DATA_NAME_LEN);
 }
 
-void device_clear_thing_token(struct knot_thing *thing)
+/* Field by field: padding and unused limit bytes differ once from the cloud */
+static bool event_equal(const knot_event *a, const knot_event *b,
+			int value_type)
 {
-	thing->token[0] = '\0';
+	return a->event_flags == b->event_flags &&
+		a->time_sec == b->time_sec &&
+		value_equal(&a->lower_limit, &b->lower_limit, value_type) &&
+		value_equal(&a->upper_limit, &b->upper_limit, value_type);
 }
 
-int device_has_thing_token(void)
+static bool reload_source(struct knot_data_item *data_item,
+			  const struct reload_item *entry)
 {
-	return thing.token[0] != '\0';
+	struct modbus_source *source = &data_item->modbus_source;
+	struct knot_thing *thing = data_item->thing;
+	struct modbus_link *link;
+	int slave_id;
+
+	link = entry->url ? modbus_link_get(thing, l_strdup(entry->url)) :
+		thing->modbus_slave.link;
+	slave_id = entry->item.slave_id < 0 ? thing->modbus_slave.id :
+		entry->item.slave_id;
+
+	if (source->link == link && source->slave_id == slave_id &&
+	    source->reg_addr == entry->item.reg_addr &&
+	    source->bit_offset == entry->item.bit_offset)
+		return false;
+
+	/* A read already on its way still lands on the item */
+	source->link = link;
+	source->slave_id = slave_id;
+	source->reg_addr = entry->item.reg_addr;
+	source->bit_offset = entry->item.bit_offset;
+
+	if (link->bus_id < 0)
+		modbus_link_start(link);
+
+	return true;
 }
 
-int device_store_credentials_on_file(char *token)
+static bool reload_aggregate(struct knot_data_item *data_item,
+			     const struct conf_image_item *item)
 {
-	int rc;
+	int id = data_item->sensor_id;
 
-	rc = properties_store_credentials(&thing,
-					  thing.conf_files.credentials_path,
-					  thing.id, token);
-	if (rc < 0)
-		return -1;
+	if (!(item->flags & CONF_IMAGE_AGGREGATE)) {
+		if (!data_item->aggregate)
+			return false;
 
-	strncpy(thing.token, token, KNOT_PROTOCOL_TOKEN_LEN);
+		aggregate_free(data_item->aggregate);
+		data_item->aggregate = NULL;
+		data_item->has_summary = false;
+		return true;
+	}
 
-	return 0;
-}
+	if (data_item->aggregate &&
+	    data_item->aggregate_window == item->aggregate_window &&
+	    data_item->aggregate_step == item->aggregate_step &&
+	    (int) data_item->aggregate_function == item->aggregate_function)
+		return false;
 
-int device_clear_credentials_on_file(void)
-{
-	return properties_clear_credentials(&thing,
-					    thing.conf_files.credentials_path);
+	if (device_set_data_item_aggregate(data_item->thing, id,
+					   item->aggregate_window,
+					   item->aggregate_step,
+					   item->aggregate_function) < 0)
+		l_error("Couldn't aggregate data item #%d", id);
+
+	return true;
 }
 
-int device_start_event(void)
+static bool reload_history(struct knot_data_item *data_item,
+			   const struct conf_image_item *item)
 {
-	int rc;
+	int size = item->flags & CONF_IMAGE_HISTORY ? item->history_size : 0;
+	int id = data_item->sensor_id;
 
-	rc = event_start(on_event_timeout);
-	if (rc < 0) {
-		l_error("Failed to start event");
-		return rc;
+	if (size == data_item->history_size)
+		return false;
+
+	if (size > 0) {
+		if (device_set_data_item_history(data_item->thing, id,
+						 size) < 0)
+			l_error("Couldn't keep history of data item #%d", id);
+		return true;
 	}
 
-	l_hashmap_foreach(thing.data_items, foreach_event_add_data_item, NULL);
+	history_close(data_item->history);
+	data_item->history = NULL;
+	data_item->history_size = 0;
 
-	return 0;
+	return true;
 }
 
-void device_stop_event(void)
+/* Brings a running item to its new settings, keeping its values */
+static bool reload_data_item(struct knot_data_item *data_item,
+			     const struct reload_item *entry)
 {
-	event_stop();
+	const struct conf_image_item *item = &entry->item;
+	int max_age;
+	int scan_class;
+	bool changed = false;
+
+	if (!schema_equal(&data_item->schema, &item->schema) ||
+	    !event_equal(&data_item->event, &item->event,
+			 item->schema.value_type)) {
+		data_item->schema = item->schema;
+		data_item->event = item->event;
+		data_item_update_event(data_item);
+		changed = true;
+	}
+
+	if (reload_source(data_item, entry))
+		changed = true;
+
+	max_age = item->flags & CONF_IMAGE_MAX_AGE ? item->max_age : -1;
+	if (max_age != data_item->max_age) {
+		data_item->max_age = max_age;
+		changed = true;
+	}
+
+	scan_class = item->flags & CONF_IMAGE_SCAN_CLASS ?
+		item->scan_class : 0;
+	if (scan_class != data_item->scan_class) {
+		data_item->scan_class = scan_class;
+		poll_set_scan_class(data_item_key(data_item),
+				    scan_class_key(data_item->thing,
+						   scan_class),
+				    on_scan_class_done);
+		changed = true;
+	}
+
+	data_item->on_demand = !data_item->scan_class &&
+		is_on_demand(data_item->event);
+	poll_set_on_demand(data_item_key(data_item), data_item->on_demand);
+
+	if (reload_aggregate(data_item, item))
+		changed = true;
+
+	if (reload_history(data_item, item))
+		changed = true;
+
+	return changed;
 }
 
-int device_update_config(struct l_queue *config_list)
+static void add_data_item(struct knot_thing *thing,
+			  const struct reload_item *entry)
 {
-	device_stop_event();
+	struct knot_data_item *data_item;
+	int id = entry->item.sensor_id;
 
-	l_queue_foreach(config_list, foreach_update_config, NULL);
+	if (properties_add_data_item(thing, &entry->item, entry->url) < 0)
+		l_error("Couldn't fully set up data item #%d", id);
+
+	data_item = l_hashmap_lookup(thing->data_items, L_INT_TO_PTR(id));
+	if (!data_item)
+		return;
 
-	device_start_event();
+	if (data_item->modbus_source.link->bus_id < 0)
+		modbus_link_start(data_item->modbus_source.link);
 
-	return 0;
+	foreach_data_item_restore(NULL, data_item, NULL);
+	start_data_item_polling(data_item);
+	data_item_update_event(data_item);
 }
 
-int device_check_schema_change(void)
+static void remove_data_item(void *data)
 {
-	/* TODO: Add schema change verification */
-	return 1;
+	struct knot_data_item *data_item = data;
+
+	poll_remove(data_item_key(data_item));
+	event_remove_data_item(data_item_key(data_item));
+
+	l_hashmap_remove(data_item->thing->data_items,
+			 L_INT_TO_PTR(data_item->sensor_id));
+	data_item_free(data_item);
 }
 
-int device_send_register_request(void)
+static void foreach_reload_removed(const void *key, void *value,
+				   void *user_data)
 {
-	return knot_cloud_register_device(thing.id, thing.name);
+	struct reload *reload = user_data;
+
+	if (!l_hashmap_lookup(reload->items, key))
+		l_queue_push_tail(reload->removed, value);
 }
 
-int device_send_auth_request(void)
+static void foreach_reload_item(const void *key, void *value,
+				void *user_data)
 {
-	return knot_cloud_auth_device(thing.id, thing.token);
+	struct reload_item *entry = value;
+	struct reload *reload = user_data;
+	struct knot_data_item *data_item;
+
+	data_item = l_hashmap_lookup(reload->thing->data_items, key);
+	if (!data_item) {
+		add_data_item(reload->thing, entry);
+		reload->added++;
+	} else if (reload_data_item(data_item, entry)) {
+		reload->changed++;
+	}
 }
 
-int device_send_config(void)
+static void on_device_file_changed(void *user_data)
 {
-	struct l_queue *config_queue;
+	struct knot_thing *thing = user_data;
+	struct reload reload;
+	unsigned int removed;
 	int rc;
 
-	config_queue = l_queue_new();
+	memset(&reload, 0, sizeof(reload));
+	reload.thing = thing;
+	reload.items = l_hashmap_new();
 
-	l_hashmap_foreach(thing.data_items, foreach_send_config, config_queue);
+	/* Nothing is applied unless the whole file is valid */
+	rc = properties_read_data_items(thing->conf_files.device_path,
+					collect_data_item, reload.items);
+	if (rc < 0) {
+		l_error("Ignoring the changes to %s",
+			thing->conf_files.device_path);
+		l_hashmap_destroy(reload.items, reload_item_free);
+		return;
+	}
 
-	rc = knot_cloud_update_config(thing.id, config_queue);
+	reload.removed = l_queue_new();
+	l_hashmap_foreach(thing->data_items, foreach_reload_removed, &reload);
+	removed = l_queue_length(reload.removed);
+	l_queue_destroy(reload.removed, remove_data_item);
 
-	l_queue_destroy(config_queue, l_free);
+	l_hashmap_foreach(reload.items, foreach_reload_item, &reload);
+	l_hashmap_destroy(reload.items, reload_item_free);
 
-	return rc;
-}
+	if (!reload.added && !reload.changed && !removed)
+		return;
 
-void device_publish_data_list(struct l_queue *sensor_id_list)
-{
-	l_queue_foreach(sensor_id_list, on_publish_data, NULL);
-}
+	l_info("Reloaded %s: %u data items added, %u changed, %u removed",
+	       thing->conf_files.device_path, reload.added, reload.changed,
+	       removed);
 
-void device_publish_data_all(void)
-{
-	l_hashmap_foreach(thing.data_items, foreach_publish_all_data, NULL);
+	/* Only a different schema goes to the cloud again */
+	if (device_check_schema_change(thing))
+		sm_input_event(thing->sm, EVT_CFG_CHANGED, NULL);
 }
 
-void device_msg_timeout_create(int seconds)
+static struct knot_thing *load_thing(struct device_settings *conf_files)
 {
-	if (thing.msg_to)
-		return;
+	struct knot_thing *thing;
+
+	thing = device_thing_new();
+	if (properties_create_device(thing, conf_files)) {
+		l_error("Failed to set device properties from %s",
+			conf_files->device_path);
+		device_thing_destroy(thing);
+		return NULL;
+	}
+
+	thing->conf_files.credentials_path =
+					l_strdup(conf_files->credentials_path);
+	thing->conf_files.device_path = l_strdup(conf_files->device_path);
+	thing->conf_files.cloud_path = l_strdup(conf_files->cloud_path);
+	thing->conf_files.image_path = l_strdup(conf_files->image_path);
 
-	thing.msg_to = l_timeout_create(seconds, on_msg_timeout, NULL, NULL);
+	restore_state(thing);
+
+	return thing;
 }
 
-void device_msg_timeout_modify(int seconds)
+static void start_thing(struct knot_thing *thing)
 {
-	l_timeout_modify(thing.msg_to, seconds);
+	start_history_server(thing);
+	start_modbus_server(thing);
+
+	/* Data items follow device.conf while running */
+	thing->watch = watch_add(thing->conf_files.device_path,
+				 on_device_file_changed, thing);
+	if (!thing->watch)
+		l_error("Failed to watch %s (%s)",
+			thing->conf_files.device_path, strerror(errno));
+
+	l_info("Device \"%s\" has started successfully", thing->name);
 }
 
-void device_msg_timeout_remove(void)
+static void destroy_things(void)
 {
-	l_timeout_remove(thing.msg_to);
-	thing.msg_to = NULL;
+	unsigned int i;
+
+	for (i = 0; i < n_things; i++) {
+		resync_stop(&things[i]->resync);
+		device_thing_destroy(things[i]);
+	}
+
+	l_free(things);
+	things = NULL;
+	n_things = 0;
+
+	/* No thing points to them anymore */
+	l_queue_destroy(links, modbus_link_free);
+	links = NULL;
 }
 
-int device_start_read_cloud(void)
+static bool same_cloud(const struct knot_thing *a,
+		       const struct knot_thing *b)
 {
-	return knot_cloud_read_start(thing.id, on_cloud_receive, NULL);
+	return !strcmp(a->rabbitmq_url, b->rabbitmq_url) &&
+		!strcmp(a->user_token, b->user_token);
 }
 
-int device_start(struct device_settings *conf_files)
+/* Every thing runs in this process, on the same loop and cloud link */
+int device_start(struct l_queue *conf_list)
 {
+	const struct l_queue_entry *entry;
+	struct knot_thing *thing;
+	unsigned int i;
 	int err;
 
-	thing.data_items = l_hashmap_new();
-	if (properties_create_device(&thing, conf_files)) {
-		l_error("Failed to set device properties");
+	if (l_queue_isempty(conf_list) ||
+	    l_queue_length(conf_list) > MAX_THINGS)
 		return -EINVAL;
+
+	things = l_new(struct knot_thing *, l_queue_length(conf_list));
+
+	for (entry = l_queue_get_entries(conf_list); entry;
+	     entry = entry->next) {
+		thing = load_thing(entry->data);
+		if (!thing) {
+			destroy_things();
+			return -EINVAL;
+		}
+
+		/* All the things share a single cloud connection */
+		if (n_things && !same_cloud(things[0], thing)) {
+			l_error("%s: cloud settings differ from %s",
+				thing->conf_files.cloud_path,
+				things[0]->conf_files.cloud_path);
+			device_thing_destroy(thing);
+			destroy_things();
+			return -EINVAL;
+		}
+
+		thing->index = n_things;
+		things[n_things++] = thing;
 	}
 
-	sm_start();
+	err = event_start(on_event_timeout);
+	if (err < 0) {
+		l_error("Failed to start event");
+		destroy_things();
+		return err;
+	}
+
+	for (i = 0; i < n_things; i++)
+		things[i]->sm = sm_start(things[i]);
 
 	err = create_data_item_polling();
 	if (err < 0) {
 		l_error("Failed to create the device polling");
-		knot_thing_destroy(&thing);
+		event_stop();
+		destroy_things();
 		return err;
 	}
 
-	err = iface_modbus_start(thing.modbus_slave.url, thing.modbus_slave.id,
-				 on_modbus_connected, on_modbus_disconnected,
-				 NULL);
+	err = start_modbus_links();
 	if (err < 0) {
 		l_error("Failed to initialize Modbus");
+		event_stop();
 		poll_destroy();
-		knot_thing_destroy(&thing);
+		destroy_things();
 		return err;
 	}
 
-	err = knot_cloud_start(thing.rabbitmq_url, thing.user_token,
+	/* The things share the connection of the first one */
+	err = knot_cloud_start(things[0]->rabbitmq_url, things[0]->user_token,
 			       on_cloud_connected, on_cloud_disconnected, NULL);
 	if (err < 0) {
 		l_error("Failed to initialize Cloud");
+		event_stop();
 		poll_destroy();
-		iface_modbus_stop();
-		knot_thing_destroy(&thing);
+		stop_modbus_links();
+		destroy_things();
 		return err;
 	}
 
-	l_info("Device \"%s\" has started successfully", thing.name);
-
-	thing.conf_files.credentials_path =
-					l_strdup(conf_files->credentials_path);
-	thing.conf_files.device_path = l_strdup(conf_files->device_path);
-	thing.conf_files.cloud_path = l_strdup(conf_files->cloud_path);
+	for (i = 0; i < n_things; i++)
+		start_thing(things[i]);
 
 	return 0;
 }
@@ -599,7 +2489,12 @@ void device_destroy(void)
 
 	poll_destroy();
 	knot_cloud_stop();
-	iface_modbus_stop();
+	stop_modbus_links();
+	iface_modbus_set_image_cb(NULL, NULL);
+
+	/* The stopped links cancelled what was still being read */
+	l_hashmap_destroy(register_reads, register_read_free);
+	register_reads = NULL;
 
-	knot_thing_destroy(&thing);
+	destroy_things();
 }
@@ -25,6 +25,7 @@ struct device_settings {
 	char *credentials_path;
 	char *device_path;
 	char *cloud_path;
+	char *image_path;
 };
 
 void device_set_log_priority(int priority);
@@ -32,40 +33,75 @@ void device_set_thing_name(struct knot_thing *thing, const char *name);
 void device_set_thing_user_token(struct knot_thing *thing, char *token);
 void device_set_thing_modbus_slave(struct knot_thing *thing, int slave_id,
 				   char *url);
+void device_set_thing_modbus_timing(struct knot_thing *thing,
+				    int turnaround_delay, int response_timeout);
+void device_set_thing_modbus_in_flight(struct knot_thing *thing,
+				       int max_in_flight,
+				       int link_max_in_flight,
+				       int slave_max_in_flight);
+void device_set_thing_modbus_link(struct knot_thing *thing,
+				  int reconnect_min_delay,
+				  int reconnect_max_delay, int keepalive,
+				  int liveness_interval);
+void device_set_thing_modbus_rate(struct knot_thing *thing, int slave_rate,
+				  int slave_burst);
+void device_set_thing_poll_adaptive(struct knot_thing *thing,
+				    int min_interval, int max_interval,
+				    int budget);
 void device_set_new_data_item(struct knot_thing *thing, int sensor_id,
-			      knot_schema schema, knot_event event,
-			      int reg_addr, int bit_offset);
+			      knot_schema schema, knot_event event, char *url,
+			      int slave_id, int reg_addr, int bit_offset);
+void device_set_data_item_max_age(struct knot_thing *thing, int sensor_id,
+				  int max_age);
+void device_set_data_item_scan_class(struct knot_thing *thing, int sensor_id,
+				     int scan_class);
+void device_set_thing_history_path(struct knot_thing *thing, char *path);
+void device_set_thing_publish_rate(struct knot_thing *thing, int rate,
+				   int burst);
+void device_set_thing_modbus_server(struct knot_thing *thing, char *address,
+				    int port, int max_age, bool writes);
+void device_set_thing_state_path(struct knot_thing *thing, char *path);
+int device_set_data_item_history(struct knot_thing *thing, int sensor_id,
+				 int size);
+int device_set_data_item_aggregate(struct knot_thing *thing, int sensor_id,
+				   int window, int step, int function);
 void device_update_config_data_item(struct knot_thing *thing,
 				    knot_msg_config *config);
 void *device_data_item_lookup(struct knot_thing *thing, int sensor_id);
 void device_set_thing_rabbitmq_url(struct knot_thing *thing, char *url);
 void device_set_thing_credentials(struct knot_thing *thing, const char *id,
 				  const char *token);
-void device_generate_thing_id(void);
+void device_generate_thing_id(struct knot_thing *thing);
+void device_set_thing_schema_hash(struct knot_thing *thing, char *hash);
 void device_clear_thing_id(struct knot_thing *thing);
 void device_clear_thing_token(struct knot_thing *thing);
-int device_has_thing_token(void);
-int device_store_credentials_on_file(char *token);
-int device_clear_credentials_on_file(void);
+int device_has_thing_token(struct knot_thing *thing);
+int device_store_credentials_on_file(struct knot_thing *thing, char *token);
+int device_clear_credentials_on_file(struct knot_thing *thing);
 
-int device_start_event(void);
-void device_stop_event(void);
+int device_start_event(struct knot_thing *thing);
+void device_stop_event(struct knot_thing *thing);
 
-int device_update_config(struct l_queue *config_list);
+int device_update_config(struct knot_thing *thing,
+			 struct l_queue *config_list);
 
-int device_check_schema_change(void);
+int device_check_schema_change(struct knot_thing *thing);
+int device_store_schema_hash(struct knot_thing *thing);
 
-int device_send_register_request(void);
-int device_send_auth_request(void);
-int device_send_config(void);
-void device_publish_data_list(struct l_queue *sensor_id_list);
-void device_publish_data_all(void);
+int device_send_register_request(struct knot_thing *thing);
+int device_send_auth_request(struct knot_thing *thing);
+int device_send_config(struct knot_thing *thing);
+void device_publish_data_list(struct knot_thing *thing,
+			      struct l_queue *sensor_id_list);
+void device_publish_data_changed(struct knot_thing *thing);
+void device_update_data_list(struct knot_thing *thing,
+			     struct l_queue *data_list);
 
-void device_msg_timeout_create(int seconds);
-void device_msg_timeout_modify(int seconds);
-void device_msg_timeout_remove(void);
+void device_msg_timeout_create(struct knot_thing *thing, int seconds);
+void device_msg_timeout_modify(struct knot_thing *thing, int seconds);
+void device_msg_timeout_remove(struct knot_thing *thing);
 
-int device_start_read_cloud(void);
+int device_start_read_cloud(struct knot_thing *thing);
 
-int device_start(struct device_settings *conf_files);
+int device_start(struct l_queue *conf_list);
 void device_destroy(void);
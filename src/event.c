@@ -33,6 +33,7 @@
 struct data_item_timeout {
 	int id;
 	unsigned int timeout_sec;
+	struct l_timeout *to;
 };
 
 struct l_queue *sensor_timeouts;
@@ -131,9 +132,18 @@ static void on_sensor_to(struct l_timeout *to, void *data)
 
 static void timeout_destroy(void *data)
 {
-	struct l_timeout *to = data;
+	struct data_item_timeout *data_item_to_info = data;
+
+	l_timeout_remove(data_item_to_info->to);
+	l_free(data_item_to_info);
+}
 
-	l_timeout_remove(to);
+static bool timeout_match_id(const void *a, const void *b)
+{
+	const struct data_item_timeout *data_item_to_info = a;
+	int id = L_PTR_TO_INT(b);
+
+	return data_item_to_info->id == id;
 }
 
 int event_check_value(knot_event event, knot_value_type current_val,
@@ -167,18 +177,55 @@ int event_check_value(knot_event event, knot_value_type current_val,
 
 void event_add_data_item(int id, knot_event event)
 {
-	struct data_item_timeout *data = l_new(struct data_item_timeout, 1);
+	struct data_item_timeout *data;
+
+	if (!is_timeout_flag_set(event.event_flags))
+		return;
 
+	data = l_new(struct data_item_timeout, 1);
 	data->id = id;
 	data->timeout_sec = event.time_sec;
+	data->to = l_timeout_create(event.time_sec, on_sensor_to, data, NULL);
 
-	if (is_timeout_flag_set(event.event_flags)) {
-		struct l_timeout *to = l_timeout_create(event.time_sec,
-							on_sensor_to,
-							data,
-							l_free);
-		l_queue_push_head(sensor_timeouts, to);
+	l_queue_push_head(sensor_timeouts, data);
+}
+
+void event_update_data_item(int id, knot_event event)
+{
+	struct data_item_timeout *data;
+
+	if (!active)
+		return;
+
+	data = l_queue_find(sensor_timeouts, timeout_match_id,
+			    L_INT_TO_PTR(id));
+	if (!data) {
+		event_add_data_item(id, event);
+		return;
+	}
+
+	if (!is_timeout_flag_set(event.event_flags)) {
+		l_queue_remove(sensor_timeouts, data);
+		timeout_destroy(data);
+		return;
 	}
+
+	/* An unchanged period keeps its phase */
+	if (data->timeout_sec == event.time_sec)
+		return;
+
+	data->timeout_sec = event.time_sec;
+	l_timeout_modify(data->to, event.time_sec);
+}
+
+void event_remove_data_item(int id)
+{
+	struct data_item_timeout *data;
+
+	data = l_queue_remove_if(sensor_timeouts, timeout_match_id,
+				 L_INT_TO_PTR(id));
+	if (data)
+		timeout_destroy(data);
 }
 
 int event_start(timeout_cb_t cb)
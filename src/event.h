@@ -20,4 +20,6 @@ int event_check_value(knot_event event, knot_value_type current_val,
 		      knot_value_type sent_val, int value_type);
 int event_start(timeout_cb_t cb);
 void event_add_data_item(int id, knot_event event);
+void event_update_data_item(int id, knot_event event);
+void event_remove_data_item(int id);
 void event_stop(void);
@@ -0,0 +1,391 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Data item history source file
+ *
+ *  Each data item keeps its samples in a ring of fixed-size records,
+ *  memory mapped from a file so that they survive restarts. A local
+ *  socket answers range queries, downsampled into buckets: a request is
+ *  a single line "<id> <from> <to> <buckets>" with times in seconds
+ *  since the epoch, and each non-empty bucket is answered with a line
+ *  "<start> <count> <bad> <min> <max> <mean>".
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <ell/ell.h>
+
+#include "history.h"
+
+#define HISTORY_MAGIC		0x4b4e4854	/* "KNHT" */
+#define HISTORY_VERSION		1
+#define USEC_PER_SEC		1000000
+#define MAX_BUCKETS		1000
+#define REQUEST_MAX		128
+#define RESPONSE_LINE_MAX	96
+
+struct history_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint32_t head;		/* next record to be written */
+	uint32_t count;
+};
+
+struct history_record {
+	int64_t timestamp;	/* usec since the epoch */
+	double value;
+	uint32_t quality;
+	uint32_t reserved;
+};
+
+struct history {
+	int fd;
+	size_t size;
+	struct history_header *header;
+	struct history_record *records;
+};
+
+struct history_bucket {
+	unsigned int count;
+	unsigned int bad;
+	double min;
+	double max;
+	double sum;
+};
+
+struct history_server {
+	struct l_io *io;
+	char *path;
+	history_lookup_cb_t lookup;
+	void *user_data;
+};
+
+static int64_t time_realtime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (int64_t) ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static bool header_is_valid(const struct history_header *header,
+			    unsigned int capacity)
+{
+	return header->magic == HISTORY_MAGIC &&
+		header->version == HISTORY_VERSION &&
+		header->record_size == sizeof(struct history_record) &&
+		header->capacity == capacity &&
+		header->head < capacity && header->count <= capacity;
+}
+
+struct history *history_open(const char *path, unsigned int capacity)
+{
+	struct history *history;
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd;
+
+	if (!capacity)
+		return NULL;
+
+	size = sizeof(struct history_header) +
+		(size_t) capacity * sizeof(struct history_record);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 ||
+	    ((size_t) st.st_size != size && ftruncate(fd, size) < 0)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	history = l_new(struct history, 1);
+	history->fd = fd;
+	history->size = size;
+	history->header = map;
+	history->records = (struct history_record *) (history->header + 1);
+
+	/* A new file, or a ring of another shape, starts over */
+	if (!header_is_valid(history->header, capacity)) {
+		memset(map, 0, size);
+		history->header->magic = HISTORY_MAGIC;
+		history->header->version = HISTORY_VERSION;
+		history->header->record_size = sizeof(struct history_record);
+		history->header->capacity = capacity;
+	}
+
+	return history;
+}
+
+void history_close(struct history *history)
+{
+	if (!history)
+		return;
+
+	munmap(history->header, history->size);
+	close(history->fd);
+	l_free(history);
+}
+
+void history_append(struct history *history, double value,
+		    enum history_quality quality)
+{
+	struct history_header *header = history->header;
+	struct history_record *record = &history->records[header->head];
+
+	record->timestamp = time_realtime();
+	record->value = value;
+	record->quality = quality;
+
+	/* The record is complete before the ring moves past it */
+	__sync_synchronize();
+
+	header->head = (header->head + 1) % header->capacity;
+	if (header->count < header->capacity)
+		header->count++;
+}
+
+static void bucket_add(struct history_bucket *bucket,
+		       const struct history_record *record)
+{
+	if (record->quality != HISTORY_QUALITY_GOOD) {
+		bucket->bad++;
+		return;
+	}
+
+	if (!bucket->count || record->value < bucket->min)
+		bucket->min = record->value;
+	if (!bucket->count || record->value > bucket->max)
+		bucket->max = record->value;
+
+	bucket->count++;
+	bucket->sum += record->value;
+}
+
+static void history_query(struct history *history, int64_t from, int64_t to,
+			  unsigned int n_buckets,
+			  struct history_bucket *buckets)
+{
+	struct history_header *header = history->header;
+	const struct history_record *record;
+	int64_t width;
+	int64_t index;
+	uint32_t i;
+	uint32_t slot;
+
+	width = (to - from) / n_buckets;
+	if (width <= 0)
+		width = 1;
+
+	/* Oldest first, from the slot after the newest record */
+	slot = (header->head + header->capacity - header->count) %
+		header->capacity;
+
+	for (i = 0; i < header->count; i++) {
+		record = &history->records[(slot + i) % header->capacity];
+
+		if (record->timestamp < from || record->timestamp >= to)
+			continue;
+
+		/* The last bucket takes the remainder of the range */
+		index = (record->timestamp - from) / width;
+		if (index >= n_buckets)
+			index = n_buckets - 1;
+
+		bucket_add(&buckets[index], record);
+	}
+}
+
+static void send_response(int fd, int64_t from, int64_t to,
+			  unsigned int n_buckets,
+			  const struct history_bucket *buckets)
+{
+	const struct history_bucket *bucket;
+	char line[RESPONSE_LINE_MAX];
+	int64_t width = (to - from) / n_buckets;
+	unsigned int i;
+	int len;
+
+	for (i = 0; i < n_buckets; i++) {
+		bucket = &buckets[i];
+		if (!bucket->count && !bucket->bad)
+			continue;
+
+		len = snprintf(line, sizeof(line), "%lld %u %u %g %g %g\n",
+			       (long long) ((from + width * i) / USEC_PER_SEC),
+			       bucket->count, bucket->bad, bucket->min,
+			       bucket->max,
+			       bucket->count ? bucket->sum / bucket->count : 0);
+
+		if (send(fd, line, len, MSG_NOSIGNAL) < 0)
+			return;
+	}
+}
+
+static int handle_request(struct history_server *server, int fd,
+			  char *request)
+{
+	struct history_bucket *buckets;
+	struct history *history;
+	long long from;
+	long long to;
+	unsigned int n_buckets;
+	int id;
+
+	if (sscanf(request, "%d %lld %lld %u", &id, &from, &to,
+		   &n_buckets) != 4)
+		return -EINVAL;
+
+	if (to <= from || !n_buckets || n_buckets > MAX_BUCKETS)
+		return -EINVAL;
+
+	history = server->lookup(id, server->user_data);
+	if (!history)
+		return -ENOENT;
+
+	from *= USEC_PER_SEC;
+	to *= USEC_PER_SEC;
+
+	buckets = l_new(struct history_bucket, n_buckets);
+	history_query(history, from, to, n_buckets, buckets);
+	send_response(fd, from, to, n_buckets, buckets);
+	l_free(buckets);
+
+	return 0;
+}
+
+static void on_client(struct history_server *server, int fd)
+{
+	char request[REQUEST_MAX];
+	char error[32];
+	ssize_t n;
+	int rc;
+
+	/* Requests are a single short line: answered and hung up at once */
+	n = recv(fd, request, sizeof(request) - 1, 0);
+	if (n <= 0)
+		return;
+
+	request[n] = '\0';
+
+	rc = handle_request(server, fd, request);
+	if (rc < 0) {
+		n = snprintf(error, sizeof(error), "error %s\n",
+			     strerror(-rc));
+		send(fd, error, n, MSG_NOSIGNAL);
+	}
+}
+
+static bool on_server_accept(struct l_io *io, void *user_data)
+{
+	struct history_server *server = user_data;
+	struct timeval tv = { .tv_sec = 1 };
+	int fd;
+
+	fd = accept(l_io_get_fd(io), NULL, NULL);
+	if (fd < 0)
+		return true;
+
+	/* A stalled client must not hold the main loop for long */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	on_client(server, fd);
+	close(fd);
+
+	return true;
+}
+
+struct history_server *history_server_start(const char *path,
+					    history_lookup_cb_t lookup_cb,
+					    void *user_data)
+{
+	struct history_server *server;
+	struct sockaddr_un addr;
+	int fd;
+	int err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	server = l_new(struct history_server, 1);
+	server->path = l_strdup(path);
+	server->lookup = lookup_cb;
+	server->user_data = user_data;
+
+	server->io = l_io_new(fd);
+	l_io_set_close_on_destroy(server->io, true);
+	l_io_set_read_handler(server->io, on_server_accept, server, NULL);
+
+	return server;
+}
+
+void history_server_stop(struct history_server *server)
+{
+	if (!server)
+		return;
+
+	l_io_destroy(server->io);
+
+	unlink(server->path);
+	l_free(server->path);
+	l_free(server);
+}
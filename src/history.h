@@ -0,0 +1,40 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Data item history header file
+ */
+
+enum history_quality {
+	HISTORY_QUALITY_GOOD,
+	HISTORY_QUALITY_BAD		/* read failed, last known value */
+};
+
+struct history;
+struct history_server;
+
+typedef struct history *(*history_lookup_cb_t) (int id, void *user_data);
+
+struct history *history_open(const char *path, unsigned int capacity);
+void history_close(struct history *history);
+void history_append(struct history *history, double value,
+		    enum history_quality quality);
+
+struct history_server *history_server_start(const char *path,
+					    history_lookup_cb_t lookup_cb,
+					    void *user_data);
+void history_server_stop(struct history_server *server);
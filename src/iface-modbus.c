@@ -27,17 +27,42 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <linux/serial.h>
 #include <asm-generic/ioctls.h>
 
 #include "iface-modbus.h"
+#include "modbus-tcp.h"
 
 #define TCP_PREFIX "tcp://"
 #define TCP_PREFIX_SIZE 6
 #define RTU_PREFIX "serial://"
 #define RTU_PREFIX_SIZE 9
-#define RECONNECT_TIMEOUT 5
+#define DEFAULT_RECONNECT_MIN_DELAY 1000	/* ms */
+#define DEFAULT_RECONNECT_MAX_DELAY 60000	/* ms */
+#define DEFAULT_KEEPALIVE 10			/* s */
+#define DEFAULT_LIVENESS_INTERVAL 10		/* s */
+#define LIVENESS_MAX_MISSES 2
+/* Above 19200 bps the Modbus spec fixes t3.5 instead of scaling it */
+#define RTU_FIXED_BAUD_RATE 19200
+#define RTU_FIXED_SILENT_INTERVAL 1750
+#define RTU_START_BIT 1
+#define USEC_PER_SEC 1000000
+#define USEC_PER_MSEC 1000
+#define READ_REQUEST_PDU_SIZE 5
+#define WRITE_REQUEST_PDU_MAX 14
+#define WRITE_RESPONSE_PDU_SIZE 5
+#define DEFAULT_MAX_IN_FLIGHT 16
+#define DEFAULT_LINK_MAX_IN_FLIGHT 4
+#define DEFAULT_SLAVE_MAX_IN_FLIGHT 1
+/* Unconfigured addresses read along to merge neighbours in one block */
+#define BLOCK_MAX_GAP 8
+#define SLAVE_FAILURE_THRESHOLD 3
+#define BREAKER_MIN_BACKOFF 1000	/* ms */
+#define BREAKER_MAX_BACKOFF 60000	/* ms */
+/* Waiting this long in a lane weighs as much as one priority level */
+#define LANE_AGING_STEP 1000		/* ms */
 
 enum driver_type {
 	TCP,
@@ -60,13 +85,139 @@ union modbus_types {
 	uint64_t val_u64;
 };
 
-static struct l_timeout *connect_to;
-static struct l_io *modbus_io;
-static modbus_t *modbus_ctx;
-static iface_modbus_connected_cb_t conn_cb;
-static iface_modbus_disconnected_cb_t disconn_cb;
+enum breaker_state {
+	BREAKER_CLOSED,
+	BREAKER_OPEN,
+	BREAKER_HALF_OPEN
+};
+
+struct modbus_breaker {
+	enum breaker_state state;
+	unsigned int failures;
+	unsigned int backoff;		/* ms */
+	uint64_t open_until;		/* usec */
+};
+
+struct modbus_request {
+	struct modbus_bus *bus;
+	struct modbus_slave_queue *slave;
+	int slave_id;
+	int function;
+	int reg_addr;
+	int nb;
+	int bit_offset;
+	bool alone;			/* quarantined: never merged */
+	enum iface_modbus_priority priority;
+	uint64_t queued_at;		/* usec */
+	bool write;
+	uint16_t regs[4];		/* write payload */
+	iface_modbus_read_cb_t read_cb;
+	iface_modbus_write_cb_t write_cb;
+	void *user_data;
+};
+
+/* Requests to adjacent addresses merged into a single transaction */
+struct modbus_block {
+	struct modbus_bus *bus;
+	struct modbus_slave_queue *slave;
+	int function;
+	int addr;
+	int nb;
+	bool write;
+	struct l_queue *requests;
+};
+
+struct modbus_slave_queue {
+	int id;
+	/* One queue per priority, served by aged priority */
+	struct l_queue *lanes[IFACE_MODBUS_PRIORITIES];
+	/* Halves of failed blocks, served before new requests */
+	struct l_queue *splits;
+	unsigned int in_flight;
+	double tokens;			/* transactions it may start now */
+	uint64_t last_refill;		/* usec */
+	struct modbus_breaker breaker;
+	/* Breakers of failing addresses, by function and address */
+	struct l_hashmap *quarantine;
+};
+
+struct modbus_bus_user {
+	iface_modbus_connected_cb_t conn_cb;
+	iface_modbus_disconnected_cb_t disconn_cb;
+	void *user_data;
+};
+
+struct modbus_bus {
+	int id;
+	char *url;
+	/* Serial port or TCP host:port shared by every unit ID behind it */
+	char *endpoint;
+	enum driver_type type;
+	modbus_t *ctx;			/* RTU: blocking libmodbus context */
+	struct modbus_tcp *tcp;		/* TCP: pipelined, non-blocking */
+	struct l_io *io;
+	struct l_timeout *connect_to;
+	struct l_timeout *sched_to;
+	bool connected;
+	unsigned int reconnect_delay;	/* ms, doubled on each failure */
+	unsigned int reconnect_min_delay;
+	unsigned int reconnect_max_delay;
+	/* TCP: an idle link is probed to catch a half-open connection */
+	struct l_timeout *liveness_to;
+	unsigned int liveness_interval;	/* s */
+	uint64_t last_rx;
+	bool probe_pending;
+	unsigned int probe_misses;
+	int probe_unit;
+	struct l_queue *users;
+	/* Slave queues served in round-robin */
+	struct l_queue *slaves;
+	unsigned int in_flight;
+	unsigned int max_in_flight;
+	unsigned int slave_max_in_flight;
+	/* Transactions per second and burst allowed to each unit */
+	double slave_rate;
+	unsigned int slave_burst;
+	int last_slave_id;
+	uint64_t next_tx_time;
+	unsigned int silent_interval;	/* usec */
+	unsigned int turnaround_delay;	/* usec */
+};
+
+static struct l_queue *buses;
+static int last_bus_id;
+static unsigned int in_flight;
+static unsigned int max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+static iface_modbus_image_cb_t image_cb;
+static void *image_user_data;
+
+static unsigned int rtu_silent_interval(int baud_rate, char parity,
+					int data_bit, int stop_bit)
+{
+	unsigned int char_bits;
 
-static modbus_t *create_rtu(const char *url)
+	if (baud_rate > RTU_FIXED_BAUD_RATE)
+		return RTU_FIXED_SILENT_INTERVAL;
+
+	char_bits = RTU_START_BIT + data_bit + stop_bit;
+	if (parity != 'N')
+		char_bits++;
+
+	/* 3.5 character times, rounded up to the next microsecond */
+	return (char_bits * 7 * USEC_PER_SEC + baud_rate * 2 - 1) /
+		(baud_rate * 2);
+}
+
+static uint64_t time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static modbus_t *create_rtu(struct modbus_bus *bus, const char *url)
 {
 	struct serial_rs485 rs485conf;
 	modbus_t *ctx;
@@ -85,7 +236,7 @@ static modbus_t *create_rtu(const char *url)
 		return NULL;
 	}
 
-	fd = open(&url[8], O_RDWR);
+	fd = open(port, O_RDWR);
 	if (fd < 0)
 		return NULL;
 
@@ -108,10 +259,14 @@ static modbus_t *create_rtu(const char *url)
 	modbus_rtu_set_serial_mode(ctx, mode);
 	modbus_rtu_set_rts(ctx, MODBUS_RTU_RTS_NONE);
 
+	bus->silent_interval = rtu_silent_interval(baud_rate, parity, data_bit,
+						   stop_bit);
+	l_info("RTU silent interval: %u us", bus->silent_interval);
+
 	return ctx;
 }
 
-static modbus_t *create_tcp(const char *url)
+static struct modbus_tcp *create_tcp(const char *url, int response_timeout)
 {
 	char hostname[128];
 	char port[8];
@@ -125,153 +280,1563 @@ static modbus_t *create_tcp(const char *url)
 		return NULL;
 	}
 
-	return modbus_new_tcp_pi(hostname, port);
+	return modbus_tcp_new(hostname, port, response_timeout);
 }
 
-static modbus_t *create_ctx(const char *url)
+static char *url_to_endpoint(const char *url)
 {
+	char hostname[128];
+	char port[256];
+
 	if (strncmp(url, TCP_PREFIX, TCP_PREFIX_SIZE) == 0) {
-		return create_tcp(url);
+		if (sscanf(&url[6], "%127[^:]:%7s", hostname, port) != 2)
+			return NULL;
+
+		return l_strdup_printf("%s:%s", hostname, port);
 	} else if (strncmp(url, RTU_PREFIX, RTU_PREFIX_SIZE) == 0) {
-		return create_rtu(url);
-	} else {
-		l_error("Address (%s) not supported: Invalid prefix", url);
-		errno = -EINVAL;
-		return NULL;
+		if (sscanf(&url[8], "%255[^:]:", port) != 1)
+			return NULL;
+
+		return l_strdup(port);
 	}
+
+	return NULL;
 }
 
-static void on_disconnected(struct l_io *io, void *user_data)
+static bool bus_match_id(const void *a, const void *b)
 {
-	if (disconn_cb)
-		disconn_cb(user_data);
+	const struct modbus_bus *bus = a;
+	int id = L_PTR_TO_INT(b);
 
-	if (connect_to)
-		l_timeout_modify(connect_to, RECONNECT_TIMEOUT);
+	return bus->id == id;
 }
 
-static void attempt_connect(struct l_timeout *to, void *user_data)
+static bool bus_match_endpoint(const void *a, const void *b)
 {
-	l_debug("Trying to connect to Modbus");
+	const struct modbus_bus *bus = a;
+	const char *endpoint = b;
 
-	/* Check and close if a connection is already up */
-	if (modbus_get_socket(modbus_ctx) != -1)
-		modbus_close(modbus_ctx);
+	return !strcmp(bus->endpoint, endpoint);
+}
 
-	/* Check and destroy if an IO is already allocated */
-	if (modbus_io) {
-		l_io_destroy(modbus_io);
-		modbus_io = NULL;
+static bool user_match(const void *a, const void *b)
+{
+	const struct modbus_bus_user *user = a;
+
+	return user->user_data == b;
+}
+
+static bool slave_queue_match_id(const void *a, const void *b)
+{
+	const struct modbus_slave_queue *slave = a;
+	int id = L_PTR_TO_INT(b);
+
+	return slave->id == id;
+}
+
+static bool request_match(const void *a, const void *b)
+{
+	const struct modbus_request *req_a = a;
+	const struct modbus_request *req_b = b;
+
+	return !req_a->write && !req_b->write &&
+		req_a->reg_addr == req_b->reg_addr &&
+		req_a->bit_offset == req_b->bit_offset;
+}
+
+static bool request_match_user_data(const void *a, const void *b)
+{
+	const struct modbus_request *req = a;
+
+	return !req->write && req->user_data == b;
+}
+
+/* Keeps a lane in arrival order, which its aging relies on */
+static int request_compare_queued(const void *a, const void *b,
+				  void *user_data)
+{
+	const struct modbus_request *req_a = a;
+	const struct modbus_request *req_b = b;
+
+	if (req_a->queued_at < req_b->queued_at)
+		return -1;
+
+	return req_a->queued_at > req_b->queued_at ? 1 : 0;
+}
+
+static bool block_has_request(const void *a, const void *b)
+{
+	const struct modbus_block *block = a;
+
+	return l_queue_find(block->requests, request_match, b) != NULL;
+}
+
+static int request_compare(const void *a, const void *b, void *user_data)
+{
+	const struct modbus_request *req_a = a;
+	const struct modbus_request *req_b = b;
+
+	return req_a->reg_addr - req_b->reg_addr;
+}
+
+static void request_cancel_with(struct modbus_request *req, int err)
+{
+	if (req->write)
+		req->write_cb(err, req->user_data);
+	else
+		req->read_cb(err, NULL, req->user_data);
+
+	l_free(req);
+}
+
+static void request_cancel(void *data)
+{
+	request_cancel_with(data, -ENOTCONN);
+}
+
+static void block_free(struct modbus_block *block, l_queue_destroy_func_t func)
+{
+	l_queue_destroy(block->requests, func);
+	l_free(block);
+}
+
+static void block_cancel(void *data)
+{
+	block_free(data, request_cancel);
+}
+
+static void block_destroy(void *data)
+{
+	block_free(data, l_free);
+}
+
+static void slave_queue_cancel(void *data, void *user_data)
+{
+	struct modbus_slave_queue *slave = data;
+	int i;
+
+	l_queue_clear(slave->splits, block_cancel);
+	for (i = 0; i < IFACE_MODBUS_PRIORITIES; i++)
+		l_queue_clear(slave->lanes[i], request_cancel);
+}
+
+static void slave_queue_destroy(void *data)
+{
+	struct modbus_slave_queue *slave = data;
+	int i;
+
+	l_queue_destroy(slave->splits, block_destroy);
+	for (i = 0; i < IFACE_MODBUS_PRIORITIES; i++)
+		l_queue_destroy(slave->lanes[i], l_free);
+	l_hashmap_destroy(slave->quarantine, l_free);
+	l_free(slave);
+}
+
+static struct modbus_slave_queue *slave_queue_new(struct modbus_bus *bus,
+						  int id)
+{
+	struct modbus_slave_queue *slave;
+	int i;
+
+	slave = l_new(struct modbus_slave_queue, 1);
+	slave->id = id;
+	for (i = 0; i < IFACE_MODBUS_PRIORITIES; i++)
+		slave->lanes[i] = l_queue_new();
+	slave->splits = l_queue_new();
+	slave->quarantine = l_hashmap_new();
+	slave->tokens = bus->slave_burst;
+	slave->last_refill = time_now();
+
+	return slave;
+}
+
+static bool slave_has_request(struct modbus_slave_queue *slave,
+			      struct modbus_request *req)
+{
+	int i;
+
+	for (i = 0; i < IFACE_MODBUS_PRIORITIES; i++)
+		if (l_queue_find(slave->lanes[i], request_match, req))
+			return true;
+
+	return l_queue_find(slave->splits, block_has_request, req) != NULL;
+}
+
+static bool slave_is_pending(struct modbus_slave_queue *slave)
+{
+	int i;
+
+	if (!l_queue_isempty(slave->splits))
+		return true;
+
+	for (i = 0; i < IFACE_MODBUS_PRIORITIES; i++)
+		if (!l_queue_isempty(slave->lanes[i]))
+			return true;
+
+	return false;
+}
+
+/* Token bucket: true when the unit may start a transaction now */
+static bool slave_has_token(struct modbus_bus *bus,
+			    struct modbus_slave_queue *slave, uint64_t now,
+			    uint64_t *wait)
+{
+	uint64_t next;
+
+	if (bus->slave_rate <= 0)
+		return true;
+
+	slave->tokens += (double) (now - slave->last_refill) / USEC_PER_SEC *
+		bus->slave_rate;
+	if (slave->tokens > bus->slave_burst)
+		slave->tokens = bus->slave_burst;
+	slave->last_refill = now;
+
+	if (slave->tokens >= 1)
+		return true;
+
+	next = (1 - slave->tokens) / bus->slave_rate * USEC_PER_SEC;
+	if (next < *wait)
+		*wait = next;
+
+	return false;
+}
+
+static bool slave_can_send(struct modbus_bus *bus,
+			   struct modbus_slave_queue *slave, uint64_t now,
+			   uint64_t *wait)
+{
+	if (!slave_is_pending(slave))
+		return false;
+
+	if (slave->in_flight >= bus->slave_max_in_flight)
+		return false;
+
+	/* A recovering slave gets a single probe at a time */
+	if (slave->breaker.state == BREAKER_HALF_OPEN && slave->in_flight)
+		return false;
+
+	return slave_has_token(bus, slave, now, wait);
+}
+
+static unsigned int quarantine_key(int function, int addr)
+{
+	return function << 16 | addr;
+}
+
+static bool breaker_allow(struct modbus_breaker *breaker)
+{
+	switch (breaker->state) {
+	case BREAKER_CLOSED:
+	case BREAKER_HALF_OPEN:
+		return true;
+	case BREAKER_OPEN:
+		if (time_now() < breaker->open_until)
+			return false;
+
+		/* Backoff elapsed: let one probe through */
+		breaker->state = BREAKER_HALF_OPEN;
+		return true;
 	}
 
-	if (modbus_connect(modbus_ctx) < 0) {
-		l_error("error connecting to Modbus: %s",
-			modbus_strerror(errno));
-		goto retry;
+	return false;
+}
+
+static void breaker_failure(struct modbus_breaker *breaker,
+			    unsigned int threshold)
+{
+	if (breaker->state == BREAKER_CLOSED &&
+	    ++breaker->failures < threshold)
+		return;
+
+	/* A failed probe doubles the time the breaker stays open */
+	if (breaker->state == BREAKER_HALF_OPEN)
+		breaker->backoff = breaker->backoff * 2 > BREAKER_MAX_BACKOFF ?
+			BREAKER_MAX_BACKOFF : breaker->backoff * 2;
+	else
+		breaker->backoff = BREAKER_MIN_BACKOFF;
+
+	breaker->state = BREAKER_OPEN;
+	breaker->open_until = time_now() + breaker->backoff * USEC_PER_MSEC;
+}
+
+static void breaker_success(struct modbus_breaker *breaker)
+{
+	memset(breaker, 0, sizeof(*breaker));
+}
+
+static void bus_destroy(struct modbus_bus *bus)
+{
+	bus->connected = false;
+
+	l_timeout_remove(bus->connect_to);
+	l_timeout_remove(bus->sched_to);
+	l_timeout_remove(bus->liveness_to);
+
+	/* In-flight TCP requests are completed before their queues go */
+	modbus_tcp_free(bus->tcp);
+
+	l_queue_destroy(bus->slaves, slave_queue_destroy);
+	l_queue_destroy(bus->users, l_free);
+
+	l_io_destroy(bus->io);
+
+	if (bus->ctx) {
+		modbus_close(bus->ctx);
+		modbus_free(bus->ctx);
 	}
 
-	modbus_io = l_io_new(modbus_get_socket(modbus_ctx));
-	if (!modbus_io)
-		goto connection_close;
+	l_free(bus->endpoint);
+	l_free(bus->url);
+	l_free(bus);
+}
 
-	if (!l_io_set_disconnect_handler(modbus_io, on_disconnected, NULL,
-					 NULL)) {
-		l_error("Couldn't set Modbus disconnect handler");
-		goto io_destroy;
+static int max_block_count(int function)
+{
+	if (function == MODBUS_FC_READ_DISCRETE_INPUTS)
+		return MODBUS_MAX_READ_BITS;
+
+	return MODBUS_MAX_READ_REGISTERS;
+}
+
+static bool block_try_merge(struct modbus_block *block,
+			    struct modbus_request *req)
+{
+	int start;
+	int end;
+
+	if (req->write || req->alone || req->function != block->function)
+		return false;
+
+	if (req->reg_addr > block->addr + block->nb + BLOCK_MAX_GAP ||
+	    req->reg_addr + req->nb + BLOCK_MAX_GAP < block->addr)
+		return false;
+
+	start = block->addr < req->reg_addr ? block->addr : req->reg_addr;
+	end = block->addr + block->nb;
+	if (req->reg_addr + req->nb > end)
+		end = req->reg_addr + req->nb;
+	if (end - start > max_block_count(block->function))
+		return false;
+
+	block->addr = start;
+	block->nb = end - start;
+	l_queue_insert(block->requests, req, request_compare, NULL);
+
+	return true;
+}
+
+static bool block_merge_lane(struct modbus_block *block, struct l_queue *lane)
+{
+	const struct l_queue_entry *entry;
+	struct modbus_request *req;
+
+	for (entry = l_queue_get_entries(lane); entry; entry = entry->next) {
+		req = entry->data;
+		if (block_try_merge(block, req)) {
+			l_queue_remove(lane, req);
+			return true;
+		}
 	}
 
-	if (conn_cb)
-		conn_cb(user_data);
+	return false;
+}
 
-	return;
+static struct modbus_block *block_new(struct modbus_slave_queue *slave,
+				      int lane)
+{
+	struct modbus_request *req;
+	struct modbus_block *block;
+	bool merged;
+	int i;
 
-io_destroy:
-	l_io_destroy(modbus_io);
-	modbus_io = NULL;
-connection_close:
-	modbus_close(modbus_ctx);
-retry:
-	l_timeout_modify(to, RECONNECT_TIMEOUT);
+	req = l_queue_pop_head(slave->lanes[lane]);
+
+	block = l_new(struct modbus_block, 1);
+	block->bus = req->bus;
+	block->slave = slave;
+	block->function = req->function;
+	block->addr = req->reg_addr;
+	block->nb = req->nb;
+	block->write = req->write;
+	block->requests = l_queue_new();
+	l_queue_push_tail(block->requests, req);
+
+	if (req->write || req->alone)
+		return block;
+
+	/*
+	 * Grow the block until no queued request is close enough. Reads
+	 * of lower lanes ride along for free.
+	 */
+	do {
+		merged = false;
+
+		for (i = 0; i < IFACE_MODBUS_PRIORITIES && !merged; i++)
+			merged = block_merge_lane(block, slave->lanes[i]);
+	} while (merged);
+
+	return block;
 }
 
-int iface_modbus_read_data(int reg_addr, int bit_offset, knot_value_type *out)
+/* Lower is more urgent: each priority level is worth an aging step */
+static int64_t slave_best_lane(struct modbus_slave_queue *slave,
+			       uint64_t now, int *lane)
 {
-	int rc;
-	union modbus_types tmp;
-	uint8_t byte_tmp[8];
-	uint8_t i;
+	struct modbus_request *req;
+	int64_t score = INT64_MAX;
+	int64_t lane_score;
+	int i;
 
-	memset(&tmp, 0, sizeof(tmp));
+	for (i = 0; i < IFACE_MODBUS_PRIORITIES; i++) {
+		req = l_queue_peek_head(slave->lanes[i]);
+		if (!req)
+			continue;
+
+		lane_score = (int64_t) i * LANE_AGING_STEP -
+			(int64_t) (now - req->queued_at) / USEC_PER_MSEC;
+		if (lane_score < score) {
+			score = lane_score;
+			*lane = i;
+		}
+	}
+
+	return score;
+}
+
+static struct modbus_block *next_block(struct modbus_bus *bus)
+{
+	const struct l_queue_entry *entry;
+	struct modbus_slave_queue *slave;
+	struct modbus_slave_queue *best = NULL;
+	struct modbus_block *block;
+	int64_t best_score = INT64_MAX;
+	int64_t score;
+	uint64_t now = time_now();
+	uint64_t wait = UINT64_MAX;
+	int best_lane = 0;
+	int lane = 0;
+
+	if (in_flight >= max_in_flight || bus->in_flight >= bus->max_in_flight)
+		return NULL;
+
+	/*
+	 * The most urgent request of all units goes first. Ties go to the
+	 * unit served least recently, as served units move to the tail.
+	 */
+	for (entry = l_queue_get_entries(bus->slaves); entry;
+	     entry = entry->next) {
+		slave = entry->data;
+
+		if (!slave_can_send(bus, slave, now, &wait))
+			continue;
+
+		/* Halves of a failed block finish before anything else */
+		if (!l_queue_isempty(slave->splits)) {
+			best = slave;
+			best_lane = -1;
+			break;
+		}
+
+		score = slave_best_lane(slave, now, &lane);
+		if (score < best_score) {
+			best = slave;
+			best_score = score;
+			best_lane = lane;
+		}
+	}
 
+	if (!best)
+		return NULL;
+
+	l_queue_remove(bus->slaves, best);
+	l_queue_push_tail(bus->slaves, best);
+
+	if (bus->slave_rate > 0)
+		best->tokens--;
+
+	if (best_lane < 0)
+		block = l_queue_pop_head(best->splits);
+	else
+		block = block_new(best, best_lane);
+
+	return block;
+}
+
+static void schedule_next(struct modbus_bus *bus)
+{
+	const struct l_queue_entry *entry;
+	uint64_t now;
+	uint64_t wait = UINT64_MAX;
+	uint64_t wait_ms;
+	bool ready = false;
+
+	if (!bus->connected)
+		return;
+
+	/* Full: the next completion schedules again */
+	if (in_flight >= max_in_flight || bus->in_flight >= bus->max_in_flight)
+		return;
+
+	now = time_now();
+
+	for (entry = l_queue_get_entries(bus->slaves); entry;
+	     entry = entry->next) {
+		if (slave_can_send(bus, entry->data, now, &wait))
+			ready = true;
+	}
+
+	if (ready) {
+		/* Timers are ms based: dispatch waits the sub-ms rest */
+		wait = bus->next_tx_time > now ? bus->next_tx_time - now : 0;
+		wait_ms = wait / USEC_PER_MSEC;
+	} else if (wait != UINT64_MAX) {
+		/* Rate limited: wake up once a token is back */
+		wait_ms = (wait + USEC_PER_MSEC - 1) / USEC_PER_MSEC;
+	} else {
+		return;
+	}
+
+	l_timeout_modify_ms(bus->sched_to, wait_ms ? wait_ms : 1);
+}
+
+static void foreach_schedule_next(void *data, void *user_data)
+{
+	schedule_next(data);
+}
+
+static int read_function(int bit_offset, int *nb)
+{
 	switch (bit_offset) {
 	case TYPE_BOOL:
-		rc = modbus_read_input_bits(modbus_ctx, reg_addr, 1,
-					    &tmp.val_bool);
-		break;
+		*nb = 1;
+		return MODBUS_FC_READ_DISCRETE_INPUTS;
 	case TYPE_BYTE:
-		rc = modbus_read_input_bits(modbus_ctx, reg_addr, 8, byte_tmp);
-		/**
-		 * Store in tmp.val_byte the value read from a Modbus Slave
-		 * where each position of byte_tmp corresponds to a bit.
-		*/
-		for (i = 0; i < sizeof(byte_tmp); i++)
-			tmp.val_byte |= byte_tmp[i] << i;
-		break;
+		*nb = 8;
+		return MODBUS_FC_READ_DISCRETE_INPUTS;
 	case TYPE_U16:
-		rc = modbus_read_registers(modbus_ctx, reg_addr, 1,
-					   &tmp.val_u16);
-		break;
+		*nb = 1;
+		return MODBUS_FC_READ_HOLDING_REGISTERS;
 	case TYPE_U32:
-		rc = modbus_read_registers(modbus_ctx, reg_addr, 2,
-					   (uint16_t *) &tmp.val_u32);
-		break;
+		*nb = 2;
+		return MODBUS_FC_READ_HOLDING_REGISTERS;
 	case TYPE_U64:
-		rc = modbus_read_registers(modbus_ctx, reg_addr, 4,
-					   (uint16_t *) &tmp.val_u64);
-		break;
+		*nb = 4;
+		return MODBUS_FC_READ_HOLDING_REGISTERS;
 	default:
-		rc = -EINVAL;
+		return -EINVAL;
 	}
+}
 
-	if (rc < 0) {
-		rc = -errno;
-		l_error("Failed to read from Modbus: %s (%d)",
-			modbus_strerror(errno), rc);
-	} else {
-		memcpy(out, &tmp, sizeof(tmp));
+static int write_function(int bit_offset, int *nb)
+{
+	switch (bit_offset) {
+	case TYPE_BOOL:
+	case TYPE_BYTE:
+		/*
+		 * Bits are read from the discrete inputs, which are read
+		 * only: writing the coils would not change what is read.
+		 */
+		return -EOPNOTSUPP;
+	case TYPE_U16:
+		*nb = 1;
+		return MODBUS_FC_WRITE_SINGLE_REGISTER;
+	case TYPE_U32:
+		*nb = 2;
+		return MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+	case TYPE_U64:
+		*nb = 4;
+		return MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+	default:
+		return -EINVAL;
 	}
-
-	return rc;
 }
 
-int iface_modbus_start(const char *url, int slave_id,
-		       iface_modbus_connected_cb_t connected_cb,
-		       iface_modbus_disconnected_cb_t disconnected_cb,
-		       void *user_data)
+static void request_encode(struct modbus_request *req,
+			   const knot_value_type *value)
 {
-	modbus_ctx = create_ctx(url);
-	if (!modbus_ctx)
-		return -errno;
+	union modbus_types tmp;
 
-	if (modbus_set_slave(modbus_ctx, slave_id) < 0)
-		return -errno;
+	memcpy(&tmp, value, sizeof(tmp));
 
-	conn_cb = connected_cb;
-	disconn_cb = disconnected_cb;
+	/* Same layout as the values read back */
+	memcpy(req->regs, &tmp, req->nb * sizeof(uint16_t));
+}
 
-	connect_to = l_timeout_create_ms(1, attempt_connect, NULL, NULL);
+static bool is_address_fault(int rc)
+{
+	switch (-rc) {
+	case EMBXILFUN:
+	case EMBXILADD:
+	case EMBXILVAL:
+	case EMBXSFAIL:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	return 0;
+static bool is_slave_failure(int rc)
+{
+	switch (-rc) {
+	case ETIMEDOUT:
+	/* The slave behind the gateway did not answer */
+	case EMBXGPATH:
+	case EMBXGTAR:
+	case EMBBADCRC:
+	case EMBBADDATA:
+	case EMBBADSLAVE:
+		return true;
+	default:
+		return false;
+	}
 }
 
-void iface_modbus_stop(void)
+static void request_decode(struct modbus_request *req,
+			   struct modbus_block *block, const uint8_t *bits,
+			   const uint16_t *regs, knot_value_type *out)
 {
-	l_timeout_remove(connect_to);
-	connect_to = NULL;
+	union modbus_types tmp;
+	int offset = req->reg_addr - block->addr;
+	int i;
+
+	memset(&tmp, 0, sizeof(tmp));
+
+	if (block->function == MODBUS_FC_READ_DISCRETE_INPUTS) {
+		/**
+		 * Store in tmp.val_byte the value read from a Modbus Slave
+		 * where each position of bits corresponds to a bit.
+		 */
+		for (i = 0; i < req->nb; i++)
+			tmp.val_byte |= bits[offset + i] << i;
+	} else {
+		memcpy(&tmp, regs + offset, req->nb * sizeof(uint16_t));
+	}
 
-	l_io_destroy(modbus_io);
-	modbus_io = NULL;
+	/* The value is wider than what Modbus carries: no stack left over */
+	memset(out, 0, sizeof(*out));
+	memcpy(out, &tmp, sizeof(tmp));
+}
 
-	modbus_close(modbus_ctx);
-	modbus_free(modbus_ctx);
+static void foreach_request_cancel(void *data, void *user_data)
+{
+	request_cancel_with(data, L_PTR_TO_INT(user_data));
+}
+
+static void slave_open(struct modbus_slave_queue *slave)
+{
+	int i;
+
+	l_info("Modbus unit %d is not responding, retrying in %u ms",
+	       slave->id, slave->breaker.backoff);
+
+	/* Fail fast instead of letting each request time out */
+	l_queue_clear(slave->splits, block_cancel);
+	for (i = 0; i < IFACE_MODBUS_PRIORITIES; i++) {
+		l_queue_foreach(slave->lanes[i], foreach_request_cancel,
+				L_INT_TO_PTR(-EHOSTUNREACH));
+		l_queue_clear(slave->lanes[i], NULL);
+	}
+}
+
+static void block_split(struct modbus_block *block)
+{
+	struct modbus_slave_queue *slave = block->slave;
+	struct modbus_block *half;
+	struct modbus_request *req;
+	unsigned int n = l_queue_length(block->requests) / 2;
+
+	/* Bisect until the illegal address is isolated */
+	while (!l_queue_isempty(block->requests)) {
+		half = l_new(struct modbus_block, 1);
+		half->bus = block->bus;
+		half->slave = slave;
+		half->function = block->function;
+		half->requests = l_queue_new();
+
+		while ((req = l_queue_pop_head(block->requests))) {
+			if (l_queue_isempty(half->requests))
+				half->addr = req->reg_addr;
+
+			/* Sorted by address, but a shorter one may end first */
+			if (req->reg_addr + req->nb - half->addr > half->nb)
+				half->nb = req->reg_addr + req->nb -
+					half->addr;
+
+			l_queue_push_tail(half->requests, req);
+
+			if (l_queue_length(half->requests) == n)
+				break;
+		}
+
+		l_queue_push_tail(slave->splits, half);
+		n = l_queue_length(block->requests);
+	}
+}
+
+static void block_fail(struct modbus_block *block, int rc)
+{
+	struct modbus_slave_queue *slave = block->slave;
+	struct modbus_request *req;
+	struct modbus_breaker *breaker;
+	unsigned int key;
+
+	if (is_address_fault(rc) && block->write) {
+		/* The slave answered: the command itself was refused */
+		breaker_success(&slave->breaker);
+	} else if (is_address_fault(rc)) {
+		/* The slave answered: only the addresses are at fault */
+		breaker_success(&slave->breaker);
+
+		if (l_queue_length(block->requests) > 1) {
+			block_split(block);
+			return;
+		}
+
+		req = l_queue_peek_head(block->requests);
+		key = quarantine_key(req->function, req->reg_addr);
+
+		breaker = l_hashmap_lookup(slave->quarantine,
+					   L_UINT_TO_PTR(key));
+		if (!breaker) {
+			breaker = l_new(struct modbus_breaker, 1);
+			l_hashmap_insert(slave->quarantine, L_UINT_TO_PTR(key),
+					 breaker);
+		}
+
+		breaker_failure(breaker, 1);
+
+		l_info("Modbus unit %d address %d quarantined for %u ms",
+		       slave->id, req->reg_addr, breaker->backoff);
+	} else if (is_slave_failure(rc)) {
+		breaker_failure(&slave->breaker, SLAVE_FAILURE_THRESHOLD);
+		if (slave->breaker.state == BREAKER_OPEN)
+			slave_open(slave);
+	}
+
+	l_queue_foreach(block->requests, foreach_request_cancel,
+			L_INT_TO_PTR(rc));
+	l_queue_clear(block->requests, NULL);
+}
+
+/* Whole blocks go out, gaps included, as a copy of the slave's table */
+static void block_image(struct modbus_block *block, const uint8_t *bits,
+			const uint16_t *regs)
+{
+	uint16_t values[MODBUS_MAX_READ_BITS];
+	int i;
+
+	if (!image_cb)
+		return;
+
+	if (block->function != MODBUS_FC_READ_DISCRETE_INPUTS) {
+		image_cb(block->bus->id, block->slave->id,
+			 IFACE_MODBUS_HOLDING_REGISTERS, block->addr,
+			 block->nb, regs, image_user_data);
+		return;
+	}
+
+	for (i = 0; i < block->nb; i++)
+		values[i] = bits[i];
+
+	image_cb(block->bus->id, block->slave->id,
+		 IFACE_MODBUS_DISCRETE_INPUTS, block->addr, block->nb, values,
+		 image_user_data);
+}
+
+static void block_done(struct modbus_block *block, const uint8_t *bits,
+		       const uint16_t *regs)
+{
+	struct modbus_slave_queue *slave = block->slave;
+	struct modbus_request *req;
+	knot_value_type value;
+	unsigned int key;
+
+	breaker_success(&slave->breaker);
+
+	if (block->write) {
+		req = l_queue_pop_head(block->requests);
+		req->write_cb(0, req->user_data);
+		l_free(req);
+		return;
+	}
+
+	block_image(block, bits, regs);
+
+	while ((req = l_queue_pop_head(block->requests))) {
+		key = quarantine_key(req->function, req->reg_addr);
+		l_free(l_hashmap_remove(slave->quarantine,
+					L_UINT_TO_PTR(key)));
+
+		request_decode(req, block, bits, regs, &value);
+		req->read_cb(req->nb, &value, req->user_data);
+		l_free(req);
+	}
+}
+
+static void block_complete(struct modbus_block *block, int rc,
+			   const uint8_t *bits, const uint16_t *regs)
+{
+	struct modbus_bus *bus = block->bus;
+	bool was_saturated = in_flight >= max_in_flight;
+
+	in_flight--;
+	bus->in_flight--;
+	block->slave->in_flight--;
+
+	if (rc < 0)
+		block_fail(block, rc);
+	else
+		block_done(block, bits, regs);
+
+	block_free(block, NULL);
+
+	/* Capacity freed on a busy engine may unblock any link */
+	if (was_saturated)
+		l_queue_foreach(buses, foreach_schedule_next, NULL);
+	else
+		schedule_next(bus);
+}
+
+static void log_block_error(struct modbus_block *block, int rc)
+{
+	l_error("Failed to read %d from Modbus %s unit %d at %d: %s (%d)",
+		block->nb, block->bus->endpoint, block->slave->id,
+		block->addr, modbus_strerror(-rc), rc);
+}
+
+static int decode_response(struct modbus_block *block, const uint8_t *pdu,
+			   int len, uint8_t *bits, uint16_t *regs)
+{
+	int bytes;
+	int i;
+
+	if (block->function == MODBUS_FC_READ_DISCRETE_INPUTS)
+		bytes = (block->nb + 7) / 8;
+	else
+		bytes = block->nb * 2;
+
+	if (pdu[0] != block->function || len < 2 + bytes || pdu[1] != bytes)
+		return -EMBBADDATA;
+
+	/* Unpacked as libmodbus does it on the RTU path */
+	for (i = 0; i < block->nb; i++) {
+		if (block->function == MODBUS_FC_READ_DISCRETE_INPUTS)
+			bits[i] = (pdu[2 + i / 8] >> (i % 8)) & 0x01;
+		else
+			regs[i] = l_get_be16(pdu + 2 + i * 2);
+	}
+
+	return block->nb;
+}
+
+static int check_write_response(struct modbus_block *block,
+				const uint8_t *pdu, int len)
+{
+	/* Writes are answered with an echo of function and address */
+	if (pdu[0] != block->function || len < WRITE_RESPONSE_PDU_SIZE ||
+	    l_get_be16(pdu + 1) != block->addr)
+		return -EMBBADDATA;
+
+	return block->nb;
+}
+
+static void on_tcp_response(int rc, const uint8_t *pdu, void *user_data)
+{
+	struct modbus_block *block = user_data;
+	uint8_t bits[MODBUS_MAX_READ_BITS];
+	uint16_t regs[MODBUS_MAX_READ_REGISTERS];
+
+	/* Even an exception tells the link and the unit are alive */
+	if (rc > 0 || is_address_fault(rc)) {
+		block->bus->last_rx = time_now();
+		block->bus->probe_unit = block->slave->id;
+	}
+
+	if (rc > 0 && block->write)
+		rc = check_write_response(block, pdu, rc);
+	else if (rc > 0)
+		rc = decode_response(block, pdu, rc, bits, regs);
+
+	if (rc < 0)
+		log_block_error(block, rc);
+
+	block_complete(block, rc, bits, regs);
+}
+
+static size_t encode_write_request(struct modbus_block *block, uint8_t *pdu)
+{
+	struct modbus_request *req = l_queue_peek_head(block->requests);
+	size_t len = 3;
+	int i;
+
+	pdu[0] = block->function;
+	l_put_be16(block->addr, pdu + 1);
+
+	switch (block->function) {
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		l_put_be16(req->regs[0], pdu + len);
+		len += 2;
+		break;
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		l_put_be16(block->nb, pdu + len);
+		pdu[len + 2] = block->nb * 2;
+		len += 3;
+		for (i = 0; i < block->nb; i++, len += 2)
+			l_put_be16(req->regs[i], pdu + len);
+		break;
+	}
+
+	return len;
+}
+
+static int send_tcp_request(struct modbus_bus *bus,
+			    struct modbus_block *block)
+{
+	uint8_t pdu[WRITE_REQUEST_PDU_MAX];
+	size_t len;
+
+	if (block->write) {
+		len = encode_write_request(block, pdu);
+	} else {
+		pdu[0] = block->function;
+		l_put_be16(block->addr, pdu + 1);
+		l_put_be16(block->nb, pdu + 3);
+		len = READ_REQUEST_PDU_SIZE;
+	}
+
+	return modbus_tcp_send(bus->tcp, block->slave->id, pdu, len,
+			       on_tcp_response, block);
+}
+
+static void dispatch_tcp(struct modbus_bus *bus)
+{
+	struct modbus_block *block;
+	int rc;
+
+	/* Scatter as many requests as the in-flight limits allow */
+	while (bus->connected && (block = next_block(bus))) {
+		in_flight++;
+		bus->in_flight++;
+		block->slave->in_flight++;
+
+		rc = send_tcp_request(bus, block);
+		if (rc < 0)
+			block_complete(block, rc, NULL, NULL);
+	}
+}
+
+static int write_block_rtu(modbus_t *ctx, struct modbus_block *block)
+{
+	struct modbus_request *req = l_queue_peek_head(block->requests);
+
+	switch (block->function) {
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		return modbus_write_register(ctx, block->addr, req->regs[0]);
+	default:
+		return modbus_write_registers(ctx, block->addr, block->nb,
+					      req->regs);
+	}
+}
+
+static int transfer_block_rtu(modbus_t *ctx, struct modbus_block *block,
+			      uint8_t *bits, uint16_t *regs)
+{
+	int rc;
+
+	if (block->write)
+		rc = write_block_rtu(ctx, block);
+	else if (block->function == MODBUS_FC_READ_DISCRETE_INPUTS)
+		rc = modbus_read_input_bits(ctx, block->addr, block->nb, bits);
+	else
+		rc = modbus_read_registers(ctx, block->addr, block->nb, regs);
+
+	return rc < 0 ? -errno : rc;
+}
+
+static void dispatch_rtu(struct modbus_bus *bus)
+{
+	struct modbus_block *block;
+	uint8_t bits[MODBUS_MAX_READ_BITS];
+	uint16_t regs[MODBUS_MAX_READ_REGISTERS];
+	uint64_t tx_time;
+	uint64_t now;
+	int rc;
+
+	block = next_block(bus);
+	if (!block)
+		return;
+
+	in_flight++;
+	bus->in_flight++;
+	block->slave->in_flight++;
+
+	/* Addressing another slave than the last one waits the turnaround */
+	tx_time = bus->next_tx_time;
+	if (bus->last_slave_id >= 0 && block->slave->id != bus->last_slave_id)
+		tx_time += bus->turnaround_delay;
+
+	now = time_now();
+	if (tx_time > now)
+		usleep(tx_time - now);
+
+	modbus_set_slave(bus->ctx, block->slave->id);
+
+	rc = transfer_block_rtu(bus->ctx, block, bits, regs);
+	if (rc < 0)
+		log_block_error(block, rc);
+
+	/* The line must stay silent for t3.5 after the last frame */
+	bus->next_tx_time = time_now() + bus->silent_interval;
+	bus->last_slave_id = block->slave->id;
+
+	block_complete(block, rc, bits, regs);
+}
+
+static void on_sched_timeout(struct l_timeout *to, void *user_data)
+{
+	struct modbus_bus *bus = user_data;
+
+	if (!bus->connected)
+		return;
+
+	if (bus->type == TCP)
+		dispatch_tcp(bus);
+	else
+		dispatch_rtu(bus);
+
+	/* Units held back by their rate limit need a later wake up */
+	schedule_next(bus);
+}
+
+static void notify_connected(void *data, void *user_data)
+{
+	struct modbus_bus_user *user = data;
+
+	if (user->conn_cb)
+		user->conn_cb(user->user_data);
+}
+
+static void notify_disconnected(void *data, void *user_data)
+{
+	struct modbus_bus_user *user = data;
+
+	if (user->disconn_cb)
+		user->disconn_cb(user->user_data);
+}
+
+static void schedule_reconnect(struct modbus_bus *bus)
+{
+	uint32_t r = 0;
+	unsigned int delay = bus->reconnect_delay;
+
+	if (!bus->connect_to)
+		return;
+
+	/*
+	 * Wait a random time between half and all of the current delay, so
+	 * that a fleet restarted at once does not retry in lockstep.
+	 */
+	l_getrandom(&r, sizeof(r));
+	l_timeout_modify_ms(bus->connect_to, delay / 2 + r % (delay / 2 + 1));
+
+	if (bus->reconnect_delay < bus->reconnect_max_delay / 2)
+		bus->reconnect_delay *= 2;
+	else
+		bus->reconnect_delay = bus->reconnect_max_delay;
+}
+
+static void bus_connected(struct modbus_bus *bus)
+{
+	bus->connected = true;
+	bus->next_tx_time = time_now() + bus->silent_interval;
+	bus->reconnect_delay = bus->reconnect_min_delay;
+	bus->last_rx = time_now();
+	bus->probe_misses = 0;
+
+	if (bus->liveness_to)
+		l_timeout_modify(bus->liveness_to, bus->liveness_interval);
+
+	l_queue_foreach(bus->users, notify_connected, NULL);
+
+	schedule_next(bus);
+}
+
+static void bus_disconnected(struct modbus_bus *bus)
+{
+	bus->connected = false;
+	l_queue_foreach(bus->slaves, slave_queue_cancel, NULL);
+	l_queue_foreach(bus->users, notify_disconnected, NULL);
+
+	schedule_reconnect(bus);
+}
+
+static void on_probe_response(int rc, const uint8_t *pdu, void *user_data)
+{
+	struct modbus_bus *bus = user_data;
+
+	bus->probe_pending = false;
+
+	if (rc == -ENOTCONN || rc == -ECONNRESET)
+		return;
+
+	if (rc != -ETIMEDOUT) {
+		bus->probe_misses = 0;
+		bus->last_rx = time_now();
+		return;
+	}
+
+	if (++bus->probe_misses < LIVENESS_MAX_MISSES)
+		return;
+
+	l_info("Modbus %s stopped answering, reconnecting", bus->endpoint);
+
+	modbus_tcp_close(bus->tcp);
+	bus_disconnected(bus);
+}
+
+static void on_liveness_timeout(struct l_timeout *to, void *user_data)
+{
+	struct modbus_bus *bus = user_data;
+	uint8_t pdu[READ_REQUEST_PDU_SIZE];
+	uint64_t idle;
+
+	if (!bus->connected)
+		return;
+
+	l_timeout_modify(to, bus->liveness_interval);
+
+	idle = time_now() - bus->last_rx;
+	if (bus->probe_pending ||
+	    idle < (uint64_t) bus->liveness_interval * USEC_PER_SEC)
+		return;
+
+	/* Any answer will do, an exception included */
+	pdu[0] = MODBUS_FC_READ_HOLDING_REGISTERS;
+	l_put_be16(0, pdu + 1);
+	l_put_be16(1, pdu + 3);
+
+	if (!modbus_tcp_send(bus->tcp, bus->probe_unit, pdu, sizeof(pdu),
+			     on_probe_response, bus))
+		bus->probe_pending = true;
+}
+
+static void on_disconnected(struct l_io *io, void *user_data)
+{
+	bus_disconnected(user_data);
+}
+
+static void on_tcp_disconnected(void *user_data)
+{
+	bus_disconnected(user_data);
+}
+
+static void on_tcp_connected(int err, void *user_data)
+{
+	struct modbus_bus *bus = user_data;
+
+	if (err < 0) {
+		l_error("error connecting to Modbus %s: %s", bus->endpoint,
+			strerror(-err));
+		modbus_tcp_close(bus->tcp);
+		schedule_reconnect(bus);
+		return;
+	}
+
+	bus_connected(bus);
+}
+
+static void attempt_connect_tcp(struct modbus_bus *bus)
+{
+	int err;
+
+	modbus_tcp_close(bus->tcp);
+
+	err = modbus_tcp_connect(bus->tcp, on_tcp_connected,
+				 on_tcp_disconnected, bus);
+	if (err < 0) {
+		l_error("error connecting to Modbus %s: %s", bus->endpoint,
+			strerror(-err));
+		schedule_reconnect(bus);
+	}
+}
+
+static void attempt_connect(struct l_timeout *to, void *user_data)
+{
+	struct modbus_bus *bus = user_data;
+
+	l_debug("Trying to connect to Modbus %s", bus->endpoint);
+
+	if (bus->type == TCP) {
+		attempt_connect_tcp(bus);
+		return;
+	}
+
+	/* Check and close if a connection is already up */
+	if (modbus_get_socket(bus->ctx) != -1)
+		modbus_close(bus->ctx);
+
+	/* Check and destroy if an IO is already allocated */
+	if (bus->io) {
+		l_io_destroy(bus->io);
+		bus->io = NULL;
+	}
+
+	if (modbus_connect(bus->ctx) < 0) {
+		l_error("error connecting to Modbus: %s",
+			modbus_strerror(errno));
+		goto retry;
+	}
+
+	bus->io = l_io_new(modbus_get_socket(bus->ctx));
+	if (!bus->io)
+		goto connection_close;
+
+	if (!l_io_set_disconnect_handler(bus->io, on_disconnected, bus,
+					 NULL)) {
+		l_error("Couldn't set Modbus disconnect handler");
+		goto io_destroy;
+	}
+
+	bus_connected(bus);
+
+	return;
+
+io_destroy:
+	l_io_destroy(bus->io);
+	bus->io = NULL;
+connection_close:
+	modbus_close(bus->ctx);
+retry:
+	schedule_reconnect(bus);
+}
+
+static struct modbus_bus *bus_new(const char *url, char *endpoint,
+				  struct iface_modbus_opts *opts)
+{
+	struct modbus_bus *bus;
+
+	bus = l_new(struct modbus_bus, 1);
+	bus->last_slave_id = -1;
+	bus->endpoint = endpoint;
+	/* Zero rate leaves the units unthrottled */
+	bus->slave_rate = opts->slave_rate;
+	bus->slave_burst = opts->slave_burst > 0 ? opts->slave_burst : 1;
+
+	if (strncmp(url, TCP_PREFIX, TCP_PREFIX_SIZE) == 0) {
+		bus->type = TCP;
+		bus->tcp = create_tcp(url, opts->response_timeout);
+		if (!bus->tcp) {
+			bus_destroy(bus);
+			return NULL;
+		}
+
+		bus->max_in_flight = opts->link_max_in_flight > 0 ?
+			opts->link_max_in_flight : DEFAULT_LINK_MAX_IN_FLIGHT;
+		bus->slave_max_in_flight = opts->slave_max_in_flight > 0 ?
+			opts->slave_max_in_flight : DEFAULT_SLAVE_MAX_IN_FLIGHT;
+
+		modbus_tcp_set_keepalive(bus->tcp, opts->keepalive > 0 ?
+					 opts->keepalive : DEFAULT_KEEPALIVE);
+
+		bus->probe_unit = MODBUS_TCP_SLAVE;
+		bus->liveness_interval = opts->liveness_interval > 0 ?
+			opts->liveness_interval : DEFAULT_LIVENESS_INTERVAL;
+		bus->liveness_to = l_timeout_create(bus->liveness_interval,
+						    on_liveness_timeout, bus,
+						    NULL);
+	} else {
+		bus->type = RTU;
+		bus->ctx = create_rtu(bus, url);
+		if (!bus->ctx) {
+			bus_destroy(bus);
+			return NULL;
+		}
+
+		if (opts->response_timeout > 0)
+			modbus_set_response_timeout(bus->ctx,
+				opts->response_timeout / 1000,
+				(opts->response_timeout % 1000) *
+				USEC_PER_MSEC);
+
+		/* A serial line carries one transaction at a time */
+		bus->max_in_flight = 1;
+		bus->slave_max_in_flight = 1;
+	}
+
+	bus->id = ++last_bus_id;
+	bus->url = l_strdup(url);
+	bus->turnaround_delay = opts->turnaround_delay * USEC_PER_MSEC;
+	bus->slaves = l_queue_new();
+	bus->users = l_queue_new();
+
+	bus->reconnect_min_delay = opts->reconnect_min_delay > 0 ?
+		opts->reconnect_min_delay : DEFAULT_RECONNECT_MIN_DELAY;
+	bus->reconnect_max_delay = opts->reconnect_max_delay > 0 ?
+		opts->reconnect_max_delay : DEFAULT_RECONNECT_MAX_DELAY;
+	if (bus->reconnect_max_delay < bus->reconnect_min_delay)
+		bus->reconnect_max_delay = bus->reconnect_min_delay;
+	bus->reconnect_delay = bus->reconnect_min_delay;
+
+	bus->sched_to = l_timeout_create_ms(0, on_sched_timeout, bus, NULL);
+	bus->connect_to = l_timeout_create_ms(1, attempt_connect, bus, NULL);
+
+	/* The first attempt is spread as well */
+	schedule_reconnect(bus);
+	bus->reconnect_delay = bus->reconnect_min_delay;
+
+	return bus;
+}
+
+void iface_modbus_set_max_in_flight(int max)
+{
+	max_in_flight = max > 0 ? max : DEFAULT_MAX_IN_FLIGHT;
+}
+
+void iface_modbus_set_image_cb(iface_modbus_image_cb_t cb, void *user_data)
+{
+	image_cb = cb;
+	image_user_data = user_data;
+}
+
+static struct modbus_slave_queue *slave_lookup(struct modbus_bus *bus,
+					       int slave_id)
+{
+	struct modbus_slave_queue *slave;
+
+	slave = l_queue_find(bus->slaves, slave_queue_match_id,
+			     L_INT_TO_PTR(slave_id));
+	if (!slave) {
+		slave = slave_queue_new(bus, slave_id);
+		l_queue_push_tail(bus->slaves, slave);
+	}
+
+	return slave;
+}
+
+int iface_modbus_read_data(int bus_id, int slave_id, int reg_addr,
+			   int bit_offset, enum iface_modbus_priority priority,
+			   iface_modbus_read_cb_t read_cb, void *user_data)
+{
+	struct modbus_bus *bus;
+	struct modbus_slave_queue *slave;
+	struct modbus_request *req;
+	struct modbus_breaker *breaker;
+	int function;
+	int nb;
+
+	if (priority < 0 || priority >= IFACE_MODBUS_PRIORITIES)
+		return -EINVAL;
+
+	bus = l_queue_find(buses, bus_match_id, L_INT_TO_PTR(bus_id));
+	if (!bus)
+		return -ENODEV;
+
+	if (!bus->connected)
+		return -ENOTCONN;
+
+	function = read_function(bit_offset, &nb);
+	if (function < 0)
+		return function;
+
+	slave = slave_lookup(bus, slave_id);
+
+	if (!breaker_allow(&slave->breaker))
+		return -EHOSTUNREACH;
+
+	breaker = l_hashmap_lookup(slave->quarantine,
+			L_UINT_TO_PTR(quarantine_key(function, reg_addr)));
+	if (breaker && !breaker_allow(breaker))
+		return -EAGAIN;
+
+	req = l_new(struct modbus_request, 1);
+	req->bus = bus;
+	req->slave = slave;
+	req->slave_id = slave_id;
+	req->function = function;
+	req->reg_addr = reg_addr;
+	req->nb = nb;
+	req->bit_offset = bit_offset;
+	/* Quarantined addresses are probed alone */
+	req->alone = breaker != NULL;
+	req->priority = priority;
+	req->queued_at = time_now();
+	req->read_cb = read_cb;
+	req->user_data = user_data;
+
+	/* A slow line must not pile up copies of the same read */
+	if (slave_has_request(slave, req)) {
+		l_free(req);
+		return -EALREADY;
+	}
+
+	l_queue_push_tail(slave->lanes[priority], req);
+
+	/* A more urgent lane may change what goes next */
+	schedule_next(bus);
+
+	return 0;
+}
+
+/*
+ * Moves a queued read to a more urgent lane, for a reader that joined
+ * it. -EINPROGRESS once it left the lanes: it is then served anyway.
+ */
+int iface_modbus_reprioritize(int bus_id, int slave_id, void *user_data,
+			      enum iface_modbus_priority priority)
+{
+	struct modbus_bus *bus;
+	struct modbus_slave_queue *slave;
+	struct modbus_request *req = NULL;
+	int i;
+
+	if (priority < 0 || priority >= IFACE_MODBUS_PRIORITIES)
+		return -EINVAL;
+
+	bus = l_queue_find(buses, bus_match_id, L_INT_TO_PTR(bus_id));
+	if (!bus)
+		return -ENODEV;
+
+	slave = l_queue_find(bus->slaves, slave_queue_match_id,
+			     L_INT_TO_PTR(slave_id));
+	if (!slave)
+		return -ENOENT;
+
+	for (i = 0; i < IFACE_MODBUS_PRIORITIES && !req; i++)
+		req = l_queue_remove_if(slave->lanes[i],
+					request_match_user_data, user_data);
+
+	if (!req)
+		return -EINPROGRESS;
+
+	/* Never demoted: the first reader still waits for it */
+	if (priority < req->priority)
+		req->priority = priority;
+
+	/* Its time in the queue keeps counting towards aging */
+	l_queue_insert(slave->lanes[req->priority], req,
+		       request_compare_queued, NULL);
+
+	schedule_next(bus);
+
+	return 0;
+}
+
+int iface_modbus_write_data(int bus_id, int slave_id, int reg_addr,
+			    int bit_offset, const knot_value_type *value,
+			    iface_modbus_write_cb_t write_cb, void *user_data)
+{
+	struct modbus_bus *bus;
+	struct modbus_slave_queue *slave;
+	struct modbus_request *req;
+	int function;
+	int nb;
+
+	bus = l_queue_find(buses, bus_match_id, L_INT_TO_PTR(bus_id));
+	if (!bus)
+		return -ENODEV;
+
+	if (!bus->connected)
+		return -ENOTCONN;
+
+	function = write_function(bit_offset, &nb);
+	if (function < 0)
+		return function;
+
+	slave = slave_lookup(bus, slave_id);
+
+	if (!breaker_allow(&slave->breaker))
+		return -EHOSTUNREACH;
+
+	req = l_new(struct modbus_request, 1);
+	req->bus = bus;
+	req->slave = slave;
+	req->slave_id = slave_id;
+	req->function = function;
+	req->reg_addr = reg_addr;
+	req->nb = nb;
+	req->bit_offset = bit_offset;
+	req->priority = IFACE_MODBUS_PRIORITY_COMMAND;
+	req->queued_at = time_now();
+	req->write = true;
+	req->write_cb = write_cb;
+	req->user_data = user_data;
+	request_encode(req, value);
+
+	/* Commands are never merged nor deduplicated: order matters */
+	l_queue_push_tail(slave->lanes[IFACE_MODBUS_PRIORITY_COMMAND], req);
+
+	schedule_next(bus);
+
+	return 0;
+}
+
+int iface_modbus_start(const char *url, struct iface_modbus_opts *opts,
+		       iface_modbus_connected_cb_t connected_cb,
+		       iface_modbus_disconnected_cb_t disconnected_cb,
+		       void *user_data)
+{
+	struct modbus_bus *bus;
+	struct modbus_bus_user *user;
+	char *endpoint;
+
+	endpoint = url_to_endpoint(url);
+	if (!endpoint) {
+		l_error("Address (%s) not supported: Invalid format", url);
+		return -EINVAL;
+	}
+
+	if (!buses)
+		buses = l_queue_new();
+
+	/* Every unit ID behind the same line or gateway uses one link */
+	bus = l_queue_find(buses, bus_match_endpoint, endpoint);
+	if (bus && strcmp(bus->url, url)) {
+		l_error("Modbus %s already in use as %s", url, bus->url);
+		l_free(endpoint);
+		return -EBUSY;
+	} else if (bus) {
+		l_free(endpoint);
+	} else {
+		bus = bus_new(url, endpoint, opts);
+		if (!bus)
+			return -EINVAL;
+
+		l_queue_push_tail(buses, bus);
+	}
+
+	user = l_new(struct modbus_bus_user, 1);
+	user->conn_cb = connected_cb;
+	user->disconn_cb = disconnected_cb;
+	user->user_data = user_data;
+	l_queue_push_tail(bus->users, user);
+
+	/* Joining a link that is already up */
+	if (bus->connected && connected_cb)
+		connected_cb(user_data);
+
+	return bus->id;
+}
+
+void iface_modbus_stop(int bus_id, void *user_data)
+{
+	struct modbus_bus *bus;
+
+	bus = l_queue_find(buses, bus_match_id, L_INT_TO_PTR(bus_id));
+	if (!bus)
+		return;
+
+	l_free(l_queue_remove_if(bus->users, user_match, user_data));
+
+	/* The link is only closed when its last user is gone */
+	if (!l_queue_isempty(bus->users))
+		return;
+
+	l_queue_remove(buses, bus);
+	bus_destroy(bus);
+
+	if (l_queue_isempty(buses)) {
+		l_queue_destroy(buses, NULL);
+		buses = NULL;
+	}
 }
@@ -17,12 +17,57 @@
 extern struct modbus_driver tcp;
 extern struct modbus_driver rtu;
 
+struct iface_modbus_opts {
+	int turnaround_delay;	/* ms */
+	int response_timeout;	/* ms, 0 keeps the libmodbus default */
+	int link_max_in_flight;	/* TCP requests pipelined per link */
+	int slave_max_in_flight;	/* TCP requests pipelined per unit */
+	int reconnect_min_delay;	/* ms, first retry */
+	int reconnect_max_delay;	/* ms, backoff cap */
+	int keepalive;			/* s, TCP keepalive idle time */
+	int liveness_interval;		/* s, TCP idle time before a probe */
+	int slave_rate;			/* transactions/s per unit, 0 = off */
+	int slave_burst;		/* transactions in a row per unit */
+};
+
+/* Transaction lanes, most urgent first */
+enum iface_modbus_priority {
+	IFACE_MODBUS_PRIORITY_COMMAND,	/* actuator writes */
+	IFACE_MODBUS_PRIORITY_REQUEST,	/* on-demand reads */
+	IFACE_MODBUS_PRIORITY_ALARM,	/* items with thresholds */
+	IFACE_MODBUS_PRIORITY_SCAN,	/* background scan */
+	IFACE_MODBUS_PRIORITIES
+};
+
+/* Tables the acquired values come from */
+enum iface_modbus_table {
+	IFACE_MODBUS_DISCRETE_INPUTS,
+	IFACE_MODBUS_HOLDING_REGISTERS
+};
+
 typedef void (*iface_modbus_connected_cb_t) (void *user_data);
 typedef void (*iface_modbus_disconnected_cb_t) (void *user_data);
+typedef void (*iface_modbus_read_cb_t) (int rc, knot_value_type *value,
+					void *user_data);
+typedef void (*iface_modbus_write_cb_t) (int rc, void *user_data);
+typedef void (*iface_modbus_image_cb_t) (int bus_id, int slave_id,
+					 enum iface_modbus_table table,
+					 int addr, int nb,
+					 const uint16_t *values,
+					 void *user_data);
 
-int iface_modbus_read_data(int reg_addr, int bit_offset, knot_value_type *out);
-int iface_modbus_start(const char *url, int slave_id,
+int iface_modbus_read_data(int bus_id, int slave_id, int reg_addr,
+			   int bit_offset, enum iface_modbus_priority priority,
+			   iface_modbus_read_cb_t read_cb, void *user_data);
+int iface_modbus_reprioritize(int bus_id, int slave_id, void *user_data,
+			      enum iface_modbus_priority priority);
+int iface_modbus_write_data(int bus_id, int slave_id, int reg_addr,
+			    int bit_offset, const knot_value_type *value,
+			    iface_modbus_write_cb_t write_cb, void *user_data);
+int iface_modbus_start(const char *url, struct iface_modbus_opts *opts,
 		       iface_modbus_connected_cb_t connected_cb,
 		       iface_modbus_disconnected_cb_t disconnected_cb,
 		       void *user_data);
-void iface_modbus_stop(void);
+void iface_modbus_stop(int bus_id, void *user_data);
+void iface_modbus_set_max_in_flight(int max);
+void iface_modbus_set_image_cb(iface_modbus_image_cb_t cb, void *user_data);
@@ -26,12 +26,19 @@
 #include <signal.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <knot/knot_protocol.h>
 #include <ell/ell.h>
 
 #include "settings.h"
 #include "device.h"
+#include "shard.h"
+
+#define THING_DEVICE_FILE	"device.conf"
+#define THING_CREDENTIALS_FILE	"credentials.conf"
 
 static int log_priority;
 
@@ -60,13 +67,65 @@ static void set_device_settings(struct device_settings *conf_files,
 	conf_files->credentials_path = l_strdup(settings->credentials_path);
 	conf_files->device_path = l_strdup(settings->device_path);
 	conf_files->cloud_path = l_strdup(settings->cloud_path);
+	conf_files->image_path = l_strdup(settings->image_path);
+}
+
+/* Each directory holding a device file is a thing, named after it */
+static int set_things_settings(struct l_queue *conf_list,
+			       struct settings *settings)
+{
+	struct device_settings *conf_files;
+	struct dirent **entries;
+	struct stat st;
+	char *device_path;
+	const char *name;
+	int n;
+	int i;
+
+	n = scandir(settings->things_path, &entries, NULL, alphasort);
+	if (n < 0)
+		return -errno;
+
+	for (i = 0; i < n; i++) {
+		name = entries[i]->d_name;
+		device_path = l_strdup_printf("%s/%s/%s",
+					      settings->things_path, name,
+					      THING_DEVICE_FILE);
+
+		if (name[0] == '.' || stat(device_path, &st) < 0 ||
+		    !S_ISREG(st.st_mode)) {
+			l_free(device_path);
+			free(entries[i]);
+			continue;
+		}
+
+		conf_files = l_new(struct device_settings, 1);
+		conf_files->device_path = device_path;
+		conf_files->credentials_path = l_strdup_printf("%s/%s/%s",
+						settings->things_path, name,
+						THING_CREDENTIALS_FILE);
+		conf_files->cloud_path = l_strdup(settings->cloud_path);
+		if (settings->image_path)
+			conf_files->image_path = l_strdup_printf("%s/%s.image",
+						settings->image_path, name);
+
+		l_queue_push_tail(conf_list, conf_files);
+		free(entries[i]);
+	}
+
+	free(entries);
+
+	return 0;
 }
 
-static void free_device_settings(struct device_settings *conf_files)
+static void free_device_settings(void *data)
 {
+	struct device_settings *conf_files = data;
+
 	l_free(conf_files->credentials_path);
 	l_free(conf_files->device_path);
 	l_free(conf_files->cloud_path);
+	l_free(conf_files->image_path);
 	l_free(conf_files);
 }
 
@@ -107,11 +166,28 @@ static void log_enable(int priority)
 		l_debug_enable("*");
 }
 
+static int start_shards(struct l_queue *conf_list, struct settings *settings)
+{
+	int err;
+
+	/* The workers must be forked by the process that stays */
+	if (settings->detach) {
+		err = detach_daemon();
+		if (err)
+			return err;
+
+		settings->detach = false;
+	}
+
+	return shard_start(conf_list, settings->workers, free_device_settings);
+}
+
 int main(int argc, char *argv[])
 {
 	struct settings *settings;
 	struct device_settings *conf_files;
-	int err;
+	struct l_queue *conf_list;
+	int err = 0;
 
 	settings = settings_load(argc, argv);
 	if (settings == NULL)
@@ -122,28 +198,60 @@ int main(int argc, char *argv[])
 		return EXIT_SUCCESS;
 	}
 
-	if (!l_main_init()) {
+	log_enable(settings->log_level);
+
+	conf_list = l_queue_new();
+
+	if (settings->things_path) {
+		err = set_things_settings(conf_list, settings);
+	} else {
+		conf_files = l_new(struct device_settings, 1);
+		set_device_settings(conf_files, settings);
+		l_queue_push_tail(conf_list, conf_files);
+	}
+
+	if (err < 0 || l_queue_isempty(conf_list)) {
+		l_error("No things found in %s", settings->things_path);
 		settings_free(settings);
+		l_queue_destroy(conf_list, free_device_settings);
 		return EXIT_FAILURE;
 	}
 
-	log_enable(settings->log_level);
+	if (settings->workers > 1 && l_queue_length(conf_list) > 1) {
+		err = start_shards(conf_list, settings);
+		if (err) {
+			settings_free(settings);
+			l_queue_destroy(conf_list, free_device_settings);
+		}
+
+		if (err < 0) {
+			l_error("Failed to start the shards: %s (%d)",
+				strerror(-err), -err);
+			return EXIT_FAILURE;
+		}
 
-	conf_files = l_new(struct device_settings, 1);
-	set_device_settings(conf_files, settings);
+		if (err > 0)
+			return shard_supervise() ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (!l_main_init()) {
+		settings_free(settings);
+		l_queue_destroy(conf_list, free_device_settings);
+		return EXIT_FAILURE;
+	}
 
 	l_info("Starting KNoT VirtualThing");
 
-	err = device_start(conf_files);
+	err = device_start(conf_list);
 	if (err) {
 		l_error("Failed to start the device: %s (%d). Exiting...",
 			strerror(-err), -err);
 		l_main_exit();
 		settings_free(settings);
-		free_device_settings(conf_files);
+		l_queue_destroy(conf_list, free_device_settings);
 		return EXIT_FAILURE;
 	}
-	free_device_settings(conf_files);
+	l_queue_destroy(conf_list, free_device_settings);
 
 	if (settings->detach) {
 		err = detach_daemon();
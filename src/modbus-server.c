@@ -0,0 +1,688 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Caching Modbus TCP server source file
+ *
+ *  Local clients read the registers the scan already acquired, so that
+ *  thingd stays the single master of the bus. Reads of discrete inputs
+ *  and holding registers are answered from the image, and only while
+ *  every value asked for is younger than the staleness bound. Clients
+ *  only name the unit, so a unit id read on several links is refused
+ *  rather than answered from the wrong slave. Writes are optionally
+ *  forwarded to the slave as commands, and answered once the slave has
+ *  replied.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <modbus/modbus.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "iface-modbus.h"
+#include "modbus-server.h"
+
+#define MBAP_HEADER_SIZE	7
+#define MBAP_LENGTH_OFFSET	4
+#define MBAP_UNIT_OFFSET	6
+#define MODBUS_TCP_MAX_PDU	253
+#define MODBUS_TCP_MAX_ADU	(MBAP_HEADER_SIZE + MODBUS_TCP_MAX_PDU)
+#define MODBUS_EXCEPTION_MASK	0x80
+#define MODBUS_ADDRESS_SPACE	0x10000
+#define READ_REQUEST_PDU_SIZE	5
+#define WRITE_RESPONSE_PDU_SIZE	5
+#define MAX_CLIENTS		16
+#define DEFAULT_ADDRESS		"127.0.0.1"
+#define DEFAULT_MAX_AGE		5000	/* ms */
+#define USEC_PER_SEC		1000000
+#define USEC_PER_MSEC		1000
+#define UNIT_AMBIGUOUS		-1
+
+/* Bit offsets of the values written through the Modbus layer */
+enum write_type {
+	WRITE_U16 = 16,
+	WRITE_U32 = 32,
+	WRITE_U64 = 64
+};
+
+struct image_cell {
+	uint16_t value;
+	uint64_t updated;	/* usec */
+};
+
+struct server_client {
+	struct modbus_server *server;
+	struct l_io *io;
+	bool closing;
+	uint8_t rx_buf[MODBUS_TCP_MAX_ADU];
+	size_t rx_len;
+};
+
+/* A forwarded write, answered once the slave replied */
+struct server_write {
+	struct modbus_server *server;	/* NULL once it stopped */
+	struct server_client *client;	/* NULL once it hung up */
+	uint8_t header[MBAP_HEADER_SIZE];
+	int bus_id;
+	uint8_t function;
+	uint16_t addr;
+	uint16_t echo;			/* value or quantity written */
+	uint16_t regs[4];
+	int nb;				/* registers */
+};
+
+struct modbus_server {
+	struct l_io *io;
+	int max_age;			/* ms */
+	bool writes;
+	/* Cells of each unit, by bus and unit, then by table and address */
+	struct l_hashmap *image;
+	/* Bus each unit is read from plus one, or UNIT_AMBIGUOUS */
+	struct l_hashmap *units;
+	struct l_queue *clients;
+	struct l_queue *pending;
+};
+
+static uint64_t time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static unsigned int unit_key(int bus_id, int unit_id)
+{
+	return bus_id << 8 | unit_id;
+}
+
+static unsigned int cell_key(enum iface_modbus_table table, int addr)
+{
+	return table << 16 | addr;
+}
+
+/* Bus a unit is served from, or -1 if it is read on none or several */
+static int unit_bus(struct modbus_server *server, int unit_id)
+{
+	int bus_id = L_PTR_TO_INT(l_hashmap_lookup(server->units,
+						   L_INT_TO_PTR(unit_id)));
+
+	return bus_id > 0 ? bus_id - 1 : -1;
+}
+
+static void image_store(struct modbus_server *server, int bus_id,
+			int unit_id, enum iface_modbus_table table, int addr,
+			int nb, const uint16_t *values)
+{
+	struct l_hashmap *cells;
+	struct image_cell *cell;
+	uint64_t now = time_now();
+	unsigned int key = unit_key(bus_id, unit_id);
+	int i;
+
+	cells = l_hashmap_lookup(server->image, L_UINT_TO_PTR(key));
+	if (!cells) {
+		cells = l_hashmap_new();
+		l_hashmap_insert(server->image, L_UINT_TO_PTR(key), cells);
+	}
+
+	for (i = 0; i < nb && addr + i < MODBUS_ADDRESS_SPACE; i++) {
+		key = cell_key(table, addr + i);
+
+		cell = l_hashmap_lookup(cells, L_UINT_TO_PTR(key));
+		if (!cell) {
+			cell = l_new(struct image_cell, 1);
+			l_hashmap_insert(cells, L_UINT_TO_PTR(key), cell);
+		}
+
+		cell->value = values[i];
+		cell->updated = now;
+	}
+}
+
+/* Returns 0 or the exception code the request must be answered with */
+static int image_read(struct modbus_server *server, int unit_id,
+		      enum iface_modbus_table table, int addr, int nb,
+		      uint16_t *values)
+{
+	struct l_hashmap *cells;
+	struct image_cell *cell;
+	uint64_t max_age = (uint64_t) server->max_age * USEC_PER_MSEC;
+	uint64_t now = time_now();
+	int bus_id;
+	int i;
+
+	bus_id = unit_bus(server, unit_id);
+	if (bus_id < 0)
+		return MODBUS_EXCEPTION_GATEWAY_PATH;
+
+	cells = l_hashmap_lookup(server->image,
+				 L_UINT_TO_PTR(unit_key(bus_id, unit_id)));
+	if (!cells)
+		return MODBUS_EXCEPTION_GATEWAY_PATH;
+
+	for (i = 0; i < nb; i++) {
+		cell = l_hashmap_lookup(cells,
+				L_UINT_TO_PTR(cell_key(table, addr + i)));
+		if (!cell)
+			return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+		/* Never hand out what the scan failed to refresh */
+		if (now - cell->updated > max_age)
+			return MODBUS_EXCEPTION_GATEWAY_TARGET;
+
+		values[i] = cell->value;
+	}
+
+	return 0;
+}
+
+static void foreach_write_detach_client(void *data, void *user_data)
+{
+	struct server_write *write = data;
+
+	if (write->client == user_data)
+		write->client = NULL;
+}
+
+static void client_free(void *data)
+{
+	struct server_client *client = data;
+
+	l_io_destroy(client->io);
+	l_free(client);
+}
+
+static void on_client_closed(void *user_data)
+{
+	client_free(user_data);
+}
+
+/* Its io is only destroyed once out of its own handler */
+static void client_close(struct server_client *client)
+{
+	struct modbus_server *server = client->server;
+
+	if (client->closing)
+		return;
+
+	client->closing = true;
+
+	l_queue_remove(server->clients, client);
+	l_queue_foreach(server->pending, foreach_write_detach_client, client);
+
+	l_idle_oneshot(on_client_closed, client, NULL);
+}
+
+static void send_frame(struct server_client *client, const uint8_t *header,
+		       const uint8_t *pdu, size_t len)
+{
+	uint8_t frame[MODBUS_TCP_MAX_ADU];
+	ssize_t n;
+
+	memcpy(frame, header, MBAP_HEADER_SIZE);
+	l_put_be16(len + 1, frame + MBAP_LENGTH_OFFSET);
+	memcpy(frame + MBAP_HEADER_SIZE, pdu, len);
+
+	if (client->closing)
+		return;
+
+	/* A torn answer would desync the stream: drop who can't keep up */
+	n = send(l_io_get_fd(client->io), frame, MBAP_HEADER_SIZE + len,
+		 MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n != (ssize_t) (MBAP_HEADER_SIZE + len))
+		client_close(client);
+}
+
+static void send_exception(struct server_client *client,
+			   const uint8_t *header, uint8_t function, int code)
+{
+	uint8_t pdu[2];
+
+	pdu[0] = function | MODBUS_EXCEPTION_MASK;
+	pdu[1] = code;
+
+	send_frame(client, header, pdu, sizeof(pdu));
+}
+
+static void handle_read(struct server_client *client, const uint8_t *header,
+			const uint8_t *pdu, size_t len)
+{
+	uint16_t values[MODBUS_MAX_READ_BITS];
+	uint8_t rsp[MODBUS_TCP_MAX_PDU];
+	enum iface_modbus_table table;
+	int unit_id = header[MBAP_UNIT_OFFSET];
+	int max_nb;
+	int addr;
+	int nb;
+	int bytes;
+	int rc;
+	int i;
+
+	if (pdu[0] == MODBUS_FC_READ_DISCRETE_INPUTS) {
+		table = IFACE_MODBUS_DISCRETE_INPUTS;
+		max_nb = MODBUS_MAX_READ_BITS;
+	} else {
+		table = IFACE_MODBUS_HOLDING_REGISTERS;
+		max_nb = MODBUS_MAX_READ_REGISTERS;
+	}
+
+	if (len != READ_REQUEST_PDU_SIZE) {
+		send_exception(client, header, pdu[0],
+			       MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	addr = l_get_be16(pdu + 1);
+	nb = l_get_be16(pdu + 3);
+
+	if (nb < 1 || nb > max_nb) {
+		send_exception(client, header, pdu[0],
+			       MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	if (addr + nb > MODBUS_ADDRESS_SPACE) {
+		send_exception(client, header, pdu[0],
+			       MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+		return;
+	}
+
+	rc = image_read(client->server, unit_id, table, addr, nb, values);
+	if (rc) {
+		send_exception(client, header, pdu[0], rc);
+		return;
+	}
+
+	if (table == IFACE_MODBUS_DISCRETE_INPUTS) {
+		bytes = (nb + 7) / 8;
+		memset(rsp + 2, 0, bytes);
+		for (i = 0; i < nb; i++)
+			rsp[2 + i / 8] |= (values[i] ? 1 : 0) << (i % 8);
+	} else {
+		bytes = nb * 2;
+		for (i = 0; i < nb; i++)
+			l_put_be16(values[i], rsp + 2 + i * 2);
+	}
+
+	rsp[0] = pdu[0];
+	rsp[1] = bytes;
+
+	send_frame(client, header, rsp, 2 + bytes);
+}
+
+static int exception_code(int rc)
+{
+	/* libmodbus errno encoding of the slave's own exceptions */
+	if (-rc > MODBUS_ENOBASE &&
+	    -rc < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)
+		return -rc - MODBUS_ENOBASE;
+
+	if (rc == -ETIMEDOUT || rc == -EHOSTUNREACH)
+		return MODBUS_EXCEPTION_GATEWAY_TARGET;
+
+	if (rc == -ENOTCONN || rc == -ENODEV)
+		return MODBUS_EXCEPTION_GATEWAY_PATH;
+
+	return MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+}
+
+static void on_write_done(int rc, void *user_data)
+{
+	struct server_write *write = user_data;
+	uint8_t rsp[WRITE_RESPONSE_PDU_SIZE];
+
+	if (write->server) {
+		l_queue_remove(write->server->pending, write);
+
+		/* The slave holds what was written now */
+		if (rc >= 0)
+			image_store(write->server, write->bus_id,
+				    write->header[MBAP_UNIT_OFFSET],
+				    IFACE_MODBUS_HOLDING_REGISTERS,
+				    write->addr, write->nb, write->regs);
+	}
+
+	if (!write->client) {
+		l_free(write);
+		return;
+	}
+
+	if (rc < 0) {
+		send_exception(write->client, write->header, write->function,
+			       exception_code(rc));
+		l_free(write);
+		return;
+	}
+
+	/* Single writes are echoed, multiple ones report the quantity */
+	rsp[0] = write->function;
+	l_put_be16(write->addr, rsp + 1);
+	l_put_be16(write->echo, rsp + 3);
+
+	send_frame(write->client, write->header, rsp, sizeof(rsp));
+	l_free(write);
+}
+
+/* Returns the bit offset of the value, or the exception code negated */
+static int parse_write(const uint8_t *pdu, size_t len,
+		       struct server_write *write, knot_value_type *value)
+{
+	int bytes;
+	int i;
+
+	if (len < 5)
+		return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+	write->function = pdu[0];
+	write->addr = l_get_be16(pdu + 1);
+	write->echo = l_get_be16(pdu + 3);
+
+	switch (pdu[0]) {
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		if (len != 5)
+			return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+		write->nb = 1;
+		write->regs[0] = write->echo;
+		memcpy(value, write->regs, sizeof(write->regs));
+		return WRITE_U16;
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		bytes = write->echo * 2;
+		if ((write->echo != 1 && write->echo != 2 &&
+		     write->echo != 4) || len != 6U + bytes ||
+		    pdu[5] != bytes)
+			return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+		write->nb = write->echo;
+		for (i = 0; i < write->nb; i++)
+			write->regs[i] = l_get_be16(pdu + 6 + i * 2);
+		memcpy(value, write->regs, sizeof(write->regs));
+		return write->nb * WRITE_U16;
+	default:
+		return -MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+	}
+}
+
+static void handle_write(struct server_client *client, const uint8_t *header,
+			 const uint8_t *pdu, size_t len)
+{
+	struct modbus_server *server = client->server;
+	struct server_write *write;
+	knot_value_type value;
+	int unit_id = header[MBAP_UNIT_OFFSET];
+	int bus_id;
+	int rc;
+
+	if (!server->writes) {
+		send_exception(client, header, pdu[0],
+			       MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+		return;
+	}
+
+	/* Written on the link the unit is read from */
+	bus_id = unit_bus(server, unit_id);
+	if (bus_id < 0) {
+		send_exception(client, header, pdu[0],
+			       MODBUS_EXCEPTION_GATEWAY_PATH);
+		return;
+	}
+
+	write = l_new(struct server_write, 1);
+	memset(&value, 0, sizeof(value));
+
+	rc = parse_write(pdu, len, write, &value);
+	if (rc < 0) {
+		send_exception(client, header, pdu[0], -rc);
+		l_free(write);
+		return;
+	}
+
+	write->server = server;
+	write->client = client;
+	write->bus_id = bus_id;
+	memcpy(write->header, header, MBAP_HEADER_SIZE);
+
+	rc = iface_modbus_write_data(bus_id, unit_id, write->addr, rc, &value,
+				     on_write_done, write);
+	if (rc < 0) {
+		send_exception(client, header, pdu[0], exception_code(rc));
+		l_free(write);
+		return;
+	}
+
+	l_queue_push_tail(server->pending, write);
+}
+
+static void handle_frame(struct server_client *client, const uint8_t *frame,
+			 size_t len)
+{
+	const uint8_t *pdu = frame + MBAP_HEADER_SIZE;
+	size_t pdu_len = len - MBAP_HEADER_SIZE;
+
+	switch (pdu[0]) {
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+		handle_read(client, frame, pdu, pdu_len);
+		break;
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		handle_write(client, frame, pdu, pdu_len);
+		break;
+	default:
+		/* Only what the scan acquires can be served */
+		send_exception(client, frame, pdu[0],
+			       MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+		break;
+	}
+}
+
+static bool on_client_read(struct l_io *io, void *user_data)
+{
+	struct server_client *client = user_data;
+	size_t frame_len;
+	uint16_t length;
+	ssize_t n;
+
+	n = read(l_io_get_fd(io), client->rx_buf + client->rx_len,
+		 sizeof(client->rx_buf) - client->rx_len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return true;
+
+	if (n <= 0) {
+		client_close(client);
+		return false;
+	}
+
+	client->rx_len += n;
+
+	while (client->rx_len >= MBAP_HEADER_SIZE) {
+		/* Length field counts the unit identifier and the PDU */
+		length = l_get_be16(client->rx_buf + MBAP_LENGTH_OFFSET);
+		if (length < 2 || length > MODBUS_TCP_MAX_PDU + 1) {
+			client_close(client);
+			return false;
+		}
+
+		frame_len = MBAP_UNIT_OFFSET + length;
+		if (client->rx_len < frame_len)
+			break;
+
+		handle_frame(client, client->rx_buf, frame_len);
+		if (client->closing)
+			return false;
+
+		client->rx_len -= frame_len;
+		memmove(client->rx_buf, client->rx_buf + frame_len,
+			client->rx_len);
+	}
+
+	return true;
+}
+
+static void on_client_disconnect(struct l_io *io, void *user_data)
+{
+	client_close(user_data);
+}
+
+static bool on_server_accept(struct l_io *io, void *user_data)
+{
+	struct modbus_server *server = user_data;
+	struct server_client *client;
+	int fd;
+
+	fd = accept(l_io_get_fd(io), NULL, NULL);
+	if (fd < 0)
+		return true;
+
+	if (l_queue_length(server->clients) >= MAX_CLIENTS) {
+		close(fd);
+		return true;
+	}
+
+	client = l_new(struct server_client, 1);
+	client->server = server;
+	client->io = l_io_new(fd);
+	l_io_set_close_on_destroy(client->io, true);
+	l_io_set_read_handler(client->io, on_client_read, client, NULL);
+	l_io_set_disconnect_handler(client->io, on_client_disconnect, client,
+				    NULL);
+
+	l_queue_push_tail(server->clients, client);
+
+	return true;
+}
+
+/*
+ * Listens on a numeric address, loopback if NULL: clients are not
+ * authenticated. max_age in ms (0 for the default).
+ */
+struct modbus_server *modbus_server_start(const char *address, int port,
+					  int max_age, bool writes)
+{
+	struct modbus_server *server;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char service[6];
+	int enable = 1;
+	int fd;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+
+	snprintf(service, sizeof(service), "%d", port);
+
+	if (getaddrinfo(address ? address : DEFAULT_ADDRESS, service, &hints,
+			&res)) {
+		errno = EADDRNOTAVAIL;
+		return NULL;
+	}
+
+	fd = socket(res->ai_family,
+		    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		freeaddrinfo(res);
+		return NULL;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 ||
+	    listen(fd, MAX_CLIENTS) < 0) {
+		err = errno;
+		freeaddrinfo(res);
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	freeaddrinfo(res);
+
+	server = l_new(struct modbus_server, 1);
+	server->max_age = max_age > 0 ? max_age : DEFAULT_MAX_AGE;
+	server->writes = writes;
+	server->image = l_hashmap_new();
+	server->units = l_hashmap_new();
+	server->clients = l_queue_new();
+	server->pending = l_queue_new();
+
+	server->io = l_io_new(fd);
+	l_io_set_close_on_destroy(server->io, true);
+	l_io_set_read_handler(server->io, on_server_accept, server, NULL);
+
+	return server;
+}
+
+static void image_unit_free(void *data)
+{
+	l_hashmap_destroy(data, l_free);
+}
+
+static void write_detach(void *data)
+{
+	struct server_write *write = data;
+
+	/* Freed when the slave replies */
+	write->server = NULL;
+	write->client = NULL;
+}
+
+void modbus_server_stop(struct modbus_server *server)
+{
+	if (!server)
+		return;
+
+	l_io_destroy(server->io);
+
+	l_queue_destroy(server->pending, write_detach);
+	l_queue_destroy(server->clients, client_free);
+	l_hashmap_destroy(server->units, NULL);
+	l_hashmap_destroy(server->image, image_unit_free);
+	l_free(server);
+}
+
+void modbus_server_update(struct modbus_server *server, int bus_id,
+			  int unit_id, enum iface_modbus_table table,
+			  int addr, int nb, const uint16_t *values)
+{
+	int served = L_PTR_TO_INT(l_hashmap_lookup(server->units,
+						   L_INT_TO_PTR(unit_id)));
+
+	/* A unit id clients cannot tell apart is not served at all */
+	if (!served) {
+		l_hashmap_insert(server->units, L_INT_TO_PTR(unit_id),
+				 L_INT_TO_PTR(bus_id + 1));
+	} else if (served != UNIT_AMBIGUOUS && served != bus_id + 1) {
+		l_warn("Unit %d is read on several links, not serving it",
+		       unit_id);
+		l_hashmap_replace(server->units, L_INT_TO_PTR(unit_id),
+				  L_INT_TO_PTR(UNIT_AMBIGUOUS), NULL);
+	}
+
+	image_store(server, bus_id, unit_id, table, addr, nb, values);
+}
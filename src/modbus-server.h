@@ -0,0 +1,28 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Caching Modbus TCP server header file
+ */
+
+struct modbus_server;
+
+struct modbus_server *modbus_server_start(const char *address, int port,
+					  int max_age, bool writes);
+void modbus_server_stop(struct modbus_server *server);
+void modbus_server_update(struct modbus_server *server, int bus_id,
+			  int unit_id, enum iface_modbus_table table,
+			  int addr, int nb, const uint16_t *values);
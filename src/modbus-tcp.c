@@ -0,0 +1,404 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Non-blocking Modbus TCP client source file
+ *
+ *  Requests are framed with a MBAP header and written right away, so
+ *  several transactions can be in flight on the same connection. Replies
+ *  are matched back to their request by transaction identifier; replies
+ *  that arrive after their request timed out are dropped.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <modbus/modbus.h>
+#include <ell/ell.h>
+
+#include "modbus-tcp.h"
+
+#define MBAP_HEADER_SIZE		7
+#define MBAP_LENGTH_OFFSET		4
+#define MBAP_UNIT_OFFSET		6
+#define MODBUS_TCP_MAX_PDU		253
+#define MODBUS_TCP_MAX_ADU		(MBAP_HEADER_SIZE + MODBUS_TCP_MAX_PDU)
+#define MODBUS_EXCEPTION_MASK		0x80
+#define CONNECT_TIMEOUT			3
+#define DEFAULT_RESPONSE_TIMEOUT	500
+#define KEEPALIVE_PROBES		3
+
+struct tcp_transaction {
+	struct modbus_tcp *tcp;
+	uint16_t id;
+	struct l_timeout *to;
+	modbus_tcp_response_cb_t response_cb;
+	void *user_data;
+};
+
+struct modbus_tcp {
+	char *hostname;
+	char *port;
+	int response_timeout;	/* ms */
+	int keepalive;		/* s, 0 keeps the system defaults */
+	struct l_io *io;
+	struct l_timeout *connect_to;
+	bool connected;
+	uint16_t next_id;
+	struct l_queue *transactions;
+	uint8_t rx_buf[MODBUS_TCP_MAX_ADU];
+	size_t rx_len;
+	modbus_tcp_connect_cb_t connect_cb;
+	modbus_tcp_disconnect_cb_t disconnect_cb;
+	void *user_data;
+};
+
+static bool transaction_match_id(const void *a, const void *b)
+{
+	const struct tcp_transaction *trans = a;
+	uint16_t id = L_PTR_TO_UINT(b);
+
+	return trans->id == id;
+}
+
+static void transaction_complete(struct tcp_transaction *trans, int rc,
+				 const uint8_t *pdu)
+{
+	l_timeout_remove(trans->to);
+	trans->response_cb(rc, pdu, trans->user_data);
+	l_free(trans);
+}
+
+static void fail_transactions(struct modbus_tcp *tcp, int err)
+{
+	struct tcp_transaction *trans;
+
+	while ((trans = l_queue_pop_head(tcp->transactions)))
+		transaction_complete(trans, err, NULL);
+}
+
+static void on_transaction_timeout(struct l_timeout *to, void *user_data)
+{
+	struct tcp_transaction *trans = user_data;
+
+	l_queue_remove(trans->tcp->transactions, trans);
+	transaction_complete(trans, -ETIMEDOUT, NULL);
+}
+
+static void handle_frame(struct modbus_tcp *tcp, const uint8_t *frame,
+			 size_t len)
+{
+	struct tcp_transaction *trans;
+	const uint8_t *pdu = frame + MBAP_HEADER_SIZE;
+	size_t pdu_len = len - MBAP_HEADER_SIZE;
+	uint16_t id = l_get_be16(frame);
+	int rc;
+
+	trans = l_queue_remove_if(tcp->transactions, transaction_match_id,
+				  L_UINT_TO_PTR(id));
+	if (!trans) {
+		l_debug("Dropping late reply %u from %s", id, tcp->hostname);
+		return;
+	}
+
+	if (pdu[0] & MODBUS_EXCEPTION_MASK)
+		/* Same errno encoding libmodbus uses for exceptions */
+		rc = pdu_len < 2 ? -EMBBADEXC : -(MODBUS_ENOBASE + pdu[1]);
+	else
+		rc = pdu_len;
+
+	transaction_complete(trans, rc, rc < 0 ? NULL : pdu);
+}
+
+static void handle_disconnect(struct modbus_tcp *tcp)
+{
+	if (!tcp->connected)
+		return;
+
+	tcp->connected = false;
+	fail_transactions(tcp, -ECONNRESET);
+
+	if (tcp->disconnect_cb)
+		tcp->disconnect_cb(tcp->user_data);
+}
+
+static bool on_io_read(struct l_io *io, void *user_data)
+{
+	struct modbus_tcp *tcp = user_data;
+	size_t frame_len;
+	uint16_t length;
+	ssize_t n;
+
+	n = read(l_io_get_fd(io), tcp->rx_buf + tcp->rx_len,
+		 sizeof(tcp->rx_buf) - tcp->rx_len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return true;
+
+	if (n <= 0) {
+		handle_disconnect(tcp);
+		return false;
+	}
+
+	tcp->rx_len += n;
+
+	while (tcp->rx_len >= MBAP_HEADER_SIZE) {
+		/* Length field counts the unit identifier and the PDU */
+		length = l_get_be16(tcp->rx_buf + MBAP_LENGTH_OFFSET);
+		if (length < 2 || length > MODBUS_TCP_MAX_PDU + 1) {
+			l_error("Invalid MBAP header from %s", tcp->hostname);
+			tcp->rx_len = 0;
+			break;
+		}
+
+		frame_len = MBAP_UNIT_OFFSET + length;
+		if (tcp->rx_len < frame_len)
+			break;
+
+		handle_frame(tcp, tcp->rx_buf, frame_len);
+
+		tcp->rx_len -= frame_len;
+		memmove(tcp->rx_buf, tcp->rx_buf + frame_len, tcp->rx_len);
+	}
+
+	return true;
+}
+
+static void on_io_disconnect(struct l_io *io, void *user_data)
+{
+	handle_disconnect(user_data);
+}
+
+static void connect_done(struct modbus_tcp *tcp, int err)
+{
+	l_timeout_remove(tcp->connect_to);
+	tcp->connect_to = NULL;
+
+	if (!err) {
+		tcp->connected = true;
+		tcp->rx_len = 0;
+		l_io_set_read_handler(tcp->io, on_io_read, tcp, NULL);
+		l_io_set_disconnect_handler(tcp->io, on_io_disconnect, tcp,
+					    NULL);
+	}
+
+	tcp->connect_cb(err, tcp->user_data);
+}
+
+static bool on_connect_ready(struct l_io *io, void *user_data)
+{
+	struct modbus_tcp *tcp = user_data;
+	socklen_t len;
+	int err = 0;
+
+	len = sizeof(err);
+	if (getsockopt(l_io_get_fd(io), SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	connect_done(tcp, -err);
+
+	return false;
+}
+
+static void on_connect_timeout(struct l_timeout *to, void *user_data)
+{
+	struct modbus_tcp *tcp = user_data;
+
+	l_io_set_write_handler(tcp->io, NULL, NULL, NULL);
+	connect_done(tcp, -ETIMEDOUT);
+}
+
+struct modbus_tcp *modbus_tcp_new(const char *hostname, const char *port,
+				  int response_timeout)
+{
+	struct modbus_tcp *tcp;
+
+	tcp = l_new(struct modbus_tcp, 1);
+	tcp->hostname = l_strdup(hostname);
+	tcp->port = l_strdup(port);
+	tcp->response_timeout = response_timeout > 0 ? response_timeout :
+						DEFAULT_RESPONSE_TIMEOUT;
+	tcp->transactions = l_queue_new();
+
+	return tcp;
+}
+
+void modbus_tcp_set_keepalive(struct modbus_tcp *tcp, int idle)
+{
+	tcp->keepalive = idle;
+}
+
+static void set_keepalive(struct modbus_tcp *tcp, int fd)
+{
+	int enable = 1;
+	int idle = tcp->keepalive;
+	int count = KEEPALIVE_PROBES;
+	unsigned int user_timeout;
+
+	if (idle <= 0)
+		return;
+
+	/*
+	 * A peer that went away without a FIN is noticed after
+	 * idle + count * idle seconds. Unacknowledged requests are bounded
+	 * by the same time through TCP_USER_TIMEOUT.
+	 */
+	user_timeout = (idle + count * idle) * 1000;
+
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+	setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout,
+		   sizeof(user_timeout));
+}
+
+void modbus_tcp_free(struct modbus_tcp *tcp)
+{
+	if (!tcp)
+		return;
+
+	modbus_tcp_close(tcp);
+
+	l_queue_destroy(tcp->transactions, NULL);
+	l_free(tcp->hostname);
+	l_free(tcp->port);
+	l_free(tcp);
+}
+
+int modbus_tcp_connect(struct modbus_tcp *tcp,
+		       modbus_tcp_connect_cb_t connect_cb,
+		       modbus_tcp_disconnect_cb_t disconnect_cb,
+		       void *user_data)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	int enable = 1;
+	int fd = -1;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	err = getaddrinfo(tcp->hostname, tcp->port, &hints, &res);
+	if (err) {
+		l_error("Can't resolve %s: %s", tcp->hostname,
+			gai_strerror(err));
+		return -EHOSTUNREACH;
+	}
+
+	err = -ENOTCONN;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family,
+			    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			continue;
+
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen) ||
+		    errno == EINPROGRESS)
+			break;
+
+		err = -errno;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd < 0)
+		return err;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	set_keepalive(tcp, fd);
+
+	tcp->io = l_io_new(fd);
+	l_io_set_close_on_destroy(tcp->io, true);
+
+	tcp->connect_cb = connect_cb;
+	tcp->disconnect_cb = disconnect_cb;
+	tcp->user_data = user_data;
+
+	l_io_set_write_handler(tcp->io, on_connect_ready, tcp, NULL);
+	tcp->connect_to = l_timeout_create(CONNECT_TIMEOUT, on_connect_timeout,
+					   tcp, NULL);
+
+	return 0;
+}
+
+void modbus_tcp_close(struct modbus_tcp *tcp)
+{
+	tcp->connected = false;
+
+	l_timeout_remove(tcp->connect_to);
+	tcp->connect_to = NULL;
+
+	l_io_destroy(tcp->io);
+	tcp->io = NULL;
+
+	fail_transactions(tcp, -ENOTCONN);
+}
+
+int modbus_tcp_send(struct modbus_tcp *tcp, int unit_id, const uint8_t *pdu,
+		    size_t len, modbus_tcp_response_cb_t response_cb,
+		    void *user_data)
+{
+	struct tcp_transaction *trans;
+	uint8_t adu[MODBUS_TCP_MAX_ADU];
+	ssize_t n;
+
+	if (!tcp->connected)
+		return -ENOTCONN;
+
+	if (!len || len > MODBUS_TCP_MAX_PDU)
+		return -EINVAL;
+
+	trans = l_new(struct tcp_transaction, 1);
+	trans->tcp = tcp;
+	trans->id = tcp->next_id++;
+	trans->response_cb = response_cb;
+	trans->user_data = user_data;
+
+	l_put_be16(trans->id, adu);
+	l_put_be16(0, adu + 2);
+	l_put_be16(len + 1, adu + MBAP_LENGTH_OFFSET);
+	adu[MBAP_UNIT_OFFSET] = unit_id;
+	memcpy(adu + MBAP_HEADER_SIZE, pdu, len);
+
+	n = send(l_io_get_fd(tcp->io), adu, MBAP_HEADER_SIZE + len,
+		 MSG_NOSIGNAL);
+	if (n != (ssize_t) (MBAP_HEADER_SIZE + len)) {
+		/* A partial frame desynchronizes the stream: drop the link */
+		if (n >= 0)
+			shutdown(l_io_get_fd(tcp->io), SHUT_RDWR);
+
+		l_free(trans);
+		return n < 0 ? -errno : -EIO;
+	}
+
+	trans->to = l_timeout_create_ms(tcp->response_timeout,
+					on_transaction_timeout, trans, NULL);
+	l_queue_push_tail(tcp->transactions, trans);
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Non-blocking Modbus TCP client header file
+ */
+
+struct modbus_tcp;
+
+typedef void (*modbus_tcp_connect_cb_t) (int err, void *user_data);
+typedef void (*modbus_tcp_disconnect_cb_t) (void *user_data);
+typedef void (*modbus_tcp_response_cb_t) (int rc, const uint8_t *pdu,
+					  void *user_data);
+
+struct modbus_tcp *modbus_tcp_new(const char *hostname, const char *port,
+				  int response_timeout);
+void modbus_tcp_free(struct modbus_tcp *tcp);
+void modbus_tcp_set_keepalive(struct modbus_tcp *tcp, int idle);
+
+int modbus_tcp_connect(struct modbus_tcp *tcp,
+		       modbus_tcp_connect_cb_t connect_cb,
+		       modbus_tcp_disconnect_cb_t disconnect_cb,
+		       void *user_data);
+void modbus_tcp_close(struct modbus_tcp *tcp);
+
+int modbus_tcp_send(struct modbus_tcp *tcp, int unit_id, const uint8_t *pdu,
+		    size_t len, modbus_tcp_response_cb_t response_cb,
+		    void *user_data);
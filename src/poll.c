@@ -15,61 +15,357 @@
  */
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <ell/util.h>
+#include <ell/log.h>
 #include <ell/queue.h>
 #include <ell/timeout.h>
 
 #include "poll.h"
 
-struct poll_data {
+#define USEC_PER_SEC 1000000
+#define MSEC_PER_SEC 1000
+/* Weight of the newest sample in the change rate moving average */
+#define RATE_ALPHA 0.25
+/* Samples taken per observed change */
+#define RATE_OVERSAMPLING 2.0
+
+/* Items sampled together, in a single burst */
+struct poll_class {
 	int id;
-	int interval;
-	poll_read_cb_t read_cb;
+	int countdown;		/* ms */
+	unsigned int outstanding;
+	uint64_t stamp;		/* usec, when the burst started */
+	poll_class_cb_t done_cb;
 };
 
 struct poll_entry {
-	struct poll_data *data;
-	struct l_timeout *to;
+	int id;
+	int interval;		/* ms */
+	int countdown;		/* ms */
+	bool pending;
+	bool on_demand;		/* read by its user, never scanned */
+	uint64_t last_read;	/* usec */
+	double rate;		/* changes and events per second */
+	struct poll_adaptive *adaptive;	/* NULL for a fixed interval */
+	struct poll_class *class;
+	poll_read_cb_t read_cb;
+};
+
+struct poll_cycle {
+	uint64_t start;
+	unsigned int outstanding;
+	unsigned int reads;
+	unsigned int failures;
+	unsigned int overruns;
+};
+
+/* Pacing of a group of entries, each group within its own budget */
+struct poll_adaptive {
+	int group;
+	int min_interval;	/* ms */
+	int max_interval;	/* ms */
+	int budget;		/* reads per second, 0 for unbounded */
+};
+
+struct poll_budget {
+	struct poll_adaptive *adaptive;
+	double floor;
+	double ceil;
+	double sum;
+	double sum_floor;
+	double scale;
 };
 
 struct l_queue *poll_entries;
+static struct l_queue *poll_classes;
+static struct l_queue *poll_adaptives;
 bool active;
 
-static void on_poll_timeout(struct l_timeout *to, void *user_data)
+static struct l_timeout *cycle_to;
+static struct poll_cycle cycle;
+static int cycle_period;	/* ms */
+
+static uint64_t time_now(void)
 {
-	struct poll_data *data;
+	struct timespec ts;
 
-	if (!active)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static bool entry_match_id(const void *a, const void *b)
+{
+	const struct poll_entry *entry = a;
+	int id = L_PTR_TO_INT(b);
+
+	return entry->id == id;
+}
+
+static bool adaptive_match_group(const void *a, const void *b)
+{
+	const struct poll_adaptive *adaptive = a;
+	int group = L_PTR_TO_INT(b);
+
+	return adaptive->group == group;
+}
+
+static bool class_match_id(const void *a, const void *b)
+{
+	const struct poll_class *class = a;
+	int id = L_PTR_TO_INT(b);
+
+	return class->id == id;
+}
+
+static double entry_frequency(struct poll_entry *entry,
+			      struct poll_budget *budget)
+{
+	double freq = entry->rate * RATE_OVERSAMPLING;
+
+	if (freq < budget->floor)
+		return budget->floor;
+
+	if (freq > budget->ceil)
+		return budget->ceil;
+
+	return freq;
+}
+
+static void entry_sum_frequency(void *data, void *user_data)
+{
+	struct poll_entry *entry = data;
+	struct poll_budget *budget = user_data;
+
+	if (entry->on_demand || entry->adaptive != budget->adaptive)
 		return;
 
-	data = (struct poll_data *) user_data;
-	data->read_cb(data->id);
+	budget->sum += entry_frequency(entry, budget);
+	budget->sum_floor += budget->floor;
+}
+
+static void entry_set_frequency(void *data, void *user_data)
+{
+	struct poll_entry *entry = data;
+	struct poll_budget *budget = user_data;
+	struct poll_adaptive *adaptive = budget->adaptive;
+	double freq;
+
+	if (entry->adaptive != adaptive)
+		return;
 
-	l_timeout_modify(to, data->interval);
+	/* Above the floor, items share what is left in the budget */
+	freq = entry_frequency(entry, budget);
+	freq = budget->floor + (freq - budget->floor) * budget->scale;
+
+	entry->interval = MSEC_PER_SEC / freq;
+	if (entry->interval < adaptive->min_interval)
+		entry->interval = adaptive->min_interval;
+	else if (entry->interval > adaptive->max_interval)
+		entry->interval = adaptive->max_interval;
+
+	/* Speeding up takes effect right away */
+	if (entry->countdown > entry->interval)
+		entry->countdown = entry->interval;
 }
 
-static void entry_destroy(void *user_data)
+static void rebalance(void *data, void *user_data)
 {
-	struct poll_entry *entry;
+	struct poll_adaptive *adaptive = data;
+	struct poll_budget budget;
 
-	entry = (struct poll_entry *) user_data;
-	l_timeout_remove(entry->to);
-	l_free(entry);
+	memset(&budget, 0, sizeof(budget));
+	budget.adaptive = adaptive;
+	budget.floor = (double) MSEC_PER_SEC / adaptive->max_interval;
+	budget.ceil = (double) MSEC_PER_SEC / adaptive->min_interval;
+	budget.scale = 1.0;
+
+	l_queue_foreach(poll_entries, entry_sum_frequency, &budget);
+
+	if (adaptive->budget && budget.sum > adaptive->budget) {
+		if (adaptive->budget > budget.sum_floor)
+			budget.scale = (adaptive->budget - budget.sum_floor) /
+				(budget.sum - budget.sum_floor);
+		else
+			budget.scale = 0;
+	}
+
+	l_queue_foreach(poll_entries, entry_set_frequency, &budget);
 }
 
-static void poll_timer_start(void *data, void *user_data)
+static void cycle_end(void)
 {
-	struct poll_entry *entry;
+	l_debug("Scan cycle: %u reads, %u failed, %u overrun in %llu ms",
+		cycle.reads, cycle.failures, cycle.overruns,
+		(unsigned long long) (time_now() - cycle.start) / 1000);
+
+	l_queue_foreach(poll_adaptives, rebalance, NULL);
+}
 
-	entry = (struct poll_entry *) data;
+static void entry_update_rate(struct poll_entry *entry, unsigned int flags)
+{
+	uint64_t now = time_now();
+	double activity = 0;
+	double elapsed;
+
+	if (flags & POLL_READ_CHANGED)
+		activity++;
+	if (flags & POLL_READ_EVENT)
+		activity++;
+
+	if (entry->last_read && now > entry->last_read) {
+		elapsed = (double) (now - entry->last_read) / USEC_PER_SEC;
+		entry->rate = RATE_ALPHA * activity / elapsed +
+			(1 - RATE_ALPHA) * entry->rate;
+	}
 
-	l_timeout_modify(entry->to, entry->data->interval);
+	entry->last_read = now;
+}
+
+static bool entry_read(struct poll_entry *entry)
+{
+	int rc;
+
+	/* Still waiting on the previous cycle: do not pile up reads */
+	if (entry->pending) {
+		cycle.overruns++;
+		return false;
+	}
+
+	cycle.reads++;
+
+	rc = entry->read_cb(entry->id);
+	if (rc == -EALREADY) {
+		/* Already being read on behalf of someone else */
+		cycle.overruns++;
+		return false;
+	} else if (rc < 0) {
+		cycle.failures++;
+		return false;
+	}
+
+	entry->pending = true;
+	cycle.outstanding++;
+
+	return true;
+}
+
+static void scatter_entry(void *data, void *user_data)
+{
+	struct poll_entry *entry = data;
+
+	if (entry->on_demand || entry->class)
+		return;
+
+	entry->countdown -= cycle_period;
+	if (entry->countdown > 0)
+		return;
+
+	entry->countdown = entry->interval;
+
+	entry_read(entry);
+}
+
+static int class_interval(struct poll_class *class)
+{
+	const struct l_queue_entry *entry;
+	struct poll_entry *poll;
+	int interval = 0;
+
+	/* A class is sampled at the pace of its fastest item */
+	for (entry = l_queue_get_entries(poll_entries); entry;
+	     entry = entry->next) {
+		poll = entry->data;
+
+		if (poll->class != class)
+			continue;
+
+		if (!interval || poll->interval < interval)
+			interval = poll->interval;
+	}
+
+	return interval;
+}
+
+static void scatter_class(void *data, void *user_data)
+{
+	struct poll_class *class = data;
+	const struct l_queue_entry *entry;
+	struct poll_entry *poll;
+
+	class->countdown -= cycle_period;
+	if (class->countdown > 0)
+		return;
+
+	class->countdown = class_interval(class);
+
+	/* Skipping a whole burst keeps the set coherent */
+	if (class->outstanding) {
+		cycle.overruns++;
+		return;
+	}
+
+	class->stamp = time_now();
+
+	for (entry = l_queue_get_entries(poll_entries); entry;
+	     entry = entry->next) {
+		poll = entry->data;
+
+		if (poll->class == class && entry_read(poll))
+			class->outstanding++;
+	}
+}
+
+static void on_cycle_timeout(struct l_timeout *to, void *user_data)
+{
+	if (!active)
+		return;
+
+	/* A new scan starts: the late reads count towards this one */
+	cycle.start = time_now();
+	cycle.reads = 0;
+	cycle.failures = 0;
+	cycle.overruns = 0;
+
+	l_queue_foreach(poll_entries, scatter_entry, NULL);
+	l_queue_foreach(poll_classes, scatter_class, NULL);
+
+	if (!cycle.outstanding)
+		cycle_end();
+
+	l_timeout_modify_ms(to, cycle_period);
+}
+
+static void entry_reset(void *data, void *user_data)
+{
+	struct poll_entry *entry = data;
+
+	entry->countdown = 0;
+	entry->pending = false;
+	entry->last_read = 0;
+}
+
+static void class_reset(void *data, void *user_data)
+{
+	struct poll_class *class = data;
+
+	class->countdown = 0;
+	class->outstanding = 0;
 }
 
 void poll_start(void)
 {
 	active = true;
-	l_queue_foreach(poll_entries, poll_timer_start, NULL);
+
+	memset(&cycle, 0, sizeof(cycle));
+	l_queue_foreach(poll_entries, entry_reset, NULL);
+	l_queue_foreach(poll_classes, class_reset, NULL);
+
+	if (cycle_to)
+		l_timeout_modify_ms(cycle_to, cycle_period);
 }
 
 void poll_stop(void)
@@ -77,24 +373,152 @@ void poll_stop(void)
 	active = false;
 }
 
-int poll_create(int interval, int id, poll_read_cb_t read_cb)
+void poll_read_complete(int id, int rc, unsigned int flags)
+{
+	struct poll_entry *entry;
+
+	entry = l_queue_find(poll_entries, entry_match_id, L_INT_TO_PTR(id));
+	if (!entry || !entry->pending)
+		return;
+
+	entry->pending = false;
+
+	if (rc < 0)
+		cycle.failures++;
+	else if (entry->adaptive)
+		entry_update_rate(entry, flags);
+
+	/* The last read of a burst hands the sample set over */
+	if (entry->class && entry->class->outstanding &&
+	    --entry->class->outstanding == 0)
+		entry->class->done_cb(entry->class->id, entry->class->stamp);
+
+	if (cycle.outstanding && --cycle.outstanding == 0)
+		cycle_end();
+}
+
+void poll_set_on_demand(int id, bool on_demand)
 {
 	struct poll_entry *entry;
-	struct poll_data *data;
-	struct l_timeout *to;
 
-	data = l_new(struct poll_data, 1);
-	data->id = id;
-	data->read_cb = read_cb;
-	data->interval = interval;
+	entry = l_queue_find(poll_entries, entry_match_id, L_INT_TO_PTR(id));
+	if (!entry)
+		return;
+
+	entry->on_demand = on_demand;
+	entry->countdown = 0;
+}
+
+int poll_set_scan_class(int id, int scan_class, poll_class_cb_t done_cb)
+{
+	struct poll_entry *entry;
+	struct poll_class *class;
+
+	entry = l_queue_find(poll_entries, entry_match_id, L_INT_TO_PTR(id));
+	if (!entry)
+		return -ENOENT;
+
+	/* A read counted in the old burst must not hold it forever */
+	if (entry->pending && entry->class &&
+	    entry->class->id != scan_class)
+		poll_read_complete(id, -ECANCELED, 0);
+
+	if (scan_class <= 0) {
+		entry->class = NULL;
+		return 0;
+	}
+
+	if (!done_cb)
+		return -EINVAL;
 
-	to = l_timeout_create(0, on_poll_timeout, data, l_free);
-	if (!to)
-		return -ENOMSG;
+	if (!poll_classes)
+		poll_classes = l_queue_new();
+
+	class = l_queue_find(poll_classes, class_match_id,
+			     L_INT_TO_PTR(scan_class));
+	if (!class) {
+		class = l_new(struct poll_class, 1);
+		class->id = scan_class;
+		class->done_cb = done_cb;
+		l_queue_push_tail(poll_classes, class);
+	}
+
+	entry->class = class;
+
+	return 0;
+}
+
+/* Entries of the group created from now on are paced adaptively */
+int poll_set_adaptive(int group, int min_interval, int max_interval,
+		      int budget)
+{
+	struct poll_adaptive *adaptive;
+
+	if (min_interval <= 0 || max_interval < min_interval || budget < 0)
+		return -EINVAL;
+
+	if (!poll_adaptives)
+		poll_adaptives = l_queue_new();
+
+	adaptive = l_queue_find(poll_adaptives, adaptive_match_group,
+				L_INT_TO_PTR(group));
+	if (!adaptive) {
+		adaptive = l_new(struct poll_adaptive, 1);
+		adaptive->group = group;
+		l_queue_push_tail(poll_adaptives, adaptive);
+	}
+
+	adaptive->min_interval = min_interval;
+	adaptive->max_interval = max_interval;
+	adaptive->budget = budget;
+
+	return 0;
+}
+
+int poll_create(int interval, int id, int group, poll_read_cb_t read_cb)
+{
+	struct poll_adaptive *adaptive;
+	struct poll_entry *entry;
+	int period;
+
+	if (interval <= 0)
+		return -EINVAL;
+
+	interval *= MSEC_PER_SEC;
+
+	adaptive = l_queue_find(poll_adaptives, adaptive_match_group,
+				L_INT_TO_PTR(group));
+
+	/* Adaptive entries start from the configured rate, within bounds */
+	if (adaptive) {
+		if (interval < adaptive->min_interval)
+			interval = adaptive->min_interval;
+		else if (interval > adaptive->max_interval)
+			interval = adaptive->max_interval;
+
+		period = adaptive->min_interval;
+	} else {
+		period = interval;
+	}
+
+	if (!cycle_to) {
+		cycle_to = l_timeout_create_ms(period, on_cycle_timeout, NULL,
+					       NULL);
+		if (!cycle_to)
+			return -ENOMSG;
+
+		cycle_period = period;
+	}
+
+	/* The scan cycle runs at the pace of the fastest entry */
+	if (period < cycle_period)
+		cycle_period = period;
 
 	entry = l_new(struct poll_entry, 1);
-	entry->data = data;
-	entry->to = to;
+	entry->id = id;
+	entry->read_cb = read_cb;
+	entry->interval = interval;
+	entry->adaptive = adaptive;
 
 	if (!poll_entries)
 		poll_entries = l_queue_new();
@@ -103,10 +527,41 @@ int poll_create(int interval, int id, poll_read_cb_t read_cb)
 	return 0;
 }
 
+void poll_remove(int id)
+{
+	struct poll_entry *entry;
+
+	entry = l_queue_find(poll_entries, entry_match_id, L_INT_TO_PTR(id));
+	if (!entry)
+		return;
+
+	/* Its read is not waited for anymore */
+	if (entry->pending)
+		poll_read_complete(id, -ECANCELED, 0);
+
+	l_queue_remove(poll_entries, entry);
+	l_free(entry);
+}
+
 void poll_destroy(void)
 {
+	if (cycle_to) {
+		l_timeout_remove(cycle_to);
+		cycle_to = NULL;
+	}
+
 	if (poll_entries) {
-		l_queue_destroy(poll_entries, entry_destroy);
+		l_queue_destroy(poll_entries, l_free);
 		poll_entries = NULL;
 	}
+
+	if (poll_classes) {
+		l_queue_destroy(poll_classes, l_free);
+		poll_classes = NULL;
+	}
+
+	if (poll_adaptives) {
+		l_queue_destroy(poll_adaptives, l_free);
+		poll_adaptives = NULL;
+	}
 }
@@ -14,9 +14,21 @@
  *  Lesser General Public License for more details.
  */
 
+enum poll_read_flags {
+	POLL_READ_CHANGED = 1 << 0,
+	POLL_READ_EVENT = 1 << 1
+};
+
 typedef int (*poll_read_cb_t)(int);
+typedef void (*poll_class_cb_t)(int scan_class, uint64_t stamp);
 
 void poll_start(void);
 void poll_stop(void);
-int poll_create(int interval, int id, poll_read_cb_t read_cb);
+void poll_read_complete(int id, int rc, unsigned int flags);
+void poll_set_on_demand(int id, bool on_demand);
+int poll_set_scan_class(int id, int scan_class, poll_class_cb_t done_cb);
+int poll_set_adaptive(int group, int min_interval, int max_interval,
+		      int budget);
+int poll_create(int interval, int id, int group, poll_read_cb_t read_cb);
+void poll_remove(int id);
 void poll_destroy(void);
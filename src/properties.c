@@ -27,12 +27,22 @@
 #include <errno.h>
 
 #include "device.h"
+#include "conf-image.h"
 #include "properties.h"
+#include "aggregate.h"
 #include "storage.h"
 #include "conf-parameters.h"
 
 #define EMPTY_STRING ""
 
+/* Where the DataItem groups go as they are read */
+struct data_item_loader {
+	struct conf_image_builder *builder;
+	conf_image_item_cb_t apply;
+	void *user_data;
+	struct l_hashmap *ids;
+};
+
 static int erase_thing_id(struct knot_thing *thing, int cred_fd)
 {
 	int rc;
@@ -62,11 +72,26 @@ static int erase_thing_token(struct knot_thing *thing, int cred_fd)
 	return rc;
 }
 
+static int erase_schema_hash(struct knot_thing *thing, int cred_fd)
+{
+	int rc;
+
+	rc = storage_write_key_string(cred_fd, CREDENTIALS_GROUP,
+				      CREDENTIALS_SCHEMA_HASH, EMPTY_STRING);
+	if (rc < 0)
+		l_error("Failed to erase schema hash");
+	else
+		device_set_thing_schema_hash(thing, NULL);
+
+	return rc;
+}
+
 static int set_thing_credentials(struct knot_thing *thing, char *filename)
 {
 	int cred_fd;
 	char *thing_id;
 	char *thing_token;
+	char *schema_hash;
 
 	cred_fd = storage_open(filename);
 	if (cred_fd < 0) {
@@ -85,6 +110,15 @@ static int set_thing_credentials(struct knot_thing *thing, char *filename)
 	l_free(thing_id);
 	l_free(thing_token);
 
+	schema_hash = storage_read_key_string(cred_fd, CREDENTIALS_GROUP,
+					     CREDENTIALS_SCHEMA_HASH);
+	if (schema_hash && !strcmp(schema_hash, EMPTY_STRING)) {
+		l_free(schema_hash);
+		schema_hash = NULL;
+	}
+
+	device_set_thing_schema_hash(thing, schema_hash);
+
 	storage_close(cred_fd);
 
 	return 0;
@@ -140,15 +174,26 @@ static int valid_bit_offset(int bit_offset, int value_type)
 	return 0;
 }
 
-static int set_modbus_source_properties(struct knot_thing *thing,
-					int fd, char *group_id,
-					knot_schema schema,
-					int *reg_addr, int *bit_offset)
+static int set_modbus_source_properties(int fd, const char *group_id,
+					knot_schema schema, char **url,
+					int *slave_id, int *reg_addr,
+					int *bit_offset)
 {
 	int rc;
+	char *url_aux;
+	int slave_id_aux;
 	int reg_addr_aux;
 	int bit_offset_aux;
 
+	/* Optional: defaults to the thing's slave when not set */
+	rc = storage_read_key_int(fd, group_id, MODBUS_SLAVE_ID,
+				  &slave_id_aux);
+	if (rc <= 0)
+		slave_id_aux = -1;
+	else if (slave_id_aux < MODBUS_MIN_SLAVE_ID ||
+		 slave_id_aux > MODBUS_MAX_SLAVE_ID)
+		return -EINVAL;
+
 	rc = storage_read_key_int(fd, group_id, MODBUS_REG_ADDRESS,
 				  &reg_addr_aux);
 	if (rc <= 0)
@@ -163,13 +208,22 @@ static int set_modbus_source_properties(struct knot_thing *thing,
 	if (rc < 0)
 		return -EINVAL;
 
+	/* Optional: items may be read from another slave or gateway */
+	url_aux = storage_read_key_string(fd, group_id, MODBUS_URL);
+	if (url_aux && !strcmp(url_aux, "")) {
+		l_free(url_aux);
+		url_aux = NULL;
+	}
+
 	*bit_offset = bit_offset_aux;
 	*reg_addr = reg_addr_aux;
+	*slave_id = slave_id_aux;
+	*url = url_aux;
 
 	return 0;
 }
 
-static int get_upper_limit(int fd, char *group_id, int value_type,
+static int get_upper_limit(int fd, const char *group_id, int value_type,
 			   knot_value_type *temp)
 {
 	int rc;
@@ -223,7 +277,7 @@ static int get_upper_limit(int fd, char *group_id, int value_type,
 	return rc;
 }
 
-static int get_lower_limit(int fd, char *group_id, int value_type,
+static int get_lower_limit(int fd, const char *group_id, int value_type,
 			   knot_value_type *temp)
 {
 	int rc;
@@ -310,8 +364,8 @@ static int set_limit(int fd, const char *group_id, const char *key,
 	return rc;
 }
 
-static int set_event(struct knot_thing *thing, int fd, char *group_id,
-		     knot_schema schema, knot_event *event)
+static int set_event(int fd, const char *group_id, knot_schema schema,
+		     knot_event *event)
 {
 	int rc;
 	int aux;
@@ -362,14 +416,15 @@ static int set_event(struct knot_thing *thing, int fd, char *group_id,
 	return 0;
 }
 
-static int set_schema(struct knot_thing *thing, int fd, char *group_id,
-		      knot_schema *schema)
+static int set_schema(int fd, const char *group_id, knot_schema *schema)
 {
 	int rc;
 	int aux;
 	char *name;
 	knot_schema schema_aux;
 
+	memset(&schema_aux, 0, sizeof(schema_aux));
+
 	name = storage_read_key_string(fd, group_id, SCHEMA_SENSOR_NAME);
 	if (name == NULL || !strcmp(name, "") ||
 			strlen(name) >= KNOT_PROTOCOL_DATA_NAME_LEN)
@@ -404,8 +459,8 @@ static int set_schema(struct knot_thing *thing, int fd, char *group_id,
 	return 0;
 }
 
-static int set_sensor_id(struct knot_thing *thing, int fd, char *group_id,
-			 int *sensor_id)
+static int set_sensor_id(struct l_hashmap *ids, int fd,
+			 const char *group_id, int *sensor_id)
 {
 	int rc;
 	int sensor_id_aux;
@@ -415,76 +470,208 @@ static int set_sensor_id(struct knot_thing *thing, int fd, char *group_id,
 	if (rc <= 0)
 		return -EINVAL;
 
-	if (device_data_item_lookup(thing, sensor_id_aux))
+	if (sensor_id_aux < SCHEMA_MIN_SENSOR_ID ||
+	    sensor_id_aux > SCHEMA_MAX_SENSOR_ID)
 		return -EINVAL;
 
+	if (l_hashmap_lookup(ids, L_INT_TO_PTR(sensor_id_aux)))
+		return -EINVAL;
+
+	l_hashmap_insert(ids, L_INT_TO_PTR(sensor_id_aux), L_UINT_TO_PTR(1));
+
 	*sensor_id = sensor_id_aux;
 
 	return 0;
 }
 
-static int set_data_items(struct knot_thing *thing, int fd)
+static int get_aggregate(int fd, const char *group_id,
+			 struct conf_image_item *item)
+{
+	int window;
+	int step = 0;
+	int function = AGGREGATE_MEAN;
+	char *name;
+
+	/* Optional: publish window statistics instead of raw samples */
+	if (storage_read_key_int(fd, group_id, AGGREGATE_WINDOW, &window) <= 0)
+		return 0;
+
+	if (storage_read_key_int(fd, group_id, AGGREGATE_STEP, &step) < 0)
+		return -EINVAL;
+
+	name = storage_read_key_string(fd, group_id, AGGREGATE_FUNCTION);
+	if (name) {
+		function = aggregate_parse_function(name);
+		l_free(name);
+		if (function < 0)
+			return -EINVAL;
+	}
+
+	item->flags |= CONF_IMAGE_AGGREGATE;
+	item->aggregate_window = window;
+	item->aggregate_step = step;
+	item->aggregate_function = function;
+
+	return 0;
+}
+
+/* Creates a data item from its validated record, parsed or compiled */
+static int apply_data_item(const struct conf_image_item *item,
+			   const char *url, void *user_data)
+{
+	struct knot_thing *thing = user_data;
+	int sensor_id = item->sensor_id;
+
+	device_set_new_data_item(thing, sensor_id, item->schema, item->event,
+				 l_strdup(url), item->slave_id,
+				 item->reg_addr, item->bit_offset);
+
+	if (item->flags & CONF_IMAGE_MAX_AGE)
+		device_set_data_item_max_age(thing, sensor_id,
+					     item->max_age);
+
+	if (item->flags & CONF_IMAGE_SCAN_CLASS)
+		device_set_data_item_scan_class(thing, sensor_id,
+						item->scan_class);
+
+	if ((item->flags & CONF_IMAGE_AGGREGATE) &&
+	    device_set_data_item_aggregate(thing, sensor_id,
+					   item->aggregate_window,
+					   item->aggregate_step,
+					   item->aggregate_function))
+		return -EINVAL;
+
+	if ((item->flags & CONF_IMAGE_HISTORY) &&
+	    device_set_data_item_history(thing, sensor_id,
+					 item->history_size))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int set_data_item(int fd, const char *group_id, void *user_data)
 {
+	struct data_item_loader *loader = user_data;
+	struct conf_image_item item;
 	int rc;
-	int i;
-	char **data_item_group;
 
 	int sensor_id;
+	char *url;
+	int slave_id;
 	int reg_addr;
 	int bit_offset;
+	int max_age;
+	int scan_class;
+	int history_size;
 	knot_schema schema;
 	knot_event event;
 
-	data_item_group = get_data_item_groups(fd);
+	rc = set_sensor_id(loader->ids, fd, group_id, &sensor_id);
+	if (rc < 0) {
+		l_error("Failed to set Sensor ID on %s", group_id);
+		return rc;
+	}
 
-	if (!data_item_group) {
-		l_error("Failed to read DataItem groups");
-		goto error;
+	rc = set_schema(fd, group_id, &schema);
+	if (rc < 0) {
+		l_error("Failed to set Schema on %s", group_id);
+		return rc;
 	}
 
-	for (i = 0; data_item_group[i] != NULL ; i++) {
-		rc = set_sensor_id(thing, fd, data_item_group[i], &sensor_id);
-		if (rc < 0) {
-			l_error("Failed to set Sensor ID on %s",
-				data_item_group[i]);
-			goto error;
-		}
+	rc = set_event(fd, group_id, schema, &event);
+	if (rc < 0) {
+		l_error("Failed to set event on %s", group_id);
+		return rc;
+	}
 
-		rc = set_schema(thing, fd, data_item_group[i], &schema);
-		if (rc < 0) {
-			l_error("Failed to set Schema on %s",
-				data_item_group[i]);
-			goto error;
-		}
+	rc = set_modbus_source_properties(fd, group_id, schema, &url,
+					  &slave_id, &reg_addr, &bit_offset);
+	if (rc < 0) {
+		l_error("Failed to set Modbus Source properties on %s",
+			group_id);
+		return rc;
+	}
 
-		rc = set_event(thing, fd, data_item_group[i], schema, &event);
-		if (rc < 0) {
-			l_error("Failed to set event on %s",
-				data_item_group[i]);
-			goto error;
-		}
+	memset(&item, 0, sizeof(item));
+	item.sensor_id = sensor_id;
+	item.schema = schema;
+	item.event = event;
+	item.slave_id = slave_id;
+	item.reg_addr = reg_addr;
+	item.bit_offset = bit_offset;
+
+	/* Optional: how old a published value may be, in ms */
+	rc = storage_read_key_int(fd, group_id, VALUE_MAX_AGE, &max_age);
+	if (rc > 0 && max_age >= 0) {
+		item.flags |= CONF_IMAGE_MAX_AGE;
+		item.max_age = max_age;
+	}
 
-		rc = set_modbus_source_properties(thing, fd, data_item_group[i],
-						  schema, &reg_addr,
-						  &bit_offset);
-		if (rc < 0) {
-			l_error("Failed to set Modbus Source properties on %s",
-				data_item_group[i]);
-			goto error;
-		}
+	/* Optional: items sampled and published as one set */
+	rc = storage_read_key_int(fd, group_id, SCAN_CLASS, &scan_class);
+	if (rc > 0 && scan_class > SCAN_CLASS_MAX) {
+		l_error("Failed to set Scan Class on %s", group_id);
+		l_free(url);
+		return -EINVAL;
+	}
 
-		device_set_new_data_item(thing, sensor_id, schema, event,
-					 reg_addr, bit_offset);
+	if (rc > 0 && scan_class > 0) {
+		item.flags |= CONF_IMAGE_SCAN_CLASS;
+		item.scan_class = scan_class;
 	}
 
-	l_strfreev(data_item_group);
+	rc = get_aggregate(fd, group_id, &item);
+	if (rc < 0) {
+		l_free(url);
+		return rc;
+	}
+
+	/* Optional: how many samples of history to keep */
+	rc = storage_read_key_int(fd, group_id, HISTORY_SIZE, &history_size);
+	if (rc > 0) {
+		item.flags |= CONF_IMAGE_HISTORY;
+		item.history_size = history_size;
+	}
+
+	if (loader->builder)
+		conf_image_builder_add_item(loader->builder, &item, url);
+
+	rc = loader->apply(&item, url, loader->user_data);
+	l_free(url);
+
+	return rc;
+}
+
+static int set_data_items(struct data_item_loader *loader, int fd)
+{
+	int rc;
+
+	loader->ids = l_hashmap_new();
+
+	/* Each DataItem group is validated and read in a single walk */
+	rc = storage_foreach_group(fd, DATA_ITEM_GROUP, set_data_item, loader);
+
+	l_hashmap_destroy(loader->ids, NULL);
+	loader->ids = NULL;
+
+	if (rc < 0) {
+		l_error("Failed to read DataItem groups");
+		return -EINVAL;
+	}
 
 	return 0;
+}
 
-error:
-	l_strfreev(data_item_group);
+/* Optional non-negative thing parameter, 0 when it is not set */
+static int read_thing_optional_int(int fd, const char *key, int *value)
+{
+	int rc;
 
-	return -EINVAL;
+	rc = storage_read_key_int(fd, THING_GROUP, key, value);
+	if (rc <= 0)
+		*value = 0;
+
+	return *value < 0 ? -EINVAL : 0;
 }
 
 static int set_modbus_slave_properties(struct knot_thing *thing, int fd)
@@ -492,6 +679,13 @@ static int set_modbus_slave_properties(struct knot_thing *thing, int fd)
 	int rc;
 	int aux;
 	int id;
+	int turnaround_delay;
+	int response_timeout;
+	int in_flight[3];
+	int reconnect[2];
+	int keepalive;
+	int liveness;
+	int rate[2];
 	char *url;
 
 	rc = storage_read_key_int(fd, THING_GROUP, THING_MODBUS_SLAVE_ID, &aux);
@@ -510,9 +704,156 @@ static int set_modbus_slave_properties(struct knot_thing *thing, int fd)
 
 	device_set_thing_modbus_slave(thing, id, url);
 
+	/* Optional line timing, in milliseconds */
+	if (read_thing_optional_int(fd, THING_MODBUS_TURNAROUND_DELAY,
+				    &turnaround_delay) < 0 ||
+	    read_thing_optional_int(fd, THING_MODBUS_RESPONSE_TIMEOUT,
+				    &response_timeout) < 0)
+		return -EINVAL;
+
+	device_set_thing_modbus_timing(thing, turnaround_delay,
+				       response_timeout);
+
+	/* Optional in-flight limits: 0 keeps the defaults */
+	if (read_thing_optional_int(fd, THING_MODBUS_MAX_IN_FLIGHT,
+				    &in_flight[0]) < 0 ||
+	    read_thing_optional_int(fd, THING_MODBUS_LINK_MAX_IN_FLIGHT,
+				    &in_flight[1]) < 0 ||
+	    read_thing_optional_int(fd, THING_MODBUS_SLAVE_MAX_IN_FLIGHT,
+				    &in_flight[2]) < 0)
+		return -EINVAL;
+
+	device_set_thing_modbus_in_flight(thing, in_flight[0], in_flight[1],
+					  in_flight[2]);
+
+	/* Optional link supervision: 0 keeps the defaults */
+	if (read_thing_optional_int(fd, THING_MODBUS_RECONNECT_MIN,
+				    &reconnect[0]) < 0 ||
+	    read_thing_optional_int(fd, THING_MODBUS_RECONNECT_MAX,
+				    &reconnect[1]) < 0 ||
+	    read_thing_optional_int(fd, THING_MODBUS_KEEPALIVE,
+				    &keepalive) < 0 ||
+	    read_thing_optional_int(fd, THING_MODBUS_LIVENESS_INTERVAL,
+				    &liveness) < 0)
+		return -EINVAL;
+
+	device_set_thing_modbus_link(thing, reconnect[0], reconnect[1],
+				     keepalive, liveness);
+
+	/* Optional pacing per unit ID: 0 leaves the units unthrottled */
+	if (read_thing_optional_int(fd, THING_MODBUS_SLAVE_RATE,
+				    &rate[0]) < 0 ||
+	    read_thing_optional_int(fd, THING_MODBUS_SLAVE_BURST,
+				    &rate[1]) < 0)
+		return -EINVAL;
+
+	device_set_thing_modbus_rate(thing, rate[0], rate[1]);
+
 	return 0;
 }
 
+static int set_poll_properties(struct knot_thing *thing, int fd)
+{
+	int min_interval;
+	int max_interval;
+	int budget;
+
+	/* Optional adaptive polling, in milliseconds and reads per second */
+	if (read_thing_optional_int(fd, THING_POLL_MIN_INTERVAL,
+				    &min_interval) < 0 ||
+	    read_thing_optional_int(fd, THING_POLL_MAX_INTERVAL,
+				    &max_interval) < 0 ||
+	    read_thing_optional_int(fd, THING_POLL_BUDGET, &budget) < 0)
+		return -EINVAL;
+
+	if (!max_interval)
+		return 0;
+
+	if (!min_interval || min_interval > max_interval)
+		return -EINVAL;
+
+	device_set_thing_poll_adaptive(thing, min_interval, max_interval,
+				       budget);
+
+	return 0;
+}
+
+static int set_publish_properties(struct knot_thing *thing, int fd)
+{
+	int rate;
+	int burst;
+
+	/* Optional pacing of the resync: 0 keeps the defaults */
+	if (read_thing_optional_int(fd, THING_PUBLISH_RATE, &rate) < 0 ||
+	    read_thing_optional_int(fd, THING_PUBLISH_BURST, &burst) < 0)
+		return -EINVAL;
+
+	device_set_thing_publish_rate(thing, rate, burst);
+
+	return 0;
+}
+
+static int set_modbus_server_properties(struct knot_thing *thing, int fd)
+{
+	char *address;
+	int port;
+	int max_age;
+	int writes;
+
+	/* Optional caching server for local clients: port 0 leaves it off */
+	if (read_thing_optional_int(fd, THING_MODBUS_SERVER_PORT, &port) < 0 ||
+	    read_thing_optional_int(fd, THING_MODBUS_SERVER_MAX_AGE,
+				    &max_age) < 0 ||
+	    read_thing_optional_int(fd, THING_MODBUS_SERVER_WRITES,
+				    &writes) < 0)
+		return -EINVAL;
+
+	if (port > MODBUS_SERVER_MAX_PORT)
+		return -EINVAL;
+
+	/* Only local clients unless told otherwise */
+	address = storage_read_key_string(fd, THING_GROUP,
+					  THING_MODBUS_SERVER_ADDRESS);
+	if (address && !strcmp(address, "")) {
+		l_free(address);
+		address = NULL;
+	}
+
+	device_set_thing_modbus_server(thing, address, port, max_age, writes);
+
+	return 0;
+}
+
+static void set_history_properties(struct knot_thing *thing, int fd)
+{
+	char *path;
+
+	/* Optional directory for the data item histories */
+	path = storage_read_key_string(fd, THING_GROUP, THING_HISTORY_PATH);
+	if (path && !strcmp(path, "")) {
+		l_free(path);
+		return;
+	}
+
+	if (path)
+		device_set_thing_history_path(thing, path);
+}
+
+static void set_state_properties(struct knot_thing *thing, int fd)
+{
+	char *path;
+
+	/* Optional file keeping the last published values */
+	path = storage_read_key_string(fd, THING_GROUP, THING_STATE_PATH);
+	if (path && !strcmp(path, "")) {
+		l_free(path);
+		return;
+	}
+
+	if (path)
+		device_set_thing_state_path(thing, path);
+}
+
 static int set_thing_user_token(struct knot_thing *thing, int fd)
 {
 	char *user_token;
@@ -544,38 +885,134 @@ static int set_thing_name(struct knot_thing *thing, int fd)
 	return 0;
 }
 
-static int set_thing_properties(struct knot_thing *thing, char *filename)
+static int set_thing_group(int fd, const char *group, void *user_data)
 {
-	int device_fd;
+	struct knot_thing *thing = user_data;
 	int rc;
 
-	device_fd = storage_open(filename);
-	if (device_fd < 0) {
-		l_error("Failed to open device file");
-		return device_fd;
-	}
-
-	rc = set_thing_name(thing, device_fd);
+	rc = set_thing_name(thing, fd);
 	if (rc < 0) {
 		l_error("Failed to set Thing name");
-		storage_close(device_fd);
 		return rc;
 	}
 
-	rc = set_modbus_slave_properties(thing, device_fd);
+	rc = set_modbus_slave_properties(thing, fd);
 	if (rc < 0) {
 		l_error("Failed to set Modbus Slave properties");
-		storage_close(device_fd);
 		return rc;
 	}
 
-	rc = set_data_items(thing, device_fd);
+	rc = set_poll_properties(thing, fd);
 	if (rc < 0) {
-		l_error("Failed to set KNoT Data items");
-		storage_close(device_fd);
+		l_error("Failed to set polling properties");
+		return rc;
+	}
+
+	rc = set_publish_properties(thing, fd);
+	if (rc < 0) {
+		l_error("Failed to set publishing properties");
+		return rc;
+	}
+
+	rc = set_modbus_server_properties(thing, fd);
+	if (rc < 0) {
+		l_error("Failed to set Modbus server properties");
 		return rc;
 	}
 
+	set_history_properties(thing, fd);
+	set_state_properties(thing, fd);
+
+	return 0;
+}
+
+static int load_image(struct knot_thing *thing, struct conf_image *image)
+{
+	const char *data;
+	size_t len;
+	int rc;
+
+	data = conf_image_get_thing(image, &len);
+
+	rc = storage_read_data(data, len, set_thing_group, thing);
+	if (rc < 0)
+		return rc;
+
+	rc = conf_image_foreach_item(image, apply_data_item, thing);
+	if (rc < 0)
+		l_error("Failed to set KNoT Data items");
+
+	return rc;
+}
+
+static void save_image(struct conf_image_builder *builder, int fd,
+		       const char *path)
+{
+	char *data;
+	size_t len;
+	int rc;
+
+	data = storage_get_group_data(fd, THING_GROUP, &len);
+	if (!data)
+		return;
+
+	conf_image_builder_set_thing(builder, data, len);
+	l_free(data);
+
+	rc = conf_image_builder_save(builder, path);
+	if (rc < 0)
+		l_warn("Failed to save configuration image %s (%s)", path,
+		       strerror(-rc));
+}
+
+static int set_thing_properties(struct knot_thing *thing,
+				struct device_settings *conf_files)
+{
+	struct data_item_loader loader;
+	struct conf_image *image;
+	int device_fd;
+	int rc;
+
+	loader.builder = NULL;
+	loader.apply = apply_data_item;
+	loader.user_data = thing;
+
+	/* Unchanged since it was compiled: nothing to parse */
+	if (conf_files->image_path) {
+		image = conf_image_open(conf_files->image_path,
+					conf_files->device_path);
+		if (image) {
+			rc = load_image(thing, image);
+			conf_image_close(image);
+			return rc;
+		}
+
+		loader.builder = conf_image_builder_new(
+						conf_files->device_path);
+	}
+
+	device_fd = storage_open(conf_files->device_path);
+	if (device_fd < 0) {
+		l_error("Failed to open device file");
+		conf_image_builder_free(loader.builder);
+		return device_fd;
+	}
+
+	rc = set_thing_group(device_fd, THING_GROUP, thing);
+	if (rc < 0)
+		goto done;
+
+	rc = set_data_items(&loader, device_fd);
+	if (rc < 0) {
+		l_error("Failed to set KNoT Data items");
+		goto done;
+	}
+
+	if (loader.builder)
+		save_image(loader.builder, device_fd, conf_files->image_path);
+
+done:
+	conf_image_builder_free(loader.builder);
 	storage_close(device_fd);
 
 	return rc;
@@ -698,25 +1135,12 @@ static int update_schema_data_item(int fd, const char *group_id,
 	return rc;
 }
 
-static bool equal_sensor_id(int fd, const char *group_id, int sensor_id)
-{
-	int sensor_id_aux;
-	int rc;
-
-	rc = storage_read_key_int(fd, group_id, SCHEMA_SENSOR_ID,
-				  &sensor_id_aux);
-	if (rc <= 0)
-		return false;
-
-	return sensor_id == sensor_id_aux ? true : false;
-}
-
 int properties_create_device(struct knot_thing *thing,
 			     struct device_settings *conf_files)
 {
 	int rc;
 
-	rc = set_thing_properties(thing, conf_files->device_path);
+	rc = set_thing_properties(thing, conf_files);
 	if (rc < 0) {
 		l_error("Failed to set Thing properties");
 		return rc;
@@ -748,6 +1172,8 @@ int properties_clear_credentials(struct knot_thing *thing, char *filename)
 		return cred_fd;
 	}
 
+	storage_begin(cred_fd);
+
 	rc = erase_thing_token(thing, cred_fd);
 	if (rc < 0)
 		goto error;
@@ -756,6 +1182,15 @@ int properties_clear_credentials(struct knot_thing *thing, char *filename)
 	if (rc < 0)
 		goto error;
 
+	/* A new registration has no config on the cloud yet */
+	rc = erase_schema_hash(thing, cred_fd);
+	if (rc < 0)
+		goto error;
+
+	rc = storage_commit(cred_fd);
+	if (rc < 0)
+		goto error;
+
 	storage_close(cred_fd);
 
 	return rc;
@@ -767,6 +1202,32 @@ error:
 	return -EINVAL;
 }
 
+int properties_store_schema_hash(struct knot_thing *thing, char *filename,
+				 const char *hash)
+{
+	int rc;
+	int cred_fd;
+
+	cred_fd = storage_open(filename);
+	if (cred_fd < 0) {
+		l_error("Failed to open credentials file");
+		return cred_fd;
+	}
+
+	rc = storage_write_key_string(cred_fd, CREDENTIALS_GROUP,
+				      CREDENTIALS_SCHEMA_HASH, hash);
+	storage_close(cred_fd);
+
+	if (rc < 0) {
+		l_error("Failed to store schema hash");
+		return rc;
+	}
+
+	device_set_thing_schema_hash(thing, l_strdup(hash));
+
+	return 0;
+}
+
 int properties_store_credentials(struct knot_thing *thing, char *filename,
 				 char *id, char *token)
 {
@@ -783,6 +1244,9 @@ int properties_store_credentials(struct knot_thing *thing, char *filename,
 		return cred_fd;
 	}
 
+	/* Both or none: a token is never stored without its id */
+	storage_begin(cred_fd);
+
 	rc = storage_write_key_string(cred_fd, CREDENTIALS_GROUP,
 				      CREDENTIALS_THING_TOKEN, token);
 	if (rc < 0)
@@ -790,12 +1254,12 @@ int properties_store_credentials(struct knot_thing *thing, char *filename,
 
 	rc = storage_write_key_string(cred_fd, CREDENTIALS_GROUP,
 				      CREDENTIALS_THING_ID, id);
-	if (rc < 0) {
-		storage_write_key_string(cred_fd, CREDENTIALS_GROUP,
-					 CREDENTIALS_THING_TOKEN,
-					 EMPTY_STRING);
+	if (rc < 0)
+		goto error;
+
+	rc = storage_commit(cred_fd);
+	if (rc < 0)
 		goto error;
-	}
 
 	storage_close(cred_fd);
 
@@ -808,12 +1272,52 @@ error:
 	return -EINVAL;
 }
 
-int properties_update_data_item(struct knot_thing *thing, char *filename,
-				knot_msg_config *config)
+static bool update_data_item_group(struct knot_thing *thing, int fd,
+				   const char *group, knot_msg_config *config)
+{
+	bool has_err = false;
+
+	/* Update values on knot_thing struct */
+	device_update_config_data_item(thing, config);
+
+	if (update_schema_data_item(fd, group, &config->schema) < 0) {
+		has_err = true;
+		l_error("Error on set schema property");
+	}
+
+	if (!(config->event.event_flags & KNOT_EVT_FLAG_UNREGISTERED)) {
+		if (update_event_data_item(fd, group,
+					   config->schema.value_type,
+					   &config->event) < 0) {
+			has_err = true;
+			l_error("Error on set event property");
+		}
+	}
+
+	return has_err;
+}
+
+static int index_data_item(int fd, const char *group_id, void *user_data)
 {
-	char **data_item_group;
+	struct l_hashmap *index = user_data;
+	int sensor_id;
+
+	if (storage_read_key_int(fd, group_id, SCHEMA_SENSOR_ID,
+				 &sensor_id) > 0)
+		l_hashmap_insert(index, L_INT_TO_PTR(sensor_id),
+				 l_strdup(group_id));
+
+	return 0;
+}
+
+int properties_update_data_items(struct knot_thing *thing, char *filename,
+				 struct l_queue *config_list)
+{
+	const struct l_queue_entry *entry;
+	knot_msg_config *config;
+	struct l_hashmap *index;
+	const char *group;
 	int device_fd;
-	int i;
 	bool has_err;
 
 	device_fd = storage_open(filename);
@@ -822,35 +1326,39 @@ int properties_update_data_item(struct knot_thing *thing, char *filename,
 		return device_fd;
 	}
 
-	/* Update values on knot_thing struct */
-	device_update_config_data_item(thing, config);
+	/* Sensor id to group name */
+	index = l_hashmap_new();
+	if (storage_foreach_group(device_fd, DATA_ITEM_GROUP,
+				  index_data_item, index) < 0) {
+		l_hashmap_destroy(index, l_free);
+		storage_close(device_fd);
+		return -EINVAL;
+	}
+
+	/* The whole list is written to disk at once */
+	storage_begin(device_fd);
 
 	has_err = false;
-	data_item_group = get_data_item_groups(device_fd);
 
-	for (i = 0; data_item_group[i] != NULL; i++) {
-		if (!equal_sensor_id(device_fd, data_item_group[i],
-				     config->sensor_id))
+	for (entry = l_queue_get_entries(config_list); entry;
+	     entry = entry->next) {
+		config = entry->data;
+
+		group = l_hashmap_lookup(index,
+					 L_INT_TO_PTR(config->sensor_id));
+		if (!group)
 			continue;
 
-		if (update_schema_data_item(device_fd, data_item_group[i],
-					    &config->schema) < 0) {
+		if (update_data_item_group(thing, device_fd, group, config))
 			has_err = true;
-			l_error("Error on set schema property");
-		}
+	}
 
-		if (!(config->event.event_flags & KNOT_EVT_FLAG_UNREGISTERED)) {
-			if (update_event_data_item(device_fd,
-						   data_item_group[i],
-						   config->schema.value_type,
-						   &config->event) < 0) {
-				has_err = true;
-				l_error("Error on set event property");
-			}
-		}
-		break;
+	if (storage_commit(device_fd) < 0) {
+		has_err = true;
+		l_error("Error on save data item properties");
 	}
 
+	l_hashmap_destroy(index, l_free);
 	storage_close(device_fd);
 
 	if (has_err)
@@ -858,3 +1366,34 @@ int properties_update_data_item(struct knot_thing *thing, char *filename,
 
 	return 0;
 }
+
+int properties_add_data_item(struct knot_thing *thing,
+			     const struct conf_image_item *item,
+			     const char *url)
+{
+	return apply_data_item(item, url, thing);
+}
+
+int properties_read_data_items(char *filename, conf_image_item_cb_t func,
+			       void *user_data)
+{
+	struct data_item_loader loader;
+	int device_fd;
+	int rc;
+
+	loader.builder = NULL;
+	loader.apply = func;
+	loader.user_data = user_data;
+
+	device_fd = storage_open(filename);
+	if (device_fd < 0) {
+		l_error("Failed to open device file");
+		return device_fd;
+	}
+
+	rc = set_data_items(&loader, device_fd);
+
+	storage_close(device_fd);
+
+	return rc;
+}
@@ -24,5 +24,12 @@ int properties_create_device(struct knot_thing *thing,
 int properties_clear_credentials(struct knot_thing *thing, char *filename);
 int properties_store_credentials(struct knot_thing *thing, char *filename,
 				 char *id, char *token);
-int properties_update_data_item(struct knot_thing *thing, char *filename,
-				knot_msg_config *config);
+int properties_store_schema_hash(struct knot_thing *thing, char *filename,
+				 const char *hash);
+int properties_update_data_items(struct knot_thing *thing, char *filename,
+				 struct l_queue *config_list);
+int properties_add_data_item(struct knot_thing *thing,
+			     const struct conf_image_item *item,
+			     const char *url);
+int properties_read_data_items(char *filename, conf_image_item_cb_t func,
+			       void *user_data);
@@ -42,11 +42,15 @@
 static bool detach = true;
 static bool help = false;
 static int log_level = L_LOG_INFO;
+static int workers = 1;
 
 static const struct option main_options[] = {
 	{ "credentials-file",	required_argument,	NULL, 'c' },
 	{ "dev-file",		required_argument,	NULL, 'd' },
 	{ "cloud-file",		required_argument,	NULL, 'p' },
+	{ "image-file",		required_argument,	NULL, 'i' },
+	{ "things-dir",		required_argument,	NULL, 't' },
+	{ "workers",		required_argument,	NULL, 'w' },
 	{ "log",		required_argument,	NULL, 'l' },
 	{ "nodetach",		no_argument,		NULL, 'n' },
 	{ "help",		no_argument,		NULL, 'h' },
@@ -64,6 +68,9 @@ static void usage(void)
 		"\t-d, --dev-file          Device configuration file path\n"
 		"\t-p, --cloud-file        Cloud configuration file path "
 		"amqp://[$USERNAME[:$PASSWORD]\\@]$HOST[:$PORT]/[$VHOST]\n"
+		"\t-i, --image-file        Compiled device file or directory\n"
+		"\t-t, --things-dir        Directory of thing directories\n"
+		"\t-w, --workers           Worker processes sharing the things\n"
 		"\t-l, --log               Configure log level, options are:"
 		"error | warn | info | debug"
 		"\t-n, --nodetach          Disable running in background\n"
@@ -94,7 +101,7 @@ static int parse_args(int argc, char *argv[], struct settings *settings)
 	int opt;
 
 	for (;;) {
-		opt = getopt_long(argc, argv, "c:d:p:l:nh",
+		opt = getopt_long(argc, argv, "c:d:p:i:t:w:l:nh",
 				  main_options, NULL);
 		if (opt < 0)
 			break;
@@ -109,6 +116,21 @@ static int parse_args(int argc, char *argv[], struct settings *settings)
 		case 'p':
 			settings->cloud_path = optarg;
 			break;
+		case 'i':
+			settings->image_path = optarg;
+			break;
+		case 't':
+			settings->things_path = optarg;
+			break;
+		case 'w':
+			settings->workers = atoi(optarg);
+			if (settings->workers < 1) {
+				fprintf(stderr,
+					"ERROR: Invalid number of workers\n");
+				usage();
+				return -EINVAL;
+			}
+			break;
 		case 'l':
 			settings->log_level = parse_log_level(optarg);
 			if (settings->log_level < 0) {
@@ -147,6 +169,7 @@ struct settings *settings_load(int argc, char *argv[])
 	settings->device_path = DEFAULT_DEVICE_FILE_PATH;
 	settings->cloud_path = DEFAULT_AMQP_FILE_PATH;
 	settings->log_level = log_level;
+	settings->workers = workers;
 	settings->detach = detach;
 	settings->help = help;
 
@@ -18,6 +18,9 @@ struct settings {
 	char *credentials_path;
 	char *device_path;
 	char *cloud_path;
+	char *image_path;
+	char *things_path;
+	int workers;
 	int log_level;
 	bool detach;
 	bool help;
@@ -0,0 +1,403 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Worker shards source file
+ *
+ *  The things are split among forked worker processes, since each
+ *  process can only run a single main loop. Things sharing any Modbus
+ *  URL, the thing's own or a data item's, are grouped and the group
+ *  hashed to a shard, so that the things polling the same slaves share
+ *  a worker and its links. The parent only supervises the workers: a
+ *  worker that exits makes all the others stop.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <ell/ell.h>
+#include <knot/knot_protocol.h>
+
+#include "storage.h"
+#include "conf-parameters.h"
+#include "device.h"
+#include "shard.h"
+
+struct shard_filter {
+	const unsigned int *conf_shards;
+	unsigned int pos;
+	unsigned int index;
+	l_queue_destroy_func_t destroy;
+};
+
+/* Union-find of the things over the links they use */
+struct shard_links {
+	struct l_hashmap *owners;	/* URL to its first thing, plus one */
+	unsigned int *parent;
+	const char **keys;		/* smallest URL of each group */
+	unsigned int index;
+};
+
+static pid_t *workers;
+static unsigned int n_workers;
+static unsigned int n_running;
+static bool stopping;
+static int exit_err;
+static sigset_t old_mask;
+
+/* Jump consistent hash: growing the shards moves the fewest things */
+static unsigned int jump_hash(uint64_t key, unsigned int n_buckets)
+{
+	int64_t b = -1;
+	int64_t j = 0;
+
+	while (j < n_buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double) (1LL << 31) /
+			       (double) ((key >> 33) + 1));
+	}
+
+	return b;
+}
+
+static unsigned int link_root(unsigned int *parent, unsigned int index)
+{
+	while (parent[index] != index) {
+		parent[index] = parent[parent[index]];
+		index = parent[index];
+	}
+
+	return index;
+}
+
+static void link_url(struct shard_links *links, const char *url)
+{
+	unsigned int owner;
+	unsigned int a;
+	unsigned int b;
+
+	if (!url || !strcmp(url, ""))
+		return;
+
+	owner = L_PTR_TO_UINT(l_hashmap_lookup(links->owners, url));
+	if (!owner) {
+		l_hashmap_insert(links->owners, url,
+				 L_UINT_TO_PTR(links->index + 1));
+		return;
+	}
+
+	a = link_root(links->parent, owner - 1);
+	b = link_root(links->parent, links->index);
+
+	if (a < b)
+		links->parent[b] = a;
+	else
+		links->parent[a] = b;
+}
+
+static int foreach_item_link(int fd, const char *group, void *user_data)
+{
+	char *url;
+
+	url = storage_read_key_string(fd, group, MODBUS_URL);
+	link_url(user_data, url);
+	l_free(url);
+
+	return 0;
+}
+
+/* The thing's own link and those its data items are read from */
+static void conf_link(const struct device_settings *conf_files,
+		      struct shard_links *links)
+{
+	char *url;
+	int fd;
+
+	fd = storage_open(conf_files->device_path);
+	if (fd < 0)
+		return;
+
+	url = storage_read_key_string(fd, THING_GROUP, THING_MODBUS_URL);
+	link_url(links, url);
+	l_free(url);
+
+	storage_foreach_group(fd, DATA_ITEM_GROUP, foreach_item_link, links);
+	storage_close(fd);
+}
+
+static void foreach_link_key(const void *key, void *value, void *user_data)
+{
+	struct shard_links *links = user_data;
+	unsigned int root;
+
+	root = link_root(links->parent, L_PTR_TO_UINT(value) - 1);
+
+	if (!links->keys[root] || strcmp(key, links->keys[root]) < 0)
+		links->keys[root] = key;
+}
+
+/*
+ * Things sharing a link, directly or through other things, make up a
+ * group hashed by its smallest URL, so that the whole group lands on
+ * the same shard whatever the order of the configuration files.
+ */
+static void conf_shards_assign(struct l_queue *conf_list,
+			       unsigned int n_shards,
+			       unsigned int *conf_shards)
+{
+	const struct l_queue_entry *entry;
+	const struct device_settings *conf_files;
+	struct shard_links links;
+	const char *key;
+	unsigned int n_confs = l_queue_length(conf_list);
+	unsigned int root;
+	unsigned int i;
+
+	links.owners = l_hashmap_string_new();
+	links.parent = l_new(unsigned int, n_confs);
+	links.keys = l_new(const char *, n_confs);
+
+	for (i = 0; i < n_confs; i++)
+		links.parent[i] = i;
+
+	for (entry = l_queue_get_entries(conf_list), i = 0; entry;
+	     entry = entry->next, i++) {
+		links.index = i;
+		conf_link(entry->data, &links);
+	}
+
+	l_hashmap_foreach(links.owners, foreach_link_key, &links);
+
+	for (entry = l_queue_get_entries(conf_list), i = 0; entry;
+	     entry = entry->next, i++) {
+		conf_files = entry->data;
+		root = link_root(links.parent, i);
+
+		/* Things without any link are on their own */
+		key = links.keys[root];
+		if (!key)
+			key = conf_files->device_path;
+		conf_shards[i] = jump_hash(l_str_hash(key), n_shards);
+	}
+
+	l_free(links.keys);
+	l_free(links.parent);
+	l_hashmap_destroy(links.owners, NULL);
+}
+
+static bool filter_shard(void *data, void *user_data)
+{
+	struct shard_filter *filter = user_data;
+
+	if (filter->conf_shards[filter->pos++] == filter->index)
+		return false;
+
+	filter->destroy(data);
+
+	return true;
+}
+
+static int worker_start(struct l_queue *conf_list,
+			const unsigned int *conf_shards, unsigned int index,
+			l_queue_destroy_func_t destroy, pid_t parent)
+{
+	struct shard_filter filter = {
+		.conf_shards = conf_shards,
+		.pos = 0,
+		.index = index,
+		.destroy = destroy,
+	};
+
+	l_free(workers);
+	workers = NULL;
+	n_workers = 0;
+	n_running = 0;
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	/* Don't outlive the supervisor */
+	if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != parent)
+		return -ECHILD;
+
+	l_queue_foreach_remove(conf_list, filter_shard, &filter);
+
+	l_info("Shard %u: %u things", index, l_queue_length(conf_list));
+
+	return 0;
+}
+
+static void stop_workers(void)
+{
+	unsigned int i;
+
+	stopping = true;
+
+	for (i = 0; i < n_workers; i++)
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+}
+
+/*
+ * Forks a worker for each shard holding things. Like fork(), returns 0
+ * in the worker, with only its things left on conf_list, and a positive
+ * value in the supervisor.
+ */
+int shard_start(struct l_queue *conf_list, unsigned int n_shards,
+		l_queue_destroy_func_t destroy)
+{
+	unsigned int *conf_shards;
+	unsigned int *shard_things;
+	unsigned int i;
+	sigset_t mask;
+	pid_t parent = getpid();
+	pid_t pid;
+	int err = 0;
+
+	conf_shards = l_new(unsigned int, l_queue_length(conf_list));
+	shard_things = l_new(unsigned int, n_shards);
+
+	conf_shards_assign(conf_list, n_shards, conf_shards);
+
+	for (i = 0; i < l_queue_length(conf_list); i++)
+		shard_things[conf_shards[i]]++;
+
+	/* Signals are taken by shard_supervise(), none can be missed */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+	workers = l_new(pid_t, n_shards);
+	n_workers = n_shards;
+
+	for (i = 0; i < n_shards; i++) {
+		if (!shard_things[i])
+			continue;
+
+		pid = fork();
+		if (pid < 0) {
+			err = -errno;
+			l_error("Failed to fork shard %u: %s (%d)", i,
+				strerror(-err), -err);
+			break;
+		}
+
+		if (pid == 0) {
+			err = worker_start(conf_list, conf_shards, i,
+					   destroy, parent);
+			goto done;
+		}
+
+		workers[i] = pid;
+		n_running++;
+	}
+
+	if (err < 0 && n_running) {
+		/* The forked ones are reaped by shard_supervise() */
+		exit_err = err;
+		stop_workers();
+	}
+
+	if (n_running) {
+		err = n_running;
+	} else {
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		l_free(workers);
+		workers = NULL;
+		n_workers = 0;
+	}
+
+done:
+	l_free(shard_things);
+	l_free(conf_shards);
+
+	return err;
+}
+
+static void worker_exited(pid_t pid, int status)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_workers; i++) {
+		if (workers[i] != pid)
+			continue;
+
+		workers[i] = 0;
+		n_running--;
+
+		if (stopping)
+			return;
+
+		exit_err = -ECHILD;
+		stop_workers();
+
+		if (WIFSIGNALED(status))
+			l_error("Shard %u killed by signal %d", i,
+				WTERMSIG(status));
+		else
+			l_error("Shard %u exited with status %d", i,
+				WEXITSTATUS(status));
+		return;
+	}
+}
+
+/* Waits for the workers, stopping them all on a signal or an early exit */
+int shard_supervise(void)
+{
+	sigset_t mask;
+	int status;
+	int signo;
+	int err;
+	pid_t pid;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+
+	while (n_running > 0) {
+		if (sigwait(&mask, &signo))
+			break;
+
+		if (signo != SIGCHLD) {
+			l_info("Terminate");
+			stop_workers();
+			continue;
+		}
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			worker_exited(pid, status);
+	}
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	l_free(workers);
+	workers = NULL;
+	n_workers = 0;
+
+	err = exit_err;
+	exit_err = 0;
+	stopping = false;
+
+	return err;
+}
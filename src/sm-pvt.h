@@ -32,10 +32,17 @@ enum STATES {
 	N_OF_STATES
 };
 
-enum STATES get_next_disconnected(enum EVENTS event, void *user_data);
-enum STATES get_next_auth(enum EVENTS event, void *user_data);
-enum STATES get_next_register(enum EVENTS event, void *user_data);
-enum STATES get_next_config(enum EVENTS event, void *user_data);
-enum STATES get_next_online(enum EVENTS event, void *user_data);
-enum STATES get_next_unregister(enum EVENTS event, void *user_data);
-enum STATES get_next_error(enum EVENTS event, void *user_data);
+enum STATES get_next_disconnected(struct knot_thing *thing, enum EVENTS event,
+				  void *user_data);
+enum STATES get_next_auth(struct knot_thing *thing, enum EVENTS event,
+			  void *user_data);
+enum STATES get_next_register(struct knot_thing *thing, enum EVENTS event,
+			      void *user_data);
+enum STATES get_next_config(struct knot_thing *thing, enum EVENTS event,
+			    void *user_data);
+enum STATES get_next_online(struct knot_thing *thing, enum EVENTS event,
+			    void *user_data);
+enum STATES get_next_unregister(struct knot_thing *thing, enum EVENTS event,
+				void *user_data);
+enum STATES get_next_error(struct knot_thing *thing, enum EVENTS event,
+			   void *user_data);
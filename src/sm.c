@@ -29,15 +29,21 @@
 
 #define DEFAULT_MSG_TIMEOUT 3
 
-typedef void (*enter_state_t)(void);
-typedef enum STATES (*get_next_t)(enum EVENTS, void *user_data);
+typedef void (*enter_state_t)(struct knot_thing *thing);
+typedef enum STATES (*get_next_t)(struct knot_thing *thing, enum EVENTS,
+				  void *user_data);
 
 struct state {
 	enter_state_t enter;
 	get_next_t get_next;
 };
 
-static struct state *current_state;
+/* Each thing goes through the states on its own */
+struct sm {
+	struct knot_thing *thing;
+	struct state *current_state;
+};
+
 struct state states[N_OF_STATES];
 
 static char *event_to_str(enum EVENTS event)
@@ -57,6 +63,9 @@ static char *event_to_str(enum EVENTS event)
 	case EVT_DATA_UPDT:
 		evt_str = "EVT_DATA_UPDT";
 		break;
+	case EVT_CFG_CHANGED:
+		evt_str = "EVT_CFG_CHANGED";
+		break;
 	case EVT_TIMEOUT:
 		evt_str = "EVT_TIMEOUT";
 		break;
@@ -126,20 +135,21 @@ static char *state_to_str(enum STATES state)
 }
 
 /* DISCONNECT */
-enum STATES get_next_disconnected(enum EVENTS event, void *user_data)
+enum STATES get_next_disconnected(struct knot_thing *thing, enum EVENTS event,
+				  void *user_data)
 {
 	enum STATES next_state;
 
 	switch(event) {
 	case EVT_READY:
-		if (device_has_thing_token())
+		if (device_has_thing_token(thing))
 			next_state = ST_AUTH;
 		else {
 			next_state = ST_REGISTER;
-			device_generate_thing_id();
+			device_generate_thing_id(thing);
 		}
 
-		if (device_start_read_cloud())
+		if (device_start_read_cloud(thing))
 			l_error("Fail to start cloud read");
 		break;
 	case EVT_NOT_READY:
@@ -154,6 +164,7 @@ enum STATES get_next_disconnected(enum EVENTS event, void *user_data)
 	case EVT_REG_PERM:
 	case EVT_PUB_DATA:
 	case EVT_DATA_UPDT:
+	case EVT_CFG_CHANGED:
 		next_state = ST_DISCONNECTED;
 		break;
 	default:
@@ -163,36 +174,37 @@ enum STATES get_next_disconnected(enum EVENTS event, void *user_data)
 	return next_state;
 }
 
-static void enter_disconnected(void)
+static void enter_disconnected(struct knot_thing *thing)
 {
 	/* No action necessary when entering state disconnected */
 }
 
 /* AUTH */
-enum STATES get_next_auth(enum EVENTS event, void *user_data)
+enum STATES get_next_auth(struct knot_thing *thing, enum EVENTS event,
+			  void *user_data)
 {
 	enum STATES next_state;
 
 	switch(event) {
 	case EVT_NOT_READY:
-		device_msg_timeout_remove();
+		device_msg_timeout_remove(thing);
 		next_state = ST_DISCONNECTED;
 		break;
 	case EVT_AUTH_OK:
-		device_msg_timeout_remove();
-		next_state =
-			device_check_schema_change() ? ST_CONFIG : ST_ONLINE;
+		device_msg_timeout_remove(thing);
+		next_state = device_check_schema_change(thing) ?
+			ST_CONFIG : ST_ONLINE;
 		break;
 	case EVT_AUTH_NOT_OK:
 	case EVT_UNREG_REQ:
-		device_msg_timeout_remove();
+		device_msg_timeout_remove(thing);
 		next_state = ST_UNREGISTER;
 		break;
 	case EVT_TIMEOUT:
-		if (device_send_auth_request() < 0)
+		if (device_send_auth_request(thing) < 0)
 			l_error("Couldn't send auth message");
 
-		device_msg_timeout_modify(DEFAULT_MSG_TIMEOUT);
+		device_msg_timeout_modify(thing, DEFAULT_MSG_TIMEOUT);
 		next_state = ST_AUTH;
 		break;
 	case EVT_READY:
@@ -203,6 +215,7 @@ enum STATES get_next_auth(enum EVENTS event, void *user_data)
 	case EVT_REG_PERM:
 	case EVT_PUB_DATA:
 	case EVT_DATA_UPDT:
+	case EVT_CFG_CHANGED:
 		next_state = ST_AUTH;
 		break;
 	default:
@@ -212,32 +225,33 @@ enum STATES get_next_auth(enum EVENTS event, void *user_data)
 	return next_state;
 }
 
-static void enter_auth(void)
+static void enter_auth(struct knot_thing *thing)
 {
 	int rc;
 
-	rc = device_send_auth_request();
+	rc = device_send_auth_request(thing);
 
 	if(rc < 0)
 		l_error("Couldn't send auth message");
 
-	device_msg_timeout_create(DEFAULT_MSG_TIMEOUT);
+	device_msg_timeout_create(thing, DEFAULT_MSG_TIMEOUT);
 }
 
 /* REGISTER */
-enum STATES get_next_register(enum EVENTS event, void *user_data)
+enum STATES get_next_register(struct knot_thing *thing, enum EVENTS event,
+			      void *user_data)
 {
 	enum STATES next_state;
 	int rc;
 
 	switch(event) {
 	case EVT_NOT_READY:
-		device_msg_timeout_remove();
+		device_msg_timeout_remove(thing);
 		next_state = ST_DISCONNECTED;
 		break;
 	case EVT_REG_OK:
-		device_msg_timeout_remove();
-		rc = device_store_credentials_on_file(user_data);
+		device_msg_timeout_remove(thing);
+		rc = device_store_credentials_on_file(thing, user_data);
 		if(rc < 0) {
 			next_state = ST_ERROR;
 			l_error("Failed to write credentials");
@@ -246,18 +260,18 @@ enum STATES get_next_register(enum EVENTS event, void *user_data)
 		next_state = ST_AUTH;
 		break;
 	case EVT_REG_NOT_OK:
-		device_generate_thing_id();
+		device_generate_thing_id(thing);
 
-		if (device_start_read_cloud())
+		if (device_start_read_cloud(thing))
 			l_error("Fail to start cloud read");
 
 		next_state = ST_REGISTER;
 		break;
 	case EVT_TIMEOUT:
-		if (device_send_register_request() < 0)
+		if (device_send_register_request(thing) < 0)
 			l_error("Couldn't send register message");
 
-		device_msg_timeout_modify(DEFAULT_MSG_TIMEOUT);
+		device_msg_timeout_modify(thing, DEFAULT_MSG_TIMEOUT);
 		next_state = ST_REGISTER;
 		break;
 	case EVT_UNREG_REQ:
@@ -269,6 +283,7 @@ enum STATES get_next_register(enum EVENTS event, void *user_data)
 	case EVT_REG_PERM:
 	case EVT_PUB_DATA:
 	case EVT_DATA_UPDT:
+	case EVT_CFG_CHANGED:
 		next_state = ST_REGISTER;
 		break;
 	default:
@@ -278,44 +293,51 @@ enum STATES get_next_register(enum EVENTS event, void *user_data)
 	return next_state;
 }
 
-static void enter_register(void)
+static void enter_register(struct knot_thing *thing)
 {
 	int rc;
 
-	rc = device_send_register_request();
+	rc = device_send_register_request(thing);
 	if(rc < 0)
 		l_error("Couldn't send register message");
 
-	device_msg_timeout_create(DEFAULT_MSG_TIMEOUT);
+	device_msg_timeout_create(thing, DEFAULT_MSG_TIMEOUT);
 }
 
 /* CONFIG */
-enum STATES get_next_config(enum EVENTS event, void *user_data)
+enum STATES get_next_config(struct knot_thing *thing, enum EVENTS event,
+			    void *user_data)
 {
 	int next_state;
 
 	switch(event) {
 	case EVT_NOT_READY:
-		device_msg_timeout_remove();
+		device_msg_timeout_remove(thing);
 		next_state = ST_DISCONNECTED;
 		break;
 	case EVT_CFG_UPT_OK:
-		device_msg_timeout_remove();
+		device_msg_timeout_remove(thing);
+
+		/* Next time, skip this state while the schema is the same */
+		if (device_store_schema_hash(thing) < 0)
+			l_error("Couldn't store the schema hash");
+
 		next_state = ST_ONLINE;
 		break;
 	case EVT_CFG_UPT_NOT_OK:
-		device_msg_timeout_remove();
+		device_msg_timeout_remove(thing);
 		next_state = ST_ERROR;
 		break;
 	case EVT_UNREG_REQ:
-		device_msg_timeout_remove();
+		device_msg_timeout_remove(thing);
 		next_state = ST_UNREGISTER;
 		break;
 	case EVT_TIMEOUT:
-		if (device_send_config() < 0)
+	case EVT_CFG_CHANGED:
+		if (device_send_config(thing) < 0)
 			l_error("Couldn't send config message");
 
-		device_msg_timeout_modify(DEFAULT_MSG_TIMEOUT);
+		device_msg_timeout_modify(thing, DEFAULT_MSG_TIMEOUT);
 		next_state = ST_CONFIG;
 		break;
 	case EVT_READY:
@@ -336,34 +358,35 @@ enum STATES get_next_config(enum EVENTS event, void *user_data)
 	return next_state;
 }
 
-static void enter_config(void)
+static void enter_config(struct knot_thing *thing)
 {
 	int rc;
 
-	rc = device_send_config();
+	rc = device_send_config(thing);
 
 	if(rc < 0)
 		l_error("Failure sending config");
 
-	device_msg_timeout_create(DEFAULT_MSG_TIMEOUT);
+	device_msg_timeout_create(thing, DEFAULT_MSG_TIMEOUT);
 }
 
 /* ONLINE */
-enum STATES get_next_online(enum EVENTS event, void *user_data)
+enum STATES get_next_online(struct knot_thing *thing, enum EVENTS event,
+			    void *user_data)
 {
 	int next_state;
 
 	switch(event) {
 	case EVT_NOT_READY:
-		device_stop_event();
+		device_stop_event(thing);
 		next_state = ST_DISCONNECTED;
 		break;
 	case EVT_PUB_DATA:
-		device_publish_data_list(user_data);
+		device_publish_data_list(thing, user_data);
 		next_state = ST_ONLINE;
 		break;
 	case EVT_DATA_UPDT:
-		/* TODO: Write to modbus actuator */
+		device_update_data_list(thing, user_data);
 		next_state = ST_ONLINE;
 		break;
 	case EVT_UNREG_REQ:
@@ -372,11 +395,17 @@ enum STATES get_next_online(enum EVENTS event, void *user_data)
 	case EVT_CFG_UPT_OK:
 		next_state = ST_ONLINE;
 
-		if (device_update_config(user_data)) {
+		if (device_update_config(thing, user_data)) {
 			l_error("Couldn't update config");
 			next_state = ST_CONFIG;
 		}
 		break;
+	case EVT_CFG_CHANGED:
+		if (device_send_config(thing) < 0)
+			l_error("Couldn't send config message");
+
+		next_state = ST_ONLINE;
+		break;
 	case EVT_TIMEOUT:
 	case EVT_CFG_UPT_NOT_OK:
 	case EVT_READY:
@@ -395,26 +424,27 @@ enum STATES get_next_online(enum EVENTS event, void *user_data)
 	return next_state;
 }
 
-static void enter_online(void)
+static void enter_online(struct knot_thing *thing)
 {
 	int err;
 
-	device_publish_data_all();
-	err = device_start_event();
+	device_publish_data_changed(thing);
+	err = device_start_event(thing);
 	if (err < 0)
 		l_error("Couldn't start config");
 }
 
 /* UNREGISTER */
-enum STATES get_next_unregister(enum EVENTS event, void *user_data)
+enum STATES get_next_unregister(struct knot_thing *thing, enum EVENTS event,
+				void *user_data)
 {
 	int next_state;
 
 	switch(event) {
 	case EVT_REG_PERM:
-		device_generate_thing_id();
+		device_generate_thing_id(thing);
 
-		if (device_start_read_cloud())
+		if (device_start_read_cloud(thing))
 			l_error("Fail to start cloud read");
 
 		next_state = ST_REGISTER;
@@ -422,6 +452,7 @@ enum STATES get_next_unregister(enum EVENTS event, void *user_data)
 	case EVT_NOT_READY:
 	case EVT_PUB_DATA:
 	case EVT_DATA_UPDT:
+	case EVT_CFG_CHANGED:
 	case EVT_TIMEOUT:
 	case EVT_CFG_UPT_OK:
 	case EVT_CFG_UPT_NOT_OK:
@@ -440,17 +471,18 @@ enum STATES get_next_unregister(enum EVENTS event, void *user_data)
 	return next_state;
 }
 
-static void enter_unregister(void)
+static void enter_unregister(struct knot_thing *thing)
 {
 	int rc;
 
-	rc = device_clear_credentials_on_file();
+	rc = device_clear_credentials_on_file(thing);
 	if(rc < 0)
 		l_error("Something went wrong when cleaning credentials");
 }
 
 /* ERROR */
-enum STATES get_next_error(enum EVENTS event, void *user_data)
+enum STATES get_next_error(struct knot_thing *thing, enum EVENTS event,
+			   void *user_data)
 {
 	int next_state;
 
@@ -459,6 +491,7 @@ enum STATES get_next_error(enum EVENTS event, void *user_data)
 	case EVT_NOT_READY:
 	case EVT_PUB_DATA:
 	case EVT_DATA_UPDT:
+	case EVT_CFG_CHANGED:
 	case EVT_TIMEOUT:
 	case EVT_CFG_UPT_OK:
 	case EVT_CFG_UPT_NOT_OK:
@@ -476,7 +509,7 @@ enum STATES get_next_error(enum EVENTS event, void *user_data)
 	return next_state;
 }
 
-static void enter_error(void)
+static void enter_error(struct knot_thing *thing)
 {
 	/*  TODO: Add usuability to warn user of error state */
 }
@@ -492,24 +525,27 @@ static struct state sm_create_state(enter_state_t enter, get_next_t next)
 	return st;
 };
 
-void sm_input_event(enum EVENTS event, void *user_data)
+void sm_input_event(struct sm *sm, enum EVENTS event, void *user_data)
 {
-	enum STATES id = current_state->get_next(event, user_data);
+	enum STATES id = sm->current_state->get_next(sm->thing, event,
+						     user_data);
 	struct state *next = &states[id];
 
 	l_debug("(%s -> %s)", event_to_str(event), state_to_str(id));
 
-	if (next != current_state) {
+	if (next != sm->current_state) {
 		if (next->enter) {
 			l_info("Current state: %s", state_to_str(id));
-			next->enter();
+			next->enter(sm->thing);
 		}
-		current_state = next;
+		sm->current_state = next;
 	}
 }
 
-void sm_start(void)
+struct sm *sm_start(struct knot_thing *thing)
 {
+	struct sm *sm;
+
 	l_info("Starting State Machine");
 
 	states[ST_DISCONNECTED] = sm_create_state(enter_disconnected,
@@ -522,7 +558,17 @@ void sm_start(void)
 	states[ST_UNREGISTER] = sm_create_state(enter_unregister,
 						get_next_unregister);
 	states[ST_ERROR] = sm_create_state(enter_error, get_next_error);
-	current_state = &states[ST_DISCONNECTED];
+
+	sm = l_new(struct sm, 1);
+	sm->thing = thing;
+	sm->current_state = &states[ST_DISCONNECTED];
 
 	l_info("Current state: %s", state_to_str(ST_DISCONNECTED));
+
+	return sm;
+}
+
+void sm_stop(struct sm *sm)
+{
+	l_free(sm);
 }
@@ -32,8 +32,13 @@ enum EVENTS {
 	EVT_UNREG_REQ,
 	EVT_REG_PERM,
 	EVT_PUB_DATA,
-	EVT_DATA_UPDT
+	EVT_DATA_UPDT,
+	EVT_CFG_CHANGED
 };
 
-void sm_start(void);
-void sm_input_event(enum EVENTS, void *user_data);
+struct knot_thing;
+struct sm;
+
+struct sm *sm_start(struct knot_thing *thing);
+void sm_stop(struct sm *sm);
+void sm_input_event(struct sm *sm, enum EVENTS event, void *user_data);
@@ -0,0 +1,215 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Published values state source file
+ *
+ *  The last value published for each data item, and when, is kept in a
+ *  file of fixed-size records. Each publish rewrites its own record in
+ *  place; the file is synced in batches, so a crash loses at most the
+ *  publishes of the last sync period and those are just sent again.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "state.h"
+
+#define STATE_MAGIC		0x4b4e5354	/* "KNST" */
+#define STATE_VERSION		1
+#define SYNC_PERIOD		5	/* seconds */
+
+struct state_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+struct state_record {
+	int32_t sensor_id;
+	uint32_t reserved;
+	int64_t published;	/* usec since the epoch */
+	knot_value_type value;
+};
+
+struct state_slot {
+	unsigned int index;
+	struct state_record record;
+};
+
+struct state {
+	int fd;
+	struct l_hashmap *slots;
+	unsigned int n_slots;
+	struct l_timeout *sync_to;
+	bool dirty;
+};
+
+static off_t slot_offset(unsigned int index)
+{
+	return sizeof(struct state_header) +
+		(off_t) index * sizeof(struct state_record);
+}
+
+static void on_sync_timeout(struct l_timeout *to, void *user_data)
+{
+	struct state *state = user_data;
+
+	if (state->dirty && fdatasync(state->fd) < 0)
+		l_error("Failed to sync state (%s)", strerror(errno));
+
+	state->dirty = false;
+}
+
+static int load_records(struct state *state)
+{
+	struct state_header header;
+	struct state_slot *slot;
+	struct state_record record;
+	ssize_t n;
+
+	n = pread(state->fd, &header, sizeof(header), 0);
+	if (n == sizeof(header) && header.magic == STATE_MAGIC &&
+	    header.version == STATE_VERSION &&
+	    header.record_size == sizeof(struct state_record)) {
+		while (pread(state->fd, &record, sizeof(record),
+			     slot_offset(state->n_slots)) == sizeof(record)) {
+			slot = l_new(struct state_slot, 1);
+			slot->index = state->n_slots++;
+			slot->record = record;
+			l_hashmap_replace(state->slots,
+					  L_INT_TO_PTR(record.sensor_id),
+					  slot, NULL);
+		}
+
+		return 0;
+	}
+
+	/* Missing or foreign: start from an empty state */
+	memset(&header, 0, sizeof(header));
+	header.magic = STATE_MAGIC;
+	header.version = STATE_VERSION;
+	header.record_size = sizeof(struct state_record);
+
+	if (ftruncate(state->fd, 0) < 0 ||
+	    pwrite(state->fd, &header, sizeof(header), 0) != sizeof(header))
+		return -errno;
+
+	return 0;
+}
+
+struct state *state_open(const char *path)
+{
+	struct state *state;
+	int err;
+
+	state = l_new(struct state, 1);
+	state->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (state->fd < 0) {
+		err = errno;
+		l_free(state);
+		errno = err;
+		return NULL;
+	}
+
+	state->slots = l_hashmap_new();
+
+	err = load_records(state);
+	if (err < 0) {
+		state_close(state);
+		errno = -err;
+		return NULL;
+	}
+
+	state->sync_to = l_timeout_create(SYNC_PERIOD, on_sync_timeout, state,
+					  NULL);
+
+	return state;
+}
+
+void state_close(struct state *state)
+{
+	if (!state)
+		return;
+
+	if (state->sync_to)
+		l_timeout_remove(state->sync_to);
+
+	if (state->dirty)
+		fdatasync(state->fd);
+
+	close(state->fd);
+
+	l_hashmap_destroy(state->slots, l_free);
+	l_free(state);
+}
+
+int state_load(struct state *state, int sensor_id, knot_value_type *value,
+	       int64_t *published)
+{
+	struct state_slot *slot;
+
+	if (!state)
+		return -ENOENT;
+
+	slot = l_hashmap_lookup(state->slots, L_INT_TO_PTR(sensor_id));
+	if (!slot)
+		return -ENOENT;
+
+	*value = slot->record.value;
+	*published = slot->record.published;
+
+	return 0;
+}
+
+void state_save(struct state *state, int sensor_id,
+		const knot_value_type *value, int64_t published)
+{
+	struct state_slot *slot;
+
+	if (!state)
+		return;
+
+	slot = l_hashmap_lookup(state->slots, L_INT_TO_PTR(sensor_id));
+	if (!slot) {
+		slot = l_new(struct state_slot, 1);
+		slot->index = state->n_slots++;
+		slot->record.sensor_id = sensor_id;
+		l_hashmap_insert(state->slots, L_INT_TO_PTR(sensor_id), slot);
+	}
+
+	slot->record.value = *value;
+	slot->record.published = published;
+
+	if (pwrite(state->fd, &slot->record, sizeof(slot->record),
+		   slot_offset(slot->index)) != sizeof(slot->record)) {
+		l_error("Failed to save state of data_item #%d", sensor_id);
+		return;
+	}
+
+	if (!state->dirty)
+		l_timeout_modify(state->sync_to, SYNC_PERIOD);
+
+	state->dirty = true;
+}
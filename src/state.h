@@ -0,0 +1,29 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Published values state header file
+ */
+
+struct state;
+
+struct state *state_open(const char *path);
+void state_close(struct state *state);
+int state_load(struct state *state, int sensor_id, knot_value_type *value,
+	       int64_t *published);
+void state_save(struct state *state, int sensor_id,
+		const knot_value_type *value, int64_t published);
@@ -24,19 +24,32 @@
 #endif
 
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <libgen.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <regex.h>
 
 #include <ell/ell.h>
 
 #include "storage.h"
 #include "conf-parameters.h"
 
+#define TMP_SUFFIX ".tmp"
+
+/* Where each open file lives, and its pending transaction */
+struct storage_file {
+	char *pathname;
+	bool transaction;
+	bool dirty;
+	bool read_only;
+};
+
 static struct l_hashmap *storage_list = NULL;
+static struct l_hashmap *storage_files;
 
 static int make_dirs(const char *filename, const mode_t mode)
 {
@@ -81,57 +94,167 @@ static int make_dirs(const char *filename, const mode_t mode)
 	return 0;
 }
 
-static int save_settings(int fd, struct l_settings *settings)
+static void storage_file_free(void *data)
+{
+	struct storage_file *file = data;
+
+	if (!file)
+		return;
+
+	l_free(file->pathname);
+	l_free(file);
+}
+
+/* Walk handles only read their group: nothing may change through them */
+static bool storage_read_only(int fd)
+{
+	struct storage_file *file;
+
+	file = l_hashmap_lookup(storage_files, L_INT_TO_PTR(fd));
+
+	return file && file->read_only;
+}
+
+static int sync_dir(const char *pathname)
+{
+	char *path = l_strdup(pathname);
+	int err = 0;
+	int fd;
+
+	fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd) < 0)
+		err = -errno;
+
+	if (fd >= 0)
+		close(fd);
+
+	l_free(path);
+
+	return err;
+}
+
+/* Written aside, then renamed over: the file is never seen half done */
+static int replace_settings(int fd, struct storage_file *file,
+			    struct l_settings *settings)
 {
+	struct stat st;
+	char *real_path;
+	char *tmp_path;
 	char *res;
 	size_t res_len;
+	ssize_t written;
+	int tmp_fd;
 	int err = 0;
 
+	/* A symlink is followed, so that its target is what gets replaced */
+	real_path = realpath(file->pathname, NULL);
+	if (!real_path)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		free(real_path);
+		return err;
+	}
+
 	res = l_settings_to_data(settings, &res_len);
+	tmp_path = l_strdup_printf("%s%s", real_path, TMP_SUFFIX);
 
-	if (ftruncate(fd, 0) == -1) {
+	tmp_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (tmp_fd < 0) {
 		err = -errno;
 		goto failure;
 	}
 
-	if (pwrite(fd, res, res_len, 0) < 0)
+	/*
+	 * The new file keeps the owner and the mode of the one replaced.
+	 * Unprivileged processes may not give a file away: it is then left
+	 * to the caller, who could write the old one anyway.
+	 */
+	if (fchown(tmp_fd, st.st_uid, st.st_gid) < 0) {
+		if (errno != EPERM) {
+			err = -errno;
+			goto discard;
+		}
+
+		l_warn("storage: %s is now owned by this process",
+		       real_path);
+	}
+
+	if (fchmod(tmp_fd, st.st_mode & 07777) < 0) {
 		err = -errno;
+		goto discard;
+	}
+
+	/* A short write sets no errno */
+	written = write(tmp_fd, res, res_len);
+	if (written != (ssize_t) res_len) {
+		err = written < 0 ? -errno : -EIO;
+		goto discard;
+	}
+
+	if (fsync(tmp_fd) < 0 || rename(tmp_path, real_path) < 0) {
+		err = -errno;
+		goto discard;
+	}
+
+	/* Callers keep their descriptor, now on the new file */
+	if (dup2(tmp_fd, fd) < 0)
+		err = -errno;
+
+	close(tmp_fd);
+
+	if (!err)
+		err = sync_dir(real_path);
+
+	goto failure;
+
+discard:
+	close(tmp_fd);
+	unlink(tmp_path);
 
 failure:
+	l_free(tmp_path);
 	l_free(res);
+	free(real_path);
 
 	return err;
 }
 
-static int check_valid_groups(char **all_groups, int index)
+static int save_settings(int fd, struct l_settings *settings)
 {
-	int repeated_check;
-	regex_t preg;
-	int i;
-
-	regcomp(&preg, "^DataItem_[0-9]+$", REG_EXTENDED);
+	struct storage_file *file;
+	char *res;
+	size_t res_len;
+	int err = 0;
 
-	if (!regexec(&preg, all_groups[index], 0, (regmatch_t *)NULL, 0) == 0) {
-		l_error("Invalid DataItem group: %s", all_groups[index]);
-		regfree(&preg);
-		return -EINVAL;
+	/* Within a transaction, changes stay in memory until the commit */
+	file = l_hashmap_lookup(storage_files, L_INT_TO_PTR(fd));
+	if (file && file->transaction) {
+		file->dirty = true;
+		return 0;
 	}
 
-	for (i = index + 1; all_groups[i] != NULL; i++) {
-		repeated_check = strcmp(all_groups[i], all_groups[index]);
-		if (repeated_check == 0) {
-			l_error("Repeated DataItem group: %s", all_groups[i]);
-			regfree(&preg);
-			return -EINVAL;
-		}
+	res = l_settings_to_data(settings, &res_len);
+
+	if (ftruncate(fd, 0) == -1) {
+		err = -errno;
+		goto failure;
 	}
 
-	return 0;
+	if (pwrite(fd, res, res_len, 0) < 0)
+		err = -errno;
+
+failure:
+	l_free(res);
+
+	return err;
 }
 
 int storage_open(const char *pathname)
 {
 	struct l_settings *settings;
+	struct storage_file *file;
 	int fd, err;
 
 	err = make_dirs(pathname, S_IRUSR | S_IWUSR | S_IXUSR);
@@ -149,7 +272,14 @@ int storage_open(const char *pathname)
 	if (!storage_list)
 		storage_list = l_hashmap_new();
 
+	if (!storage_files)
+		storage_files = l_hashmap_new();
+
+	file = l_new(struct storage_file, 1);
+	file->pathname = l_strdup(pathname);
+
 	l_hashmap_insert(storage_list, L_INT_TO_PTR(fd), settings);
+	l_hashmap_insert(storage_files, L_INT_TO_PTR(fd), file);
 
 	return fd;
 }
@@ -157,16 +287,63 @@ int storage_open(const char *pathname)
 int storage_close(int fd)
 {
 	struct l_settings *settings;
+	struct storage_file *file;
+
+	if (storage_read_only(fd))
+		return -EBADF;
 
 	settings = l_hashmap_remove(storage_list, L_INT_TO_PTR(fd));
 	if(!settings)
 		return -ENOENT;
 
+	file = l_hashmap_remove(storage_files, L_INT_TO_PTR(fd));
+	if (file && file->dirty)
+		l_error("storage: %s closed with uncommitted changes",
+			file->pathname);
+
+	storage_file_free(file);
 	l_settings_free(settings);
 
 	return close(fd);
 }
 
+int storage_begin(int fd)
+{
+	struct storage_file *file;
+
+	file = l_hashmap_lookup(storage_files, L_INT_TO_PTR(fd));
+	if (!file || file->read_only)
+		return -EINVAL;
+
+	if (file->transaction)
+		return -EALREADY;
+
+	file->transaction = true;
+	file->dirty = false;
+
+	return 0;
+}
+
+int storage_commit(int fd)
+{
+	struct l_settings *settings;
+	struct storage_file *file;
+	int err = 0;
+
+	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	file = l_hashmap_lookup(storage_files, L_INT_TO_PTR(fd));
+	if (!settings || !file || !file->transaction)
+		return -EINVAL;
+
+	if (file->dirty)
+		err = replace_settings(fd, file, settings);
+
+	file->transaction = false;
+	file->dirty = false;
+
+	return err;
+}
+
 void storage_foreach_slave(int fd, storage_foreach_slave_t func,
 						void *user_data)
 {
@@ -267,6 +444,9 @@ int storage_write_key_string(int fd, const char *group,
 	if (!settings)
 		return -EIO;
 
+	if (storage_read_only(fd))
+		return -EBADF;
+
 	if (l_settings_set_string(settings, group, key, value) == false)
 		return -EINVAL;
 
@@ -292,6 +472,9 @@ int storage_write_key_int(int fd, const char *group, const char *key, int value)
 	if (!settings)
 		return -EINVAL;
 
+	if (storage_read_only(fd))
+		return -EBADF;
+
 	if (l_settings_set_int(settings, group, key, value) == false)
 		return -EINVAL;
 
@@ -319,6 +502,9 @@ int storage_write_key_float(int fd, const char *group, const char *key,
 	if (!settings)
 		return -EINVAL;
 
+	if (storage_read_only(fd))
+		return -EBADF;
+
 	if (l_settings_set_float(settings, group, key, value) == false)
 		return -EINVAL;
 
@@ -352,6 +538,9 @@ int storage_write_key_bool(int fd, const char *group, const char *key,
 	if (!settings)
 		return -EINVAL;
 
+	if (storage_read_only(fd))
+		return -EBADF;
+
 	if (l_settings_set_bool(settings, group, key, value) == false)
 		return -EINVAL;
 
@@ -379,6 +568,9 @@ int storage_write_key_int64(int fd, const char *group, const char *key,
 	if (!settings)
 		return -EINVAL;
 
+	if (storage_read_only(fd))
+		return -EBADF;
+
 	if (l_settings_set_int64(settings, group, key, value) == false)
 		return -EINVAL;
 
@@ -406,6 +598,9 @@ int storage_write_key_uint(int fd, const char *group, const char *key,
 	if (!settings)
 		return -EINVAL;
 
+	if (storage_read_only(fd))
+		return -EBADF;
+
 	if (l_settings_set_uint(settings, group, key, value) == false)
 		return -EINVAL;
 
@@ -433,6 +628,9 @@ int storage_write_key_uint64(int fd, const char *group, const char *key,
 	if (!settings)
 		return -EINVAL;
 
+	if (storage_read_only(fd))
+		return -EBADF;
+
 	if (l_settings_set_uint64(settings, group, key, value) == false)
 		return -EINVAL;
 
@@ -447,6 +645,9 @@ int storage_remove_group(int fd, const char *group)
 	if (!settings)
 		return -EINVAL;
 
+	if (storage_read_only(fd))
+		return -EBADF;
+
 	if (l_settings_remove_group(settings, group) == false)
 		return -EINVAL;
 
@@ -461,6 +662,9 @@ int storage_remove_key(int fd, const char *group, const char *key)
 	if (!settings)
 		return -EINVAL;
 
+	if (storage_read_only(fd))
+		return -EBADF;
+
 	if (l_settings_remove_key(settings, group, key) == false)
 		return -EINVAL;
 
@@ -478,36 +682,152 @@ bool storage_has_unit(int fd, const char *group, const char *key)
 	return l_settings_has_key(settings, group, key);
 }
 
-char **get_data_item_groups(int fd)
+/* <prefix> followed by a number, e.g. DataItem_1 */
+static bool valid_group_name(const char *group, const char *prefix)
+{
+	size_t len = strlen(prefix);
+
+	if (strncmp(group, prefix, len) || group[len] == '\0')
+		return false;
+
+	return strspn(group + len, "0123456789") == strlen(group + len);
+}
+
+/* Handles are never valid descriptors, and are read only */
+static int walk_group(int handle, const char *group, const char *data,
+		      size_t len, storage_foreach_group_t func,
+		      void *user_data)
 {
 	struct l_settings *settings;
-	char **all_groups;
-	int group_index;
-	int data_item_check;
+	struct storage_file file;
 	int err;
 
-	err = 0;
+	if (!storage_list)
+		storage_list = l_hashmap_new();
+
+	if (!storage_files)
+		storage_files = l_hashmap_new();
+
+	settings = l_settings_new();
+	if (!l_settings_load_from_data(settings, data, len)) {
+		l_settings_free(settings);
+		return -EINVAL;
+	}
+
+	memset(&file, 0, sizeof(file));
+	file.read_only = true;
+
+	l_hashmap_insert(storage_list, L_INT_TO_PTR(handle), settings);
+	l_hashmap_insert(storage_files, L_INT_TO_PTR(handle), &file);
+	err = func(handle, group, user_data);
+	l_hashmap_remove(storage_files, L_INT_TO_PTR(handle));
+	l_hashmap_remove(storage_list, L_INT_TO_PTR(handle));
+
+	l_settings_free(settings);
+
+	return err;
+}
+
+int storage_foreach_group(int fd, const char *prefix,
+			  storage_foreach_group_t func, void *user_data)
+{
+	struct l_settings *settings;
+	struct l_hashmap *seen;
+	const char *start = NULL;
+	const char *pos;
+	const char *end;
+	const char *eol;
+	const char *next;
+	char *group = NULL;
+	char *data;
+	size_t len;
+	int err = 0;
 
 	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	if (!settings)
+		return -EINVAL;
+
+	/*
+	 * Looking a key up in l_settings scans every group before it, so
+	 * the groups are split apart in one pass over the serialized file
+	 * and each is read on its own.
+	 */
+	data = l_settings_to_data(settings, &len);
+	seen = l_hashmap_string_new();
+	end = data + len;
+
+	for (pos = data; !err; pos = next) {
+		eol = memchr(pos, '\n', end - pos);
+		next = eol ? eol + 1 : end;
+
+		if (pos != end && *pos != '[')
+			continue;
+
+		if (group && !strncmp(group, prefix, strlen(prefix))) {
+			if (!valid_group_name(group, prefix)) {
+				l_error("Invalid group: %s", group);
+				err = -EINVAL;
+			} else if (l_hashmap_lookup(seen, group)) {
+				l_error("Repeated group: %s", group);
+				err = -EINVAL;
+			} else {
+				l_hashmap_insert(seen, group,
+						 L_UINT_TO_PTR(1));
+				err = walk_group(-(fd + 2), group, start,
+						 pos - start, func, user_data);
+			}
+		}
 
+		l_free(group);
+		group = NULL;
+
+		if (pos == end)
+			break;
+
+		start = pos;
+		group = l_strndup(pos + 1, strcspn(pos + 1, "]\n"));
+	}
+
+	l_free(group);
+	l_hashmap_destroy(seen, NULL);
+	l_free(data);
+
+	return err;
+}
+
+int storage_read_data(const char *data, size_t len,
+		      storage_foreach_group_t func, void *user_data)
+{
+	return walk_group(-1, NULL, data, len, func, user_data);
+}
+
+char *storage_get_group_data(int fd, const char *group, size_t *len)
+{
+	struct l_settings *settings;
+	struct l_settings *copy;
+	char **keys;
+	char *data;
+	int i;
+
+	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
 	if (!settings)
 		return NULL;
 
-	all_groups = l_settings_get_groups(settings);
+	keys = l_settings_get_keys(settings, group);
+	if (!keys)
+		return NULL;
 
-	for (group_index = 0; all_groups[group_index] != NULL; group_index++) {
-		data_item_check = strncmp(all_groups[group_index],
-						DATA_ITEM_GROUP,
-						strlen(DATA_ITEM_GROUP));
-		if (data_item_check)
-			l_settings_remove_group(settings,
-						all_groups[group_index]);
-		else
-			err = check_valid_groups(all_groups, group_index);
+	copy = l_settings_new();
 
-	}
+	for (i = 0; keys[i] != NULL; i++)
+		l_settings_set_value(copy, group, keys[i],
+				     l_settings_get_value(settings, group,
+							  keys[i]));
+
+	data = l_settings_to_data(copy, len);
 
-	l_strfreev(all_groups);
+	l_settings_free(copy);
+	l_strfreev(keys);
 
-	return err < 0 ? NULL : l_settings_get_groups(settings);
+	return data;
 }
@@ -24,6 +24,9 @@ typedef void (storage_foreach_slave_t)(const char *key,
 				       const char *name,
 				       const char *address,
 				       void *user_data);
+typedef int (storage_foreach_group_t)(int fd,
+				      const char *group,
+				      void *user_data);
 typedef void (storage_foreach_source_t)(const char *address,
 				       const char *name,
 				       const char *type,
@@ -37,10 +40,18 @@ void storage_foreach_slave(int fd,
 void storage_foreach_source(int fd,
 			    storage_foreach_source_t func,
 			    void *user_data);
+int storage_foreach_group(int fd, const char *prefix,
+			  storage_foreach_group_t func, void *user_data);
+int storage_read_data(const char *data, size_t len,
+		      storage_foreach_group_t func, void *user_data);
+char *storage_get_group_data(int fd, const char *group, size_t *len);
 
 int storage_open(const char *pathname);
 int storage_close(int fd);
 
+int storage_begin(int fd);
+int storage_commit(int fd);
+
 int storage_remove_group(int fd, const char *group);
 int storage_remove_key(int fd, const char *group, const char *key);
 
@@ -79,5 +90,3 @@ int storage_write_key_uint64(int fd, const char *group, const char *key,
 			     uint64_t value);
 
 bool storage_has_unit(int fd, const char *group, const char *key);
-
-char **get_data_item_groups(int fd);
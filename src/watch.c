@@ -0,0 +1,199 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  File watch source file
+ *
+ *  The directory is watched rather than the file itself, since editors
+ *  and the storage layer replace the file instead of writing it in
+ *  place. Changes are reported once they settle, so that a save made
+ *  of several writes is seen as one. All the files share a single
+ *  inotify instance.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <ell/ell.h>
+
+#include "watch.h"
+
+#define SETTLE_TIME		500	/* ms */
+
+struct watch {
+	int wd;
+	char *name;
+	struct l_timeout *settle_to;
+	watch_cb_t cb;
+	void *user_data;
+};
+
+static struct l_io *watch_io;
+static struct l_queue *watches;
+
+static void on_settle_timeout(struct l_timeout *to, void *user_data)
+{
+	struct watch *watch = user_data;
+
+	watch->cb(watch->user_data);
+}
+
+static void watch_changed(const struct inotify_event *event)
+{
+	const struct l_queue_entry *entry;
+	struct watch *watch;
+
+	for (entry = l_queue_get_entries(watches); entry;
+	     entry = entry->next) {
+		watch = entry->data;
+
+		if (watch->wd != event->wd || strcmp(event->name, watch->name))
+			continue;
+
+		if (watch->settle_to)
+			l_timeout_modify_ms(watch->settle_to, SETTLE_TIME);
+		else
+			watch->settle_to = l_timeout_create_ms(SETTLE_TIME,
+							on_settle_timeout,
+							watch, NULL);
+	}
+}
+
+static bool on_watch_read(struct l_io *io, void *user_data)
+{
+	union {
+		struct inotify_event event;
+		char buf[4096];
+	} events;
+	const struct inotify_event *event;
+	ssize_t len;
+	char *pos;
+
+	len = read(l_io_get_fd(io), &events, sizeof(events));
+	if (len <= 0)
+		return true;
+
+	for (pos = events.buf; pos < events.buf + len;
+	     pos += sizeof(*event) + event->len) {
+		event = (const struct inotify_event *) pos;
+
+		if (event->len)
+			watch_changed(event);
+	}
+
+	return true;
+}
+
+static bool watch_match_wd(const void *a, const void *b)
+{
+	const struct watch *watch = a;
+	int wd = L_PTR_TO_INT(b);
+
+	return watch->wd == wd;
+}
+
+static int watch_io_start(void)
+{
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	watches = l_queue_new();
+
+	watch_io = l_io_new(fd);
+	l_io_set_close_on_destroy(watch_io, true);
+	l_io_set_read_handler(watch_io, on_watch_read, NULL, NULL);
+
+	return 0;
+}
+
+static void watch_io_stop(void)
+{
+	l_io_destroy(watch_io);
+	watch_io = NULL;
+
+	l_queue_destroy(watches, NULL);
+	watches = NULL;
+}
+
+struct watch *watch_add(const char *path, watch_cb_t cb, void *user_data)
+{
+	struct watch *watch;
+	char *dir;
+	char *name;
+	int err;
+	int wd;
+
+	if (!watch_io) {
+		err = watch_io_start();
+		if (err < 0) {
+			errno = -err;
+			return NULL;
+		}
+	}
+
+	/* Files in the same directory share its watch descriptor */
+	dir = l_strdup(path);
+	wd = inotify_add_watch(l_io_get_fd(watch_io), dirname(dir),
+			       IN_CLOSE_WRITE | IN_MOVED_TO);
+	err = errno;
+	l_free(dir);
+
+	if (wd < 0) {
+		if (l_queue_isempty(watches))
+			watch_io_stop();
+		errno = err;
+		return NULL;
+	}
+
+	name = l_strdup(path);
+
+	watch = l_new(struct watch, 1);
+	watch->wd = wd;
+	watch->name = l_strdup(basename(name));
+	watch->cb = cb;
+	watch->user_data = user_data;
+
+	l_free(name);
+
+	l_queue_push_tail(watches, watch);
+
+	return watch;
+}
+
+void watch_remove(struct watch *watch)
+{
+	if (!watch)
+		return;
+
+	l_queue_remove(watches, watch);
+
+	if (!l_queue_find(watches, watch_match_wd, L_INT_TO_PTR(watch->wd)))
+		inotify_rm_watch(l_io_get_fd(watch_io), watch->wd);
+
+	if (watch->settle_to)
+		l_timeout_remove(watch->settle_to);
+
+	l_free(watch->name);
+	l_free(watch);
+
+	if (l_queue_isempty(watches))
+		watch_io_stop();
+}
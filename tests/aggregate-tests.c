@@ -0,0 +1,207 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <ell/ell.h>
+
+#include "src/aggregate.h"
+
+#define TEST_ID		7
+#define STEP_MS		20
+#define GUARD_SEC	5
+#define MAX_SUMMARIES	3
+#define TOLERANCE	1e-9
+
+static struct aggregate *test_agg;
+static struct aggregate_summary summaries[MAX_SUMMARIES];
+static int n_summaries;
+static int closed_id;
+
+static void on_guard_timeout(struct l_timeout *to, void *user_data)
+{
+	l_main_quit();
+}
+
+static void on_tumbling_close(int id, const struct aggregate_summary *summary)
+{
+	closed_id = id;
+	summaries[n_summaries++] = *summary;
+	l_main_quit();
+}
+
+static void on_sliding_close(int id, const struct aggregate_summary *summary)
+{
+	summaries[n_summaries++] = *summary;
+
+	/* Samples taken after the first step fill the second pane */
+	if (n_summaries == 1) {
+		aggregate_add(test_agg, 10);
+		aggregate_add(test_agg, 20);
+	}
+
+	if (n_summaries == MAX_SUMMARIES)
+		l_main_quit();
+}
+
+static void run_until_closed(void)
+{
+	struct l_timeout *guard;
+
+	guard = l_timeout_create(GUARD_SEC, on_guard_timeout, NULL, NULL);
+	l_main_run();
+	l_timeout_remove(guard);
+}
+
+static void setup(void)
+{
+	l_main_init();
+	test_agg = NULL;
+	n_summaries = 0;
+	closed_id = -1;
+}
+
+static void teardown(void)
+{
+	aggregate_free(test_agg);
+	l_main_exit();
+}
+
+START_TEST(aggregate_parse_function_known_names)
+{
+	ck_assert_int_eq(aggregate_parse_function("mean"), AGGREGATE_MEAN);
+	ck_assert_int_eq(aggregate_parse_function("stddev"),
+			 AGGREGATE_STDDEV);
+	ck_assert_int_eq(aggregate_parse_function("median"), -EINVAL);
+}
+END_TEST
+
+START_TEST(aggregate_new_rejects_uneven_panes)
+{
+	/* The window must be a whole number of steps */
+	ck_assert_ptr_eq(aggregate_new(TEST_ID, 100, 30, on_tumbling_close),
+			 NULL);
+	ck_assert_ptr_eq(aggregate_new(TEST_ID, 100, 200, on_tumbling_close),
+			 NULL);
+	ck_assert_ptr_eq(aggregate_new(TEST_ID, 1000, 10, on_tumbling_close),
+			 NULL);
+}
+END_TEST
+
+START_TEST(aggregate_tumbling_window_summary)
+{
+	const double samples[] = { 2, 4, 4, 4, 5, 5, 7, 9 };
+	unsigned int i;
+
+	test_agg = aggregate_new(TEST_ID, STEP_MS, 0, on_tumbling_close);
+	ck_assert_ptr_ne(test_agg, NULL);
+
+	for (i = 0; i < L_ARRAY_SIZE(samples); i++)
+		aggregate_add(test_agg, samples[i]);
+
+	run_until_closed();
+
+	ck_assert_int_eq(n_summaries, 1);
+	ck_assert_int_eq(closed_id, TEST_ID);
+	ck_assert_uint_eq(summaries[0].count, 8);
+	ck_assert(fabs(summaries[0].mean - 5) < TOLERANCE);
+	ck_assert(fabs(summaries[0].min - 2) < TOLERANCE);
+	ck_assert(fabs(summaries[0].max - 9) < TOLERANCE);
+	ck_assert(fabs(summaries[0].last - 9) < TOLERANCE);
+	ck_assert(fabs(summaries[0].stddev - sqrt(32.0 / 7)) < TOLERANCE);
+}
+END_TEST
+
+START_TEST(aggregate_sliding_window_merges_panes)
+{
+	/* Mean and sample deviation of 1, 2, 3, 10 and 20 */
+	const double mean = 7.2;
+	const double stddev = sqrt(254.8 / 4);
+
+	test_agg = aggregate_new(TEST_ID, 2 * STEP_MS, STEP_MS,
+				 on_sliding_close);
+	ck_assert_ptr_ne(test_agg, NULL);
+
+	aggregate_add(test_agg, 1);
+	aggregate_add(test_agg, 2);
+	aggregate_add(test_agg, 3);
+
+	run_until_closed();
+
+	ck_assert_int_eq(n_summaries, MAX_SUMMARIES);
+
+	/* First step: only the first pane holds samples */
+	ck_assert_uint_eq(summaries[0].count, 3);
+	ck_assert(fabs(summaries[0].mean - 2) < TOLERANCE);
+
+	/* Second step: both panes merged, the newest sample last */
+	ck_assert_uint_eq(summaries[1].count, 5);
+	ck_assert(fabs(summaries[1].mean - mean) < TOLERANCE);
+	ck_assert(fabs(summaries[1].stddev - stddev) < TOLERANCE);
+	ck_assert(fabs(summaries[1].min - 1) < TOLERANCE);
+	ck_assert(fabs(summaries[1].max - 20) < TOLERANCE);
+	ck_assert(fabs(summaries[1].last - 20) < TOLERANCE);
+
+	/* Third step: the first pane slid out of the window */
+	ck_assert_uint_eq(summaries[2].count, 2);
+	ck_assert(fabs(summaries[2].mean - 15) < TOLERANCE);
+	ck_assert(fabs(summaries[2].min - 10) < TOLERANCE);
+}
+END_TEST
+
+Suite *aggregate_suite(void)
+{
+	Suite *agg_suite;
+	TCase *tc_config;
+	TCase *tc_window;
+
+	agg_suite = suite_create("Aggregate");
+
+	/* Configuration test case */
+	tc_config = tcase_create("Configuration");
+	tcase_add_test(tc_config, aggregate_parse_function_known_names);
+	tcase_add_test(tc_config, aggregate_new_rejects_uneven_panes);
+
+	suite_add_tcase(agg_suite, tc_config);
+
+	/* Window test case */
+	tc_window = tcase_create("Window");
+	tcase_add_checked_fixture(tc_window, setup, teardown);
+	tcase_add_test(tc_window, aggregate_tumbling_window_summary);
+	tcase_add_test(tc_window, aggregate_sliding_window_merges_panes);
+
+	suite_add_tcase(agg_suite, tc_window);
+
+	return agg_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *agg_suite;
+	SRunner *agg_suite_runner;
+
+	agg_suite = aggregate_suite();
+	agg_suite_runner = srunner_create(agg_suite);
+
+	srunner_run_all(agg_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(agg_suite_runner);
+	srunner_free(agg_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,268 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "src/conf-image.h"
+
+#define DIR_TEMPLATE	"/tmp/conf-image-tests-XXXXXX"
+#define THING_TEXT	"[KNoTThing]\nName=test\n"
+#define VERSION_OFFSET	4
+#define MAX_ITEMS	8
+
+struct seen_item {
+	int sensor_id;
+	char url[32];
+};
+
+static char test_dir[sizeof(DIR_TEMPLATE)];
+static char *source_path;
+static char *image_path;
+static struct seen_item seen[MAX_ITEMS];
+static int n_seen;
+
+static void write_source(const char *content)
+{
+	FILE *file;
+
+	file = fopen(source_path, "w");
+	ck_assert_ptr_ne(file, NULL);
+	ck_assert(fputs(content, file) >= 0);
+	fclose(file);
+}
+
+static void add_item(struct conf_image_builder *builder, int sensor_id,
+		     const char *url, int slave_id, int reg_addr)
+{
+	struct conf_image_item item;
+
+	memset(&item, 0, sizeof(item));
+	item.sensor_id = sensor_id;
+	item.slave_id = slave_id;
+	item.reg_addr = reg_addr;
+
+	conf_image_builder_add_item(builder, &item, url);
+}
+
+/* Items on three links, added out of acquisition order */
+static void build_image(void)
+{
+	struct conf_image_builder *builder;
+
+	builder = conf_image_builder_new(source_path);
+	ck_assert_ptr_ne(builder, NULL);
+
+	add_item(builder, 1, "tcp://b:502", 1, 10);
+	add_item(builder, 2, NULL, 2, 20);
+	add_item(builder, 3, "tcp://a:502", 1, 30);
+	add_item(builder, 4, NULL, 1, 40);
+	add_item(builder, 5, NULL, 1, 5);
+	conf_image_builder_set_thing(builder, THING_TEXT, strlen(THING_TEXT));
+
+	ck_assert_int_eq(conf_image_builder_save(builder, image_path), 0);
+	conf_image_builder_free(builder);
+}
+
+static void patch_image(off_t offset, const void *data, size_t len)
+{
+	int fd;
+
+	fd = open(image_path, O_WRONLY);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(pwrite(fd, data, len, offset), len);
+	close(fd);
+}
+
+static int on_item(const struct conf_image_item *item, const char *url,
+		   void *user_data)
+{
+	ck_assert_int_lt(n_seen, MAX_ITEMS);
+
+	seen[n_seen].sensor_id = item->sensor_id;
+	snprintf(seen[n_seen].url, sizeof(seen[n_seen].url), "%s",
+		 url ? url : "");
+	n_seen++;
+
+	return 0;
+}
+
+static void setup(void)
+{
+	strcpy(test_dir, DIR_TEMPLATE);
+	ck_assert_ptr_ne(mkdtemp(test_dir), NULL);
+
+	source_path = l_strdup_printf("%s/device.conf", test_dir);
+	image_path = l_strdup_printf("%s/device.image", test_dir);
+	n_seen = 0;
+
+	write_source(THING_TEXT "[DataItem_1]\nSchemaSensorId=1\n");
+}
+
+static void teardown(void)
+{
+	unlink(image_path);
+	unlink(source_path);
+	rmdir(test_dir);
+
+	l_free(image_path);
+	l_free(source_path);
+}
+
+START_TEST(conf_image_items_in_acquisition_order)
+{
+	struct conf_image *image;
+	const char *thing;
+	size_t len;
+
+	build_image();
+
+	image = conf_image_open(image_path, source_path);
+	ck_assert_ptr_ne(image, NULL);
+
+	thing = conf_image_get_thing(image, &len);
+	ck_assert_uint_eq(len, strlen(THING_TEXT));
+	ck_assert(!memcmp(thing, THING_TEXT, len));
+
+	/* The thing's link first, then by URL, slave and register */
+	ck_assert_int_eq(conf_image_foreach_item(image, on_item, NULL), 0);
+	ck_assert_int_eq(n_seen, 5);
+	ck_assert_int_eq(seen[0].sensor_id, 5);
+	ck_assert_int_eq(seen[1].sensor_id, 4);
+	ck_assert_int_eq(seen[2].sensor_id, 2);
+	ck_assert_str_eq(seen[2].url, "");
+	ck_assert_int_eq(seen[3].sensor_id, 3);
+	ck_assert_str_eq(seen[3].url, "tcp://a:502");
+	ck_assert_int_eq(seen[4].sensor_id, 1);
+	ck_assert_str_eq(seen[4].url, "tcp://b:502");
+
+	conf_image_close(image);
+}
+END_TEST
+
+START_TEST(conf_image_rejects_bad_checksum)
+{
+	struct stat st;
+	char byte = '#';
+
+	build_image();
+
+	/* The last byte of the thing text */
+	ck_assert_int_eq(stat(image_path, &st), 0);
+	patch_image(st.st_size - 1, &byte, sizeof(byte));
+
+	ck_assert_ptr_eq(conf_image_open(image_path, source_path), NULL);
+}
+END_TEST
+
+START_TEST(conf_image_rejects_other_version)
+{
+	uint32_t version = 0xffff;
+
+	build_image();
+	patch_image(VERSION_OFFSET, &version, sizeof(version));
+
+	ck_assert_ptr_eq(conf_image_open(image_path, source_path), NULL);
+}
+END_TEST
+
+START_TEST(conf_image_rejects_truncated_image)
+{
+	struct stat st;
+
+	build_image();
+
+	ck_assert_int_eq(stat(image_path, &st), 0);
+	ck_assert_int_eq(truncate(image_path, st.st_size - 1), 0);
+
+	ck_assert_ptr_eq(conf_image_open(image_path, source_path), NULL);
+}
+END_TEST
+
+START_TEST(conf_image_out_of_date_after_edit)
+{
+	build_image();
+
+	write_source(THING_TEXT "[DataItem_2]\nSchemaSensorId=22\n");
+
+	ck_assert_ptr_eq(conf_image_open(image_path, source_path), NULL);
+}
+END_TEST
+
+START_TEST(conf_image_current_after_touch)
+{
+	struct conf_image *image;
+	struct timespec times[2] = {
+		{ .tv_sec = 1, .tv_nsec = 0 },
+		{ .tv_sec = 1, .tv_nsec = 0 },
+	};
+
+	build_image();
+
+	/* Same contents under another mtime: still the same file */
+	ck_assert_int_eq(utimensat(AT_FDCWD, source_path, times, 0), 0);
+
+	image = conf_image_open(image_path, source_path);
+	ck_assert_ptr_ne(image, NULL);
+	conf_image_close(image);
+}
+END_TEST
+
+Suite *conf_image_suite(void)
+{
+	Suite *img_suite;
+	TCase *tc_image;
+
+	img_suite = suite_create("Configuration Image");
+
+	/* Image test case */
+	tc_image = tcase_create("Image");
+	tcase_add_checked_fixture(tc_image, setup, teardown);
+	tcase_add_test(tc_image, conf_image_items_in_acquisition_order);
+	tcase_add_test(tc_image, conf_image_rejects_bad_checksum);
+	tcase_add_test(tc_image, conf_image_rejects_other_version);
+	tcase_add_test(tc_image, conf_image_rejects_truncated_image);
+	tcase_add_test(tc_image, conf_image_out_of_date_after_edit);
+	tcase_add_test(tc_image, conf_image_current_after_touch);
+
+	suite_add_tcase(img_suite, tc_image);
+
+	return img_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *img_suite;
+	SRunner *img_suite_runner;
+
+	img_suite = conf_image_suite();
+	img_suite_runner = srunner_create(img_suite);
+
+	srunner_run_all(img_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(img_suite_runner);
+	srunner_free(img_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
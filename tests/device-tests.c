@@ -23,11 +23,13 @@
 
 START_TEST(device_generate_thing_id_is_not_empty)
 {
+	struct knot_thing *thing = device_thing_new();
 	char fst[KNOT_PROTOCOL_UUID_LEN + 1];
 
-	device_generate_thing_id();
-	strncpy(fst, device_get_id(), KNOT_PROTOCOL_UUID_LEN);
+	device_generate_thing_id(thing);
+	strncpy(fst, device_get_id(thing), KNOT_PROTOCOL_UUID_LEN);
 	fst[KNOT_PROTOCOL_UUID_LEN] = '\0';
+	device_thing_destroy(thing);
 
 	ck_assert_str_ne(fst, "\0");
 }
@@ -35,16 +37,18 @@ END_TEST
 
 START_TEST(device_generate_thing_id_is_different_from_previous)
 {
+	struct knot_thing *thing = device_thing_new();
 	char fst[KNOT_PROTOCOL_UUID_LEN + 1];
 	char snd[KNOT_PROTOCOL_UUID_LEN + 1];
 
-	device_generate_thing_id();
-	strncpy(fst, device_get_id(), KNOT_PROTOCOL_UUID_LEN);
+	device_generate_thing_id(thing);
+	strncpy(fst, device_get_id(thing), KNOT_PROTOCOL_UUID_LEN);
 	fst[KNOT_PROTOCOL_UUID_LEN] = '\0';
 
-	device_generate_thing_id();
-	strncpy(snd, device_get_id(), KNOT_PROTOCOL_UUID_LEN);
+	device_generate_thing_id(thing);
+	strncpy(snd, device_get_id(thing), KNOT_PROTOCOL_UUID_LEN);
 	snd[KNOT_PROTOCOL_UUID_LEN] = '\0';
+	device_thing_destroy(thing);
 
 	ck_assert_str_ne(fst, snd);
 }
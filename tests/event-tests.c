@@ -0,0 +1,213 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "src/event.h"
+
+#define TEST_ID		3
+#define PERIOD_SEC	1
+#define LONG_PERIOD_SEC	60
+#define GUARD_MS	2500
+#define HALF_PERIOD_MS	500
+#define MSEC_PER_SEC	1000
+
+static int fired_id;
+static int n_fired;
+static uint64_t fired_ms;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * MSEC_PER_SEC + ts.tv_nsec / 1000000;
+}
+
+static knot_event periodic(unsigned int time_sec)
+{
+	knot_event event = {
+		.event_flags = KNOT_EVT_FLAG_TIME,
+		.time_sec = time_sec,
+	};
+
+	return event;
+}
+
+static void on_item_timeout(int id)
+{
+	fired_id = id;
+	fired_ms = now_ms();
+	n_fired++;
+	l_main_quit();
+}
+
+static void on_guard_timeout(struct l_timeout *to, void *user_data)
+{
+	l_main_quit();
+}
+
+/* Returns once an item timer fired, or the guard expired */
+static void run_until_fired(void)
+{
+	struct l_timeout *guard;
+
+	guard = l_timeout_create_ms(GUARD_MS, on_guard_timeout, NULL, NULL);
+	l_main_run();
+	l_timeout_remove(guard);
+}
+
+static void on_half_period(struct l_timeout *to, void *user_data)
+{
+	/* The same period again, as a config for another item would */
+	event_update_data_item(TEST_ID, periodic(PERIOD_SEC));
+}
+
+static void setup(void)
+{
+	l_main_init();
+	ck_assert_int_eq(event_start(on_item_timeout), 0);
+	fired_id = -1;
+	n_fired = 0;
+}
+
+static void teardown(void)
+{
+	event_stop();
+	l_main_exit();
+}
+
+START_TEST(event_update_adds_new_periodic_item)
+{
+	event_update_data_item(TEST_ID, periodic(PERIOD_SEC));
+
+	run_until_fired();
+
+	ck_assert_int_eq(n_fired, 1);
+	ck_assert_int_eq(fired_id, TEST_ID);
+}
+END_TEST
+
+START_TEST(event_update_clears_periodic_item)
+{
+	knot_event event = { .event_flags = KNOT_EVT_FLAG_CHANGE };
+
+	event_add_data_item(TEST_ID, periodic(PERIOD_SEC));
+	event_update_data_item(TEST_ID, event);
+
+	run_until_fired();
+
+	ck_assert_int_eq(n_fired, 0);
+}
+END_TEST
+
+START_TEST(event_update_restarts_changed_period)
+{
+	event_add_data_item(TEST_ID, periodic(LONG_PERIOD_SEC));
+	event_update_data_item(TEST_ID, periodic(PERIOD_SEC));
+
+	run_until_fired();
+
+	ck_assert_int_eq(n_fired, 1);
+	ck_assert_int_eq(fired_id, TEST_ID);
+}
+END_TEST
+
+START_TEST(event_update_keeps_phase_of_same_period)
+{
+	struct l_timeout *half;
+	uint64_t start = now_ms();
+
+	event_add_data_item(TEST_ID, periodic(PERIOD_SEC));
+	half = l_timeout_create_ms(HALF_PERIOD_MS, on_half_period, NULL,
+				   NULL);
+
+	run_until_fired();
+	l_timeout_remove(half);
+
+	/* Still due one period after it was added, not after the update */
+	ck_assert_int_eq(n_fired, 1);
+	ck_assert(fired_ms - start < PERIOD_SEC * MSEC_PER_SEC +
+		  HALF_PERIOD_MS);
+}
+END_TEST
+
+START_TEST(event_remove_data_item_stops_timer)
+{
+	event_add_data_item(TEST_ID, periodic(PERIOD_SEC));
+	event_remove_data_item(TEST_ID);
+
+	run_until_fired();
+
+	ck_assert_int_eq(n_fired, 0);
+}
+END_TEST
+
+START_TEST(event_update_ignored_when_stopped)
+{
+	event_stop();
+	event_update_data_item(TEST_ID, periodic(PERIOD_SEC));
+
+	run_until_fired();
+
+	ck_assert_int_eq(n_fired, 0);
+}
+END_TEST
+
+Suite *event_suite(void)
+{
+	Suite *evt_suite;
+	TCase *tc_timer;
+
+	evt_suite = suite_create("Event");
+
+	/* Timer test case */
+	tc_timer = tcase_create("Timer");
+	tcase_add_checked_fixture(tc_timer, setup, teardown);
+	tcase_add_test(tc_timer, event_update_adds_new_periodic_item);
+	tcase_add_test(tc_timer, event_update_clears_periodic_item);
+	tcase_add_test(tc_timer, event_update_restarts_changed_period);
+	tcase_add_test(tc_timer, event_update_keeps_phase_of_same_period);
+	tcase_add_test(tc_timer, event_remove_data_item_stops_timer);
+	tcase_add_test(tc_timer, event_update_ignored_when_stopped);
+
+	suite_add_tcase(evt_suite, tc_timer);
+
+	return evt_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *evt_suite;
+	SRunner *evt_suite_runner;
+
+	evt_suite = event_suite();
+	evt_suite_runner = srunner_create(evt_suite);
+
+	srunner_run_all(evt_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(evt_suite_runner);
+	srunner_free(evt_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,268 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ell/ell.h>
+
+#include "src/history.h"
+
+#define TEST_ID		1
+#define CAPACITY	4
+#define RESPONSE_MAX	512
+#define TOLERANCE	1e-9
+#define DIR_TEMPLATE	"/tmp/history-tests-XXXXXX"
+
+static char test_dir[sizeof(DIR_TEMPLATE)];
+static char *ring_path;
+static char *socket_path;
+static struct history *test_history;
+static struct history_server *test_server;
+
+static struct history *history_lookup(int id, void *user_data)
+{
+	return id == TEST_ID ? test_history : NULL;
+}
+
+/* Asks the server over its socket, answered on the next loop iteration */
+static void query(const char *request, char *response)
+{
+	struct sockaddr_un addr;
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(connect(fd, (struct sockaddr *) &addr,
+				 sizeof(addr)), 0);
+	ck_assert_int_eq(send(fd, request, strlen(request), 0),
+			 strlen(request));
+
+	l_main_iterate(1000);
+
+	while ((n = recv(fd, response + len, RESPONSE_MAX - 1 - len,
+			 0)) > 0)
+		len += n;
+
+	response[len] = '\0';
+	close(fd);
+}
+
+struct bucket {
+	long long start;
+	unsigned int count;
+	unsigned int bad;
+	double min;
+	double max;
+	double mean;
+};
+
+/* A single bucket around now, spanning every record appended */
+static void query_all(struct bucket *bucket)
+{
+	char response[RESPONSE_MAX];
+	char request[64];
+	long long now = time(NULL);
+	int rc;
+
+	snprintf(request, sizeof(request), "%d %lld %lld 1\n", TEST_ID,
+		 now - 60, now + 60);
+	query(request, response);
+
+	rc = sscanf(response, "%lld %u %u %lf %lf %lf", &bucket->start,
+		    &bucket->count, &bucket->bad, &bucket->min, &bucket->max,
+		    &bucket->mean);
+	ck_assert_int_eq(rc, 6);
+}
+
+static void setup(void)
+{
+	l_main_init();
+
+	strcpy(test_dir, DIR_TEMPLATE);
+	ck_assert_ptr_ne(mkdtemp(test_dir), NULL);
+	ring_path = l_strdup_printf("%s/%d.ring", test_dir, TEST_ID);
+	socket_path = l_strdup_printf("%s/history.sock", test_dir);
+
+	test_history = history_open(ring_path, CAPACITY);
+	test_server = history_server_start(socket_path, history_lookup, NULL);
+}
+
+static void teardown(void)
+{
+	history_server_stop(test_server);
+	history_close(test_history);
+
+	unlink(ring_path);
+	rmdir(test_dir);
+
+	l_free(socket_path);
+	l_free(ring_path);
+	l_main_exit();
+}
+
+START_TEST(history_open_rejects_empty_ring)
+{
+	ck_assert_ptr_eq(history_open(ring_path, 0), NULL);
+}
+END_TEST
+
+START_TEST(history_ring_keeps_newest_records)
+{
+	struct bucket bucket;
+	int i;
+
+	ck_assert_ptr_ne(test_history, NULL);
+	ck_assert_ptr_ne(test_server, NULL);
+
+	/* Six records in a ring of four: the first two are overwritten */
+	for (i = 1; i <= 6; i++)
+		history_append(test_history, i, HISTORY_QUALITY_GOOD);
+
+	query_all(&bucket);
+
+	ck_assert_uint_eq(bucket.count, CAPACITY);
+	ck_assert_uint_eq(bucket.bad, 0);
+	ck_assert(fabs(bucket.min - 3) < TOLERANCE);
+	ck_assert(fabs(bucket.max - 6) < TOLERANCE);
+	ck_assert(fabs(bucket.mean - 4.5) < TOLERANCE);
+}
+END_TEST
+
+START_TEST(history_bad_records_counted_apart)
+{
+	struct bucket bucket;
+
+	history_append(test_history, 10, HISTORY_QUALITY_GOOD);
+	history_append(test_history, 99, HISTORY_QUALITY_BAD);
+	history_append(test_history, 20, HISTORY_QUALITY_GOOD);
+
+	query_all(&bucket);
+
+	ck_assert_uint_eq(bucket.count, 2);
+	ck_assert_uint_eq(bucket.bad, 1);
+	ck_assert(fabs(bucket.max - 20) < TOLERANCE);
+	ck_assert(fabs(bucket.mean - 15) < TOLERANCE);
+}
+END_TEST
+
+START_TEST(history_ring_survives_reopen)
+{
+	struct bucket bucket;
+	int i;
+
+	for (i = 1; i <= 5; i++)
+		history_append(test_history, i, HISTORY_QUALITY_GOOD);
+
+	history_close(test_history);
+	test_history = history_open(ring_path, CAPACITY);
+	ck_assert_ptr_ne(test_history, NULL);
+
+	/* Appending after the reopen continues from the saved head */
+	history_append(test_history, 6, HISTORY_QUALITY_GOOD);
+
+	query_all(&bucket);
+
+	ck_assert_uint_eq(bucket.count, CAPACITY);
+	ck_assert(fabs(bucket.min - 3) < TOLERANCE);
+	ck_assert(fabs(bucket.max - 6) < TOLERANCE);
+}
+END_TEST
+
+START_TEST(history_ring_of_another_shape_starts_over)
+{
+	char response[RESPONSE_MAX];
+
+	history_append(test_history, 1, HISTORY_QUALITY_GOOD);
+
+	history_close(test_history);
+	test_history = history_open(ring_path, CAPACITY * 2);
+	ck_assert_ptr_ne(test_history, NULL);
+
+	/* Empty buckets are not answered */
+	query("1 0 4000000000 1\n", response);
+	ck_assert_str_eq(response, "");
+}
+END_TEST
+
+START_TEST(history_unknown_id_is_an_error)
+{
+	char response[RESPONSE_MAX];
+
+	query("42 0 60 1\n", response);
+	ck_assert(!strncmp(response, "error ", 6));
+
+	query("1 60 0 1\n", response);
+	ck_assert(!strncmp(response, "error ", 6));
+}
+END_TEST
+
+Suite *history_suite(void)
+{
+	Suite *hst_suite;
+	TCase *tc_ring;
+	TCase *tc_server;
+
+	hst_suite = suite_create("History");
+
+	/* Ring test case */
+	tc_ring = tcase_create("Ring");
+	tcase_add_checked_fixture(tc_ring, setup, teardown);
+	tcase_add_test(tc_ring, history_open_rejects_empty_ring);
+	tcase_add_test(tc_ring, history_ring_keeps_newest_records);
+	tcase_add_test(tc_ring, history_bad_records_counted_apart);
+	tcase_add_test(tc_ring, history_ring_survives_reopen);
+	tcase_add_test(tc_ring, history_ring_of_another_shape_starts_over);
+
+	suite_add_tcase(hst_suite, tc_ring);
+
+	/* Server test case */
+	tc_server = tcase_create("Server");
+	tcase_add_checked_fixture(tc_server, setup, teardown);
+	tcase_add_test(tc_server, history_unknown_id_is_an_error);
+
+	suite_add_tcase(hst_suite, tc_server);
+
+	return hst_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *hst_suite;
+	SRunner *hst_suite_runner;
+
+	hst_suite = history_suite();
+	hst_suite_runner = srunner_create(hst_suite);
+
+	srunner_run_all(hst_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(hst_suite_runner);
+	srunner_free(hst_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,507 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <modbus/modbus.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "src/iface-modbus.h"
+#include "tests/mocks/fake-modbus-tcp.h"
+#include "tests/mocks/fake-modbus-rtu.h"
+
+#define TCP_URL		"tcp://127.0.0.1:502"
+#define RTU_URL		"serial:///dev/null:9600,N,8,1"
+/* t3.5 at 9600 bps, 8N1 */
+#define RTU_SILENT_US	3646
+#define TURNAROUND_MS	20
+#define USEC_PER_MSEC	1000
+#define U16		16
+/* Unconfigured addresses read along when merging, as BLOCK_MAX_GAP */
+#define MAX_GAP		8
+#define VALUE_BASE	1000
+#define GUARD_MS	500
+#define RUN_MS		20
+/* Just past the first backoff of a breaker, and one aging step */
+#define BACKOFF_MS	1100
+#define AGING_MS	1100
+#define MAX_READS	8
+
+struct read_result {
+	bool done;
+	int rc;
+	uint16_t value;
+};
+
+static struct iface_modbus_opts opts;
+static struct read_result results[MAX_READS];
+static int bus_id;
+static bool connected;
+
+static void on_connected(void *user_data)
+{
+	connected = true;
+	l_main_quit();
+}
+
+static void on_disconnected(void *user_data)
+{
+	connected = false;
+}
+
+static void on_read(int rc, knot_value_type *value, void *user_data)
+{
+	struct read_result *result = user_data;
+
+	result->done = true;
+	result->rc = rc;
+	if (value)
+		result->value = value->val_u;
+}
+
+static void on_run_timeout(struct l_timeout *to, void *user_data)
+{
+	l_main_quit();
+}
+
+static void run_for(unsigned int ms)
+{
+	struct l_timeout *stop;
+
+	stop = l_timeout_create_ms(ms, on_run_timeout, NULL, NULL);
+	l_main_run();
+	l_timeout_remove(stop);
+}
+
+static void start_bus(const char *url)
+{
+	struct l_timeout *guard;
+
+	bus_id = iface_modbus_start(url, &opts, on_connected,
+				    on_disconnected, &bus_id);
+	ck_assert_int_gt(bus_id, 0);
+
+	guard = l_timeout_create_ms(GUARD_MS, on_run_timeout, NULL, NULL);
+	l_main_run();
+	l_timeout_remove(guard);
+
+	ck_assert(connected);
+}
+
+static int read_data(int slave_id, int addr,
+		     enum iface_modbus_priority priority, int index)
+{
+	return iface_modbus_read_data(bus_id, slave_id, addr, U16, priority,
+				      on_read, &results[index]);
+}
+
+static void expect_request(int index, int unit_id, int addr, int nb)
+{
+	int req_unit_id;
+	int req_function;
+	int req_addr;
+	int req_nb;
+
+	ck_assert_int_eq(modbus_tcp_get_request(index, &req_unit_id,
+						&req_function, &req_addr,
+						&req_nb), 0);
+	ck_assert_int_eq(req_unit_id, unit_id);
+	ck_assert_int_eq(req_function, MODBUS_FC_READ_HOLDING_REGISTERS);
+	ck_assert_int_eq(req_addr, addr);
+	ck_assert_int_eq(req_nb, nb);
+}
+
+/* Every register holds its address plus VALUE_BASE */
+static void respond_registers(int index, int addr, int nb)
+{
+	uint8_t pdu[2 + 2 * MODBUS_MAX_READ_REGISTERS];
+	int i;
+
+	pdu[0] = MODBUS_FC_READ_HOLDING_REGISTERS;
+	pdu[1] = nb * 2;
+	for (i = 0; i < nb; i++)
+		l_put_be16(VALUE_BASE + addr + i, pdu + 2 + i * 2);
+
+	modbus_tcp_respond(index, 2 + nb * 2, pdu);
+}
+
+static void setup(void)
+{
+	l_main_init();
+
+	memset(&opts, 0, sizeof(opts));
+	memset(results, 0, sizeof(results));
+	/* Connect right away */
+	opts.reconnect_min_delay = 2;
+	opts.reconnect_max_delay = 2;
+	bus_id = -1;
+	connected = false;
+}
+
+static void teardown(void)
+{
+	if (bus_id > 0)
+		iface_modbus_stop(bus_id, &bus_id);
+
+	modbus_tcp_reset();
+	modbus_rtu_reset();
+	l_main_exit();
+}
+
+START_TEST(iface_modbus_merges_close_reads)
+{
+	start_bus(TCP_URL);
+
+	/* The second one is MAX_GAP past the end of the first */
+	ck_assert_int_eq(read_data(1, 10, IFACE_MODBUS_PRIORITY_SCAN, 0), 0);
+	ck_assert_int_eq(read_data(1, 11 + MAX_GAP,
+				   IFACE_MODBUS_PRIORITY_SCAN, 1), 0);
+	ck_assert_int_eq(read_data(1, 40, IFACE_MODBUS_PRIORITY_SCAN, 2), 0);
+	ck_assert_int_eq(read_data(1, 10, IFACE_MODBUS_PRIORITY_SCAN, 3),
+			 -EALREADY);
+
+	run_for(RUN_MS);
+
+	ck_assert_int_eq(modbus_tcp_pending(), 1);
+	expect_request(0, 1, 10, 2 + MAX_GAP);
+	respond_registers(0, 10, 2 + MAX_GAP);
+
+	ck_assert_int_eq(results[0].rc, 1);
+	ck_assert_int_eq(results[0].value, VALUE_BASE + 10);
+	ck_assert_int_eq(results[1].rc, 1);
+	ck_assert_int_eq(results[1].value, VALUE_BASE + 11 + MAX_GAP);
+	ck_assert(!results[2].done);
+
+	run_for(RUN_MS);
+
+	expect_request(0, 1, 40, 1);
+	respond_registers(0, 40, 1);
+	ck_assert_int_eq(results[2].value, VALUE_BASE + 40);
+}
+END_TEST
+
+START_TEST(iface_modbus_limits_in_flight)
+{
+	int unit_id;
+	int function;
+	int addr;
+	int nb;
+	int per_unit[3] = { 0 };
+	int i;
+
+	opts.link_max_in_flight = 3;
+	opts.slave_max_in_flight = 2;
+	start_bus(TCP_URL);
+
+	ck_assert_int_eq(read_data(1, 0, IFACE_MODBUS_PRIORITY_SCAN, 0), 0);
+	ck_assert_int_eq(read_data(1, 100, IFACE_MODBUS_PRIORITY_SCAN, 1), 0);
+	ck_assert_int_eq(read_data(1, 200, IFACE_MODBUS_PRIORITY_SCAN, 2), 0);
+	ck_assert_int_eq(read_data(2, 0, IFACE_MODBUS_PRIORITY_SCAN, 3), 0);
+	ck_assert_int_eq(read_data(2, 100, IFACE_MODBUS_PRIORITY_SCAN, 4), 0);
+
+	run_for(RUN_MS);
+
+	/* Pipelined up to the link limit, without flooding a unit */
+	ck_assert_int_eq(modbus_tcp_pending(), 3);
+	for (i = 0; i < 3; i++) {
+		ck_assert_int_eq(modbus_tcp_get_request(i, &unit_id, &function,
+							&addr, &nb), 0);
+		per_unit[unit_id]++;
+	}
+
+	ck_assert_int_eq(per_unit[1], 2);
+	ck_assert_int_eq(per_unit[2], 1);
+
+	/* Each answer lets the next one go */
+	modbus_tcp_respond(0, -ETIMEDOUT, NULL);
+	run_for(RUN_MS);
+	ck_assert_int_eq(modbus_tcp_pending(), 3);
+}
+END_TEST
+
+START_TEST(iface_modbus_serves_urgent_lane_first)
+{
+	start_bus(TCP_URL);
+
+	ck_assert_int_eq(read_data(1, 0, IFACE_MODBUS_PRIORITY_SCAN, 0), 0);
+	ck_assert_int_eq(read_data(1, 100, IFACE_MODBUS_PRIORITY_REQUEST, 1),
+			 0);
+
+	run_for(RUN_MS);
+	expect_request(0, 1, 100, 1);
+	respond_registers(0, 100, 1);
+
+	run_for(RUN_MS);
+	expect_request(0, 1, 0, 1);
+}
+END_TEST
+
+START_TEST(iface_modbus_ages_waiting_reads)
+{
+	start_bus(TCP_URL);
+
+	/* The unit is busy while the alarm read waits */
+	ck_assert_int_eq(read_data(1, 200, IFACE_MODBUS_PRIORITY_SCAN, 0), 0);
+	run_for(RUN_MS);
+	expect_request(0, 1, 200, 1);
+
+	ck_assert_int_eq(read_data(1, 0, IFACE_MODBUS_PRIORITY_ALARM, 1), 0);
+	run_for(AGING_MS);
+	ck_assert_int_eq(read_data(1, 100, IFACE_MODBUS_PRIORITY_REQUEST, 2),
+			 0);
+
+	/* Waiting an aging step outweighs one priority level */
+	respond_registers(0, 200, 1);
+	run_for(RUN_MS);
+	expect_request(0, 1, 0, 1);
+}
+END_TEST
+
+START_TEST(iface_modbus_reprioritize_moves_read)
+{
+	start_bus(TCP_URL);
+
+	ck_assert_int_eq(read_data(1, 200, IFACE_MODBUS_PRIORITY_SCAN, 0), 0);
+	run_for(RUN_MS);
+	expect_request(0, 1, 200, 1);
+
+	ck_assert_int_eq(read_data(1, 0, IFACE_MODBUS_PRIORITY_SCAN, 1), 0);
+	ck_assert_int_eq(read_data(1, 100, IFACE_MODBUS_PRIORITY_ALARM, 2),
+			 0);
+
+	ck_assert_int_eq(iface_modbus_reprioritize(bus_id, 1, &results[1],
+					IFACE_MODBUS_PRIORITY_REQUEST), 0);
+	ck_assert_int_eq(iface_modbus_reprioritize(bus_id, 1, &results[0],
+					IFACE_MODBUS_PRIORITY_REQUEST),
+			 -EINPROGRESS);
+	ck_assert_int_eq(iface_modbus_reprioritize(bus_id, 9, &results[1],
+					IFACE_MODBUS_PRIORITY_REQUEST),
+			 -ENOENT);
+
+	respond_registers(0, 200, 1);
+	run_for(RUN_MS);
+	expect_request(0, 1, 0, 1);
+}
+END_TEST
+
+START_TEST(iface_modbus_bisects_illegal_address)
+{
+	int i;
+
+	start_bus(TCP_URL);
+
+	for (i = 0; i < 4; i++)
+		ck_assert_int_eq(read_data(1, i, IFACE_MODBUS_PRIORITY_SCAN,
+					   i), 0);
+
+	run_for(RUN_MS);
+	expect_request(0, 1, 0, 4);
+	modbus_tcp_respond(0, -EMBXILADD, NULL);
+
+	/* Halves go first, until the faulty address is alone */
+	run_for(RUN_MS);
+	expect_request(0, 1, 0, 2);
+	modbus_tcp_respond(0, -EMBXILADD, NULL);
+
+	run_for(RUN_MS);
+	expect_request(0, 1, 2, 2);
+	respond_registers(0, 2, 2);
+
+	run_for(RUN_MS);
+	expect_request(0, 1, 0, 1);
+	respond_registers(0, 0, 1);
+
+	run_for(RUN_MS);
+	expect_request(0, 1, 1, 1);
+	modbus_tcp_respond(0, -EMBXILADD, NULL);
+
+	ck_assert_int_eq(results[0].rc, 1);
+	ck_assert_int_eq(results[1].rc, -EMBXILADD);
+	ck_assert_int_eq(results[2].rc, 1);
+	ck_assert_int_eq(results[3].rc, 1);
+	ck_assert_int_eq(results[3].value, VALUE_BASE + 3);
+
+	/* Quarantined: not even queued */
+	ck_assert_int_eq(read_data(1, 1, IFACE_MODBUS_PRIORITY_SCAN, 4),
+			 -EAGAIN);
+}
+END_TEST
+
+START_TEST(iface_modbus_quarantine_backs_off)
+{
+	start_bus(TCP_URL);
+
+	ck_assert_int_eq(read_data(1, 1, IFACE_MODBUS_PRIORITY_SCAN, 0), 0);
+	run_for(RUN_MS);
+	modbus_tcp_respond(0, -EMBXILADD, NULL);
+
+	ck_assert_int_eq(read_data(1, 1, IFACE_MODBUS_PRIORITY_SCAN, 1),
+			 -EAGAIN);
+
+	/* Probed again once the backoff is over, never merged */
+	run_for(BACKOFF_MS);
+	ck_assert_int_eq(read_data(1, 0, IFACE_MODBUS_PRIORITY_SCAN, 1), 0);
+	ck_assert_int_eq(read_data(1, 1, IFACE_MODBUS_PRIORITY_SCAN, 2), 0);
+
+	run_for(RUN_MS);
+	expect_request(0, 1, 0, 1);
+	respond_registers(0, 0, 1);
+
+	run_for(RUN_MS);
+	expect_request(0, 1, 1, 1);
+	modbus_tcp_respond(0, -EMBXILADD, NULL);
+
+	/* A failed probe doubles the backoff */
+	run_for(BACKOFF_MS);
+	ck_assert_int_eq(read_data(1, 1, IFACE_MODBUS_PRIORITY_SCAN, 3),
+			 -EAGAIN);
+}
+END_TEST
+
+START_TEST(iface_modbus_breaker_opens_on_silent_unit)
+{
+	int i;
+
+	opts.slave_max_in_flight = 2;
+	start_bus(TCP_URL);
+
+	for (i = 0; i < 3; i++) {
+		ck_assert_int_eq(read_data(1, 0, IFACE_MODBUS_PRIORITY_SCAN,
+					   0), 0);
+		run_for(RUN_MS);
+		modbus_tcp_respond(0, -ETIMEDOUT, NULL);
+	}
+
+	/* Open: reads fail fast instead of timing out */
+	ck_assert_int_eq(read_data(1, 0, IFACE_MODBUS_PRIORITY_SCAN, 0),
+			 -EHOSTUNREACH);
+
+	/* Half open: a single probe at a time */
+	run_for(BACKOFF_MS);
+	ck_assert_int_eq(read_data(1, 0, IFACE_MODBUS_PRIORITY_SCAN, 0), 0);
+	ck_assert_int_eq(read_data(1, 100, IFACE_MODBUS_PRIORITY_SCAN, 1), 0);
+	run_for(RUN_MS);
+	ck_assert_int_eq(modbus_tcp_pending(), 1);
+
+	/* Closed again on an answer */
+	respond_registers(0, 0, 1);
+	ck_assert_int_eq(read_data(1, 200, IFACE_MODBUS_PRIORITY_SCAN, 2), 0);
+	run_for(RUN_MS);
+	ck_assert_int_eq(modbus_tcp_pending(), 2);
+}
+END_TEST
+
+START_TEST(iface_modbus_rtu_keeps_silent_interval)
+{
+	uint64_t start[3];
+	uint64_t gap;
+	int slave_id[3];
+	int i;
+
+	opts.turnaround_delay = TURNAROUND_MS;
+	start_bus(RTU_URL);
+
+	ck_assert_int_eq(read_data(1, 0, IFACE_MODBUS_PRIORITY_SCAN, 0), 0);
+	ck_assert_int_eq(read_data(1, 100, IFACE_MODBUS_PRIORITY_SCAN, 1), 0);
+	ck_assert_int_eq(read_data(2, 0, IFACE_MODBUS_PRIORITY_SCAN, 2), 0);
+
+	run_for(5 * TURNAROUND_MS);
+	ck_assert_int_eq(modbus_rtu_transfers(), 3);
+
+	for (i = 0; i < 3; i++)
+		ck_assert_int_eq(modbus_rtu_get_transfer(i, &slave_id[i],
+							 &start[i]), 0);
+
+	/* t3.5 between frames, and the turnaround for another unit */
+	for (i = 1; i < 3; i++) {
+		gap = start[i] - start[i - 1];
+		ck_assert(gap >= RTU_SILENT_US);
+
+		if (slave_id[i] != slave_id[i - 1])
+			ck_assert(gap >= RTU_SILENT_US +
+				  TURNAROUND_MS * USEC_PER_MSEC);
+	}
+
+	ck_assert(slave_id[0] != slave_id[2] || slave_id[1] != slave_id[2]);
+}
+END_TEST
+
+Suite *iface_modbus_suite(void)
+{
+	Suite *mb_suite;
+	TCase *tc_pipeline;
+	TCase *tc_lanes;
+	TCase *tc_faults;
+	TCase *tc_rtu;
+
+	mb_suite = suite_create("Modbus Interface");
+
+	/* Pipelining test case */
+	tc_pipeline = tcase_create("Pipelining");
+	tcase_add_checked_fixture(tc_pipeline, setup, teardown);
+	tcase_add_test(tc_pipeline, iface_modbus_merges_close_reads);
+	tcase_add_test(tc_pipeline, iface_modbus_limits_in_flight);
+
+	suite_add_tcase(mb_suite, tc_pipeline);
+
+	/* Lanes test case */
+	tc_lanes = tcase_create("Lanes");
+	tcase_add_checked_fixture(tc_lanes, setup, teardown);
+	tcase_add_test(tc_lanes, iface_modbus_serves_urgent_lane_first);
+	tcase_add_test(tc_lanes, iface_modbus_ages_waiting_reads);
+	tcase_add_test(tc_lanes, iface_modbus_reprioritize_moves_read);
+
+	suite_add_tcase(mb_suite, tc_lanes);
+
+	/* Faults test case */
+	tc_faults = tcase_create("Faults");
+	tcase_add_checked_fixture(tc_faults, setup, teardown);
+	tcase_add_test(tc_faults, iface_modbus_bisects_illegal_address);
+	tcase_add_test(tc_faults, iface_modbus_quarantine_backs_off);
+	tcase_add_test(tc_faults, iface_modbus_breaker_opens_on_silent_unit);
+
+	suite_add_tcase(mb_suite, tc_faults);
+
+	/* RTU test case */
+	tc_rtu = tcase_create("RTU");
+	tcase_add_checked_fixture(tc_rtu, setup, teardown);
+	tcase_add_test(tc_rtu, iface_modbus_rtu_keeps_silent_interval);
+
+	suite_add_tcase(mb_suite, tc_rtu);
+
+	return mb_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *mb_suite;
+	SRunner *mb_suite_runner;
+
+	mb_suite = iface_modbus_suite();
+	mb_suite_runner = srunner_create(mb_suite);
+
+	srunner_run_all(mb_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(mb_suite_runner);
+	srunner_free(mb_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,151 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Startup time of the DataItem loader on generated configurations
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <ell/ell.h>
+
+#include "src/storage.h"
+#include "src/conf-parameters.h"
+
+static const char * const item_keys[] = {
+	SCHEMA_SENSOR_ID, SCHEMA_SENSOR_NAME, SCHEMA_VALUE_TYPE, SCHEMA_UNIT,
+	SCHEMA_TYPE_ID, EVENT_LOWER_THRESHOLD, EVENT_UPPER_THRESHOLD,
+	EVENT_TIME_SEC, EVENT_CHANGE, MODBUS_SLAVE_ID, MODBUS_REG_ADDRESS,
+	MODBUS_BIT_OFFSET, MODBUS_URL, VALUE_MAX_AGE, SCAN_CLASS,
+	AGGREGATE_WINDOW, HISTORY_SIZE, NULL
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int write_config(const char *pathname, int items)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(pathname, "w");
+	if (!fp)
+		return -1;
+
+	fprintf(fp, "[%s]\n%s=Bench\n%s=1\n%s=tcp://127.0.0.1:502\n\n",
+		THING_GROUP, THING_NAME, THING_MODBUS_SLAVE_ID,
+		THING_MODBUS_URL);
+
+	for (i = 0; i < items; i++)
+		fprintf(fp, "[%s%d]\n%s=%d\n%s=Item %d\n%s=1\n%s=1\n"
+			"%s=65296\n%s=0\n%s=100\n%s=60\n%s=1\n%s=%d\n%s=0\n\n",
+			DATA_ITEM_GROUP, i, SCHEMA_SENSOR_ID, i,
+			SCHEMA_SENSOR_NAME, i, SCHEMA_VALUE_TYPE, SCHEMA_UNIT,
+			SCHEMA_TYPE_ID, EVENT_LOWER_THRESHOLD,
+			EVENT_UPPER_THRESHOLD, EVENT_TIME_SEC, EVENT_CHANGE,
+			MODBUS_REG_ADDRESS, i % 65536, MODBUS_BIT_OFFSET);
+
+	return fclose(fp);
+}
+
+/* The lookups the loader makes for each item */
+static int read_item(int fd, const char *group, void *user_data)
+{
+	int *items = user_data;
+	int value;
+	int i;
+
+	for (i = 0; item_keys[i]; i++)
+		storage_read_key_int(fd, group, item_keys[i], &value);
+
+	(*items)++;
+
+	return 0;
+}
+
+static int run(int items)
+{
+	char pathname[] = "/tmp/loader-bench-XXXXXX";
+	uint64_t start, loaded, walked;
+	int read = 0;
+	int fd;
+	int rc;
+
+	fd = mkstemp(pathname);
+	if (fd < 0)
+		return -1;
+	close(fd);
+
+	if (write_config(pathname, items) < 0)
+		goto failure;
+
+	start = now_us();
+
+	fd = storage_open(pathname);
+	if (fd < 0)
+		goto failure;
+
+	loaded = now_us();
+	rc = storage_foreach_group(fd, DATA_ITEM_GROUP, read_item, &read);
+	walked = now_us();
+
+	storage_close(fd);
+	unlink(pathname);
+
+	if (rc < 0 || read != items)
+		return -1;
+
+	printf("%7d items: parse %6llu ms, load %6llu ms, total %6llu ms\n",
+	       items, (unsigned long long) (loaded - start) / 1000,
+	       (unsigned long long) (walked - loaded) / 1000,
+	       (unsigned long long) (walked - start) / 1000);
+
+	return 0;
+
+failure:
+	unlink(pathname);
+
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <items>...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (run(atoi(argv[i])) < 0) {
+			fprintf(stderr, "Failed on %s items\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
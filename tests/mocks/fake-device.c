@@ -25,62 +25,74 @@ int schema_change_rc;
 int cred_rc;
 int store_cred_rc;
 
-int device_start_event(void)
+int device_start_event(struct knot_thing *thing)
 {
 	return start_event_rc;
 }
 
-void device_stop_event(void)
+void device_stop_event(struct knot_thing *thing)
 {
 	/* purposely left empty as no behaviour expected/required */
 }
 
-int device_send_config(void)
+int device_send_config(struct knot_thing *thing)
 {
 	return 0;
 }
 
-int device_has_thing_token(void)
+int device_has_thing_token(struct knot_thing *thing)
 {
 	return cred_rc;
 }
 
-int device_store_credentials_on_file(char *token)
+int device_store_credentials_on_file(struct knot_thing *thing, char *token)
 {
 	return store_cred_rc;
 }
 
-int device_send_register_request(void)
+int device_send_register_request(struct knot_thing *thing)
 {
 	return 0;
 }
 
-void device_generate_thing_id(void)
+void device_generate_thing_id(struct knot_thing *thing)
 {
 	/* purposely left empty as no behaviour expected/required */
 }
 
-int device_send_auth_request(void)
+int device_send_auth_request(struct knot_thing *thing)
 {
 	return 0;
 }
 
-int device_check_schema_change(void)
+int device_check_schema_change(struct knot_thing *thing)
 {
 	return schema_change_rc;
 }
 
-int device_clear_credentials_on_file(void)
+int device_store_schema_hash(struct knot_thing *thing)
 {
 	return 0;
 }
 
-void device_publish_data_list(struct l_queue *sensor_id_list)
+int device_clear_credentials_on_file(struct knot_thing *thing)
+{
+	return 0;
+}
+
+void device_publish_data_list(struct knot_thing *thing,
+			      struct l_queue *sensor_id_list)
+{
+	/* purposely left empty as no behaviour expected/required */
+}
+
+void device_publish_data_changed(struct knot_thing *thing)
 {
 	/* purposely left empty as no behaviour expected/required */
 }
 
-void device_publish_data_all(void)
+void device_update_data_list(struct knot_thing *thing,
+			     struct l_queue *data_list)
 {
 	/* purposely left empty as no behaviour expected/required */
 }
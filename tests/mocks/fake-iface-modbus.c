@@ -0,0 +1,85 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "src/iface-modbus.h"
+#include "fake-iface-modbus.h"
+
+int write_rc;
+bool write_pending;
+int write_bus_id;
+int write_slave_id;
+int write_reg_addr;
+int write_bit_offset;
+knot_value_type write_value;
+iface_modbus_write_cb_t write_cb;
+void *write_user_data;
+
+int iface_modbus_write_data(int bus_id, int slave_id, int reg_addr,
+			    int bit_offset, const knot_value_type *value,
+			    iface_modbus_write_cb_t write_cb_fn,
+			    void *user_data)
+{
+	if (write_rc < 0)
+		return write_rc;
+
+	/* Answered when the test completes it, like a slave would */
+	write_pending = true;
+	write_bus_id = bus_id;
+	write_slave_id = slave_id;
+	write_reg_addr = reg_addr;
+	write_bit_offset = bit_offset;
+	write_value = *value;
+	write_cb = write_cb_fn;
+	write_user_data = user_data;
+
+	return 0;
+}
+
+int iface_modbus_last_write(int *bus_id, int *slave_id, int *reg_addr,
+			    int *bit_offset, knot_value_type *value)
+{
+	if (!write_pending)
+		return -ENOENT;
+
+	*bus_id = write_bus_id;
+	*slave_id = write_slave_id;
+	*reg_addr = write_reg_addr;
+	*bit_offset = write_bit_offset;
+	*value = write_value;
+
+	return 0;
+}
+
+void iface_modbus_complete_write(int rc)
+{
+	if (!write_pending)
+		return;
+
+	write_pending = false;
+	write_cb(rc, write_user_data);
+}
+
+void iface_modbus_set_write_rc(int rc)
+{
+	write_rc = rc;
+	write_pending = false;
+}
@@ -0,0 +1,177 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <modbus/modbus.h>
+#include <ell/ell.h>
+
+#include "fake-modbus-rtu.h"
+
+#define USEC_PER_SEC 1000000
+#define MAX_TRANSFERS 16
+
+/* A serial line that answers every request at once */
+struct _modbus {
+	int slave;
+	int fds[2];
+};
+
+struct fake_transfer {
+	int slave_id;
+	uint64_t start;		/* usec */
+};
+
+static struct fake_transfer transfers[MAX_TRANSFERS];
+static int n_transfers;
+
+static uint64_t time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static int transfer(modbus_t *ctx, int nb)
+{
+	if (n_transfers < MAX_TRANSFERS) {
+		transfers[n_transfers].slave_id = ctx->slave;
+		transfers[n_transfers].start = time_now();
+	}
+
+	n_transfers++;
+
+	return nb;
+}
+
+modbus_t *modbus_new_rtu(const char *device, int baud, char parity,
+			 int data_bit, int stop_bit)
+{
+	modbus_t *ctx;
+
+	ctx = l_new(modbus_t, 1);
+	ctx->fds[0] = -1;
+	ctx->fds[1] = -1;
+
+	return ctx;
+}
+
+int modbus_rtu_set_serial_mode(modbus_t *ctx, int mode)
+{
+	return 0;
+}
+
+int modbus_rtu_set_rts(modbus_t *ctx, int mode)
+{
+	return 0;
+}
+
+int modbus_set_response_timeout(modbus_t *ctx, uint32_t to_sec,
+				uint32_t to_usec)
+{
+	return 0;
+}
+
+int modbus_set_slave(modbus_t *ctx, int slave)
+{
+	ctx->slave = slave;
+
+	return 0;
+}
+
+/* The line is a pipe kept open, so that it never hangs up */
+int modbus_connect(modbus_t *ctx)
+{
+	return pipe(ctx->fds);
+}
+
+int modbus_get_socket(modbus_t *ctx)
+{
+	return ctx->fds[0];
+}
+
+void modbus_close(modbus_t *ctx)
+{
+	if (ctx->fds[0] < 0)
+		return;
+
+	close(ctx->fds[0]);
+	close(ctx->fds[1]);
+	ctx->fds[0] = -1;
+	ctx->fds[1] = -1;
+}
+
+void modbus_free(modbus_t *ctx)
+{
+	l_free(ctx);
+}
+
+const char *modbus_strerror(int errnum)
+{
+	return strerror(errnum);
+}
+
+int modbus_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest)
+{
+	memset(dest, 0, nb);
+
+	return transfer(ctx, nb);
+}
+
+int modbus_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest)
+{
+	memset(dest, 0, nb * sizeof(*dest));
+
+	return transfer(ctx, nb);
+}
+
+int modbus_write_register(modbus_t *ctx, int reg_addr, const uint16_t value)
+{
+	return transfer(ctx, 1);
+}
+
+int modbus_write_registers(modbus_t *ctx, int addr, int nb,
+			   const uint16_t *data)
+{
+	return transfer(ctx, nb);
+}
+
+int modbus_rtu_transfers(void)
+{
+	return n_transfers;
+}
+
+/* Which unit a transfer addressed, and when it started */
+int modbus_rtu_get_transfer(int index, int *slave_id, uint64_t *start)
+{
+	if (index < 0 || index >= n_transfers || index >= MAX_TRANSFERS)
+		return -ENOENT;
+
+	*slave_id = transfers[index].slave_id;
+	*start = transfers[index].start;
+
+	return 0;
+}
+
+void modbus_rtu_reset(void)
+{
+	n_transfers = 0;
+}
@@ -0,0 +1,167 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ell/ell.h>
+
+#include "src/modbus-tcp.h"
+#include "fake-modbus-tcp.h"
+
+#define FAKE_PDU_MAX 16
+
+struct modbus_tcp {
+	bool connected;
+};
+
+struct fake_transaction {
+	int unit_id;
+	uint8_t pdu[FAKE_PDU_MAX];
+	modbus_tcp_response_cb_t response_cb;
+	void *user_data;
+};
+
+static struct l_queue *transactions;
+
+static void fail_transactions(int err)
+{
+	struct fake_transaction *trans;
+
+	while ((trans = l_queue_pop_head(transactions))) {
+		trans->response_cb(err, NULL, trans->user_data);
+		l_free(trans);
+	}
+}
+
+struct modbus_tcp *modbus_tcp_new(const char *hostname, const char *port,
+				  int response_timeout)
+{
+	if (!transactions)
+		transactions = l_queue_new();
+
+	return l_new(struct modbus_tcp, 1);
+}
+
+void modbus_tcp_free(struct modbus_tcp *tcp)
+{
+	if (!tcp)
+		return;
+
+	modbus_tcp_close(tcp);
+	l_free(tcp);
+}
+
+void modbus_tcp_set_keepalive(struct modbus_tcp *tcp, int idle)
+{
+}
+
+/* The gateway is always there, and answers at once */
+int modbus_tcp_connect(struct modbus_tcp *tcp,
+		       modbus_tcp_connect_cb_t connect_cb,
+		       modbus_tcp_disconnect_cb_t disconnect_cb,
+		       void *user_data)
+{
+	tcp->connected = true;
+	connect_cb(0, user_data);
+
+	return 0;
+}
+
+void modbus_tcp_close(struct modbus_tcp *tcp)
+{
+	tcp->connected = false;
+	fail_transactions(-ENOTCONN);
+}
+
+/* Requests wait until the test answers them, like a slave would */
+int modbus_tcp_send(struct modbus_tcp *tcp, int unit_id, const uint8_t *pdu,
+		    size_t len, modbus_tcp_response_cb_t response_cb,
+		    void *user_data)
+{
+	struct fake_transaction *trans;
+
+	if (!tcp->connected)
+		return -ENOTCONN;
+
+	if (!len || len > FAKE_PDU_MAX)
+		return -EINVAL;
+
+	trans = l_new(struct fake_transaction, 1);
+	trans->unit_id = unit_id;
+	memcpy(trans->pdu, pdu, len);
+	trans->response_cb = response_cb;
+	trans->user_data = user_data;
+
+	l_queue_push_tail(transactions, trans);
+
+	return 0;
+}
+
+int modbus_tcp_pending(void)
+{
+	return l_queue_length(transactions);
+}
+
+/* Function code, starting address and count of a request in flight */
+int modbus_tcp_get_request(int index, int *unit_id, int *function,
+			   int *addr, int *nb)
+{
+	const struct l_queue_entry *entry;
+	struct fake_transaction *trans;
+
+	for (entry = l_queue_get_entries(transactions); entry && index;
+	     entry = entry->next)
+		index--;
+
+	if (!entry)
+		return -ENOENT;
+
+	trans = entry->data;
+	*unit_id = trans->unit_id;
+	*function = trans->pdu[0];
+	*addr = l_get_be16(trans->pdu + 1);
+	*nb = l_get_be16(trans->pdu + 3);
+
+	return 0;
+}
+
+void modbus_tcp_respond(int index, int rc, const uint8_t *pdu)
+{
+	const struct l_queue_entry *entry;
+	struct fake_transaction *trans;
+
+	for (entry = l_queue_get_entries(transactions); entry && index;
+	     entry = entry->next)
+		index--;
+
+	if (!entry)
+		return;
+
+	trans = entry->data;
+	l_queue_remove(transactions, trans);
+
+	trans->response_cb(rc, pdu, trans->user_data);
+	l_free(trans);
+}
+
+void modbus_tcp_reset(void)
+{
+	fail_transactions(-ENOTCONN);
+	l_queue_destroy(transactions, NULL);
+	transactions = NULL;
+}
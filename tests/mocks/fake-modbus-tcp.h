@@ -0,0 +1,21 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+int modbus_tcp_pending(void);
+int modbus_tcp_get_request(int index, int *unit_id, int *function,
+			   int *addr, int *nb);
+void modbus_tcp_respond(int index, int rc, const uint8_t *pdu);
+void modbus_tcp_reset(void);
@@ -0,0 +1,449 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <modbus/modbus.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "src/iface-modbus.h"
+#include "src/modbus-server.h"
+#include "tests/mocks/fake-iface-modbus.h"
+
+#define TEST_PORT	15502
+#define TEST_BUS	2
+#define TEST_UNIT	1
+#define TEST_ADDR	100
+#define MAX_AGE_MS	20
+#define FRAME_MAX	260
+#define MBAP_SIZE	7
+
+static struct modbus_server *test_server;
+static int client_fd;
+
+static void start_server(int max_age, bool writes)
+{
+	struct sockaddr_in addr;
+
+	test_server = modbus_server_start(NULL, TEST_PORT, max_age, writes);
+	ck_assert_ptr_ne(test_server, NULL);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	client_fd = socket(AF_INET, SOCK_STREAM, 0);
+	ck_assert_int_ge(client_fd, 0);
+	ck_assert_int_eq(connect(client_fd, (struct sockaddr *) &addr,
+				 sizeof(addr)), 0);
+
+	/* Accepted on the next loop iteration */
+	l_main_iterate(1000);
+}
+
+/* Frames a PDU behind an MBAP header for the unit given */
+static size_t frame(uint8_t *buf, uint16_t tid, uint8_t unit,
+		    const uint8_t *pdu, size_t len)
+{
+	l_put_be16(tid, buf);
+	l_put_be16(0, buf + 2);
+	l_put_be16(len + 1, buf + 4);
+	buf[6] = unit;
+	memcpy(buf + MBAP_SIZE, pdu, len);
+
+	return MBAP_SIZE + len;
+}
+
+static size_t read_request(uint8_t *buf, uint16_t tid, uint8_t unit,
+			   uint8_t function, uint16_t addr, uint16_t nb)
+{
+	uint8_t pdu[5];
+
+	pdu[0] = function;
+	l_put_be16(addr, pdu + 1);
+	l_put_be16(nb, pdu + 3);
+
+	return frame(buf, tid, unit, pdu, sizeof(pdu));
+}
+
+static void send_request(const uint8_t *buf, size_t len)
+{
+	ck_assert_int_eq(send(client_fd, buf, len, 0), len);
+	l_main_iterate(1000);
+}
+
+/* Whatever the server answered so far, without waiting for more */
+static ssize_t receive(uint8_t *buf)
+{
+	return recv(client_fd, buf, FRAME_MAX, MSG_DONTWAIT);
+}
+
+static void transact(const uint8_t *req, size_t len, uint8_t *rsp,
+		     size_t rsp_len)
+{
+	send_request(req, len);
+	ck_assert_int_eq(receive(rsp), rsp_len);
+}
+
+static void check_exception(const uint8_t *rsp, uint16_t tid, uint8_t unit,
+			    uint8_t function, int code)
+{
+	ck_assert_uint_eq(l_get_be16(rsp), tid);
+	ck_assert_uint_eq(l_get_be16(rsp + 4), 3);
+	ck_assert_uint_eq(rsp[6], unit);
+	ck_assert_uint_eq(rsp[7], function | 0x80);
+	ck_assert_uint_eq(rsp[8], code);
+}
+
+static void assert_exception(uint16_t tid, uint8_t unit, uint8_t function,
+			     const uint8_t *req, size_t len, int code)
+{
+	uint8_t rsp[FRAME_MAX];
+
+	transact(req, len, rsp, MBAP_SIZE + 2);
+	check_exception(rsp, tid, unit, function, code);
+}
+
+static void setup(void)
+{
+	l_main_init();
+	iface_modbus_set_write_rc(0);
+	test_server = NULL;
+	client_fd = -1;
+}
+
+static void teardown(void)
+{
+	if (client_fd >= 0)
+		close(client_fd);
+
+	modbus_server_stop(test_server);
+	l_main_exit();
+}
+
+START_TEST(modbus_server_read_holding_registers)
+{
+	static const uint16_t values[] = { 0x1234, 0xabcd };
+	uint8_t req[FRAME_MAX];
+	uint8_t rsp[FRAME_MAX];
+	size_t len;
+
+	start_server(0, false);
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_HOLDING_REGISTERS, TEST_ADDR, 2,
+			     values);
+
+	len = read_request(req, 0x0102, TEST_UNIT,
+			   MODBUS_FC_READ_HOLDING_REGISTERS, TEST_ADDR, 2);
+	transact(req, len, rsp, MBAP_SIZE + 6);
+
+	/* Transaction echoed, length counting the unit and the PDU */
+	ck_assert_uint_eq(l_get_be16(rsp), 0x0102);
+	ck_assert_uint_eq(l_get_be16(rsp + 2), 0);
+	ck_assert_uint_eq(l_get_be16(rsp + 4), 7);
+	ck_assert_uint_eq(rsp[6], TEST_UNIT);
+	ck_assert_uint_eq(rsp[7], MODBUS_FC_READ_HOLDING_REGISTERS);
+	ck_assert_uint_eq(rsp[8], 4);
+	ck_assert_uint_eq(l_get_be16(rsp + 9), 0x1234);
+	ck_assert_uint_eq(l_get_be16(rsp + 11), 0xabcd);
+}
+END_TEST
+
+START_TEST(modbus_server_read_discrete_inputs_packed)
+{
+	static const uint16_t values[] = { 1, 0, 1 };
+	uint8_t req[FRAME_MAX];
+	uint8_t rsp[FRAME_MAX];
+	size_t len;
+
+	start_server(0, false);
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_DISCRETE_INPUTS, TEST_ADDR, 3,
+			     values);
+
+	len = read_request(req, 7, TEST_UNIT, MODBUS_FC_READ_DISCRETE_INPUTS,
+			   TEST_ADDR, 3);
+	transact(req, len, rsp, MBAP_SIZE + 3);
+
+	ck_assert_uint_eq(rsp[7], MODBUS_FC_READ_DISCRETE_INPUTS);
+	ck_assert_uint_eq(rsp[8], 1);
+	ck_assert_uint_eq(rsp[9], 0x05);
+}
+END_TEST
+
+START_TEST(modbus_server_pipelined_requests)
+{
+	static const uint16_t values[] = { 1, 2 };
+	uint8_t req[FRAME_MAX];
+	uint8_t rsp[FRAME_MAX];
+	size_t len;
+
+	start_server(0, false);
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_HOLDING_REGISTERS, TEST_ADDR, 2,
+			     values);
+
+	/* Two frames in a single segment are both answered, in order */
+	len = read_request(req, 1, TEST_UNIT,
+			   MODBUS_FC_READ_HOLDING_REGISTERS, TEST_ADDR, 1);
+	len += read_request(req + len, 2, TEST_UNIT,
+			    MODBUS_FC_READ_HOLDING_REGISTERS, TEST_ADDR + 1,
+			    1);
+	transact(req, len, rsp, 2 * (MBAP_SIZE + 4));
+
+	ck_assert_uint_eq(l_get_be16(rsp), 1);
+	ck_assert_uint_eq(l_get_be16(rsp + 9), 1);
+	ck_assert_uint_eq(l_get_be16(rsp + 11), 2);
+	ck_assert_uint_eq(l_get_be16(rsp + 20), 2);
+}
+END_TEST
+
+START_TEST(modbus_server_stale_value_is_an_exception)
+{
+	static const uint16_t values[] = { 1 };
+	uint8_t req[FRAME_MAX];
+	size_t len;
+
+	start_server(MAX_AGE_MS, false);
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_HOLDING_REGISTERS, TEST_ADDR, 1,
+			     values);
+
+	usleep(2 * MAX_AGE_MS * 1000);
+
+	len = read_request(req, 3, TEST_UNIT,
+			   MODBUS_FC_READ_HOLDING_REGISTERS, TEST_ADDR, 1);
+	assert_exception(3, TEST_UNIT, MODBUS_FC_READ_HOLDING_REGISTERS, req,
+			 len, MODBUS_EXCEPTION_GATEWAY_TARGET);
+}
+END_TEST
+
+START_TEST(modbus_server_unknown_unit_and_address)
+{
+	static const uint16_t values[] = { 1 };
+	uint8_t req[FRAME_MAX];
+	size_t len;
+
+	start_server(0, false);
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_HOLDING_REGISTERS, TEST_ADDR, 1,
+			     values);
+
+	len = read_request(req, 4, TEST_UNIT + 1,
+			   MODBUS_FC_READ_HOLDING_REGISTERS, TEST_ADDR, 1);
+	assert_exception(4, TEST_UNIT + 1, MODBUS_FC_READ_HOLDING_REGISTERS,
+			 req, len, MODBUS_EXCEPTION_GATEWAY_PATH);
+
+	/* The register after the last one acquired */
+	len = read_request(req, 5, TEST_UNIT,
+			   MODBUS_FC_READ_HOLDING_REGISTERS, TEST_ADDR, 2);
+	assert_exception(5, TEST_UNIT, MODBUS_FC_READ_HOLDING_REGISTERS, req,
+			 len, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+}
+END_TEST
+
+START_TEST(modbus_server_ambiguous_unit_not_served)
+{
+	static const uint16_t values[] = { 1 };
+	uint8_t req[FRAME_MAX];
+	size_t len;
+
+	start_server(0, true);
+
+	/* The same unit id read on two links */
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_HOLDING_REGISTERS, TEST_ADDR, 1,
+			     values);
+	modbus_server_update(test_server, TEST_BUS + 1, TEST_UNIT,
+			     IFACE_MODBUS_HOLDING_REGISTERS, TEST_ADDR, 1,
+			     values);
+
+	len = read_request(req, 6, TEST_UNIT,
+			   MODBUS_FC_READ_HOLDING_REGISTERS, TEST_ADDR, 1);
+	assert_exception(6, TEST_UNIT, MODBUS_FC_READ_HOLDING_REGISTERS, req,
+			 len, MODBUS_EXCEPTION_GATEWAY_PATH);
+
+	len = read_request(req, 7, TEST_UNIT,
+			   MODBUS_FC_WRITE_SINGLE_REGISTER, TEST_ADDR, 1);
+	assert_exception(7, TEST_UNIT, MODBUS_FC_WRITE_SINGLE_REGISTER, req,
+			 len, MODBUS_EXCEPTION_GATEWAY_PATH);
+}
+END_TEST
+
+START_TEST(modbus_server_writes_disabled)
+{
+	static const uint16_t values[] = { 1 };
+	uint8_t req[FRAME_MAX];
+	size_t len;
+
+	start_server(0, false);
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_HOLDING_REGISTERS, TEST_ADDR, 1,
+			     values);
+
+	len = read_request(req, 8, TEST_UNIT,
+			   MODBUS_FC_WRITE_SINGLE_REGISTER, TEST_ADDR, 2);
+	assert_exception(8, TEST_UNIT, MODBUS_FC_WRITE_SINGLE_REGISTER, req,
+			 len, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+}
+END_TEST
+
+START_TEST(modbus_server_coils_never_written)
+{
+	static const uint16_t values[] = { 1 };
+	uint8_t req[FRAME_MAX];
+	size_t len;
+
+	start_server(0, true);
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_DISCRETE_INPUTS, TEST_ADDR, 1,
+			     values);
+
+	len = read_request(req, 9, TEST_UNIT, MODBUS_FC_WRITE_SINGLE_COIL,
+			   TEST_ADDR, 0xff00);
+	assert_exception(9, TEST_UNIT, MODBUS_FC_WRITE_SINGLE_COIL, req, len,
+			 MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+}
+END_TEST
+
+START_TEST(modbus_server_write_forwarded_to_bus)
+{
+	static const uint16_t values[] = { 1 };
+	knot_value_type value;
+	uint8_t req[FRAME_MAX];
+	uint8_t rsp[FRAME_MAX];
+	int bus_id;
+	int slave_id;
+	int reg_addr;
+	int bit_offset;
+	size_t len;
+
+	start_server(0, true);
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_HOLDING_REGISTERS, TEST_ADDR, 1,
+			     values);
+
+	len = read_request(req, 10, TEST_UNIT,
+			   MODBUS_FC_WRITE_SINGLE_REGISTER, TEST_ADDR, 0x55);
+	send_request(req, len);
+
+	/* Written on the unit's own link, answered once the slave is */
+	ck_assert_int_eq(iface_modbus_last_write(&bus_id, &slave_id,
+						 &reg_addr, &bit_offset,
+						 &value), 0);
+	ck_assert_int_eq(bus_id, TEST_BUS);
+	ck_assert_int_eq(slave_id, TEST_UNIT);
+	ck_assert_int_eq(reg_addr, TEST_ADDR);
+	ck_assert_int_eq(bit_offset, 16);
+	ck_assert_uint_eq(value.val_u, 0x55);
+	ck_assert_int_lt(receive(rsp), 0);
+
+	iface_modbus_complete_write(0);
+	ck_assert_int_eq(receive(rsp), MBAP_SIZE + 5);
+	ck_assert_uint_eq(l_get_be16(rsp), 10);
+	ck_assert_uint_eq(rsp[7], MODBUS_FC_WRITE_SINGLE_REGISTER);
+	ck_assert_uint_eq(l_get_be16(rsp + 8), TEST_ADDR);
+	ck_assert_uint_eq(l_get_be16(rsp + 10), 0x55);
+
+	/* The image holds the value written */
+	len = read_request(req, 11, TEST_UNIT,
+			   MODBUS_FC_READ_HOLDING_REGISTERS, TEST_ADDR, 1);
+	transact(req, len, rsp, MBAP_SIZE + 4);
+	ck_assert_uint_eq(l_get_be16(rsp + 9), 0x55);
+}
+END_TEST
+
+START_TEST(modbus_server_write_failure_is_an_exception)
+{
+	static const uint16_t values[] = { 1 };
+	uint8_t req[FRAME_MAX];
+	uint8_t rsp[FRAME_MAX];
+	size_t len;
+
+	start_server(0, true);
+	modbus_server_update(test_server, TEST_BUS, TEST_UNIT,
+			     IFACE_MODBUS_HOLDING_REGISTERS, TEST_ADDR, 1,
+			     values);
+
+	len = read_request(req, 12, TEST_UNIT,
+			   MODBUS_FC_WRITE_SINGLE_REGISTER, TEST_ADDR, 0x55);
+	send_request(req, len);
+	iface_modbus_complete_write(-ETIMEDOUT);
+
+	ck_assert_int_eq(receive(rsp), MBAP_SIZE + 2);
+	check_exception(rsp, 12, TEST_UNIT, MODBUS_FC_WRITE_SINGLE_REGISTER,
+			MODBUS_EXCEPTION_GATEWAY_TARGET);
+}
+END_TEST
+
+Suite *modbus_server_suite(void)
+{
+	Suite *srv_suite;
+	TCase *tc_read;
+	TCase *tc_write;
+
+	srv_suite = suite_create("Modbus Server");
+
+	/* Read test case */
+	tc_read = tcase_create("Read");
+	tcase_add_checked_fixture(tc_read, setup, teardown);
+	tcase_add_test(tc_read, modbus_server_read_holding_registers);
+	tcase_add_test(tc_read, modbus_server_read_discrete_inputs_packed);
+	tcase_add_test(tc_read, modbus_server_pipelined_requests);
+	tcase_add_test(tc_read, modbus_server_stale_value_is_an_exception);
+	tcase_add_test(tc_read, modbus_server_unknown_unit_and_address);
+	tcase_add_test(tc_read, modbus_server_ambiguous_unit_not_served);
+
+	suite_add_tcase(srv_suite, tc_read);
+
+	/* Write test case */
+	tc_write = tcase_create("Write");
+	tcase_add_checked_fixture(tc_write, setup, teardown);
+	tcase_add_test(tc_write, modbus_server_writes_disabled);
+	tcase_add_test(tc_write, modbus_server_coils_never_written);
+	tcase_add_test(tc_write, modbus_server_write_forwarded_to_bus);
+	tcase_add_test(tc_write, modbus_server_write_failure_is_an_exception);
+
+	suite_add_tcase(srv_suite, tc_write);
+
+	return srv_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *srv_suite;
+	SRunner *srv_suite_runner;
+
+	srv_suite = modbus_server_suite();
+	srv_suite_runner = srunner_create(srv_suite);
+
+	srunner_run_all(srv_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(srv_suite_runner);
+	srunner_free(srv_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,295 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ell/ell.h>
+
+#include "src/poll.h"
+
+#define INTERVAL_SEC	1
+#define FAST_MS		20
+#define SLOW_MS		100
+#define RUN_MS		2000
+#define BURST_MS	50
+#define TEST_CLASS	7
+#define MAX_ID		8
+
+static unsigned int n_reads[MAX_ID];
+static unsigned int read_flags[MAX_ID];
+static bool auto_complete;
+static int done_class;
+static int n_done;
+
+static void on_read_complete(void *user_data)
+{
+	int id = L_PTR_TO_INT(user_data);
+
+	poll_read_complete(id, 0, read_flags[id]);
+}
+
+/* Reads finish from the main loop, as Modbus replies would */
+static int on_read(int id)
+{
+	ck_assert(id >= 0 && id < MAX_ID);
+
+	n_reads[id]++;
+
+	if (auto_complete)
+		l_idle_oneshot(on_read_complete, L_INT_TO_PTR(id), NULL);
+
+	return 0;
+}
+
+static void on_class_done(int scan_class, uint64_t stamp)
+{
+	done_class = scan_class;
+	n_done++;
+}
+
+static void on_run_timeout(struct l_timeout *to, void *user_data)
+{
+	l_main_quit();
+}
+
+static void run_for(unsigned int ms)
+{
+	struct l_timeout *stop;
+
+	stop = l_timeout_create_ms(ms, on_run_timeout, NULL, NULL);
+	l_main_run();
+	l_timeout_remove(stop);
+}
+
+static void setup(void)
+{
+	l_main_init();
+
+	memset(n_reads, 0, sizeof(n_reads));
+	memset(read_flags, 0, sizeof(read_flags));
+	auto_complete = true;
+	done_class = 0;
+	n_done = 0;
+}
+
+static void teardown(void)
+{
+	poll_stop();
+	poll_destroy();
+	l_main_exit();
+}
+
+START_TEST(poll_adaptive_follows_changes)
+{
+	ck_assert_int_eq(poll_set_adaptive(1, FAST_MS, SLOW_MS, 0), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 1, 1, on_read), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 2, 1, on_read), 0);
+
+	/* Item 1 changes on every read, item 2 never does */
+	read_flags[1] = POLL_READ_CHANGED;
+
+	poll_start();
+	run_for(RUN_MS);
+
+	ck_assert(n_reads[2] > 0);
+	ck_assert(n_reads[2] <= RUN_MS / SLOW_MS + 1);
+	ck_assert(n_reads[1] > 2 * n_reads[2]);
+}
+END_TEST
+
+START_TEST(poll_adaptive_rejects_bad_bounds)
+{
+	ck_assert_int_eq(poll_set_adaptive(1, 0, SLOW_MS, 0), -EINVAL);
+	ck_assert_int_eq(poll_set_adaptive(1, SLOW_MS, FAST_MS, 0), -EINVAL);
+	ck_assert_int_eq(poll_set_adaptive(1, FAST_MS, SLOW_MS, -1), -EINVAL);
+}
+END_TEST
+
+START_TEST(poll_budget_is_per_group)
+{
+	/* Group 1 may only afford its slowest rate, group 2 is unbounded */
+	ck_assert_int_eq(poll_set_adaptive(1, FAST_MS, SLOW_MS,
+					   2 * 1000 / SLOW_MS), 0);
+	ck_assert_int_eq(poll_set_adaptive(2, FAST_MS, SLOW_MS, 0), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 1, 1, on_read), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 2, 1, on_read), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 3, 2, on_read), 0);
+
+	read_flags[1] = POLL_READ_CHANGED;
+	read_flags[2] = POLL_READ_CHANGED;
+	read_flags[3] = POLL_READ_CHANGED;
+
+	poll_start();
+	run_for(RUN_MS);
+
+	ck_assert(n_reads[1] <= RUN_MS / SLOW_MS + 1);
+	ck_assert(n_reads[2] <= RUN_MS / SLOW_MS + 1);
+	ck_assert(n_reads[3] > 2 * (RUN_MS / SLOW_MS + 1));
+}
+END_TEST
+
+START_TEST(poll_on_demand_is_not_scanned)
+{
+	ck_assert_int_eq(poll_set_adaptive(1, FAST_MS, FAST_MS, 0), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 1, 1, on_read), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 2, 1, on_read), 0);
+
+	poll_set_on_demand(2, true);
+
+	poll_start();
+	run_for(SLOW_MS);
+
+	ck_assert(n_reads[1] > 0);
+	ck_assert_int_eq(n_reads[2], 0);
+
+	/* Scanned again right away once given back */
+	poll_set_on_demand(2, false);
+	run_for(BURST_MS);
+
+	ck_assert(n_reads[2] > 0);
+}
+END_TEST
+
+START_TEST(poll_scan_class_reads_in_bursts)
+{
+	ck_assert_int_eq(poll_set_adaptive(1, FAST_MS, FAST_MS, 0), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 1, 1, on_read), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 2, 1, on_read), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 3, 1, on_read), 0);
+
+	ck_assert_int_eq(poll_set_scan_class(1, TEST_CLASS, on_class_done),
+			 0);
+	ck_assert_int_eq(poll_set_scan_class(2, TEST_CLASS, on_class_done),
+			 0);
+	ck_assert_int_eq(poll_set_scan_class(3, TEST_CLASS, NULL), -EINVAL);
+
+	poll_start();
+	run_for(SLOW_MS);
+
+	/* Members are read together, and each burst is handed over once */
+	ck_assert(n_reads[1] > 0);
+	ck_assert_int_eq(n_reads[1], n_reads[2]);
+	ck_assert(n_done > 0);
+	ck_assert(n_done + 1 >= (int) n_reads[1]);
+	ck_assert_int_eq(done_class, TEST_CLASS);
+}
+END_TEST
+
+START_TEST(poll_scan_class_skips_outstanding_burst)
+{
+	auto_complete = false;
+
+	ck_assert_int_eq(poll_set_adaptive(1, FAST_MS, FAST_MS, 0), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 1, 1, on_read), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 2, 1, on_read), 0);
+	ck_assert_int_eq(poll_set_scan_class(1, TEST_CLASS, on_class_done),
+			 0);
+	ck_assert_int_eq(poll_set_scan_class(2, TEST_CLASS, on_class_done),
+			 0);
+
+	poll_start();
+	run_for(SLOW_MS);
+
+	/* Item 2 never answers: no new burst starts meanwhile */
+	poll_read_complete(1, 0, 0);
+	ck_assert_int_eq(n_reads[1], 1);
+	ck_assert_int_eq(n_reads[2], 1);
+	ck_assert_int_eq(n_done, 0);
+
+	poll_read_complete(2, 0, 0);
+	ck_assert_int_eq(n_done, 1);
+}
+END_TEST
+
+START_TEST(poll_scan_class_change_cancels_read)
+{
+	auto_complete = false;
+
+	ck_assert_int_eq(poll_set_adaptive(1, FAST_MS, FAST_MS, 0), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 1, 1, on_read), 0);
+	ck_assert_int_eq(poll_create(INTERVAL_SEC, 2, 1, on_read), 0);
+	ck_assert_int_eq(poll_set_scan_class(1, TEST_CLASS, on_class_done),
+			 0);
+	ck_assert_int_eq(poll_set_scan_class(2, TEST_CLASS, on_class_done),
+			 0);
+
+	poll_start();
+	run_for(BURST_MS);
+
+	ck_assert_int_eq(n_reads[2], 1);
+	poll_read_complete(1, 0, 0);
+
+	/* Its pending read leaves the old burst, which is then done */
+	ck_assert_int_eq(poll_set_scan_class(2, 0, NULL), 0);
+	ck_assert_int_eq(n_done, 1);
+	ck_assert_int_eq(done_class, TEST_CLASS);
+
+	/* The next bursts do not wait for it */
+	run_for(BURST_MS);
+	poll_read_complete(1, 0, 0);
+	ck_assert_int_eq(n_done, 2);
+}
+END_TEST
+
+Suite *poll_suite(void)
+{
+	Suite *pll_suite;
+	TCase *tc_adaptive;
+	TCase *tc_class;
+
+	pll_suite = suite_create("Poll");
+
+	/* Adaptive test case */
+	tc_adaptive = tcase_create("Adaptive");
+	tcase_add_checked_fixture(tc_adaptive, setup, teardown);
+	tcase_add_test(tc_adaptive, poll_adaptive_follows_changes);
+	tcase_add_test(tc_adaptive, poll_adaptive_rejects_bad_bounds);
+	tcase_add_test(tc_adaptive, poll_budget_is_per_group);
+	tcase_add_test(tc_adaptive, poll_on_demand_is_not_scanned);
+
+	suite_add_tcase(pll_suite, tc_adaptive);
+
+	/* Scan class test case */
+	tc_class = tcase_create("Scan class");
+	tcase_add_checked_fixture(tc_class, setup, teardown);
+	tcase_add_test(tc_class, poll_scan_class_reads_in_bursts);
+	tcase_add_test(tc_class, poll_scan_class_skips_outstanding_burst);
+	tcase_add_test(tc_class, poll_scan_class_change_cancels_read);
+
+	suite_add_tcase(pll_suite, tc_class);
+
+	return pll_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *pll_suite;
+	SRunner *pll_suite_runner;
+
+	pll_suite = poll_suite();
+	pll_suite_runner = srunner_create(pll_suite);
+
+	srunner_run_all(pll_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(pll_suite_runner);
+	srunner_free(pll_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
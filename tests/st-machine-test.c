@@ -23,7 +23,7 @@
 START_TEST(disconnected_get_next_event_ready_is_register)
 {
 	device_set_has_cred_rc(0);
-	int next_state = get_next_disconnected(EVT_READY, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
@@ -31,217 +31,217 @@ END_TEST
 START_TEST(disconnected_get_next_event_ready_is_auth)
 {
 	device_set_has_cred_rc(1);
-	int next_state = get_next_disconnected(EVT_READY, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_not_ready_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_NOT_READY, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_NOT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_timeout_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_TIMEOUT, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_TIMEOUT, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_reg_ok_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_REG_OK, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_REG_OK, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_reg_not_ok_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_REG_NOT_OK, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_REG_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_auth_ok_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_AUTH_OK, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_AUTH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_auth_not_ok_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_AUTH_NOT_OK, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_AUTH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_schema_ok_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_SCH_OK, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_SCH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_schema_not_ok_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_SCH_NOT_OK, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_SCH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_unreg_req_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_UNREG_REQ, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_UNREG_REQ, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_data_update_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_DATA_UPDT, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_DATA_UPDT, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_publish_data_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_PUB_DATA, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_PUB_DATA, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(disconnected_get_next_event_reg_perm_is_disconnected)
 {
-	int next_state = get_next_disconnected(EVT_REG_PERM, NULL);
+	int next_state = get_next_disconnected(NULL, EVT_REG_PERM, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(register_get_next_event_ready_is_register)
 {
-	int next_state = get_next_register(EVT_READY, NULL);
+	int next_state = get_next_register(NULL, EVT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_not_ready_is_disconnected)
 {
-	int next_state = get_next_register(EVT_NOT_READY, NULL);
+	int next_state = get_next_register(NULL, EVT_NOT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(register_get_next_event_timeout_is_register)
 {
-	int next_state = get_next_register(EVT_TIMEOUT, NULL);
+	int next_state = get_next_register(NULL, EVT_TIMEOUT, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_reg_ok_is_auth)
 {
-	int next_state = get_next_register(EVT_REG_OK, NULL);
+	int next_state = get_next_register(NULL, EVT_REG_OK, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(register_get_next_event_reg_not_ok_is_register)
 {
-	int next_state = get_next_register(EVT_REG_NOT_OK, NULL);
+	int next_state = get_next_register(NULL, EVT_REG_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_auth_ok_is_register)
 {
-	int next_state = get_next_register(EVT_AUTH_OK, NULL);
+	int next_state = get_next_register(NULL, EVT_AUTH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_auth_not_ok_is_register)
 {
-	int next_state = get_next_register(EVT_AUTH_NOT_OK, NULL);
+	int next_state = get_next_register(NULL, EVT_AUTH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_schema_ok_is_register)
 {
-	int next_state = get_next_register(EVT_SCH_OK, NULL);
+	int next_state = get_next_register(NULL, EVT_SCH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_schema_not_ok_is_register)
 {
-	int next_state = get_next_register(EVT_SCH_NOT_OK, NULL);
+	int next_state = get_next_register(NULL, EVT_SCH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_unreg_req_is_register)
 {
-	int next_state = get_next_register(EVT_UNREG_REQ, NULL);
+	int next_state = get_next_register(NULL, EVT_UNREG_REQ, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_data_update_is_register)
 {
-	int next_state = get_next_register(EVT_DATA_UPDT, NULL);
+	int next_state = get_next_register(NULL, EVT_DATA_UPDT, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_publish_data_is_register)
 {
-	int next_state = get_next_register(EVT_PUB_DATA, NULL);
+	int next_state = get_next_register(NULL, EVT_PUB_DATA, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(register_get_next_event_reg_perm_is_register)
 {
-	int next_state = get_next_register(EVT_REG_PERM, NULL);
+	int next_state = get_next_register(NULL, EVT_REG_PERM, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_ready_is_auth)
 {
-	int next_state = get_next_auth(EVT_READY, NULL);
+	int next_state = get_next_auth(NULL, EVT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_not_ready_is_disconnected)
 {
-	int next_state = get_next_auth(EVT_NOT_READY, NULL);
+	int next_state = get_next_auth(NULL, EVT_NOT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_timeout_is_auth)
 {
-	int next_state = get_next_auth(EVT_TIMEOUT, NULL);
+	int next_state = get_next_auth(NULL, EVT_TIMEOUT, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_reg_ok_is_auth)
 {
-	int next_state = get_next_auth(EVT_REG_OK, NULL);
+	int next_state = get_next_auth(NULL, EVT_REG_OK, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_reg_not_ok_is_auth)
 {
-	int next_state = get_next_auth(EVT_REG_NOT_OK, NULL);
+	int next_state = get_next_auth(NULL, EVT_REG_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
@@ -249,7 +249,7 @@ END_TEST
 START_TEST(auth_get_next_event_auth_ok_is_online)
 {
 	device_set_schema_change_rc(0);
-	int next_state = get_next_auth(EVT_AUTH_OK, NULL);
+	int next_state = get_next_auth(NULL, EVT_AUTH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
@@ -257,420 +257,420 @@ END_TEST
 START_TEST(auth_get_next_event_auth_ok_is_schema)
 {
 	device_set_schema_change_rc(1);
-	int next_state = get_next_auth(EVT_AUTH_OK, NULL);
+	int next_state = get_next_auth(NULL, EVT_AUTH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_auth_not_ok_is_unregister)
 {
-	int next_state = get_next_auth(EVT_AUTH_NOT_OK, NULL);
+	int next_state = get_next_auth(NULL, EVT_AUTH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_schema_ok_is_auth)
 {
-	int next_state = get_next_auth(EVT_SCH_OK, NULL);
+	int next_state = get_next_auth(NULL, EVT_SCH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_schema_not_ok_is_auth)
 {
-	int next_state = get_next_auth(EVT_SCH_NOT_OK, NULL);
+	int next_state = get_next_auth(NULL, EVT_SCH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_unreg_req_is_unregister)
 {
-	int next_state = get_next_auth(EVT_UNREG_REQ, NULL);
+	int next_state = get_next_auth(NULL, EVT_UNREG_REQ, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_data_update_is_auth)
 {
-	int next_state = get_next_auth(EVT_DATA_UPDT, NULL);
+	int next_state = get_next_auth(NULL, EVT_DATA_UPDT, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_publish_data_is_auth)
 {
-	int next_state = get_next_auth(EVT_PUB_DATA, NULL);
+	int next_state = get_next_auth(NULL, EVT_PUB_DATA, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(auth_get_next_event_reg_perm_is_auth)
 {
-	int next_state = get_next_auth(EVT_REG_PERM, NULL);
+	int next_state = get_next_auth(NULL, EVT_REG_PERM, NULL);
 	ck_assert_int_eq(next_state, ST_AUTH);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_ready_is_schema)
 {
-	int next_state = get_next_schema(EVT_READY, NULL);
+	int next_state = get_next_schema(NULL, EVT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_not_ready_is_disconnected)
 {
-	int next_state = get_next_schema(EVT_NOT_READY, NULL);
+	int next_state = get_next_schema(NULL, EVT_NOT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_timeout_is_schema)
 {
-	int next_state = get_next_schema(EVT_TIMEOUT, NULL);
+	int next_state = get_next_schema(NULL, EVT_TIMEOUT, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_reg_ok_is_schema)
 {
-	int next_state = get_next_schema(EVT_REG_OK, NULL);
+	int next_state = get_next_schema(NULL, EVT_REG_OK, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_reg_not_ok_is_schema)
 {
-	int next_state = get_next_schema(EVT_REG_NOT_OK, NULL);
+	int next_state = get_next_schema(NULL, EVT_REG_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_auth_ok_is_schema)
 {
-	int next_state = get_next_schema(EVT_AUTH_OK, NULL);
+	int next_state = get_next_schema(NULL, EVT_AUTH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_auth_not_ok_is_schema)
 {
-	int next_state = get_next_schema(EVT_AUTH_NOT_OK, NULL);
+	int next_state = get_next_schema(NULL, EVT_AUTH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_schema_ok_is_online)
 {
-	int next_state = get_next_schema(EVT_SCH_OK, NULL);
+	int next_state = get_next_schema(NULL, EVT_SCH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_schema_not_ok_is_error)
 {
-	int next_state = get_next_schema(EVT_SCH_NOT_OK, NULL);
+	int next_state = get_next_schema(NULL, EVT_SCH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_unreg_req_is_unregister)
 {
-	int next_state = get_next_schema(EVT_UNREG_REQ, NULL);
+	int next_state = get_next_schema(NULL, EVT_UNREG_REQ, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_data_update_is_schema)
 {
-	int next_state = get_next_schema(EVT_DATA_UPDT, NULL);
+	int next_state = get_next_schema(NULL, EVT_DATA_UPDT, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_publish_data_is_schema)
 {
-	int next_state = get_next_schema(EVT_PUB_DATA, NULL);
+	int next_state = get_next_schema(NULL, EVT_PUB_DATA, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(schema_get_next_event_reg_perm_is_schema)
 {
-	int next_state = get_next_schema(EVT_REG_PERM, NULL);
+	int next_state = get_next_schema(NULL, EVT_REG_PERM, NULL);
 	ck_assert_int_eq(next_state, ST_SCHEMA);
 }
 END_TEST
 
 START_TEST(online_get_next_event_ready_is_online)
 {
-	int next_state = get_next_online(EVT_READY, NULL);
+	int next_state = get_next_online(NULL, EVT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_not_ready_is_disconnected)
 {
-	int next_state = get_next_online(EVT_NOT_READY, NULL);
+	int next_state = get_next_online(NULL, EVT_NOT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_DISCONNECTED);
 }
 END_TEST
 
 START_TEST(online_get_next_event_timeout_is_online)
 {
-	int next_state = get_next_online(EVT_TIMEOUT, NULL);
+	int next_state = get_next_online(NULL, EVT_TIMEOUT, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_reg_ok_is_online)
 {
-	int next_state = get_next_online(EVT_REG_OK, NULL);
+	int next_state = get_next_online(NULL, EVT_REG_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_reg_not_ok_is_online)
 {
-	int next_state = get_next_online(EVT_REG_NOT_OK, NULL);
+	int next_state = get_next_online(NULL, EVT_REG_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_auth_ok_is_online)
 {
-	int next_state = get_next_online(EVT_AUTH_OK, NULL);
+	int next_state = get_next_online(NULL, EVT_AUTH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_auth_not_ok_is_online)
 {
-	int next_state = get_next_online(EVT_AUTH_NOT_OK, NULL);
+	int next_state = get_next_online(NULL, EVT_AUTH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_schema_ok_is_online)
 {
-	int next_state = get_next_online(EVT_SCH_OK, NULL);
+	int next_state = get_next_online(NULL, EVT_SCH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_schema_not_ok_is_online)
 {
-	int next_state = get_next_online(EVT_SCH_NOT_OK, NULL);
+	int next_state = get_next_online(NULL, EVT_SCH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_unreg_req_is_unregister)
 {
-	int next_state = get_next_online(EVT_UNREG_REQ, NULL);
+	int next_state = get_next_online(NULL, EVT_UNREG_REQ, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(online_get_next_event_data_update_is_online)
 {
-	int next_state = get_next_online(EVT_DATA_UPDT, NULL);
+	int next_state = get_next_online(NULL, EVT_DATA_UPDT, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_publish_data_is_online)
 {
-	int next_state = get_next_online(EVT_PUB_DATA, NULL);
+	int next_state = get_next_online(NULL, EVT_PUB_DATA, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(online_get_next_event_reg_perm_is_online)
 {
-	int next_state = get_next_online(EVT_REG_PERM, NULL);
+	int next_state = get_next_online(NULL, EVT_REG_PERM, NULL);
 	ck_assert_int_eq(next_state, ST_ONLINE);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_ready_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_READY, NULL);
+	int next_state = get_next_unregister(NULL, EVT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_not_ready_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_NOT_READY, NULL);
+	int next_state = get_next_unregister(NULL, EVT_NOT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_timeout_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_TIMEOUT, NULL);
+	int next_state = get_next_unregister(NULL, EVT_TIMEOUT, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_reg_ok_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_REG_OK, NULL);
+	int next_state = get_next_unregister(NULL, EVT_REG_OK, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_reg_not_ok_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_REG_NOT_OK, NULL);
+	int next_state = get_next_unregister(NULL, EVT_REG_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_auth_ok_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_AUTH_OK, NULL);
+	int next_state = get_next_unregister(NULL, EVT_AUTH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_auth_not_ok_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_AUTH_NOT_OK, NULL);
+	int next_state = get_next_unregister(NULL, EVT_AUTH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_schema_ok_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_SCH_OK, NULL);
+	int next_state = get_next_unregister(NULL, EVT_SCH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_schema_not_ok_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_SCH_NOT_OK, NULL);
+	int next_state = get_next_unregister(NULL, EVT_SCH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_unreg_req_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_UNREG_REQ, NULL);
+	int next_state = get_next_unregister(NULL, EVT_UNREG_REQ, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_data_update_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_DATA_UPDT, NULL);
+	int next_state = get_next_unregister(NULL, EVT_DATA_UPDT, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_publish_data_is_unregister)
 {
-	int next_state = get_next_unregister(EVT_PUB_DATA, NULL);
+	int next_state = get_next_unregister(NULL, EVT_PUB_DATA, NULL);
 	ck_assert_int_eq(next_state, ST_UNREGISTER);
 }
 END_TEST
 
 START_TEST(unregister_get_next_event_reg_perm_is_register)
 {
-	int next_state = get_next_unregister(EVT_REG_PERM, NULL);
+	int next_state = get_next_unregister(NULL, EVT_REG_PERM, NULL);
 	ck_assert_int_eq(next_state, ST_REGISTER);
 }
 END_TEST
 
 START_TEST(error_get_next_event_ready_is_error)
 {
-	int next_state = get_next_error(EVT_READY, NULL);
+	int next_state = get_next_error(NULL, EVT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_not_ready_is_error)
 {
-	int next_state = get_next_error(EVT_NOT_READY, NULL);
+	int next_state = get_next_error(NULL, EVT_NOT_READY, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_timeout_is_error)
 {
-	int next_state = get_next_error(EVT_TIMEOUT, NULL);
+	int next_state = get_next_error(NULL, EVT_TIMEOUT, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_reg_ok_is_error)
 {
-	int next_state = get_next_error(EVT_REG_OK, NULL);
+	int next_state = get_next_error(NULL, EVT_REG_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_reg_not_ok_is_error)
 {
-	int next_state = get_next_error(EVT_REG_NOT_OK, NULL);
+	int next_state = get_next_error(NULL, EVT_REG_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_auth_ok_is_error)
 {
-	int next_state = get_next_error(EVT_AUTH_OK, NULL);
+	int next_state = get_next_error(NULL, EVT_AUTH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_auth_not_ok_is_error)
 {
-	int next_state = get_next_error(EVT_AUTH_NOT_OK, NULL);
+	int next_state = get_next_error(NULL, EVT_AUTH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_schema_ok_is_error)
 {
-	int next_state = get_next_error(EVT_SCH_OK, NULL);
+	int next_state = get_next_error(NULL, EVT_SCH_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_schema_not_ok_is_error)
 {
-	int next_state = get_next_error(EVT_SCH_NOT_OK, NULL);
+	int next_state = get_next_error(NULL, EVT_SCH_NOT_OK, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_unreg_req_is_error)
 {
-	int next_state = get_next_error(EVT_UNREG_REQ, NULL);
+	int next_state = get_next_error(NULL, EVT_UNREG_REQ, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_data_update_is_error)
 {
-	int next_state = get_next_error(EVT_DATA_UPDT, NULL);
+	int next_state = get_next_error(NULL, EVT_DATA_UPDT, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_publish_data_is_error)
 {
-	int next_state = get_next_error(EVT_PUB_DATA, NULL);
+	int next_state = get_next_error(NULL, EVT_PUB_DATA, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
 
 START_TEST(error_get_next_event_reg_perm_is_error)
 {
-	int next_state = get_next_error(EVT_REG_PERM, NULL);
+	int next_state = get_next_error(NULL, EVT_REG_PERM, NULL);
 	ck_assert_int_eq(next_state, ST_ERROR);
 }
 END_TEST
@@ -0,0 +1,199 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <knot/knot_protocol.h>
+#include <ell/ell.h>
+
+#include "src/state.h"
+
+#define PATH_TEMPLATE	"/tmp/state-tests-XXXXXX"
+
+static char state_path[sizeof(PATH_TEMPLATE)];
+static struct state *test_state;
+
+static off_t file_size(void)
+{
+	struct stat st;
+
+	ck_assert_int_eq(stat(state_path, &st), 0);
+
+	return st.st_size;
+}
+
+static void setup(void)
+{
+	int fd;
+
+	l_main_init();
+
+	strcpy(state_path, PATH_TEMPLATE);
+	fd = mkstemp(state_path);
+	ck_assert_int_ge(fd, 0);
+	close(fd);
+
+	test_state = state_open(state_path);
+}
+
+static void teardown(void)
+{
+	state_close(test_state);
+	unlink(state_path);
+	l_main_exit();
+}
+
+START_TEST(state_load_unknown_item)
+{
+	knot_value_type value;
+	int64_t published;
+
+	ck_assert_ptr_ne(test_state, NULL);
+	ck_assert_int_eq(state_load(test_state, 1, &value, &published),
+			 -ENOENT);
+	ck_assert_int_eq(state_load(NULL, 1, &value, &published), -ENOENT);
+}
+END_TEST
+
+START_TEST(state_records_reload_after_reopen)
+{
+	knot_value_type value;
+	knot_value_type loaded;
+	int64_t published;
+
+	memset(&value, 0, sizeof(value));
+
+	value.val_i = 42;
+	state_save(test_state, 1, &value, 1000);
+	value.val_i = -7;
+	state_save(test_state, 2, &value, 2000);
+
+	state_close(test_state);
+	test_state = state_open(state_path);
+	ck_assert_ptr_ne(test_state, NULL);
+
+	ck_assert_int_eq(state_load(test_state, 1, &loaded, &published), 0);
+	ck_assert_int_eq(loaded.val_i, 42);
+	ck_assert_int_eq(published, 1000);
+
+	ck_assert_int_eq(state_load(test_state, 2, &loaded, &published), 0);
+	ck_assert_int_eq(loaded.val_i, -7);
+	ck_assert_int_eq(published, 2000);
+}
+END_TEST
+
+START_TEST(state_save_rewrites_record_in_place)
+{
+	knot_value_type value;
+	knot_value_type loaded;
+	int64_t published;
+	off_t size;
+
+	memset(&value, 0, sizeof(value));
+
+	value.val_i = 1;
+	state_save(test_state, 1, &value, 1000);
+	value.val_i = 2;
+	state_save(test_state, 2, &value, 1000);
+	size = file_size();
+
+	/* Neither a save nor a reload appends another record */
+	value.val_i = 3;
+	state_save(test_state, 1, &value, 3000);
+	ck_assert_int_eq(file_size(), size);
+
+	state_close(test_state);
+	test_state = state_open(state_path);
+	ck_assert_ptr_ne(test_state, NULL);
+
+	value.val_i = 4;
+	state_save(test_state, 2, &value, 4000);
+	ck_assert_int_eq(file_size(), size);
+
+	ck_assert_int_eq(state_load(test_state, 1, &loaded, &published), 0);
+	ck_assert_int_eq(loaded.val_i, 3);
+	ck_assert_int_eq(published, 3000);
+
+	ck_assert_int_eq(state_load(test_state, 2, &loaded, &published), 0);
+	ck_assert_int_eq(loaded.val_i, 4);
+	ck_assert_int_eq(published, 4000);
+}
+END_TEST
+
+START_TEST(state_foreign_file_starts_empty)
+{
+	static const char garbage[] = "not a state file, just some text";
+	knot_value_type value;
+	int64_t published;
+	int fd;
+
+	state_close(test_state);
+
+	fd = open(state_path, O_WRONLY | O_TRUNC);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(write(fd, garbage, sizeof(garbage)),
+			 sizeof(garbage));
+	close(fd);
+
+	test_state = state_open(state_path);
+	ck_assert_ptr_ne(test_state, NULL);
+
+	ck_assert_int_eq(state_load(test_state, 1, &value, &published),
+			 -ENOENT);
+	ck_assert_int_lt(file_size(), sizeof(garbage));
+}
+END_TEST
+
+Suite *state_suite(void)
+{
+	Suite *st_suite;
+	TCase *tc_records;
+
+	st_suite = suite_create("State");
+
+	/* Records test case */
+	tc_records = tcase_create("Records");
+	tcase_add_checked_fixture(tc_records, setup, teardown);
+	tcase_add_test(tc_records, state_load_unknown_item);
+	tcase_add_test(tc_records, state_records_reload_after_reopen);
+	tcase_add_test(tc_records, state_save_rewrites_record_in_place);
+	tcase_add_test(tc_records, state_foreign_file_starts_empty);
+
+	suite_add_tcase(st_suite, tc_records);
+
+	return st_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *st_suite;
+	SRunner *st_suite_runner;
+
+	st_suite = state_suite();
+	st_suite_runner = srunner_create(st_suite);
+
+	srunner_run_all(st_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(st_suite_runner);
+	srunner_free(st_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
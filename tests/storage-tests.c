@@ -0,0 +1,342 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2020, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <ell/ell.h>
+
+#include "src/storage.h"
+
+#define DIR_TEMPLATE	"/tmp/storage-tests-XXXXXX"
+#define TEST_GROUP	"Thing"
+#define WALK_GROUP	"DataItem_1"
+#define CONTENT_MAX	512
+
+static char test_dir[sizeof(DIR_TEMPLATE)];
+static char *conf_path;
+static char *tmp_path;
+static char *link_path;
+
+static void write_file(const char *path, const char *content)
+{
+	FILE *file;
+
+	file = fopen(path, "w");
+	ck_assert_ptr_ne(file, NULL);
+	ck_assert(fputs(content, file) >= 0);
+	fclose(file);
+}
+
+/* What a reader opening the file afresh would see */
+static void read_file(const char *path, char *content)
+{
+	size_t len;
+	FILE *file;
+
+	file = fopen(path, "r");
+	ck_assert_ptr_ne(file, NULL);
+	len = fread(content, 1, CONTENT_MAX - 1, file);
+	content[len] = '\0';
+	fclose(file);
+}
+
+static ino_t file_inode(const char *path)
+{
+	struct stat st;
+
+	ck_assert_int_eq(stat(path, &st), 0);
+
+	return st.st_ino;
+}
+
+static void setup(void)
+{
+	strcpy(test_dir, DIR_TEMPLATE);
+	ck_assert_ptr_ne(mkdtemp(test_dir), NULL);
+
+	conf_path = l_strdup_printf("%s/device.conf", test_dir);
+	tmp_path = l_strdup_printf("%s.tmp", conf_path);
+	link_path = l_strdup_printf("%s/link.conf", test_dir);
+
+	write_file(conf_path, "[" TEST_GROUP "]\nName=before\n");
+}
+
+static void teardown(void)
+{
+	unlink(link_path);
+	unlink(tmp_path);
+	unlink(conf_path);
+	rmdir(test_dir);
+
+	l_free(link_path);
+	l_free(tmp_path);
+	l_free(conf_path);
+}
+
+START_TEST(storage_commit_writes_transaction)
+{
+	char content[CONTENT_MAX];
+	char *name;
+	int fd;
+
+	fd = storage_open(conf_path);
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert_int_eq(storage_begin(fd), 0);
+	ck_assert_int_eq(storage_write_key_string(fd, TEST_GROUP, "Name",
+						  "after"), 0);
+	ck_assert_int_eq(storage_write_key_int(fd, TEST_GROUP, "Id", 5), 0);
+
+	/* Readers through the descriptor see the change at once */
+	name = storage_read_key_string(fd, TEST_GROUP, "Name");
+	ck_assert_str_eq(name, "after");
+	l_free(name);
+
+	/* The file itself only changes on commit */
+	read_file(conf_path, content);
+	ck_assert_ptr_ne(strstr(content, "Name=before"), NULL);
+	ck_assert_ptr_eq(strstr(content, "Id"), NULL);
+
+	ck_assert_int_eq(storage_commit(fd), 0);
+
+	read_file(conf_path, content);
+	ck_assert_ptr_ne(strstr(content, "Name=after"), NULL);
+	ck_assert_ptr_ne(strstr(content, "Id=5"), NULL);
+
+	storage_close(fd);
+}
+END_TEST
+
+START_TEST(storage_close_without_commit_aborts)
+{
+	char content[CONTENT_MAX];
+	char *name;
+	int fd;
+
+	fd = storage_open(conf_path);
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert_int_eq(storage_begin(fd), 0);
+	ck_assert_int_eq(storage_write_key_string(fd, TEST_GROUP, "Name",
+						  "after"), 0);
+	storage_close(fd);
+
+	read_file(conf_path, content);
+	ck_assert_ptr_ne(strstr(content, "Name=before"), NULL);
+
+	fd = storage_open(conf_path);
+	ck_assert_int_ge(fd, 0);
+	name = storage_read_key_string(fd, TEST_GROUP, "Name");
+	ck_assert_str_eq(name, "before");
+	l_free(name);
+	storage_close(fd);
+}
+END_TEST
+
+START_TEST(storage_commit_renames_over_the_file)
+{
+	char content[CONTENT_MAX];
+	struct stat st;
+	ino_t inode;
+	int fd;
+
+	ck_assert_int_eq(chmod(conf_path, 0640), 0);
+	inode = file_inode(conf_path);
+
+	fd = storage_open(conf_path);
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert_int_eq(storage_begin(fd), 0);
+	ck_assert_int_eq(storage_write_key_string(fd, TEST_GROUP, "Name",
+						  "after"), 0);
+	ck_assert_int_eq(storage_commit(fd), 0);
+
+	/* A new file took the name, keeping the mode, and none is left */
+	ck_assert_int_ne(file_inode(conf_path), inode);
+	ck_assert_int_eq(stat(conf_path, &st), 0);
+	ck_assert_int_eq(st.st_mode & 07777, 0640);
+	ck_assert_int_eq(access(tmp_path, F_OK), -1);
+
+	/* The descriptor follows the new file */
+	ck_assert_int_eq(storage_write_key_string(fd, TEST_GROUP, "Name",
+						  "later"), 0);
+	read_file(conf_path, content);
+	ck_assert_ptr_ne(strstr(content, "Name=later"), NULL);
+
+	storage_close(fd);
+}
+END_TEST
+
+START_TEST(storage_commit_keeps_symlink)
+{
+	char content[CONTENT_MAX];
+	struct stat st;
+	int fd;
+
+	ck_assert_int_eq(symlink(conf_path, link_path), 0);
+
+	fd = storage_open(link_path);
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert_int_eq(storage_begin(fd), 0);
+	ck_assert_int_eq(storage_write_key_string(fd, TEST_GROUP, "Name",
+						  "after"), 0);
+	ck_assert_int_eq(storage_commit(fd), 0);
+	storage_close(fd);
+
+	ck_assert_int_eq(lstat(link_path, &st), 0);
+	ck_assert(S_ISLNK(st.st_mode));
+
+	read_file(conf_path, content);
+	ck_assert_ptr_ne(strstr(content, "Name=after"), NULL);
+}
+END_TEST
+
+START_TEST(storage_commit_without_changes_keeps_file)
+{
+	ino_t inode;
+	int fd;
+
+	inode = file_inode(conf_path);
+
+	fd = storage_open(conf_path);
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert_int_eq(storage_begin(fd), 0);
+	ck_assert_int_eq(storage_commit(fd), 0);
+	ck_assert_int_eq(file_inode(conf_path), inode);
+
+	storage_close(fd);
+}
+END_TEST
+
+START_TEST(storage_transaction_misuse)
+{
+	int fd;
+
+	fd = storage_open(conf_path);
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert_int_eq(storage_commit(fd), -EINVAL);
+	ck_assert_int_eq(storage_begin(fd), 0);
+	ck_assert_int_eq(storage_begin(fd), -EALREADY);
+	ck_assert_int_eq(storage_commit(fd), 0);
+
+	storage_close(fd);
+
+	ck_assert_int_eq(storage_begin(fd), -EINVAL);
+}
+END_TEST
+
+/* Writes through a walk handle must fail before changing anything */
+static int on_group_write(int handle, const char *group, void *user_data)
+{
+	char *name;
+
+	ck_assert_int_eq(storage_write_key_string(handle, WALK_GROUP,
+						  "Name", "changed"), -EBADF);
+	ck_assert_int_eq(storage_write_key_int(handle, WALK_GROUP, "Id", 9),
+			 -EBADF);
+	ck_assert_int_eq(storage_remove_key(handle, WALK_GROUP, "Name"),
+			 -EBADF);
+	ck_assert_int_eq(storage_remove_group(handle, WALK_GROUP), -EBADF);
+	ck_assert_int_eq(storage_begin(handle), -EINVAL);
+	ck_assert_int_eq(storage_close(handle), -EBADF);
+
+	name = storage_read_key_string(handle, WALK_GROUP, "Name");
+	ck_assert_str_eq(name, "item");
+	l_free(name);
+
+	(*(int *) user_data)++;
+
+	return 0;
+}
+
+START_TEST(storage_walk_handles_are_read_only)
+{
+	static const char content[] = "[" WALK_GROUP "]\nName=item\n";
+	int walked = 0;
+	int fd;
+
+	write_file(conf_path, content);
+
+	fd = storage_open(conf_path);
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert_int_eq(storage_foreach_group(fd, "DataItem_",
+					       on_group_write, &walked), 0);
+	ck_assert_int_eq(walked, 1);
+
+	ck_assert_int_eq(storage_read_data(content, strlen(content),
+					   on_group_write, &walked), 0);
+	ck_assert_int_eq(walked, 2);
+
+	storage_close(fd);
+}
+END_TEST
+
+Suite *storage_suite(void)
+{
+	Suite *stg_suite;
+	TCase *tc_transaction;
+	TCase *tc_walk;
+
+	stg_suite = suite_create("Storage");
+
+	/* Transaction test case */
+	tc_transaction = tcase_create("Transaction");
+	tcase_add_checked_fixture(tc_transaction, setup, teardown);
+	tcase_add_test(tc_transaction, storage_commit_writes_transaction);
+	tcase_add_test(tc_transaction, storage_close_without_commit_aborts);
+	tcase_add_test(tc_transaction, storage_commit_renames_over_the_file);
+	tcase_add_test(tc_transaction, storage_commit_keeps_symlink);
+	tcase_add_test(tc_transaction,
+		       storage_commit_without_changes_keeps_file);
+	tcase_add_test(tc_transaction, storage_transaction_misuse);
+
+	suite_add_tcase(stg_suite, tc_transaction);
+
+	/* Walk test case */
+	tc_walk = tcase_create("Walk");
+	tcase_add_checked_fixture(tc_walk, setup, teardown);
+	tcase_add_test(tc_walk, storage_walk_handles_are_read_only);
+
+	suite_add_tcase(stg_suite, tc_walk);
+
+	return stg_suite;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *stg_suite;
+	SRunner *stg_suite_runner;
+
+	stg_suite = storage_suite();
+	stg_suite_runner = srunner_create(stg_suite);
+
+	srunner_run_all(stg_suite_runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(stg_suite_runner);
+	srunner_free(stg_suite_runner);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}